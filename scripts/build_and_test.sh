@@ -15,11 +15,19 @@ NC='\033[0m' # No Color
 
 echo -e "${BLUE}=== Building banco project ===${NC}"
 cd src
-gcc -o ../bin/banco banco.c -pthread
+gcc -o ../bin/banco banco.c -pthread -lz
+gcc -o ../bin/banco_log banco_log.c -lz
+gcc -O2 -o ../bin/banco_analisis banco_analisis.c -pthread -lz
+gcc -o ../bin/banco_router banco_router.c
+gcc -O2 -o ../bin/monitor monitor.c
 gcc -o ../bin/usuario usuario.c -pthread
+gcc -O2 -o ../bin/bench_micro bench_micro.c -pthread -lz
+gcc -O2 -o ../bin/generar_cuentas generar_cuentas.c -pthread -lm
+gcc -O2 -o ../bin/banco_replay banco_replay.c
 gcc -o ../bin/fix_eof fix_eof.c
 gcc -o ../bin/test_fifo_response test_fifo_response.c
 gcc -o ../bin/test_cuenta test_cuenta.c
+gcc -o ../bin/test_sesion test_sesion.c
 gcc -o ../bin/check_cuentas check_cuentas.c
 gcc -o ../bin/init_cuentas init_cuentas.c
 
@@ -64,6 +72,181 @@ else
     echo -e "${RED}Failed to read from FIFO${NC}"
 fi
 
+# Scenario tests: each one runs banco from a scratch directory with its own
+# config, accounts and sockets, so they do not touch ./data or a running bank
+echo -e "${BLUE}=== Running scenario tests ===${NC}"
+SCENARIO_DIR=$(mktemp -d /tmp/banco_scenarios.XXXXXX)
+SCENARIO_FAILED=0
+
+pass() { echo -e "${GREEN}PASS${NC} $1"; }
+fail() { echo -e "${RED}FAIL${NC} $1"; SCENARIO_FAILED=1; }
+
+# Pids of the banco processes running from a scenario directory
+scenario_pids() {
+    for pid in $(pgrep -x banco); do
+        [ "$(readlink "/proc/$pid/cwd")" = "$1/bin" ] && echo "$pid"
+    done
+}
+
+stop_scenario() {
+    scenario_pids "$1" | xargs -r kill -9
+    sleep 0.2
+}
+
+trap 'for d in "$SCENARIO_DIR"/*/; do stop_scenario "${d%/}"; done' EXIT
+
+# prepare_scenario <name> <shards> [config lines...]
+prepare_scenario() {
+    local dir="$SCENARIO_DIR/$1"
+    mkdir -p "$dir/bin" "$dir/config" "$dir/data"
+    cp bin/banco bin/banco_log bin/test_sesion "$dir/bin/"
+    ./bin/generar_cuentas -n 100 -p 1000 -o "$dir/data/cuentas.dat" > /dev/null
+    cat > "$dir/config/config.txt" <<EOF
+NUM_HILOS=2
+ARCHIVO_CUENTAS=../data/cuentas.dat
+ARCHIVO_LOG=../data/transacciones.log
+NUM_SHARDS=$2
+SOCKET_SHARDS=$dir/shard_%d.sock
+SOCKET_REPLICA=$dir/replica.sock
+SOCKET_ADMIN=$dir/admin.sock
+LIMITE_PETICIONES_CUENTA=0
+MOTOR_IO=poll
+EOF
+    shift 2
+    [ $# -gt 0 ] && printf '%s\n' "$@" >> "$dir/config/config.txt"
+    echo "$dir"
+}
+
+# start_shard <dir> <shard>: waits until the shard accepts sessions
+start_shard() {
+    (cd "$1/bin" && exec ./banco -s "$2" >> "../banco_$2.out" 2>&1 &)
+    for _ in $(seq 50); do
+        ./bin/test_sesion -t 200 "$1/shard_$2.sock" 1000 > /dev/null 2>&1 && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+# balance <dir> <shard> <account>
+balance() {
+    "$1/bin/test_sesion" "$1/shard_$2.sock" "$3" "SALDOS:$3" 2>/dev/null | sed -n "s/^\[SALDOS:$3=\([-0-9.]*\):OK\]/\1/p"
+}
+
+# wait_balance <dir> <shard> <account> <expected>: polls for up to 10 s
+wait_balance() {
+    for _ in $(seq 100); do
+        [ "$(balance "$1" "$2" "$3")" = "$4" ] && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+plus() { awk -v a="$1" -v b="$2" 'BEGIN { printf "%.2f", a + b }'; }
+
+# 1. 2PC: the coordinator dies right after confirming a transfer. Once more it
+#    also loses the CONFIRMADO line, as if it crashed before the decision was
+#    durable. Either way the restart must apply the transfer exactly once, and
+#    a debit already in the index must be recovered as confirmed, not aborted.
+dir=$(prepare_scenario dospc 2 "PLAZO_2PC_MS=500")
+start_shard "$dir" 0 && start_shard "$dir" 1 || fail "2PC: shards did not start"
+"$dir/bin/test_sesion" "$dir/shard_0.sock" 1000 "ID:fondos|Depósito de 100 en la cuenta 1000" > /dev/null
+for caso in committed undecided; do
+    a=$(balance "$dir" 0 1000); b=$(balance "$dir" 1 1001)
+    "$dir/bin/test_sesion" "$dir/shard_0.sock" 1000 "ID:$caso|Transferencia de 5 desde la cuenta 1000 a la cuenta 1001" \
+        | grep -q "^\[OK" || fail "2PC ($caso): transfer was not confirmed"
+    scenario_pids "$dir" | while read -r pid; do
+        grep -q -- "-s.0" "/proc/$pid/cmdline" 2>/dev/null && kill -9 "$pid"
+    done
+    sleep 0.2
+    if [ "$caso" = undecided ]; then
+        id=$(grep -a "2PC PREPARADO" "$dir/data/transacciones.log.shard0" | tail -1 | awk '{print $5}')
+        sed -i "/2PC [A-Z]* ${id}/{/PREPARADO/!d}" "$dir/data/transacciones.log.shard0"
+    fi
+    start_shard "$dir" 0
+    if wait_balance "$dir" 0 1000 "$(plus "$a" -5)" && wait_balance "$dir" 1 1001 "$(plus "$b" 5)"; then
+        sleep 1
+        if [ "$(balance "$dir" 0 1000)" != "$(plus "$a" -5)" ] || [ "$(balance "$dir" 1 1001)" != "$(plus "$b" 5)" ]; then
+            fail "2PC ($caso): transfer applied twice after recovery"
+        elif [ "$caso" = undecided ] && ! grep -aq "2PC CONFIRMADO ${id}" "$dir/data/transacciones.log.shard0"; then
+            fail "2PC ($caso): recovery did not record the transfer as confirmed"
+        else
+            pass "2PC ($caso): coordinator restart applies the transfer once"
+        fi
+    else
+        fail "2PC ($caso): balances $(balance "$dir" 0 1000)/$(balance "$dir" 1 1001), expected $(plus "$a" -5)/$(plus "$b" 5)"
+    fi
+done
+stop_scenario "$dir"
+
+# 2. Idempotency: a request repeated with the same ID:<key>| in a new session
+#    gets the cached reply and is not applied again
+dir=$(prepare_scenario idempotencia 1)
+start_shard "$dir" 0 || fail "idempotency: banco did not start"
+antes=$(balance "$dir" 0 1002)
+r1=$("$dir/bin/test_sesion" "$dir/shard_0.sock" 1002 "ID:pago-1|Depósito de 25 en la cuenta 1002")
+r2=$("$dir/bin/test_sesion" "$dir/shard_0.sock" 1002 "ID:pago-1|Depósito de 25 en la cuenta 1002")
+despues=$(balance "$dir" 0 1002)
+if [ -n "$r1" ] && [ "$r1" = "$r2" ] && [ "$despues" = "$(plus "$antes" 25)" ]; then
+    pass "idempotency: repeated key returns the cached reply"
+else
+    fail "idempotency: replies '$r1' / '$r2', balance $antes -> $despues"
+fi
+stop_scenario "$dir"
+
+# 3. Rotation: after several rotations every offset in the movement index must
+#    still resolve, through banco_log -o, to the line it points at
+dir=$(prepare_scenario rotacion 1 "TAM_MAX_LOG=8192")
+start_shard "$dir" 0 || fail "rotation: banco did not start"
+"$dir/bin/test_sesion" -r 300 -e 0 -t 1500 "$dir/shard_0.sock" 1003 "Depósito de 1 en la cuenta 1003" > /dev/null
+stop_scenario "$dir"
+segmentos=$(ls "$dir"/data/transacciones.log.shard0.*.seg 2>/dev/null | wc -l)
+errores=0
+comprobadas=0
+# Index records are 48 bytes: cuenta and transferencia (one 8-byte word), instante,
+# monto, saldo, desplazamiento_log and anterior
+while read -r cuenta desplazamiento saldo; do
+    [ "$cuenta" = 1003 ] || continue
+    linea=$(cd "$dir/bin" && ./banco_log -f ../data/transacciones.log.shard0 -o "$desplazamiento" 2>/dev/null)
+    comprobadas=$((comprobadas + 1))
+    echo "$linea" | grep -q "Movimiento (Cuenta 1003): +1.00 saldo=$saldo" || errores=$((errores + 1))
+done < <(paste -d' ' \
+    <(od -An -v -w48 -t d4 "$dir/data/transacciones.log.shard0.idx" | awk '{print $1}') \
+    <(od -An -v -w48 -t d8 "$dir/data/transacciones.log.shard0.idx" | awk '{print $5}') \
+    <(od -An -v -w48 -t f8 "$dir/data/transacciones.log.shard0.idx" | awk '{printf "%.2f\n", $4}'))
+if [ "$segmentos" -ge 2 ] && [ "$comprobadas" -eq 300 ] && [ "$errores" -eq 0 ]; then
+    pass "rotation: $comprobadas offsets across $segmentos segments resolve with banco_log -o"
+else
+    fail "rotation: $segmentos segments, $comprobadas offsets checked, $errores wrong"
+fi
+
+# 4. Hot restart: SIGUSR2 hands the session to a new process in the middle of a
+#    burst of deposits. TAM_MAX_LOG=1 rotates the log on every loop, which makes
+#    each loop slow enough that the 1 ms drain expires with requests still
+#    queued. They must travel with the session; none may be lost
+dir=$(prepare_scenario relevo 1 "PLAZO_RELEVO_MS=1" "TAM_MAX_LOG=1")
+start_shard "$dir" 0 || fail "hot restart: banco did not start"
+antes=$(balance "$dir" 0 1004)
+viejo=$(scenario_pids "$dir")
+"$dir/bin/test_sesion" -r 500 -e 0 -t 2000 "$dir/shard_0.sock" 1004 "Depósito de 1 en la cuenta 1004" > /dev/null &
+cliente=$!
+sleep 0.1
+kill -USR2 "$viejo"
+wait "$cliente"
+nuevo=$(scenario_pids "$dir")
+if [ -n "$nuevo" ] && [ "$nuevo" != "$viejo" ] && wait_balance "$dir" 0 1004 "$(plus "$antes" 500)"; then
+    pass "hot restart: all 500 deposits applied across the handoff"
+else
+    fail "hot restart: pid $viejo -> $nuevo, balance $antes -> $(balance "$dir" 0 1004), expected $(plus "$antes" 500)"
+fi
+stop_scenario "$dir"
+
+if [ $SCENARIO_FAILED -ne 0 ]; then
+    echo -e "${RED}Scenario tests failed, logs kept in $SCENARIO_DIR${NC}"
+    exit 1
+fi
+rm -rf "$SCENARIO_DIR"
+echo -e "${GREEN}Scenario tests passed${NC}"
+
 echo ""
 echo -e "${YELLOW}All tests completed. Use these commands to run the application:${NC}"
 echo "cd bin"
@@ -11,17 +11,38 @@ echo -e "${BLUE}====================================================${NC}"
 echo -e "${BLUE}        MONITOR DE COMUNICACIÓN BANCO-USUARIO        ${NC}"
 echo -e "${BLUE}====================================================${NC}"
 
-# Check for FIFO files
-echo -e "\n${YELLOW}Comprobando FIFOs activos:${NC}"
-ls -la /tmp/banco_fifo_* 2>/dev/null
+# Socket de administración del banco (SOCKET_ADMIN en config.txt)
+SOCKET_ADMIN=$(grep '^SOCKET_ADMIN=' ../config/config.txt 2>/dev/null | cut -d= -f2)
+SOCKET_ADMIN=${SOCKET_ADMIN:-/tmp/banco_admin.sock}
 
-if [ $? -ne 0 ]; then
-    echo -e "${RED}No se encontraron FIFOs activos${NC}"
-fi
+# Envía una orden al socket de administración y muestra la respuesta
+admin() {
+    if command -v socat > /dev/null; then
+        printf '%s\n' "$1" | socat -t1 - UNIX-CONNECT:"$SOCKET_ADMIN"
+    else
+        printf '%s\n' "$1" | nc -U -q1 "$SOCKET_ADMIN"
+    fi
+}
+
+if [ -S "$SOCKET_ADMIN" ]; then
+    echo -e "\n${YELLOW}Estado del banco:${NC}"
+    admin estadisticas
+    echo -e "\n${YELLOW}Sesiones abiertas:${NC}"
+    admin sesiones
+else
+    echo -e "\n${RED}No se encontró el socket de administración ${SOCKET_ADMIN}${NC}"
 
-# Monitor active processes
-echo -e "\n${YELLOW}Procesos de banco activos:${NC}"
-ps aux | grep -E "banco|usuario" | grep -v "grep" | grep -v "monitor"
+    # Sin socket de administración, se buscan los FIFOs y procesos a mano
+    echo -e "\n${YELLOW}Comprobando FIFOs activos:${NC}"
+    ls -la /tmp/banco_fifo_* 2>/dev/null
+
+    if [ $? -ne 0 ]; then
+        echo -e "${RED}No se encontraron FIFOs activos${NC}"
+    fi
+
+    echo -e "\n${YELLOW}Procesos de banco activos:${NC}"
+    ps aux | grep -E "banco|usuario" | grep -v "grep" | grep -v "monitor"
+fi
 
 # Check log file
 echo -e "\n${YELLOW}Últimas líneas del log de transacciones:${NC}"
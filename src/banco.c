@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,6 +14,23 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <limits.h>
+#include <zlib.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include "shards.h"
+#include "uring.h"
+#include "memoria.h"
+#include "traza.h"
+#include "trafico.h"
 
 #define CONFIG_FILE "../config/config.txt"
 #define LOG_FILE "../data/transacciones.log"
@@ -20,6 +38,18 @@
 #define FIFO_BASE_PATH "/tmp/banco_fifo_"
 #define BUFFER_SIZE 256
 
+#define MAX_PESOS_CUENTAS 32
+#define MAX_CUENTAS_SUPERVISORAS 16
+
+// Peso de planificación de una cuenta (PESOS_CUENTAS=1001:4,1002:2)
+typedef struct {
+    int cuenta;
+    int peso;
+} PesoCuenta;
+
+#define MOTOR_POLL 0       // Una llamada read/write por sesión y fprintf por línea del log
+#define MOTOR_IO_URING 1   // Lecturas, respuestas y log agrupados en una io_uring_enter por vuelta
+
 typedef struct {
     int limite_retiro;
     int limite_transferencia;
@@ -28,10 +58,63 @@ typedef struct {
     int num_hilos;
     char archivo_cuentas[256];
     char archivo_log[256];
+    long tam_max_log;             // Bytes del log activo antes de rotarlo (0 = sin límite)
+    int rotacion_log_segundos;    // Antigüedad máxima del log activo (0 = sin límite)
+    int marca_alta_salida;        // Bytes pendientes a partir de los que se deja de leer al usuario
+    int marca_baja_salida;        // Bytes pendientes por debajo de los que se vuelve a leer
+    int plazo_salida_segundos;    // Tiempo sin aceptar datos antes de desconectar al usuario
+    int quantum_drr;              // Crédito por ronda del planificador (en unidades de coste)
+    int prioridad_lecturas;       // 1 = las consultas de saldo van por un carril prioritario
+    PesoCuenta pesos[MAX_PESOS_CUENTAS];
+    int num_pesos;
+    int supervisoras[MAX_CUENTAS_SUPERVISORAS];  // Sesiones que pueden consultar cualquier cuenta
+    int num_supervisoras;
+    double tasa_cuenta;           // Peticiones por segundo admitidas por cuenta (0 = sin límite)
+    int rafaga_cuenta;            // Tamaño del cubo de tokens de cada cuenta
+    double tasa_global;           // Peticiones por segundo admitidas en total (0 = sin límite)
+    int rafaga_global;            // Tamaño del cubo de tokens global
+    int max_cola_global;          // Peticiones en cola a partir de las que se rechaza (0 = sin límite)
+    int max_espera_cola_ms;       // Espera en cola a partir de la que se rechaza (0 = sin límite)
+    int sesion_inactiva_segundos; // Desconexión de sesiones sin actividad (0 = nunca)
+    int plazo_peticion_ms;        // Tiempo máximo de una petición en cola (0 = sin plazo)
+    int latido_segundos;          // Periodo de la comprobación de que el usuario sigue conectado
+    int idempotencia_segundos;    // Tiempo que se recuerda una clave de idempotencia
+    ConfigShards shards;          // Reparto de cuentas entre procesos banco
+    int plazo_2pc_ms;             // Espera del voto o del ACK en una transferencia entre shards
+    char socket_replica[108];     // Socket por el que la réplica atiende las sesiones
+    int plazo_relevo_ms;          // Espera máxima para drenar las peticiones en curso en un relevo
+    char socket_admin[108];       // Socket de administración (estadísticas, sesiones, drenaje...)
+    int motor_io;                 // MOTOR_POLL o MOTOR_IO_URING; se fija al arrancar
+    int traza_muestreo;           // Se traza una de cada N peticiones (0 = sin trazas)
+    char archivo_captura[256];    // Captura del tráfico desde el arranque (vacío = no); se fija al arrancar
 } Config;
 
-Config config;
+// Configuración vigente. Se publica con un puntero atómico: quien la consulta hace una sola
+// carga y usa esa versión, que ya no cambia. Una recarga publica otra copia y retira la anterior.
+Config config_inicial;                     // Leída al arrancar; nunca se libera
+_Atomic(const Config *) config_vigente = &config_inicial;
+
+static inline const Config *configuracion() {
+    return atomic_load_explicit(&config_vigente, memory_order_acquire);
+}
+int modo_shard = 0;          // banco -s <id>: sólo atiende las cuentas de su shard
+int modo_replica = 0;        // banco -r: réplica de sólo lectura que sigue el índice del primario
+int shard_id = 0;
+int fd_escucha = -1;         // Socket por el que llegan las sesiones en modo shard
+int fd_escucha_admin = -1;   // Socket de administración
+int modo_drenaje = 0;        // Orden "drenar": no se aceptan sesiones y se sale al cerrarse la última
 int continuar_ejecucion = 1;  // Flag para controlar el bucle principal
+int fd_despertar = -1;        // eventfd para despertar al bucle principal desde los hilos lectores
+FILE *log_file = NULL;        // Log de transacciones
+sem_t *sem_cuentas = SEM_FAILED; // Semáforo del archivo de cuentas (solo para escrituras)
+
+// Definición de la estructura Cuenta (mismo formato binario que check_cuentas y test_cuenta)
+typedef struct {
+    int numero_cuenta;
+    char titular[50];
+    float saldo;
+    int num_transacciones;
+} Cuenta;
 
 // Forward declarations for all functions
 void manejador_senales(int sig);
@@ -39,14 +122,26 @@ void leer_configuracion(const char *filename, Config *cfg);
 int crear_fifo(const char *path);
 void limpiar_recursos_usuario(int idx);
 double obtener_saldo_cuenta(int cuenta);
-void procesar_consulta_saldo(int cuenta, int fifo_escritura_fd);
+void procesar_consulta_saldo(int cuenta, int slot, unsigned int generacion);
+int almacen_cargado();
+int leer_cuenta_snapshot(int numero_cuenta, Cuenta *salida);
+void extraer_peticiones(int i);
+void cancelar_suscripciones(int slot);
+int identificar_sesion_socket(int slot, const char *mensaje);
+int procesar_transferencia(int slot, const char *mensaje);
+void relanzar_registros_2pc();
+int procesar_mensaje_replica(int slot, const char *mensaje);
+int puede_leer_usuario(int i);
+void recibir_datos_usuario(int i, ssize_t nbytes);
+void cancelar_operaciones_sesion(int i, int lectura, int escritura);
 
 // Debug function to log with timestamp
 void debug_log(const char *format, ...) {
     char timestamp[30];
     time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
+    struct tm tm_info;
+    // localtime_r: localtime revisa la zona horaria (y reserva memoria) en cada llamada
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &tm_info));
     
     va_list args;
     va_start(args, format);
@@ -59,6 +154,379 @@ void debug_log(const char *format, ...) {
     va_end(args);
 }
 
+// Reservas de memoria dinámica. Las de banco.c pasan por estas funciones, que cuentan
+// cada llamada; las que ocurren mientras un hilo atiende una petición se cuentan aparte, y en
+// régimen estable ese contador no debe crecer. El resto sale de las arenas y de buffers fijos.
+// Compilado con -DCONTAR_RESERVAS_LIBC (sólo glibc), se sustituyen malloc, calloc y realloc y
+// se cuentan también las reservas de la biblioteca (stdio, localtime...), para comprobarlo.
+atomic_ulong reservas_memoria;
+atomic_ulong reservas_en_peticiones;
+static __thread int atendiendo_peticion;
+
+static inline void contar_reserva() {
+    atomic_fetch_add_explicit(&reservas_memoria, 1, memory_order_relaxed);
+    if (atendiendo_peticion) atomic_fetch_add_explicit(&reservas_en_peticiones, 1, memory_order_relaxed);
+}
+
+#if defined(CONTAR_RESERVAS_LIBC) && defined(__GLIBC__)
+extern void *__libc_malloc(size_t tam);
+extern void *__libc_calloc(size_t num, size_t tam);
+extern void *__libc_realloc(void *ptr, size_t tam);
+
+void *malloc(size_t tam) {
+    contar_reserva();
+    return __libc_malloc(tam);
+}
+
+void *calloc(size_t num, size_t tam) {
+    contar_reserva();
+    return __libc_calloc(num, tam);
+}
+
+void *realloc(void *ptr, size_t tam) {
+    contar_reserva();
+    return __libc_realloc(ptr, tam);
+}
+
+// Las sustituciones ya cuentan cada reserva
+#define contar_reserva_propia()
+#else
+#define contar_reserva_propia() contar_reserva()
+#endif
+
+static void *reservar_memoria(size_t tam) {
+    contar_reserva_propia();
+    return malloc(tam);
+}
+
+static void *reservar_memoria_ceros(size_t num, size_t tam) {
+    contar_reserva_propia();
+    return calloc(num, tam);
+}
+
+static void *ampliar_memoria(void *ptr, size_t tam) {
+    contar_reserva_propia();
+    return realloc(ptr, tam);
+}
+
+// Arena de cada hilo que atiende peticiones (el principal y los lectores). Las respuestas se
+// componen en ella en lugar de en buffers de pila de tamaño fijo, y se vacía al acabar cada petición.
+#define TAM_ARENA_PETICION (16 * 1024)
+static __thread Arena arena_peticion;
+static __thread char memoria_arena_peticion[TAM_ARENA_PETICION];
+atomic_ulong pico_arenas;   // Mayor uso de una arena al terminar una petición
+
+static Arena *arena_hilo() {
+    if (arena_peticion.base == NULL) arena_iniciar(&arena_peticion, memoria_arena_peticion, TAM_ARENA_PETICION);
+    return &arena_peticion;
+}
+
+static void empezar_peticion() {
+    atendiendo_peticion = 1;
+}
+
+static void terminar_peticion() {
+    Arena *a = arena_hilo();
+    unsigned long pico = atomic_load_explicit(&pico_arenas, memory_order_relaxed);
+    while (a->pico > pico && !atomic_compare_exchange_weak(&pico_arenas, &pico, a->pico)) {
+    }
+    arena_vaciar(a);
+    atendiendo_peticion = 0;
+}
+
+/// @brief Formatea una respuesta terminada en FIN-MSG en la arena del hilo
+/// @return El mensaje (válido hasta que se vacíe la arena) y su largo en *largo, o NULL si no cabe
+static char *formatear_respuesta(size_t *largo, const char *formato, ...) {
+    static const char fin[] = "\nFIN-MSG\n";
+    Arena *a = arena_hilo();
+    size_t libre;
+    char *mensaje = arena_hueco(a, &libre);
+    va_list args;
+    va_start(args, formato);
+    int escritos = vsnprintf(mensaje, libre, formato, args);
+    va_end(args);
+    if (escritos < 0 || (size_t)escritos + sizeof(fin) > libre) {
+        a->agotada++;
+        return NULL;
+    }
+    memcpy(mensaje + escritos, fin, sizeof(fin));
+    *largo = escritos + sizeof(fin) - 1;
+    arena_confirmar(a, *largo + 1);
+    return mensaje;
+}
+
+// Trazas (traza.h). Con TRAZA_MUESTREO=N, o la orden de administración "traza N", se traza
+// una de cada N peticiones de principio a fin; los tramos sin petición se muestrean igual.
+// Con N = 0 cada punto de traza cuesta una carga de la configuración, sin leer el reloj.
+static __thread uint32_t peticion_trazada;   // Petición muestreada que atiende el hilo (0 = ninguna)
+static __thread unsigned contador_muestreo;
+atomic_uint siguiente_peticion_traza = 1;
+
+static inline int traza_activa() {
+    return configuracion()->traza_muestreo > 0;
+}
+
+// 1 una de cada traza_muestreo veces que lo pregunta el hilo
+static inline int traza_muestrear() {
+    int cada = configuracion()->traza_muestreo;
+    return cada > 0 && ++contador_muestreo % cada == 0;
+}
+
+// Inicio de un tramo: 0, sin leer el reloj, si no se traza
+static inline uint64_t tramo_inicio(int trazar) {
+    return trazar ? traza_reloj() : 0;
+}
+
+static inline void tramo_fin(const char *nombre, uint64_t inicio, int32_t dato) {
+    if (inicio != 0) traza_registrar(nombre, inicio, traza_reloj(), peticion_trazada, dato);
+}
+
+// Captura del tráfico (trafico.h) con la orden "capturar <ruta>" o CAPTURA_TRAFICO=<ruta>: cada
+// línea que llega de una sesión y cada respuesta que se le encola, con su instante, para
+// reproducirlas después con banco_replay. Escriben el hilo principal y los hilos lectores.
+#define TAM_BUFFER_CAPTURA (1024 * 1024)
+
+typedef struct {
+    pthread_mutex_t mutex;
+    FILE *archivo;                // NULL si no se está capturando
+    char *buffer;                 // Buffer de stdio: una escritura al disco por MB capturado
+    char ruta[256];
+    int64_t inicio_ns;            // Reloj monótono al empezar; los instantes se cuentan desde aquí
+    int64_t inicio_us;            // La misma marca en la época, para la cabecera
+    uint32_t sesiones;            // Sesiones numeradas desde que empezó
+    uint64_t registros;
+    int fallo;                    // Hubo un error de escritura: el archivo está incompleto
+} CapturaTrafico;
+
+CapturaTrafico captura_trafico = {PTHREAD_MUTEX_INITIALIZER, NULL, NULL, "", 0, 0, 0, 0, 0};
+atomic_int captura_activa;        // Copia de archivo != NULL que se consulta sin el mutex
+
+static inline int capturando_trafico() {
+    return atomic_load_explicit(&captura_activa, memory_order_relaxed);
+}
+
+void registrar_trafico(uint32_t sesion, uint8_t tipo, const char *texto, size_t largo) {
+    pthread_mutex_lock(&captura_trafico.mutex);
+    if (captura_trafico.archivo != NULL) {
+        // El instante se toma con el mutex: los registros quedan en orden
+        uint64_t instante = (uint64_t)(traza_ns() - captura_trafico.inicio_ns) / 1000;
+        if (escribir_registro_trafico(captura_trafico.archivo, instante, sesion, tipo, texto, largo) == 0) {
+            captura_trafico.registros++;
+        } else {
+            captura_trafico.fallo = 1;
+        }
+    }
+    pthread_mutex_unlock(&captura_trafico.mutex);
+}
+
+// Número para una sesión nueva en la captura
+uint32_t iniciar_sesion_trafico() {
+    pthread_mutex_lock(&captura_trafico.mutex);
+    uint32_t sesion = ++captura_trafico.sesiones;
+    pthread_mutex_unlock(&captura_trafico.mutex);
+    return sesion;
+}
+
+#define MAX_OPS_TRANSACCION 16   // Operaciones máximas dentro de un BEGIN/COMMIT
+#define MAX_REINTENTOS_TX 3      // Reintentos automáticos si falla la validación
+
+// Tipos de operación dentro de una transacción
+#define TX_OP_LEER 1
+#define TX_OP_MOVER 2
+#define TX_OP_DEPOSITO 3
+#define TX_OP_RETIRO 4
+
+// Operación registrada en una transacción (se guarda para poder reejecutarla)
+typedef struct {
+    int tipo;
+    int origen;
+    int destino;
+    double monto;
+} OperacionTx;
+
+// Versión observada de una cuenta durante la ejecución de la transacción
+typedef struct {
+    int cuenta;
+    unsigned long version;
+} LecturaTx;
+
+// Cambio de saldo pendiente de aplicar en el COMMIT
+typedef struct {
+    int cuenta;
+    double delta;
+    int retiros;          // Retiros y transferencias salientes que forman el delta, para
+    int transferencias;   // que los analizadores del log no tengan que deducirlos del signo
+} EscrituraTx;
+
+// Transacción optimista: las lecturas registran versiones y las escrituras
+// se acumulan en memoria hasta el COMMIT, donde se validan las versiones.
+typedef struct {
+    int activa;
+    int num_ops;
+    OperacionTx ops[MAX_OPS_TRANSACCION];
+    int num_lecturas;
+    LecturaTx lecturas[MAX_OPS_TRANSACCION * 2];
+    int num_escrituras;
+    EscrituraTx escrituras[MAX_OPS_TRANSACCION * 2];
+    uint32_t transferencia;   // Huella de la transferencia entre shards que aplica (0 si ninguna)
+} Transaccion;
+
+#define TAM_BUFFER_SALIDA (64 * 1024)
+
+// Buffer circular de respuestas pendientes de enviar a un usuario
+typedef struct {
+    char datos[TAM_BUFFER_SALIDA];
+    size_t inicio;
+    size_t usados;
+    time_t ultimo_progreso;  // Último momento en que el usuario aceptó datos
+    long descartados;        // Respuestas que no cupieron en el buffer
+    pthread_mutex_t mutex;   // Los hilos lectores encolan, el hilo principal vacía
+} BufferSalida;
+
+// Milisegundos de un reloj monótono, para temporizadores, cubos de tokens y esperas en cola
+int64_t reloj_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#define TICK_TEMPORIZADOR_MS 100   // Resolución de la rueda de temporizadores
+#define BITS_NIVEL_RUEDA 6
+#define RANURAS_NIVEL (1 << BITS_NIVEL_RUEDA)
+#define NIVELES_RUEDA 3            // 64 ranuras por nivel: hasta 64^3 ticks (~7 h)
+
+// Temporizador intrusivo: vive dentro de la estructura a la que pertenece
+typedef struct Temporizador {
+    struct Temporizador *anterior;
+    struct Temporizador *siguiente;
+    uint64_t vence;                         // Tick absoluto en que vence
+    void (*accion)(struct Temporizador *t);
+    int slot;                               // Usuario al que pertenece (-1 = global)
+    int dato;                               // Parámetro extra de la acción
+} Temporizador;
+
+/// @brief Rueda jerárquica de temporizadores. Programar y cancelar son O(1); cada tick
+///        dispara una ranura del nivel 0 y, cuando éste da la vuelta, reparte una ranura
+///        del nivel superior entre los inferiores.
+typedef struct {
+    Temporizador ranuras[NIVELES_RUEDA][RANURAS_NIVEL];  // Centinelas de listas circulares
+    uint64_t tick;
+    int64_t ultimo_ms;
+} RuedaTemporizadores;
+
+RuedaTemporizadores rueda;
+
+void iniciar_rueda(int64_t ahora_ms) {
+    for (int n = 0; n < NIVELES_RUEDA; n++) {
+        for (int r = 0; r < RANURAS_NIVEL; r++) {
+            rueda.ranuras[n][r].anterior = rueda.ranuras[n][r].siguiente = &rueda.ranuras[n][r];
+        }
+    }
+    rueda.tick = 0;
+    rueda.ultimo_ms = ahora_ms;
+}
+
+static void insertar_en_rueda(Temporizador *t) {
+    uint64_t delta = t->vence - rueda.tick;
+    Temporizador *cabeza;
+    if (delta < RANURAS_NIVEL) {
+        cabeza = &rueda.ranuras[0][t->vence & (RANURAS_NIVEL - 1)];
+    } else if (delta < (uint64_t)RANURAS_NIVEL * RANURAS_NIVEL) {
+        cabeza = &rueda.ranuras[1][(t->vence >> BITS_NIVEL_RUEDA) & (RANURAS_NIVEL - 1)];
+    } else {
+        uint64_t max = (uint64_t)RANURAS_NIVEL * RANURAS_NIVEL * RANURAS_NIVEL - 1;
+        if (delta > max) t->vence = rueda.tick + max;
+        cabeza = &rueda.ranuras[2][(t->vence >> (2 * BITS_NIVEL_RUEDA)) & (RANURAS_NIVEL - 1)];
+    }
+    t->siguiente = cabeza;
+    t->anterior = cabeza->anterior;
+    cabeza->anterior->siguiente = t;
+    cabeza->anterior = t;
+}
+
+int temporizador_armado(const Temporizador *t) {
+    return t->siguiente != NULL;
+}
+
+void cancelar_temporizador(Temporizador *t) {
+    if (!temporizador_armado(t)) return;
+    t->anterior->siguiente = t->siguiente;
+    t->siguiente->anterior = t->anterior;
+    t->anterior = t->siguiente = NULL;
+}
+
+// (Re)programa el temporizador para dentro de "ms" milisegundos
+void programar_temporizador(Temporizador *t, int64_t ms) {
+    cancelar_temporizador(t);
+    uint64_t ticks = ms > 0 ? (uint64_t)((ms + TICK_TEMPORIZADOR_MS - 1) / TICK_TEMPORIZADOR_MS) : 0;
+    t->vence = rueda.tick + (ticks > 0 ? ticks : 1);
+    insertar_en_rueda(t);
+}
+
+// Vacía una ranura y vuelve a insertar sus temporizadores según el tick actual
+static void redistribuir_ranura(Temporizador *cabeza) {
+    Temporizador *t = cabeza->siguiente;
+    cabeza->anterior = cabeza->siguiente = cabeza;
+    while (t != cabeza) {
+        Temporizador *siguiente = t->siguiente;
+        insertar_en_rueda(t);
+        t = siguiente;
+    }
+}
+
+/// @brief Avanza la rueda hasta "ahora_ms" disparando los temporizadores vencidos.
+///        Las acciones pueden reprogramar o cancelar cualquier temporizador.
+void avanzar_rueda(int64_t ahora_ms) {
+    while (ahora_ms - rueda.ultimo_ms >= TICK_TEMPORIZADOR_MS) {
+        rueda.ultimo_ms += TICK_TEMPORIZADOR_MS;
+        rueda.tick++;
+
+        uint64_t indice = rueda.tick & (RANURAS_NIVEL - 1);
+        if (indice == 0) {
+            uint64_t indice1 = (rueda.tick >> BITS_NIVEL_RUEDA) & (RANURAS_NIVEL - 1);
+            if (indice1 == 0) {
+                redistribuir_ranura(&rueda.ranuras[2][(rueda.tick >> (2 * BITS_NIVEL_RUEDA)) & (RANURAS_NIVEL - 1)]);
+            }
+            redistribuir_ranura(&rueda.ranuras[1][indice1]);
+        }
+
+        Temporizador *cabeza = &rueda.ranuras[0][indice];
+        while (cabeza->siguiente != cabeza) {
+            Temporizador *t = cabeza->siguiente;
+            cancelar_temporizador(t);
+            t->accion(t);
+        }
+    }
+}
+
+#define MAX_CLAVE_IDEMPOTENCIA 48         // Longitud máxima de la clave "ID:<clave>|"
+#define MAX_RESPUESTA_IDEMPOTENCIA 512    // Bytes de respuesta guardados por clave
+
+#define MAX_SUSCRIPCIONES 8       // Cuentas cuyos cambios de saldo recibe una sesión
+
+#define MAX_PETICIONES_SESION 32   // Peticiones en cola por sesión y carril
+#define CARRIL_GENERAL 0
+#define CARRIL_LECTURAS 1
+#define COSTE_LECTURA 1            // Coste DRR de una consulta de saldo o movimientos
+#define COSTE_ESCRITURA 4          // Coste DRR de operaciones, transacciones y mensajes de control
+
+// Línea recibida de un usuario, pendiente de atender
+typedef struct {
+    char linea[BUFFER_SIZE];
+    int coste;
+    int64_t llegada_ms;      // Instante de admisión, para medir la espera en cola
+    uint32_t traza;          // Número de la petición si se muestreó para trazarla (0 = no)
+    uint64_t llegada_traza;  // traza_reloj() al encolarla, si se traza
+} Peticion;
+
+// Cola de peticiones de una sesión con su déficit acumulado
+typedef struct {
+    Peticion peticiones[MAX_PETICIONES_SESION];
+    int inicio;
+    int num;
+    int deficit;
+} ColaPeticiones;
+
 // Estructura para mantener información de usuarios activos
 typedef struct {
     pid_t pid;               // PID del proceso usuario
@@ -66,6 +534,27 @@ typedef struct {
     int fifo_lectura_fd;     // Descriptor para leer del usuario
     char fifo_lectura[100];  // Ruta al FIFO para leer del usuario
     char fifo_escritura[100]; // Ruta al FIFO para escribir al usuario
+    Transaccion transaccion; // Transacción abierta con TX:BEGIN (si la hay)
+    unsigned int generacion; // Cambia al liberar el slot para descartar respuestas atrasadas
+    int lectura_pausada;     // Contrapresión: no se lee al usuario mientras su salida esté llena
+    BufferSalida salida;     // Respuestas pendientes de enviar
+    char entrada[2 * BUFFER_SIZE]; // Bytes recibidos aún sin formar una línea completa
+    size_t entrada_usados;
+    ColaPeticiones colas[2]; // Peticiones por carril (general y lecturas)
+    int peso;                // Peso en el planificador DRR
+    Temporizador t_inactividad; // Desconecta la sesión si no envía nada en SESION_INACTIVA_SEGUNDOS
+    Temporizador t_latido;   // Comprueba cada LATIDO_SEGUNDOS que el usuario sigue leyendo
+    Temporizador t_cierre;   // Cierra la sesión tras el EOF, cuando ya no quedan peticiones
+    Temporizador t_plazo[2]; // Plazo de la petición más antigua de cada carril
+    int capturando;          // Se copian las respuestas a "captura" para la caché de idempotencia
+    char captura[MAX_RESPUESTA_IDEMPOTENCIA];
+    size_t captura_usada;
+    int suscripciones[MAX_SUSCRIPCIONES]; // Cuentas de las que se envían los cambios de saldo
+    int num_suscripciones;
+    int es_socket;           // La sesión llegó por el socket del shard (pid es el del router)
+    char clave_actual[MAX_CLAVE_IDEMPOTENCIA]; // Clave de la petición que se está atendiendo
+    int respuesta_diferida;  // La petición se responderá más tarde (transferencia entre shards)
+    atomic_uint sesion_trafico; // Número de la sesión en la captura de tráfico (0 = sin numerar)
 } InfoUsuario;
 
 InfoUsuario usuarios[MAX_USUARIOS_SIMULTANEOS];
@@ -113,6 +602,9 @@ int get_fifo_connection(int usuario_slot, const char *path) {
                 perror("[ERROR] Failed to open FIFO for persistent connection");
                 return -1;
             }
+            // Once open, replies are flushed with non-blocking writev from the main loop
+            int flags = fcntl(fifo_connections[i].fd, F_GETFL);
+            fcntl(fifo_connections[i].fd, F_SETFL, flags | O_NONBLOCK);
             
             fifo_connections[i].usuario_slot = usuario_slot;
             fifo_connections[i].is_open = 1;
@@ -128,6 +620,20 @@ int get_fifo_connection(int usuario_slot, const char *path) {
     return -1;
 }
 
+// Registra como conexión de respuestas de la sesión un descriptor ya abierto (socket, o FIFO recibido en un relevo)
+void registrar_conexion_socket(int usuario_slot, int fd) {
+    for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) {
+        if (fifo_connections[i].usuario_slot == -1) {
+            fifo_connections[i].fd = fd;
+            fifo_connections[i].usuario_slot = usuario_slot;
+            fifo_connections[i].is_open = 1;
+            strcpy(fifo_connections[i].path, "socket");
+            return;
+        }
+    }
+    close(fd);
+}
+
 // Function to close a FIFO connection when a user disconnects
 void close_fifo_connection(int usuario_slot) {
     for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) {
@@ -143,6 +649,112 @@ void close_fifo_connection(int usuario_slot) {
     }
 }
 
+// Despierta al bucle principal cuando un hilo lector deja una respuesta pendiente
+static void despertar_bucle_principal() {
+    uint64_t uno = 1;
+    if (fd_despertar >= 0 && write(fd_despertar, &uno, sizeof(uno)) < 0 && errno != EAGAIN) {
+        perror("write eventfd");
+    }
+}
+
+/// @brief Añade una respuesta al buffer de salida de la sesión (seguro desde cualquier hilo).
+///        Se descarta si la sesión cambió (otra generación) o si el buffer está lleno.
+/// @return 0 si se encoló, -1 si se descartó
+int encolar_salida(int slot, unsigned int generacion, const char *texto, size_t largo) {
+    BufferSalida *salida = &usuarios[slot].salida;
+    int resultado = -1;
+
+    pthread_mutex_lock(&salida->mutex);
+    if (usuarios[slot].generacion == generacion && usuarios[slot].pid != 0) {
+        if (salida->usados + largo <= TAM_BUFFER_SALIDA) {
+            size_t fin = (salida->inicio + salida->usados) % TAM_BUFFER_SALIDA;
+            size_t primero = largo < TAM_BUFFER_SALIDA - fin ? largo : TAM_BUFFER_SALIDA - fin;
+            memcpy(salida->datos + fin, texto, primero);
+            memcpy(salida->datos, texto + primero, largo - primero);
+            if (salida->usados == 0) salida->ultimo_progreso = time(NULL);
+            salida->usados += largo;
+            resultado = 0;
+            uint32_t sesion = atomic_load_explicit(&usuarios[slot].sesion_trafico, memory_order_relaxed);
+            if (sesion != 0 && capturando_trafico()) registrar_trafico(sesion, TRAFICO_RESPUESTA, texto, largo);
+        } else {
+            salida->descartados++;
+        }
+    }
+    pthread_mutex_unlock(&salida->mutex);
+
+    if (resultado == 0) despertar_bucle_principal();
+    return resultado;
+}
+
+size_t bytes_salida_pendientes(int slot) {
+    pthread_mutex_lock(&usuarios[slot].salida.mutex);
+    size_t usados = usuarios[slot].salida.usados;
+    pthread_mutex_unlock(&usuarios[slot].salida.mutex);
+    return usados;
+}
+
+/// @brief Escribe con writev no bloqueante todo lo que acepte el FIFO del usuario
+/// @return bytes escritos, o -1 si el usuario cerró su extremo
+ssize_t vaciar_salida(int slot, int fd) {
+    BufferSalida *salida = &usuarios[slot].salida;
+    ssize_t escritos = 0;
+
+    pthread_mutex_lock(&salida->mutex);
+    if (salida->usados > 0) {
+        struct iovec partes[2];
+        size_t primero = TAM_BUFFER_SALIDA - salida->inicio;
+        if (primero > salida->usados) primero = salida->usados;
+        partes[0].iov_base = salida->datos + salida->inicio;
+        partes[0].iov_len = primero;
+        partes[1].iov_base = salida->datos;
+        partes[1].iov_len = salida->usados - primero;
+
+        uint64_t tramo = tramo_inicio(traza_muestrear());
+        escritos = writev(fd, partes, partes[1].iov_len > 0 ? 2 : 1);
+        tramo_fin("responder", tramo, slot);
+        if (escritos > 0) {
+            salida->inicio = (salida->inicio + escritos) % TAM_BUFFER_SALIDA;
+            salida->usados -= escritos;
+            salida->ultimo_progreso = time(NULL);
+        } else if (escritos < 0 && (errno == EAGAIN || errno == EINTR)) {
+            escritos = 0;
+        }
+    }
+    pthread_mutex_unlock(&salida->mutex);
+    return escritos;
+}
+
+/// @brief Pausa o reanuda la lectura del usuario según las marcas de agua de su buffer
+///        y comprueba si lleva demasiado tiempo sin aceptar datos.
+/// @return 1 si la sesión superó el plazo y hay que desconectarla
+int aplicar_contrapresion(int slot, time_t ahora) {
+    const Config *cfg = configuracion();
+    BufferSalida *salida = &usuarios[slot].salida;
+    int vencida;
+
+    pthread_mutex_lock(&salida->mutex);
+    if (!usuarios[slot].lectura_pausada && salida->usados >= (size_t)cfg->marca_alta_salida) {
+        usuarios[slot].lectura_pausada = 1;
+        debug_log("⏸️ Lectura pausada para cuenta %d: %zu bytes sin enviar", usuarios[slot].cuenta, salida->usados);
+    } else if (usuarios[slot].lectura_pausada && salida->usados <= (size_t)cfg->marca_baja_salida) {
+        usuarios[slot].lectura_pausada = 0;
+        debug_log("▶️ Lectura reanudada para cuenta %d", usuarios[slot].cuenta);
+    }
+    vencida = salida->usados > 0 && ahora - salida->ultimo_progreso > cfg->plazo_salida_segundos;
+    pthread_mutex_unlock(&salida->mutex);
+    return vencida;
+}
+
+// Descriptor de la conexión persistente del usuario, sin abrir una nueva (-1 si no hay)
+int fd_conexion_usuario(int usuario_slot) {
+    for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) {
+        if (fifo_connections[i].usuario_slot == usuario_slot && fifo_connections[i].is_open) {
+            return fifo_connections[i].fd;
+        }
+    }
+    return -1;
+}
+
 /* Función para manejar señales y terminar adecuadamente */
 void manejador_senales(int sig) {
     printf("\nSeñal recibida (%d). Terminando proceso banco...\n", sig);
@@ -172,7 +784,9 @@ void leer_configuracion(const char *filename, Config *cfg) {
     while (fgets(line, sizeof(line), file)) {
         // Eliminar salto de línea
         line[strcspn(line, "\n")] = 0;
-        if (strncmp(line, "LIMITE_RETIRO=", 14) == 0) {
+        if (leer_config_shards(line, &cfg->shards)) {
+            continue;
+        } else if (strncmp(line, "LIMITE_RETIRO=", 14) == 0) {
             cfg->limite_retiro = atoi(line + 14);
         } else if (strncmp(line, "LIMITE_TRANSFERENCIA=", 21) == 0) {
             cfg->limite_transferencia = atoi(line + 21);
@@ -182,6 +796,71 @@ void leer_configuracion(const char *filename, Config *cfg) {
             cfg->umbral_transferencias = atoi(line + 22);
         } else if (strncmp(line, "NUM_HILOS=", 10) == 0) {
             cfg->num_hilos = atoi(line + 10);
+        } else if (strncmp(line, "SALIDA_MARCA_ALTA=", 18) == 0) {
+            cfg->marca_alta_salida = atoi(line + 18);
+        } else if (strncmp(line, "SALIDA_MARCA_BAJA=", 18) == 0) {
+            cfg->marca_baja_salida = atoi(line + 18);
+        } else if (strncmp(line, "SALIDA_PLAZO_SEGUNDOS=", 22) == 0) {
+            cfg->plazo_salida_segundos = atoi(line + 22);
+        } else if (strncmp(line, "QUANTUM_DRR=", 12) == 0) {
+            cfg->quantum_drr = atoi(line + 12);
+        } else if (strncmp(line, "PRIORIDAD_LECTURAS=", 19) == 0) {
+            cfg->prioridad_lecturas = atoi(line + 19);
+        } else if (strncmp(line, "PESOS_CUENTAS=", 14) == 0) {
+            // Lista cuenta:peso separada por comas
+            char *guardado = NULL;
+            cfg->num_pesos = 0;
+            for (char *par = strtok_r(line + 14, ",", &guardado); par != NULL && cfg->num_pesos < MAX_PESOS_CUENTAS;
+                 par = strtok_r(NULL, ",", &guardado)) {
+                PesoCuenta *pc = &cfg->pesos[cfg->num_pesos];
+                if (sscanf(par, "%d:%d", &pc->cuenta, &pc->peso) == 2 && pc->peso > 0) cfg->num_pesos++;
+            }
+        } else if (strncmp(line, "CUENTAS_SUPERVISORAS=", 21) == 0) {
+            char *guardado = NULL;
+            cfg->num_supervisoras = 0;
+            for (char *campo = strtok_r(line + 21, ",", &guardado);
+                 campo != NULL && cfg->num_supervisoras < MAX_CUENTAS_SUPERVISORAS;
+                 campo = strtok_r(NULL, ",", &guardado)) {
+                if (atoi(campo) > 0) cfg->supervisoras[cfg->num_supervisoras++] = atoi(campo);
+            }
+        } else if (strncmp(line, "LIMITE_PETICIONES_CUENTA=", 25) == 0) {
+            cfg->tasa_cuenta = atof(line + 25);
+        } else if (strncmp(line, "RAFAGA_CUENTA=", 14) == 0) {
+            cfg->rafaga_cuenta = atoi(line + 14);
+        } else if (strncmp(line, "LIMITE_PETICIONES_GLOBAL=", 25) == 0) {
+            cfg->tasa_global = atof(line + 25);
+        } else if (strncmp(line, "RAFAGA_GLOBAL=", 14) == 0) {
+            cfg->rafaga_global = atoi(line + 14);
+        } else if (strncmp(line, "MAX_COLA_GLOBAL=", 16) == 0) {
+            cfg->max_cola_global = atoi(line + 16);
+        } else if (strncmp(line, "MAX_ESPERA_COLA_MS=", 19) == 0) {
+            cfg->max_espera_cola_ms = atoi(line + 19);
+        } else if (strncmp(line, "SESION_INACTIVA_SEGUNDOS=", 25) == 0) {
+            cfg->sesion_inactiva_segundos = atoi(line + 25);
+        } else if (strncmp(line, "PLAZO_PETICION_MS=", 18) == 0) {
+            cfg->plazo_peticion_ms = atoi(line + 18);
+        } else if (strncmp(line, "LATIDO_SEGUNDOS=", 16) == 0) {
+            cfg->latido_segundos = atoi(line + 16);
+        } else if (strncmp(line, "IDEMPOTENCIA_SEGUNDOS=", 22) == 0) {
+            cfg->idempotencia_segundos = atoi(line + 22);
+        } else if (strncmp(line, "SOCKET_REPLICA=", 15) == 0) {
+            sscanf(line + 15, "%107s", cfg->socket_replica);
+        } else if (strncmp(line, "PLAZO_2PC_MS=", 13) == 0) {
+            cfg->plazo_2pc_ms = atoi(line + 13);
+        } else if (strncmp(line, "PLAZO_RELEVO_MS=", 16) == 0) {
+            cfg->plazo_relevo_ms = atoi(line + 16);
+        } else if (strncmp(line, "SOCKET_ADMIN=", 13) == 0) {
+            sscanf(line + 13, "%107s", cfg->socket_admin);
+        } else if (strncmp(line, "MOTOR_IO=", 9) == 0) {
+            cfg->motor_io = strcmp(line + 9, "io_uring") == 0 ? MOTOR_IO_URING : MOTOR_POLL;
+        } else if (strncmp(line, "TRAZA_MUESTREO=", 15) == 0) {
+            cfg->traza_muestreo = atoi(line + 15);
+        } else if (strncmp(line, "CAPTURA_TRAFICO=", 16) == 0) {
+            if (sscanf(line + 16, "%255s", cfg->archivo_captura) != 1) cfg->archivo_captura[0] = '\0';
+        } else if (strncmp(line, "TAM_MAX_LOG=", 12) == 0) {
+            cfg->tam_max_log = atol(line + 12);
+        } else if (strncmp(line, "ROTACION_LOG_SEGUNDOS=", 22) == 0) {
+            cfg->rotacion_log_segundos = atoi(line + 22);
         } else if (strncmp(line, "ARCHIVO_CUENTAS=", 16) == 0) {
             if (sscanf(line + 16, "%255s", cfg->archivo_cuentas) != 1) {
                 printf("Warning: Error reading ARCHIVO_CUENTAS\n");
@@ -195,6 +874,23 @@ void leer_configuracion(const char *filename, Config *cfg) {
         }
     }
     fclose(file);
+
+    // Valores por defecto de la contrapresión
+    if (cfg->marca_alta_salida <= 0 || cfg->marca_alta_salida > TAM_BUFFER_SALIDA) cfg->marca_alta_salida = 48 * 1024;
+    if (cfg->marca_baja_salida <= 0 || cfg->marca_baja_salida >= cfg->marca_alta_salida) cfg->marca_baja_salida = cfg->marca_alta_salida / 3;
+    if (cfg->plazo_salida_segundos <= 0) cfg->plazo_salida_segundos = 10;
+    if (cfg->quantum_drr <= 0) cfg->quantum_drr = COSTE_ESCRITURA;
+    if (cfg->latido_segundos <= 0) cfg->latido_segundos = 5;
+    if (cfg->idempotencia_segundos <= 0) cfg->idempotencia_segundos = 300;
+    if (cfg->plazo_2pc_ms <= 0) cfg->plazo_2pc_ms = 2000;
+    if (cfg->plazo_relevo_ms <= 0) cfg->plazo_relevo_ms = 3000;
+    if (cfg->socket_replica[0] == '\0') strcpy(cfg->socket_replica, "/tmp/banco_replica.sock");
+    if (cfg->socket_admin[0] == '\0') strcpy(cfg->socket_admin, "/tmp/banco_admin.sock");
+    completar_config_shards(&cfg->shards);
+
+    // Sin ráfaga configurada, el cubo admite un segundo de peticiones
+    if (cfg->rafaga_cuenta <= 0) cfg->rafaga_cuenta = cfg->tasa_cuenta > 1 ? (int)cfg->tasa_cuenta : 1;
+    if (cfg->rafaga_global <= 0) cfg->rafaga_global = cfg->tasa_global > 1 ? (int)cfg->tasa_global : 1;
 }
 
 // Función para crear un FIFO con manejo de errores
@@ -211,6 +907,7 @@ int crear_fifo(const char *path) {
 // Función para limpiar recursos de un usuario
 void limpiar_recursos_usuario(int idx) {
     if (idx < 0 || idx >= MAX_USUARIOS_SIMULTANEOS) return;
+    cancelar_operaciones_sesion(idx, 1, 1);
     
     if (usuarios[idx].fifo_lectura_fd > 0) {
         close(usuarios[idx].fifo_lectura_fd);
@@ -228,8 +925,29 @@ void limpiar_recursos_usuario(int idx) {
         usuarios[idx].fifo_escritura[0] = '\0';
     }
     
+    // Descartar la salida pendiente; las respuestas en vuelo verán otra generación
+    pthread_mutex_lock(&usuarios[idx].salida.mutex);
     usuarios[idx].pid = 0;
+    usuarios[idx].generacion++;
+    usuarios[idx].salida.inicio = 0;
+    usuarios[idx].salida.usados = 0;
+    usuarios[idx].salida.descartados = 0;
+    pthread_mutex_unlock(&usuarios[idx].salida.mutex);
+    uint32_t sesion = atomic_exchange(&usuarios[idx].sesion_trafico, 0);
+    if (sesion != 0 && capturando_trafico()) registrar_trafico(sesion, TRAFICO_FIN, "", 0);
+    usuarios[idx].lectura_pausada = 0;
+    cancelar_temporizador(&usuarios[idx].t_inactividad);
+    cancelar_temporizador(&usuarios[idx].t_latido);
+    cancelar_temporizador(&usuarios[idx].t_cierre);
+    cancelar_temporizador(&usuarios[idx].t_plazo[CARRIL_GENERAL]);
+    cancelar_temporizador(&usuarios[idx].t_plazo[CARRIL_LECTURAS]);
+    usuarios[idx].capturando = 0;
+    usuarios[idx].es_socket = 0;
+    cancelar_suscripciones(idx);
+    usuarios[idx].entrada_usados = 0;
+    memset(usuarios[idx].colas, 0, sizeof(usuarios[idx].colas));
     usuarios[idx].cuenta = 0;
+    memset(&usuarios[idx].transaccion, 0, sizeof(Transaccion));
 
     // Close persistent FIFO connection
     close_fifo_connection(idx);
@@ -237,18 +955,11 @@ void limpiar_recursos_usuario(int idx) {
 
 // Definición de la función obtener_saldo_cuenta
 double obtener_saldo_cuenta(int cuenta) {
-    // Definición de la estructura Cuenta
-    typedef struct {
-        int numero_cuenta;
-        char titular[50];
-        float saldo;
-        int num_transacciones;
-    } Cuenta;
-    
+    const Config *cfg = configuracion();
     // Primero determinar la ruta del archivo de cuentas
     const char* rutas_posibles[] = {
         // Usar la configuración si está disponible
-        strlen(config.archivo_cuentas) > 0 ? config.archivo_cuentas : NULL,
+        strlen(cfg->archivo_cuentas) > 0 ? cfg->archivo_cuentas : NULL,
         "../data/cuentas.dat",
         "./data/cuentas.dat",
         "/home/admin/PracticaFinal/BANCO/data/cuentas.dat"
@@ -377,398 +1088,4670 @@ double obtener_saldo_cuenta(int cuenta) {
 }
 
 // Función para procesar la consulta de saldo
-void procesar_consulta_saldo(int cuenta, int fifo_escritura_fd) {
-    debug_log("Iniciando proceso de consulta de saldo para cuenta %d (fd=%d)", 
-           cuenta, fifo_escritura_fd);
+void procesar_consulta_saldo(int cuenta, int slot, unsigned int generacion) {
+    debug_log("Iniciando proceso de consulta de saldo para cuenta %d (slot %d)", cuenta, slot);
     
-    // Verify that the descriptor is valid
-    if (fifo_escritura_fd < 0) {
-        debug_log("ERROR: Descriptor de FIFO inválido");
-        return;
-    }
-    
-    struct stat fifo_stat;
-    if (fstat(fifo_escritura_fd, &fifo_stat) < 0) {
-        debug_log("ERROR: El descriptor %d no es válido", fifo_escritura_fd);
-        perror("fstat");
-        return;
+    // Obtener el saldo real: del almacén en memoria sin bloqueos, o del archivo si no está cargado
+    double saldo;
+    Cuenta snapshot;
+    if (almacen_cargado()) {
+        saldo = leer_cuenta_snapshot(cuenta, &snapshot) == 0 ? snapshot.saldo : -1;
+    } else {
+        uint64_t tramo = tramo_inicio(peticion_trazada != 0);
+        saldo = obtener_saldo_cuenta(cuenta);
+        tramo_fin("saldo_archivo", tramo, cuenta);
     }
-    
-    debug_log("Descriptor de FIFO %d verificado y válido", fifo_escritura_fd);
-    
-    // Obtener el saldo real
-    double saldo = obtener_saldo_cuenta(cuenta);
     debug_log("Saldo obtenido para cuenta %d: %.2f", cuenta, saldo);
     
-    // Create a message packet with fixed format and length
-    char respuesta[BUFFER_SIZE];
-    
+    // Create a message packet with fixed format, terminated by FIN-MSG, in the thread's arena
+    size_t largo;
+    char *respuesta;
     if (saldo < 0) {
-        sprintf(respuesta, "[SALDO:ERROR:No se pudo obtener el saldo de la cuenta %d]", cuenta);
+        respuesta = formatear_respuesta(&largo, "[SALDO:ERROR:No se pudo obtener el saldo de la cuenta %d]", cuenta);
     } else {
-        sprintf(respuesta, "[SALDO:%.2f:OK]", saldo);
+        respuesta = formatear_respuesta(&largo, "[SALDO:%.2f:OK]", saldo);
     }
+    if (respuesta == NULL) return;
     
-    debug_log("Mensaje estructurado: '%s'", respuesta);
-    
-    // Add a test signature and newline for clear message boundaries
-    strcat(respuesta, "\nFIN-MSG\n");
+    debug_log("Mensaje estructurado: '%.*s'", (int)largo - 9, respuesta);
     
-    // Send the response
-    debug_log("Enviando respuesta (%ld bytes) por fd=%d...", strlen(respuesta), fifo_escritura_fd);
-    
-    ssize_t bytes_escritos = write(fifo_escritura_fd, respuesta, strlen(respuesta));
-    if (bytes_escritos < 0) {
-        debug_log("ERROR: No se pudo enviar la respuesta al cliente");
-        perror("write");
+    // Queue the response; the main loop flushes it when the FIFO is writable
+    if (encolar_salida(slot, generacion, respuesta, largo) < 0) {
+        debug_log("ERROR: Respuesta descartada para el slot %d (sesión cerrada o buffer lleno)", slot);
         return;
     }
     
-    debug_log("Respuesta enviada correctamente: %ld bytes escritos", bytes_escritos);
-    
-    // Ensure the data is sent immediately
-    fsync(fifo_escritura_fd);
-    debug_log("Datos sincronizados a disco");
-    
-    // Shorter delay that's still effective
-    debug_log("Esperando para asegurar que el cliente procese la respuesta (100ms)...");
-    usleep(100000);  // 100ms instead of 1 second
-    debug_log("Respuesta completada");
+    debug_log("Respuesta encolada: %zu bytes", largo);
 }
 
-int main() {
-    // Inicializar array de usuarios
-    for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) {
-        usuarios[i].pid = 0;
-        usuarios[i].cuenta = 0;
-        usuarios[i].fifo_lectura_fd = 0;
-        usuarios[i].fifo_lectura[0] = '\0';
-        usuarios[i].fifo_escritura[0] = '\0';
-    }
+#define TAM_RING_MOVIMIENTOS 16   // Últimos movimientos por cuenta que se guardan en memoria
 
-    // Leer el fichero de configuración.
-    leer_configuracion(CONFIG_FILE, &config);
+// Movimiento confirmado sobre una cuenta
+typedef struct {
+    int64_t instante;            // Segundos desde epoch
+    double monto;                // Cambio de saldo (negativo en retiros)
+    double saldo;                // Saldo resultante
+    int64_t desplazamiento_log;  // Posición de la línea en el log de transacciones
+    int64_t posicion_indice;     // Posición del registro en el índice de movimientos
+    int64_t anterior;            // Posición en el índice del movimiento previo de la cuenta (-1 si no hay)
+} Movimiento;
 
-    // Configuración de manejadores de señales para terminación adecuada
-    signal(SIGINT, manejador_senales);
-    signal(SIGTERM, manejador_senales);
+// Ring con los últimos movimientos de una cuenta
+typedef struct {
+    Movimiento entradas[TAM_RING_MOVIMIENTOS];
+    int num;
+    int siguiente;
+} RingMovimientos;
 
-    // Verificar la existencia del archivo de cuentas al iniciar
-    const char* ruta_cuentas = strlen(config.archivo_cuentas) > 0 ? 
-                          config.archivo_cuentas : "../data/cuentas.dat";
-    
-    if (access(ruta_cuentas, F_OK) != 0) {
-        printf("\n");
-        printf("┌──────────────────────────────────────────────────┐\n");
-        printf("│               ¡¡ ADVERTENCIA !!                  │\n");
-        printf("│     NO SE ENCONTRÓ EL ARCHIVO DE CUENTAS:        │\n");
-        printf("│     %-42s │\n", ruta_cuentas);
-        printf("└──────────────────────────────────────────────────┘\n");
-        printf("  Se iniciará con valores temporales al consultar saldos.\n");
-        printf("  Para crear un archivo permanente ejecute: ./init_cuentas\n\n");
-    } else if (access(ruta_cuentas, R_OK) != 0) {
-        printf("\n");
-        printf("┌──────────────────────────────────────────────────┐\n");
-        printf("│               ¡¡ ADVERTENCIA !!                  │\n");
-        printf("│   NO TIENE PERMISOS PARA LEER ARCHIVO CUENTAS:   │\n");
-        printf("│     %-42s │\n", ruta_cuentas);
-        printf("└──────────────────────────────────────────────────┘\n");
-        printf("  Corrija los permisos con: chmod 644 %s\n\n", ruta_cuentas);
-    }
+// Registro del índice de movimientos en disco (archivo de log + ".idx", solo se añaden registros).
+// Los registros de una misma cuenta forman una lista enlazada hacia atrás mediante "anterior".
+typedef struct {
+    int32_t cuenta;
+    uint32_t transferencia;       // Huella del id 2PC cuyo cambio aplica el registro (0 si no es de una)
+    int64_t instante;
+    double monto;
+    double saldo;
+    int64_t desplazamiento_log;
+    int64_t anterior;
+} RegistroIndice;
 
-    // Crear un semáforo nombrado para controlar el acceso al archivo de cuentas.
-    sem_t *sem = sem_open("/cuentas_semaphore", O_CREAT, 0644, 1);
-    if (sem == SEM_FAILED) {
-        perror("Error al crear el semáforo");
-        exit(EXIT_FAILURE);
-    }
+int indice_movimientos_fd = -1;
+int64_t indice_aplicado = 0;   // Bytes del índice ya reflejados en el almacén (réplica y relevo)
 
-    // Abrir el archivo de log.
-    const char *log_filename = strlen(config.archivo_log) > 0 ? config.archivo_log : LOG_FILE;
-    FILE *log_file = fopen(log_filename, "a");
-    if (log_file == NULL) {
-        perror("Error al abrir el archivo de log");
-        exit(EXIT_FAILURE);
-    }
+#define ENTRADAS_IDEMPOTENCIA 16   // Claves recientes recordadas por cuenta
 
-    // Initialize FIFO connections
-    init_fifo_connections();
+// Respuesta ya enviada a una petición con clave de idempotencia
+typedef struct {
+    char clave[MAX_CLAVE_IDEMPOTENCIA];
+    uint64_t hash;
+    time_t creada;
+    uint64_t ultimo_uso;     // Para sustituir la entrada menos usada (LRU)
+    size_t largo;
+    char respuesta[MAX_RESPUESTA_IDEMPOTENCIA];
+} EntradaIdempotencia;
 
-    printf("Banco iniciado. Esperando conexiones de usuario...\n");
-    printf("Presione Ctrl+C para terminar.\n\n");
+typedef struct {
+    EntradaIdempotencia entradas[ENTRADAS_IDEMPOTENCIA];
+    uint64_t reloj;
+} CacheIdempotencia;
 
-    // Add a variable to control the check interval
-    int check_count = 0;
-    
-    // Bucle principal para aceptar conexiones de usuarios
-    while (continuar_ejecucion) {
-        // Increment the counter for periodic messages
-        check_count++;
-        
-        // Every 30 iterations, print a waiting message to show the bank is still listening
-        if (check_count % 30 == 0) {
-            printf("Banco activo - Esperando mensajes de usuarios o nuevas conexiones...\n");
-            check_count = 0;  // Reset counter
-        }
-        
-        // First process messages from existing users
-        for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) {
-            if (usuarios[i].fifo_lectura_fd > 0) {
-                char buffer[256];
-                fd_set set;
-                struct timeval timeout;
-                
-                FD_ZERO(&set);
-                FD_SET(usuarios[i].fifo_lectura_fd, &set);
-                
-                // Revert to a shorter timeout for better responsiveness
-                timeout.tv_sec = 0;
-                timeout.tv_usec = 20000; // 20ms (reduced from 1 second but still better than 1ms)
-                
-                int ready = select(usuarios[i].fifo_lectura_fd + 1, &set, NULL, NULL, &timeout);
-                
-                if (ready > 0 && FD_ISSET(usuarios[i].fifo_lectura_fd, &set)) {
-                    ssize_t nbytes = read(usuarios[i].fifo_lectura_fd, buffer, sizeof(buffer) - 1);
-                    
-                    if (nbytes > 0) {
-                        buffer[nbytes] = '\0';
-                        
-                        // Categorize the message for better logging
-                        int is_login = strstr(buffer, "ha iniciado sesión") != NULL;
-                        int is_logout = strstr(buffer, "ha cerrado sesión") != NULL;
-                        int is_balance_query = strstr(buffer, "Consulta de saldo") != NULL || 
-                                              strstr(buffer, "consulta de saldo") != NULL ||
-                                              strstr(buffer, "saldo") != NULL;
-                        
-                        if (is_login) {
-                            debug_log("✅ Mensaje de conexión detectado: Usuario %d ha iniciado sesión", usuarios[i].cuenta);
-                        } else if (is_logout) {
-                            debug_log("👋 Mensaje de desconexión detectado: Usuario %d ha cerrado sesión", usuarios[i].cuenta);
-                        } else {
-                            debug_log("📩 Mensaje regular recibido de usuario %d (cuenta %d) - %d bytes: '%s'", 
-                                    i, usuarios[i].cuenta, (int)nbytes, buffer);
-                        }
-                        
-                        // Log to transaction log
-                        fprintf(log_file, "Usuario (Cuenta %d): %s", usuarios[i].cuenta, buffer);
-                        fflush(log_file);
-                        
-                        // Print to console in a more formatted way
-                        printf("Mensaje de usuario %d (Cuenta %d): %s", i, usuarios[i].cuenta, buffer);
-                        
-                        // Only check for operations in non-connection messages
-                        if (!is_login && !is_logout) {
-                            debug_log("Analizando mensaje para detectar operaciones...");
-                            
-                            // Check for balance query with consistent patterns
-                            if (is_balance_query) {
-                                debug_log("🔍 Detectada consulta de saldo de cuenta %d", usuarios[i].cuenta);
-                                
-                                // Verify that the FIFO exists
-                                if (access(usuarios[i].fifo_escritura, F_OK) == -1) {
-                                    debug_log("❌ ERROR: El FIFO %s no existe", usuarios[i].fifo_escritura);
-                                    continue;
-                                }
-                                
-                                // Get the persistent connection instead of opening a new one
-                                int fifo_escritura_fd = get_fifo_connection(i, usuarios[i].fifo_escritura);
-                                if (fifo_escritura_fd < 0) {
-                                    debug_log("❌ ERROR: No se pudo obtener la conexión FIFO persistente");
-                                    continue;
-                                }
-                                
-                                debug_log("✅ FIFO abierto correctamente (fd=%d)", fifo_escritura_fd);
-                                procesar_consulta_saldo(usuarios[i].cuenta, fifo_escritura_fd);
-                            } else {
-                                debug_log("ℹ️ No se detectó ninguna operación en el mensaje");
-                            }
-                        } else {
-                            debug_log("ℹ️ Mensaje administrativo procesado, no requiere respuesta");
-                        }
-                    }
-                    else if (nbytes == 0) { // EOF - el FIFO se cerró
-                        close(usuarios[i].fifo_lectura_fd);
-                        usuarios[i].fifo_lectura_fd = 0;
-                    }
-                }
-            }
-        }
+// Almacén de cuentas en memoria con un contador de versión por cuenta
+typedef struct {
+    Cuenta datos;
+    long posicion;            // Índice del registro dentro del archivo de cuentas
+    // Seqlock de la cuenta: impar mientras se escribe, par cuando es estable.
+    // Avanza en cada COMMIT que modifica la cuenta y sirve de versión para el control optimista.
+    atomic_ulong version;
+    RingMovimientos *movimientos; // Se reserva con el primer movimiento de la cuenta
+    int64_t ultimo_indice;        // Cabeza de la lista de la cuenta en el índice (-1 si no hay)
+    CacheIdempotencia *idempotencia; // Se reserva con la primera escritura con clave
+    uint32_t suscriptores;        // Bit i: el slot i recibe los cambios de saldo (sólo hilo principal)
+    double retenido;              // Fondos reservados por transferencias entre shards sin decidir
+} CuentaAlmacen;
 
-        // Fix the waitpid issue - only mark as disconnected if truly gone
-        for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) {
-            if (usuarios[i].pid > 0) {
-                int status;
-                pid_t result = waitpid(usuarios[i].pid, &status, WNOHANG);
-                
-                // Only consider truly terminated processes (not just the terminal launcher)
-                if (result > 0) {
-                    // Check if this is the actual user process terminating or just the launcher
-                    // We'll do this by checking if we can still read from the FIFO
-                    if (usuarios[i].fifo_lectura_fd > 0) {
-                        // Try a non-blocking read to see if the connection is truly dead
-                        char test_buf[10];
-                        int flags = fcntl(usuarios[i].fifo_lectura_fd, F_GETFL);
-                        fcntl(usuarios[i].fifo_lectura_fd, F_SETFL, flags | O_NONBLOCK);
-                        
-                        // We don't care about the contents, just whether the read fails
-                        ssize_t test_read = read(usuarios[i].fifo_lectura_fd, test_buf, 1);
-                        
-                        // Only disconnect if read returns 0 (EOF) or error
-                        if (test_read <= 0) {
-                            printf("Usuario (Cuenta: %d, PID: %d) desconectado.\n", 
-                                   usuarios[i].cuenta, usuarios[i].pid);
-                            fprintf(log_file, "Usuario desconectado: Cuenta %d (PID %d)\n", 
-                                    usuarios[i].cuenta, usuarios[i].pid);
-                            fflush(log_file);
-                            
-                            limpiar_recursos_usuario(i);
-                        } else {
-                            // False alarm - just the launcher exited
-                            debug_log("Launcher exited but user connection still active (Cuenta: %d)", 
-                                     usuarios[i].cuenta);
-                        }
-                    } else {
-                        // FIFO is already closed, definitely disconnected
-                        limpiar_recursos_usuario(i);
-                    }
-                }
-                else if (result < 0 && errno != ECHILD) {
-                    perror("Error en waitpid");
-                }
-            }
-        }
+typedef struct {
+    CuentaAlmacen *cuentas;   // Ordenadas por número de cuenta para búsqueda binaria
+    int num_cuentas;
+    Cuenta *mapa;             // Archivo de cuentas proyectado con mmap (compartido): persistir es copiar
+    size_t tam_mapa;
+} AlmacenCuentas;
 
-        int cuenta_usuario;
-        int slot_disponible = -1;
+AlmacenCuentas almacen = {NULL, 0, NULL, 0};
 
-        // Buscar un slot disponible para un nuevo usuario
-        for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) {
-            if (usuarios[i].pid == 0) {
-                slot_disponible = i;
-                break;
-            }
-        }
+// Seqlock global: avanza alrededor de cada COMMIT para lecturas consistentes de varias cuentas
+atomic_ulong epoca_almacen = 0;
 
-        if (slot_disponible != -1) {
-            // Create a non-blocking input method to check for user account input
-            fd_set stdin_set;
-            struct timeval input_timeout;
-            FD_ZERO(&stdin_set);
-            FD_SET(STDIN_FILENO, &stdin_set);
-            
-            // Set a very short timeout so we don't block the message processing
-            input_timeout.tv_sec = 0;
-            input_timeout.tv_usec = 10000;  // 10ms
-            
-            // Check if there's input ready to be read
-            if (select(STDIN_FILENO + 1, &stdin_set, NULL, NULL, &input_timeout) > 0) {
-                printf("Ingrese el número de cuenta (o 0 para salir): ");
-                if (scanf("%d", &cuenta_usuario) != 1) {
-                    printf("Entrada inválida. Intente de nuevo.\n");
-                    while (getchar() != '\n'); // Limpiar buffer
-                    continue;
-                }
+static int comparar_cuentas_almacen(const void *a, const void *b) {
+    const CuentaAlmacen *ca = a, *cb = b;
+    return (ca->datos.numero_cuenta > cb->datos.numero_cuenta) -
+           (ca->datos.numero_cuenta < cb->datos.numero_cuenta);
+}
 
-                if (cuenta_usuario == 0) {
-                    printf("Solicitud de cierre recibida.\n");
-                    continuar_ejecucion = 0;
-                    continue;
-                }
+/// @brief Carga todas las cuentas del archivo binario en memoria. El archivo queda proyectado
+///        con mmap compartido: los COMMIT copian ahí cada cuenta modificada, y otro proceso banco
+///        que lo proyecte (un relevo, una réplica) ve los cambios sin esperar a ningún fflush.
+int cargar_almacen_cuentas(const char *ruta) {
+    int fd = open(ruta, modo_replica ? O_RDONLY : O_RDWR);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        printf("[ERROR] No se pudo abrir %s para el almacén de cuentas: %s\n", ruta, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
 
-                // Crear dos FIFOs para este usuario: banco->usuario y usuario->banco
-                char fifo_to_usuario[100], fifo_from_usuario[100];
-                sprintf(fifo_to_usuario, "%s%d_to_user", FIFO_BASE_PATH, slot_disponible);
-                sprintf(fifo_from_usuario, "%s%d_from_user", FIFO_BASE_PATH, slot_disponible);
-                
-                // Guardar las rutas de los FIFOs en la estructura del usuario
-                strcpy(usuarios[slot_disponible].fifo_escritura, fifo_to_usuario);
-                strcpy(usuarios[slot_disponible].fifo_lectura, fifo_from_usuario);
-                
-                // Crear los FIFOs
-                if (crear_fifo(fifo_to_usuario) < 0 || crear_fifo(fifo_from_usuario) < 0) {
-                    fprintf(stderr, "Error al crear FIFOs para el usuario %d\n", cuenta_usuario);
-                    continue;
-                }
+    long num_registros = st.st_size / (long)sizeof(Cuenta);
+    size_t tam_mapa = num_registros * sizeof(Cuenta);
+    Cuenta *mapa = NULL;
+    if (num_registros > 0) {
+        // La réplica nunca escribe en el archivo del primario
+        mapa = mmap(NULL, tam_mapa, modo_replica ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mapa == MAP_FAILED) {
+        printf("[ERROR] No se pudo proyectar %s: %s\n", ruta, strerror(errno));
+        return -1;
+    }
 
-                pid_t pid = fork();
-                if (pid < 0) {
-                    perror("Error al crear el proceso hijo");
-                    continue;
-                } else if (pid == 0) {
-                    // Proceso hijo
-                    
-                    // Primero cerramos los FIFOs que podría tener abiertos el proceso padre
-                    // para evitar bloqueos
-                    for (int j = 0; j < MAX_USUARIOS_SIMULTANEOS; j++) {
-                        if (usuarios[j].fifo_lectura_fd > 0) {
-                            close(usuarios[j].fifo_lectura_fd);
-                        }
-                    }
-                    
-                    // Convertir cuenta_usuario a string y preparar argumentos
-                    char cuenta_str[20];
-                    sprintf(cuenta_str, "%d", cuenta_usuario);
-                    
-                    // Crear el comando para ejecutar en la nueva terminal
-                    char command[512];
-                    if (system("command -v xterm > /dev/null") == 0) {
-                        sprintf(command, "xterm -T \"Usuario Banco - Cuenta %d\" -e \"./usuario %s %s %s\"",
-                                cuenta_usuario, cuenta_str, fifo_from_usuario, fifo_to_usuario);
-                    } else if (system("command -v gnome-terminal > /dev/null") == 0) {
-                        sprintf(command, "gnome-terminal -- ./usuario %s %s %s",
-                                cuenta_str, fifo_from_usuario, fifo_to_usuario);
-                    } else {
-                        fprintf(stderr, "Error: No se encontró xterm ni gnome-terminal\n");
-                        exit(EXIT_FAILURE);
-                    }
-                    
-                    // Ejecutar el comando
-                    system(command);
-                    exit(EXIT_SUCCESS);
-                } else {
-                    // Proceso padre
-                    usuarios[slot_disponible].pid = pid;
-                    usuarios[slot_disponible].cuenta = cuenta_usuario;
-                    
-                    // Primero abrimos el FIFO para lectura (bloqueante)
-                    printf("Esperando a que el usuario abra el FIFO para lectura...\n");
-                    usuarios[slot_disponible].fifo_lectura_fd = open(fifo_from_usuario, O_RDONLY);
-                    if (usuarios[slot_disponible].fifo_lectura_fd < 0) {
-                        perror("Error al abrir FIFO para lectura");
-                        limpiar_recursos_usuario(slot_disponible);
-                        continue;
-                    }
-                    
-                    // Ahora configuramos como no bloqueante
-                    int flags = fcntl(usuarios[slot_disponible].fifo_lectura_fd, F_GETFL);
-                    fcntl(usuarios[slot_disponible].fifo_lectura_fd, F_SETFL, flags | O_NONBLOCK);
-                    
-                    // Establecer una conexión FIFO persistente para escritura
-                    printf("Esperando a que el usuario abra el FIFO para escritura...\n");
-                    int fifo_escritura_fd = get_fifo_connection(slot_disponible, fifo_to_usuario);
-                    if (fifo_escritura_fd < 0) {
-                        perror("Error al obtener conexión FIFO persistente");
-                        limpiar_recursos_usuario(slot_disponible);
-                        continue;
-                    }
-                    
-                    printf("Usuario con cuenta %d conectado (PID: %d)\n", cuenta_usuario, pid);
-                    fprintf(log_file, "Usuario conectado: Cuenta %d (PID: %d)\n", cuenta_usuario, pid);
-                    fflush(log_file);
-                }
-            }
-        }
-        
-        // Revert to original sleep value for responsiveness
-        usleep(100000); // 100ms (original value)
+    CuentaAlmacen *cuentas = reservar_memoria_ceros(num_registros > 0 ? num_registros : 1, sizeof(CuentaAlmacen));
+    if (cuentas == NULL) {
+        perror("Error al reservar memoria para el almacén de cuentas");
+        if (mapa != NULL) munmap(mapa, tam_mapa);
+        return -1;
     }
 
-    // Esperar a que todos los procesos hijos terminen
-    printf("Finalizando todos los procesos de usuario...\n");
-    for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) {
-        if (usuarios[i].pid > 0) {
-            kill(usuarios[i].pid, SIGTERM);
-            waitpid(usuarios[i].pid, NULL, 0);
+    for (long i = 0; i < num_registros; i++) {
+        cuentas[i].datos = mapa[i];
+        cuentas[i].posicion = i;
+        atomic_init(&cuentas[i].version, 0);
+        cuentas[i].ultimo_indice = -1;
+    }
+    qsort(cuentas, num_registros, sizeof(CuentaAlmacen), comparar_cuentas_almacen);
+
+    if (modo_replica && mapa != NULL) {
+        munmap(mapa, tam_mapa);
+        mapa = NULL;
+    }
+    almacen.cuentas = cuentas;
+    almacen.num_cuentas = (int)num_registros;
+    almacen.mapa = mapa;
+    almacen.tam_mapa = tam_mapa;
+    debug_log("Almacén de cuentas cargado: %ld cuentas desde %s", num_registros, ruta);
+    return 0;
+}
+
+int almacen_cargado() {
+    return almacen.num_cuentas > 0;
+}
+
+void liberar_almacen_cuentas() {
+    if (almacen.mapa != NULL) munmap(almacen.mapa, almacen.tam_mapa);
+    for (int i = 0; i < almacen.num_cuentas; i++) {
+        free(almacen.cuentas[i].movimientos);
+        free(almacen.cuentas[i].idempotencia);
+    }
+    if (indice_movimientos_fd >= 0) close(indice_movimientos_fd);
+    indice_movimientos_fd = -1;
+    free(almacen.cuentas);
+    almacen.cuentas = NULL;
+    almacen.num_cuentas = 0;
+    almacen.mapa = NULL;
+}
+
+CuentaAlmacen *buscar_cuenta_almacen(int numero_cuenta) {
+    CuentaAlmacen clave;
+    clave.datos.numero_cuenta = numero_cuenta;
+    return bsearch(&clave, almacen.cuentas, almacen.num_cuentas,
+                   sizeof(CuentaAlmacen), comparar_cuentas_almacen);
+}
+
+static uint64_t hash_clave(const char *clave) {
+    uint64_t h = 1469598103934665603ULL;  // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)clave; *p; p++) {
+        h = (h ^ *p) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/// @brief Busca una clave de idempotencia reciente de la cuenta.
+/// @return La entrada con la respuesta guardada, o NULL si no está o ya caducó
+const EntradaIdempotencia *buscar_idempotencia(CuentaAlmacen *c, const char *clave) {
+    CacheIdempotencia *cache = c->idempotencia;
+    if (cache == NULL) return NULL;
+    uint64_t h = hash_clave(clave);
+    time_t ahora = time(NULL);
+    for (int k = 0; k < ENTRADAS_IDEMPOTENCIA; k++) {
+        EntradaIdempotencia *e = &cache->entradas[k];
+        if (e->hash == h && e->creada != 0 && ahora - e->creada <= configuracion()->idempotencia_segundos &&
+            strcmp(e->clave, clave) == 0) {
+            e->ultimo_uso = ++cache->reloj;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Guarda la respuesta de una petición con clave; sustituye la entrada caducada o la menos usada
+void guardar_idempotencia(CuentaAlmacen *c, const char *clave, const char *respuesta, size_t largo) {
+    if (c->idempotencia == NULL && (c->idempotencia = reservar_memoria_ceros(1, sizeof(CacheIdempotencia))) == NULL) return;
+    CacheIdempotencia *cache = c->idempotencia;
+    time_t ahora = time(NULL);
+    uint64_t h = hash_clave(clave);
+
+    // Una clave ya guardada se actualiza (respuesta diferida que por fin llega)
+    EntradaIdempotencia *victima = NULL;
+    for (int k = 0; k < ENTRADAS_IDEMPOTENCIA && victima == NULL; k++) {
+        EntradaIdempotencia *e = &cache->entradas[k];
+        if (e->creada != 0 && e->hash == h && strcmp(e->clave, clave) == 0) victima = e;
+    }
+    for (int k = 0; k < ENTRADAS_IDEMPOTENCIA && victima == NULL; k++) {
+        EntradaIdempotencia *e = &cache->entradas[k];
+        if (e->creada == 0 || ahora - e->creada > configuracion()->idempotencia_segundos) victima = e;
+    }
+    if (victima == NULL) {
+        victima = &cache->entradas[0];
+        for (int k = 1; k < ENTRADAS_IDEMPOTENCIA; k++) {
+            if (cache->entradas[k].ultimo_uso < victima->ultimo_uso) victima = &cache->entradas[k];
+        }
+    }
+
+    snprintf(victima->clave, sizeof(victima->clave), "%s", clave);
+    victima->hash = h;
+    victima->creada = ahora;
+    victima->ultimo_uso = ++cache->reloj;
+    victima->largo = largo < sizeof(victima->respuesta) ? largo : sizeof(victima->respuesta);
+    memcpy(victima->respuesta, respuesta, victima->largo);
+}
+
+// Solo el hilo principal escribe en el almacén, así que los escritores no compiten entre sí
+static void seqlock_escritura_inicio(atomic_ulong *seq) {
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void seqlock_escritura_fin(atomic_ulong *seq) {
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_release);
+}
+
+/// @brief Lee una cuenta sin bloqueos: reintenta si coincidió con una escritura
+/// @return 0 si la cuenta existe, -1 si no
+int leer_cuenta_snapshot(int numero_cuenta, Cuenta *salida) {
+    CuentaAlmacen *c = buscar_cuenta_almacen(numero_cuenta);
+    if (c == NULL) return -1;
+
+    unsigned long antes, despues;
+    do {
+        antes = atomic_load_explicit(&c->version, memory_order_acquire);
+        memcpy(salida, &c->datos, sizeof(Cuenta));
+        atomic_thread_fence(memory_order_acquire);
+        despues = atomic_load_explicit(&c->version, memory_order_relaxed);
+    } while ((antes & 1) || antes != despues);
+    return 0;
+}
+
+/// @brief Lee varias cuentas de la misma versión del almacén (ningún COMMIT a medias)
+/// @return número de cuentas encontradas; las inexistentes quedan con numero_cuenta = 0
+int leer_cuentas_snapshot(const int *numeros, int n, Cuenta *salida) {
+    unsigned long antes, despues;
+    int encontradas;
+    do {
+        antes = atomic_load_explicit(&epoca_almacen, memory_order_acquire);
+        encontradas = 0;
+        for (int i = 0; i < n; i++) {
+            CuentaAlmacen *c = buscar_cuenta_almacen(numeros[i]);
+            if (c != NULL) {
+                memcpy(&salida[i], &c->datos, sizeof(Cuenta));
+                encontradas++;
+            } else {
+                memset(&salida[i], 0, sizeof(Cuenta));
+            }
+        }
+        atomic_thread_fence(memory_order_acquire);
+        despues = atomic_load_explicit(&epoca_almacen, memory_order_relaxed);
+    } while ((antes & 1) || antes != despues);
+    return encontradas;
+}
+
+// Escribe el registro de una cuenta en su posición original del archivo
+static void persistir_cuenta(CuentaAlmacen *c) {
+    if (almacen.mapa == NULL) return;
+    almacen.mapa[c->posicion] = c->datos;
+}
+
+// Motor de E/S con io_uring (MOTOR_IO=io_uring). En cada vuelta del bucle se preparan las
+// lecturas de las sesiones, las respuestas pendientes y las líneas acumuladas del log, y se
+// pasan al núcleo con una sola io_uring_enter. El poll del bucle vigila el descriptor del
+// anillo para atender las terminaciones. Si el núcleo no admite io_uring se sigue con poll.
+#define ENTRADAS_URING 256
+#define TAM_LOG_URING (64 * 1024)
+#define MAX_APLAZADAS_URING (2 * ENTRADAS_URING)
+
+// Tipo de operación en los 8 bits altos de user_data; debajo van la generación y el slot
+enum {
+    OP_URING_AVISO_LECTURA = 1,  // POLL_ADD enlazado delante de la lectura de una sesión
+    OP_URING_LECTURA,
+    OP_URING_AVISO_ESCRITURA,    // POLL_ADD enlazado delante del envío de respuestas
+    OP_URING_ESCRITURA,
+    OP_URING_LOG,
+    OP_URING_CANCELAR
+};
+
+typedef struct {
+    AnilloUring anillo;
+    int activo;
+    int buffers_fijos;           // Buffers registrados: se usan READ_FIXED y WRITE_FIXED
+    int drenando;                // Relevo en curso: lo leído se guarda sin extraer peticiones
+    // Una lectura y un envío en vuelo como mucho por sesión
+    char lectura[MAX_USUARIOS_SIMULTANEOS][BUFFER_SIZE];
+    uint64_t aviso_lectura[MAX_USUARIOS_SIMULTANEOS];    // user_data del POLL_ADD (0 = sin lectura)
+    uint64_t aviso_escritura[MAX_USUARIOS_SIMULTANEOS];
+    int lectura_en_vuelo[MAX_USUARIOS_SIMULTANEOS];
+    int escritura_en_vuelo[MAX_USUARIOS_SIMULTANEOS];
+    // Log: las líneas se añaden a un buffer mientras el otro se escribe
+    char log[2][TAM_LOG_URING];
+    size_t log_usados[2];
+    int log_actual;              // Buffer al que se añaden las líneas nuevas
+    int log_en_vuelo;            // El otro buffer se está escribiendo
+    size_t log_enviados;         // Parte ya escrita del buffer en vuelo
+    int64_t log_escrito;         // Bytes del log activo que ya están en el archivo
+    // Terminaciones que llegaron mientras se esperaba al log y aún no se han atendido
+    struct io_uring_cqe aplazadas[MAX_APLAZADAS_URING];
+    int num_aplazadas;
+    unsigned long operaciones;   // SQE enviadas
+    unsigned long llamadas;      // io_uring_enter hechas
+} MotorUring;
+
+MotorUring motor;
+
+static uint64_t dato_uring(int tipo, unsigned int generacion, int slot) {
+    return (uint64_t)tipo << 56 | (uint64_t)generacion << 8 | (uint64_t)(slot & 0xff);
+}
+
+/// @brief Crea el anillo y registra como buffers fijos las lecturas de cada sesión, sus buffers
+///        de salida y los del log. Sin buffers registrados se usan READ y WRITE normales.
+/// @return 0 si el motor quedó activo, -1 si hay que seguir con poll
+int iniciar_motor_uring() {
+    int r = uring_iniciar(&motor.anillo, ENTRADAS_URING);
+    if (r < 0) {
+        printf("io_uring no disponible (%s): se usa poll.\n", strerror(-r));
+        return -1;
+    }
+    const int necesarias[] = {IORING_OP_POLL_ADD, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_ASYNC_CANCEL};
+    if (!uring_soporta(&motor.anillo, necesarias, 4)) {
+        printf("El núcleo no implementa las operaciones de io_uring necesarias: se usa poll.\n");
+        uring_cerrar(&motor.anillo);
+        return -1;
+    }
+
+    struct iovec buffers[2 * MAX_USUARIOS_SIMULTANEOS + 2];
+    for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) {
+        buffers[i].iov_base = motor.lectura[i];
+        buffers[i].iov_len = sizeof(motor.lectura[i]);
+        buffers[MAX_USUARIOS_SIMULTANEOS + i].iov_base = usuarios[i].salida.datos;
+        buffers[MAX_USUARIOS_SIMULTANEOS + i].iov_len = TAM_BUFFER_SALIDA;
+    }
+    for (int k = 0; k < 2; k++) {
+        buffers[2 * MAX_USUARIOS_SIMULTANEOS + k].iov_base = motor.log[k];
+        buffers[2 * MAX_USUARIOS_SIMULTANEOS + k].iov_len = TAM_LOG_URING;
+    }
+    const int fijas[] = {IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED};
+    r = uring_soporta(&motor.anillo, fijas, 2) ? uring_registrar_buffers(&motor.anillo, buffers, 2 * MAX_USUARIOS_SIMULTANEOS + 2)
+                                               : -EOPNOTSUPP;
+    motor.buffers_fijos = r == 0;
+    if (r < 0) printf("io_uring sin buffers registrados (%s).\n", strerror(-r));
+    motor.activo = 1;
+    return 0;
+}
+
+void cerrar_motor_uring() {
+    if (!motor.activo) return;
+    uring_cerrar(&motor.anillo);
+    motor.activo = 0;
+}
+
+// Prepara un POLL_ADD enlazado con la operación que lo sigue, que sólo se ejecuta cuando el
+// descriptor está listo (los descriptores de las sesiones son no bloqueantes)
+static int preparar_cadena_uring(int fd, short eventos, uint64_t aviso, int op, const void *datos, unsigned largo,
+                                 int buffer, uint64_t dato) {
+    if (uring_libres(&motor.anillo) < 2) return -1;
+    struct io_uring_sqe *sqe = uring_sqe(&motor.anillo);
+    uring_preparar(sqe, IORING_OP_POLL_ADD, fd, NULL, 0, 0, aviso);
+    sqe->poll32_events = eventos;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = uring_sqe(&motor.anillo);
+    if (motor.buffers_fijos) {
+        uring_preparar(sqe, op == IORING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED, fd, datos, largo,
+                       (uint64_t)-1, dato);
+        sqe->buf_index = buffer;
+    } else {
+        uring_preparar(sqe, op, fd, datos, largo, (uint64_t)-1, dato);
+    }
+    motor.operaciones += 2;
+    return 0;
+}
+
+// Escribe el buffer del log en vuelo (o lo que falte de él) a continuación de lo ya escrito
+static void preparar_escritura_log_uring() {
+    int k = 1 - motor.log_actual;
+    struct io_uring_sqe *sqe = uring_sqe(&motor.anillo);
+    if (sqe == NULL) return;
+    const char *datos = motor.log[k] + motor.log_enviados;
+    unsigned largo = motor.log_usados[k] - motor.log_enviados;
+    int op = motor.buffers_fijos ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    uring_preparar(sqe, op, fileno(log_file), datos, largo, motor.log_escrito, dato_uring(OP_URING_LOG, 0, 0));
+    sqe->buf_index = 2 * MAX_USUARIOS_SIMULTANEOS + k;
+    motor.log_en_vuelo = 1;
+    motor.operaciones++;
+}
+
+// Pasa a escribir el buffer del log que se estaba llenando, si no hay otro en vuelo
+static void enviar_log_uring() {
+    if (motor.log_en_vuelo || motor.log_usados[motor.log_actual] == 0) return;
+    motor.log_actual = 1 - motor.log_actual;
+    motor.log_usados[motor.log_actual] = 0;
+    motor.log_enviados = 0;
+    preparar_escritura_log_uring();
+}
+
+// Pide al núcleo que cancele la lectura y el envío en vuelo de la sesión (al cerrarla o en un relevo)
+void cancelar_operaciones_sesion(int i, int lectura, int escritura) {
+    if (!motor.activo) return;
+    uint64_t avisos[2] = {lectura ? motor.aviso_lectura[i] : 0, escritura ? motor.aviso_escritura[i] : 0};
+    for (int k = 0; k < 2; k++) {
+        if (avisos[k] == 0) continue;
+        struct io_uring_sqe *sqe = uring_sqe(&motor.anillo);
+        if (sqe == NULL) return;
+        uring_preparar(sqe, IORING_OP_ASYNC_CANCEL, -1, (void *)(uintptr_t)avisos[k], 0, 0,
+                       dato_uring(OP_URING_CANCELAR, 0, i));
+        motor.operaciones++;
+    }
+    if (lectura) motor.aviso_lectura[i] = 0;
+    if (escritura) motor.aviso_escritura[i] = 0;
+}
+
+/// @brief Prepara las lecturas de las sesiones que admiten peticiones, los envíos de las
+///        respuestas pendientes y la escritura del log, y lo envía todo en una io_uring_enter.
+///        Mientras se drena un relevo no se lee a los usuarios y se cancelan las lecturas en vuelo.
+void preparar_operaciones_uring(int drenando) {
+    motor.drenando = drenando;
+    for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) {
+        InfoUsuario *u = &usuarios[i];
+        if (drenando && motor.aviso_lectura[i] != 0) cancelar_operaciones_sesion(i, 1, 0);
+        if (!motor.lectura_en_vuelo[i] && u->fifo_lectura_fd > 0 && !u->lectura_pausada && puede_leer_usuario(i) &&
+            !drenando) {
+            size_t libre = sizeof(u->entrada) - 1 - u->entrada_usados;
+            if (libre > sizeof(motor.lectura[i])) libre = sizeof(motor.lectura[i]);
+            uint64_t aviso = dato_uring(OP_URING_AVISO_LECTURA, u->generacion, i);
+            if (libre > 0 && preparar_cadena_uring(u->fifo_lectura_fd, POLLIN, aviso, IORING_OP_READ, motor.lectura[i],
+                                                   libre, i, dato_uring(OP_URING_LECTURA, u->generacion, i)) == 0) {
+                motor.lectura_en_vuelo[i] = 1;
+                motor.aviso_lectura[i] = aviso;
+            }
+        }
+        int fd_salida = fd_conexion_usuario(i);
+        if (!motor.escritura_en_vuelo[i] && fd_salida >= 0) {
+            // El núcleo lee directamente del buffer circular: sólo el tramo contiguo desde el inicio
+            pthread_mutex_lock(&u->salida.mutex);
+            size_t inicio = u->salida.inicio;
+            size_t largo = u->salida.usados;
+            unsigned int generacion = u->generacion;
+            pthread_mutex_unlock(&u->salida.mutex);
+            if (largo > TAM_BUFFER_SALIDA - inicio) largo = TAM_BUFFER_SALIDA - inicio;
+            uint64_t aviso = dato_uring(OP_URING_AVISO_ESCRITURA, generacion, i);
+            if (largo > 0 && preparar_cadena_uring(fd_salida, POLLOUT, aviso, IORING_OP_WRITE, u->salida.datos + inicio,
+                                                   largo, MAX_USUARIOS_SIMULTANEOS + i,
+                                                   dato_uring(OP_URING_ESCRITURA, generacion, i)) == 0) {
+                motor.escritura_en_vuelo[i] = 1;
+                motor.aviso_escritura[i] = aviso;
+            }
+        }
+    }
+    enviar_log_uring();
+    if (motor.anillo.sq_preparadas > 0) {
+        uint64_t tramo = tramo_inicio(traza_muestrear());
+        int r = uring_enviar(&motor.anillo, 0);
+        tramo_fin("io_uring_enter", tramo, (int32_t)r);
+        motor.llamadas++;
+        if (r < 0) printf("[ERROR] io_uring_enter: %s\n", strerror(-r));
+    }
+}
+
+static void terminar_log_uring(int res) {
+    int k = 1 - motor.log_actual;
+    if (res < 0) {
+        printf("[ERROR] No se pudo escribir en el log: %s\n", strerror(-res));
+        motor.log_en_vuelo = 0;
+        return;
+    }
+    motor.log_enviados += res;
+    motor.log_escrito += res;
+    if (res > 0 && motor.log_enviados < motor.log_usados[k]) {
+        preparar_escritura_log_uring();   // Escritura parcial: se envía el resto
+    } else {
+        motor.log_en_vuelo = 0;
+    }
+}
+
+static void terminar_lectura_uring(int i, unsigned int generacion, int res) {
+    InfoUsuario *u = &usuarios[i];
+    motor.lectura_en_vuelo[i] = 0;
+    if (motor.aviso_lectura[i] == dato_uring(OP_URING_AVISO_LECTURA, generacion, i)) motor.aviso_lectura[i] = 0;
+    // Una sesión ya cerrada, o un slot reutilizado por otra, descarta lo leído
+    if (u->generacion != generacion || u->pid == 0 || u->fifo_lectura_fd <= 0) return;
+    if (res == -EAGAIN || res == -ECANCELED || res == -EINTR) return;
+    if (res > 0) memcpy(u->entrada + u->entrada_usados, motor.lectura[i], res);
+    if (motor.drenando) {
+        // Lo leído viaja al proceso nuevo con la entrada a medio leer
+        if (res > 0) u->entrada_usados += res;
+        return;
+    }
+    recibir_datos_usuario(i, res < 0 ? -1 : res);
+}
+
+static void terminar_escritura_uring(int i, unsigned int generacion, int res) {
+    BufferSalida *salida = &usuarios[i].salida;
+    motor.escritura_en_vuelo[i] = 0;
+    if (motor.aviso_escritura[i] == dato_uring(OP_URING_AVISO_ESCRITURA, generacion, i)) motor.aviso_escritura[i] = 0;
+    if (usuarios[i].generacion != generacion) return;
+    if (res > 0) {
+        pthread_mutex_lock(&salida->mutex);
+        salida->inicio = (salida->inicio + res) % TAM_BUFFER_SALIDA;
+        salida->usados -= res;
+        salida->ultimo_progreso = time(NULL);
+        pthread_mutex_unlock(&salida->mutex);
+    } else if (res < 0 && res != -EAGAIN && res != -ECANCELED && res != -EINTR) {
+        debug_log("❌ El usuario %d cerró su FIFO de respuestas: %s", usuarios[i].cuenta, strerror(-res));
+        close_fifo_connection(i);
+    }
+}
+
+static void atender_terminacion_uring(const struct io_uring_cqe *cqe) {
+    int tipo = (int)(cqe->user_data >> 56);
+    unsigned int generacion = (unsigned int)(cqe->user_data >> 8);
+    int slot = (int)(cqe->user_data & 0xff);
+    if (tipo == OP_URING_LECTURA) {
+        terminar_lectura_uring(slot, generacion, cqe->res);
+    } else if (tipo == OP_URING_ESCRITURA) {
+        terminar_escritura_uring(slot, generacion, cqe->res);
+    } else if (tipo == OP_URING_LOG) {
+        terminar_log_uring(cqe->res);
+    }
+    // Los POLL_ADD enlazados y las cancelaciones no necesitan nada más
+}
+
+// Atiende las terminaciones disponibles sin bloquear, empezando por las aplazadas
+void atender_terminaciones_uring() {
+    struct io_uring_cqe cqe;
+    for (int k = 0; k < motor.num_aplazadas; k++) atender_terminacion_uring(&motor.aplazadas[k]);
+    motor.num_aplazadas = 0;
+    while (uring_siguiente(&motor.anillo, &cqe)) atender_terminacion_uring(&cqe);
+}
+
+/// @brief Espera a que todo el log acumulado esté en el archivo. Las demás terminaciones se
+///        aplazan hasta la siguiente vuelta del bucle, porque esto puede ocurrir a mitad de una petición.
+void completar_log_uring() {
+    struct io_uring_cqe cqe;
+    while (motor.log_en_vuelo || motor.log_usados[motor.log_actual] > 0) {
+        enviar_log_uring();
+        int r = uring_enviar(&motor.anillo, 1);
+        motor.llamadas++;
+        if (r < 0 && r != -EINTR) {
+            printf("[ERROR] io_uring_enter: %s\n", strerror(-r));
+            return;
+        }
+        while (uring_siguiente(&motor.anillo, &cqe)) {
+            if ((int)(cqe.user_data >> 56) == OP_URING_LOG) {
+                terminar_log_uring(cqe.res);
+            } else if (motor.num_aplazadas < MAX_APLAZADAS_URING) {
+                motor.aplazadas[motor.num_aplazadas++] = cqe;
+            }
+        }
+    }
+}
+
+/// @brief Cancela las operaciones de todas las sesiones y espera a que terminen, para que
+///        el relevo entregue la entrada y la salida de cada sesión sin nada en vuelo
+void detener_operaciones_uring() {
+    if (!motor.activo) return;
+    motor.drenando = 1;
+    for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) cancelar_operaciones_sesion(i, 1, 1);
+    completar_log_uring();
+    atender_terminaciones_uring();
+    for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) {
+        while (motor.lectura_en_vuelo[i] || motor.escritura_en_vuelo[i]) {
+            int r = uring_enviar(&motor.anillo, 1);
+            motor.llamadas++;
+            if (r < 0 && r != -EINTR) return;
+            atender_terminaciones_uring();
+        }
+    }
+}
+
+/// @brief Añade una línea al log. Se escribe en la siguiente vuelta del bucle, junto con las
+///        lecturas y las respuestas; si el buffer se llena, se espera a que se vacíe.
+void anadir_log_uring(const char *texto, size_t largo) {
+    if (largo > TAM_LOG_URING) largo = TAM_LOG_URING;
+    if (motor.log_usados[motor.log_actual] + largo > TAM_LOG_URING) completar_log_uring();
+    memcpy(motor.log[motor.log_actual] + motor.log_usados[motor.log_actual], texto, largo);
+    motor.log_usados[motor.log_actual] += largo;
+}
+
+// Bytes del log activo contando lo que aún está en los buffers del motor
+long tam_log_activo() {
+    if (!motor.activo) return ftell(log_file);
+    size_t en_vuelo = motor.log_en_vuelo ? motor.log_usados[1 - motor.log_actual] - motor.log_enviados : 0;
+    return (long)(motor.log_escrito + en_vuelo + motor.log_usados[motor.log_actual]);
+}
+
+/// @brief Lleva al archivo todo lo registrado en el log (antes de fdatasync, rotar o entregar un relevo)
+/// @return 0 si se vació, EOF si falló fflush
+int vaciar_log() {
+    if (motor.activo) completar_log_uring();
+    return fflush(log_file);
+}
+
+#define TAM_BLOQUE_LOG (64 * 1024)   // Bytes de texto por bloque comprimido de un segmento
+#define BITS_BLOOM_BLOQUE 512        // Filtro fijo de los segmentos de versión 1
+#define BITS_BLOOM_CUENTA 10         // Versión 2: el filtro del bloque crece con sus líneas (~1% de falsos positivos)
+#define HASHES_BLOOM 7
+#define MAGIA_SEGMENTO "BLOGSEG1"
+
+// Cabecera de un segmento rotado (<ARCHIVO_LOG>.<N>.seg). Debe coincidir con banco_log.c
+typedef struct {
+    char magia[8];
+    uint32_t version;
+    uint32_t num_bloques;
+    int64_t desplazamiento_base;  // Posición lógica del primer byte del segmento
+    int64_t bytes_originales;     // Tamaño del texto sin comprimir
+    int64_t posicion_indice;      // Dónde empieza la tabla de EntradaBloque
+    int64_t instante_min;
+    int64_t instante_max;
+} CabeceraSegmento;
+
+// Entrada del índice disperso: una por bloque comprimido con zlib
+typedef struct {
+    int64_t posicion;             // Posición del bloque comprimido en el segmento
+    uint32_t tam_comprimido;
+    uint32_t tam_original;
+    uint32_t num_lineas;
+    int32_t cuenta_min;
+    int32_t cuenta_max;
+    uint32_t bits_bloom;          // Versión 2: bits del filtro, guardado justo detrás del bloque comprimido
+    int64_t instante_min;         // 0 si ninguna línea del bloque lleva marca de tiempo
+    int64_t instante_max;
+    int64_t desplazamiento_log;   // Posición lógica de la primera línea del bloque
+    uint8_t bloom[BITS_BLOOM_BLOQUE / 8];   // Sólo versión 1; en la 2 queda a cero
+} EntradaBloque;
+
+// Estado del log activo y de sus segmentos rotados
+typedef struct {
+    char ruta[256];
+    int64_t desplazamiento_base;  // Bytes lógicos ya rotados a segmentos
+    int siguiente_segmento;
+    time_t apertura;              // Momento en que se abrió el log activo
+} EstadoLog;
+
+EstadoLog estado_log = {"", 0, 1, 0};
+int rotacion_log_pendiente = 0;   // El log activo superó TAM_MAX_LOG o ROTACION_LOG_SEGUNDOS
+
+// Marca de tiempo "[YYYY-MM-DD HH:MM:SS] " al inicio de la línea, 0 si no la tiene
+static int64_t instante_linea_log(const char *linea) {
+    struct tm tm_info;
+    memset(&tm_info, 0, sizeof(tm_info));
+    if (linea[0] != '[' || strptime(linea + 1, "%Y-%m-%d %H:%M:%S]", &tm_info) == NULL) return 0;
+    tm_info.tm_isdst = -1;
+    return (int64_t)mktime(&tm_info);
+}
+
+// Número de cuenta mencionado en la línea ("Cuenta N" o "cuenta N"), 0 si no hay
+static int cuenta_linea_log(const char *linea) {
+    const char *p = linea;
+    while ((p = strstr(p, "uenta ")) != NULL) {
+        if (p > linea && (p[-1] == 'C' || p[-1] == 'c')) {
+            int cuenta = atoi(p + 6);
+            if (cuenta > 0) return cuenta;
+        }
+        p += 6;
+    }
+    return 0;
+}
+
+// Doble hash: la función i del filtro es h1 + i * h2
+static void bloom_anadir(uint8_t *bloom, uint32_t bits, int cuenta) {
+    uint32_t h1 = (uint32_t)cuenta * 2654435761u;
+    uint32_t h2 = ((uint32_t)cuenta ^ 0x5bd1e995u) * 2246822519u;
+    for (int i = 0; i < HASHES_BLOOM; i++, h1 += h2) {
+        uint32_t bit = h1 % bits;
+        bloom[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+static void ruta_segmento_log(int numero, char *ruta, size_t tam) {
+    snprintf(ruta, tam, "%s.%d.seg", estado_log.ruta, numero);
+}
+
+// Comprime y escribe un bloque del segmento, completando su entrada del índice
+static int escribir_bloque_segmento(FILE *segmento, const char *texto, size_t tam, EntradaBloque *entrada) {
+    uLongf tam_comprimido = compressBound(tam);
+    Bytef *comprimido = reservar_memoria(tam_comprimido);
+    if (comprimido == NULL) return -1;
+
+    if (compress2(comprimido, &tam_comprimido, (const Bytef *)texto, tam, Z_BEST_SPEED) != Z_OK) {
+        free(comprimido);
+        return -1;
+    }
+    entrada->posicion = ftell(segmento);
+    entrada->tam_comprimido = tam_comprimido;
+    entrada->tam_original = tam;
+    int ok = fwrite(comprimido, 1, tam_comprimido, segmento) == tam_comprimido;
+    free(comprimido);
+    return ok ? 0 : -1;
+}
+
+// Escribe tras el bloque comprimido el filtro de Bloom de sus cuentas, a BITS_BLOOM_CUENTA bits por línea con cuenta
+static int escribir_bloom_segmento(FILE *segmento, const int *cuentas, int num_cuentas, EntradaBloque *entrada) {
+    uint32_t bits = (uint32_t)(num_cuentas > 0 ? num_cuentas : 1) * BITS_BLOOM_CUENTA;
+    bits = (bits + 63) / 64 * 64;
+    uint8_t *bloom = reservar_memoria_ceros(bits / 8, 1);
+    if (bloom == NULL) return -1;
+    for (int i = 0; i < num_cuentas; i++) bloom_anadir(bloom, bits, cuentas[i]);
+    entrada->bits_bloom = bits;
+    int ok = fwrite(bloom, 1, bits / 8, segmento) == bits / 8;
+    free(bloom);
+    return ok ? 0 : -1;
+}
+
+/// @brief Convierte el log activo en un segmento comprimido con índice y abre uno nuevo
+/// @return 0 si se rotó, -1 si falló (el log activo sigue abierto)
+int rotar_log() {
+    char ruta_segmento[300], ruta_temporal[310];
+    ruta_segmento_log(estado_log.siguiente_segmento, ruta_segmento, sizeof(ruta_segmento));
+    snprintf(ruta_temporal, sizeof(ruta_temporal), "%s.tmp", ruta_segmento);
+
+    vaciar_log();
+    FILE *texto = fopen(estado_log.ruta, "r");
+    FILE *segmento = fopen(ruta_temporal, "wb");
+    char *bloque = reservar_memoria(TAM_BLOQUE_LOG);
+    if (texto == NULL || segmento == NULL || bloque == NULL) {
+        printf("[ERROR] No se pudo rotar el log %s: %s\n", estado_log.ruta, strerror(errno));
+        if (texto) fclose(texto);
+        if (segmento) fclose(segmento);
+        free(bloque);
+        return -1;
+    }
+
+    CabeceraSegmento cabecera;
+    memset(&cabecera, 0, sizeof(cabecera));
+    memcpy(cabecera.magia, MAGIA_SEGMENTO, 8);
+    cabecera.version = 2;
+    cabecera.desplazamiento_base = estado_log.desplazamiento_base;
+    fwrite(&cabecera, sizeof(cabecera), 1, segmento);
+
+    EntradaBloque *entradas = NULL;
+    int capacidad = 0, error = 0;
+    int *cuentas = NULL, num_cuentas = 0, capacidad_cuentas = 0;   // Cuentas de las líneas del bloque
+    size_t usados = 0;
+    EntradaBloque actual;
+    memset(&actual, 0, sizeof(actual));
+    actual.desplazamiento_log = estado_log.desplazamiento_base;
+
+    char linea[4096];
+    int fin = 0;
+    while (!fin && !error) {
+        fin = fgets(linea, sizeof(linea), texto) == NULL;
+        size_t largo = fin ? 0 : strlen(linea);
+
+        // Cerrar el bloque cuando no cabe la siguiente línea o al llegar al final
+        if (usados > 0 && (fin || usados + largo > TAM_BLOQUE_LOG)) {
+            if (cabecera.num_bloques == (uint32_t)capacidad) {
+                capacidad = capacidad ? capacidad * 2 : 64;
+                EntradaBloque *nuevas = ampliar_memoria(entradas, capacidad * sizeof(EntradaBloque));
+                if (nuevas == NULL) { error = 1; break; }
+                entradas = nuevas;
+            }
+            if (escribir_bloque_segmento(segmento, bloque, usados, &actual) < 0 ||
+                escribir_bloom_segmento(segmento, cuentas, num_cuentas, &actual) < 0) { error = 1; break; }
+            entradas[cabecera.num_bloques++] = actual;
+            num_cuentas = 0;
+            cabecera.bytes_originales += usados;
+
+            int64_t siguiente = actual.desplazamiento_log + usados;
+            memset(&actual, 0, sizeof(actual));
+            actual.desplazamiento_log = siguiente;
+            usados = 0;
+        }
+        if (fin) break;
+
+        memcpy(bloque + usados, linea, largo);
+        usados += largo;
+        actual.num_lineas++;
+
+        int64_t instante = instante_linea_log(linea);
+        if (instante > 0) {
+            if (actual.instante_min == 0 || instante < actual.instante_min) actual.instante_min = instante;
+            if (instante > actual.instante_max) actual.instante_max = instante;
+            if (cabecera.instante_min == 0 || instante < cabecera.instante_min) cabecera.instante_min = instante;
+            if (instante > cabecera.instante_max) cabecera.instante_max = instante;
+        }
+        int cuenta = cuenta_linea_log(linea);
+        if (cuenta > 0) {
+            if (actual.cuenta_min == 0 || cuenta < actual.cuenta_min) actual.cuenta_min = cuenta;
+            if (cuenta > actual.cuenta_max) actual.cuenta_max = cuenta;
+            if (num_cuentas == capacidad_cuentas) {
+                capacidad_cuentas = capacidad_cuentas ? capacidad_cuentas * 2 : 1024;
+                int *nuevas = ampliar_memoria(cuentas, capacidad_cuentas * sizeof(int));
+                if (nuevas == NULL) { error = 1; break; }
+                cuentas = nuevas;
+            }
+            cuentas[num_cuentas++] = cuenta;
+        }
+    }
+
+    if (!error) {
+        cabecera.posicion_indice = ftell(segmento);
+        error = cabecera.num_bloques > 0 &&
+                fwrite(entradas, sizeof(EntradaBloque), cabecera.num_bloques, segmento) != cabecera.num_bloques;
+        fseek(segmento, 0, SEEK_SET);
+        error |= fwrite(&cabecera, sizeof(cabecera), 1, segmento) != 1;
+        error |= fflush(segmento) != 0 || fsync(fileno(segmento)) != 0;
+    }
+    fclose(texto);
+    fclose(segmento);
+    free(entradas);
+    free(cuentas);
+    free(bloque);
+
+    if (error || rename(ruta_temporal, ruta_segmento) != 0) {
+        printf("[ERROR] Falló la rotación del log a %s\n", ruta_segmento);
+        unlink(ruta_temporal);
+        return -1;
+    }
+
+    // Vaciar el log activo: su contenido ya está en el segmento
+    FILE *nuevo = fopen(estado_log.ruta, "w");
+    if (nuevo == NULL) {
+        perror("Error al reabrir el archivo de log");
+        return -1;
+    }
+    fclose(log_file);
+    log_file = nuevo;
+    motor.log_escrito = 0;
+    estado_log.desplazamiento_base += cabecera.bytes_originales;
+    estado_log.siguiente_segmento++;
+    estado_log.apertura = time(NULL);
+    debug_log("Log rotado a %s (%u bloques, %lld bytes)", ruta_segmento, cabecera.num_bloques,
+              (long long)cabecera.bytes_originales);
+    return 0;
+}
+
+/// @brief rotar_log publica el segmento antes de vaciar el log activo. Tras una caída entre
+///        las dos cosas, el activo empieza con el mismo texto que el segmento; se detecta
+///        comparando el primer bloque del segmento, descomprimido, con el principio del activo.
+/// @return 1 si el log activo repite el segmento, 0 si no
+static int log_activo_repite_segmento(FILE *segmento, const CabeceraSegmento *cabecera, const char *ruta) {
+    struct stat st;
+    EntradaBloque entrada;
+    if (cabecera->num_bloques == 0 || stat(ruta, &st) < 0 || st.st_size < cabecera->bytes_originales ||
+        fseek(segmento, cabecera->posicion_indice, SEEK_SET) != 0 || fread(&entrada, sizeof(entrada), 1, segmento) != 1) {
+        return 0;
+    }
+    int repite = 0;
+    uLongf tam = entrada.tam_original;
+    char *comprimido = reservar_memoria(entrada.tam_comprimido);
+    char *bloque = reservar_memoria(2 * (size_t)entrada.tam_original);
+    FILE *activo = fopen(ruta, "rb");
+    if (comprimido != NULL && bloque != NULL && activo != NULL && fseek(segmento, entrada.posicion, SEEK_SET) == 0 &&
+        fread(comprimido, 1, entrada.tam_comprimido, segmento) == entrada.tam_comprimido &&
+        uncompress((Bytef *)bloque, &tam, (const Bytef *)comprimido, entrada.tam_comprimido) == Z_OK &&
+        tam == entrada.tam_original &&
+        fread(bloque + tam, 1, tam, activo) == tam) {
+        repite = memcmp(bloque, bloque + tam, tam) == 0;
+    }
+    if (activo) fclose(activo);
+    free(comprimido);
+    free(bloque);
+    return repite;
+}
+
+// Quita del log activo los primeros "bytes", que ya están en el último segmento
+static int descartar_prefijo_log(const char *ruta, int64_t bytes) {
+    char ruta_temporal[310];
+    snprintf(ruta_temporal, sizeof(ruta_temporal), "%s.tmp", ruta);
+    FILE *origen = fopen(ruta, "rb");
+    FILE *destino = fopen(ruta_temporal, "wb");
+    int error = origen == NULL || destino == NULL || fseek(origen, bytes, SEEK_SET) != 0;
+    char buffer[65536];
+    size_t n;
+    while (!error && (n = fread(buffer, 1, sizeof(buffer), origen)) > 0) {
+        error = fwrite(buffer, 1, n, destino) != n;
+    }
+    if (destino != NULL) error |= fflush(destino) != 0 || fsync(fileno(destino)) != 0;
+    if (origen) fclose(origen);
+    if (destino) fclose(destino);
+    if (error || rename(ruta_temporal, ruta) != 0) {
+        unlink(ruta_temporal);
+        return -1;
+    }
+    return 0;
+}
+
+/// @brief Abre el log activo y localiza los segmentos rotados anteriores. Si una rotación
+///        quedó a medias, quita del activo el texto que ya está en el último segmento.
+/// @return 0 si se abrió, -1 si no
+int abrir_log(const char *ruta) {
+    strncpy(estado_log.ruta, ruta, sizeof(estado_log.ruta) - 1);
+
+    // Los segmentos se numeran desde 1; la base lógica continúa tras el último
+    char ruta_segmento[300];
+    CabeceraSegmento cabecera;
+    for (int n = 1; ; n++) {
+        ruta_segmento_log(n, ruta_segmento, sizeof(ruta_segmento));
+        FILE *segmento = fopen(ruta_segmento, "rb");
+        if (segmento == NULL) {
+            estado_log.siguiente_segmento = n;
+            break;
+        }
+        if (fread(&cabecera, sizeof(cabecera), 1, segmento) == 1 && memcmp(cabecera.magia, MAGIA_SEGMENTO, 8) == 0) {
+            estado_log.desplazamiento_base = cabecera.desplazamiento_base + cabecera.bytes_originales;
+            char ruta_siguiente[300];
+            ruta_segmento_log(n + 1, ruta_siguiente, sizeof(ruta_siguiente));
+            if (access(ruta_siguiente, F_OK) != 0 && log_activo_repite_segmento(segmento, &cabecera, ruta)) {
+                printf("Aviso: el log %s repite el segmento %s (rotación interrumpida); se descarta la copia\n",
+                       ruta, ruta_segmento);
+                if (descartar_prefijo_log(ruta, cabecera.bytes_originales) < 0) {
+                    perror("Error al descartar el texto ya rotado del log");
+                }
+            }
+        }
+        fclose(segmento);
+    }
+
+    log_file = fopen(ruta, "a");
+    if (log_file == NULL) return -1;
+    fseek(log_file, 0, SEEK_END);
+    motor.log_escrito = ftell(log_file);
+    estado_log.apertura = time(NULL);
+    return 0;
+}
+
+// Posición lógica (contando los segmentos rotados) donde se escribirá la próxima línea
+int64_t posicion_log_actual() {
+    if (!motor.activo) fseek(log_file, 0, SEEK_END);
+    return estado_log.desplazamiento_base + tam_log_activo();
+}
+
+/// @brief Escribe una línea con marca de tiempo en el log y rota si supera TAM_MAX_LOG o ROTACION_LOG_SEGUNDOS.
+///        Solo se llama desde el hilo principal.
+void registrar_log(const char *formato, ...) {
+    const Config *cfg = configuracion();
+    char mensaje[1024];
+    char timestamp[30];
+    time_t now = time(NULL);
+    struct tm tm_info;
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &tm_info));
+
+    va_list args;
+    va_start(args, formato);
+    vsnprintf(mensaje, sizeof(mensaje), formato, args);
+    va_end(args);
+
+    size_t largo = strlen(mensaje);
+    const char *fin = (largo > 0 && mensaje[largo - 1] == '\n') ? "" : "\n";
+    uint64_t tramo = tramo_inicio(peticion_trazada != 0);
+    if (motor.activo) {
+        char linea[sizeof(mensaje) + sizeof(timestamp) + 4];
+        int n = snprintf(linea, sizeof(linea), "[%s] %s%s", timestamp, mensaje, fin);
+        anadir_log_uring(linea, n < (int)sizeof(linea) ? (size_t)n : sizeof(linea) - 1);
+    } else {
+        fprintf(log_file, "[%s] %s%s", timestamp, mensaje, fin);
+        fflush(log_file);
+    }
+    tramo_fin("log", tramo, (int32_t)largo);
+
+    // Aquí puede estar abierto un COMMIT (semáforo tomado, época impar): la rotación, que
+    // comprime el log entero, la hace el bucle principal con rotar_log_pendiente
+    long tam_actual = tam_log_activo();
+    if ((cfg->tam_max_log > 0 && tam_actual >= cfg->tam_max_log) ||
+        (cfg->rotacion_log_segundos > 0 && tam_actual > 0 &&
+         now - estado_log.apertura >= cfg->rotacion_log_segundos)) {
+        rotacion_log_pendiente = 1;
+    }
+}
+
+/// @brief Rota el log si registrar_log lo dejó pendiente. La llama el bucle principal
+///        entre peticiones, sin ningún COMMIT abierto.
+void rotar_log_pendiente() {
+    if (!rotacion_log_pendiente) return;
+    rotacion_log_pendiente = 0;
+    uint64_t tramo = tramo_inicio(traza_activa());
+    if (rotar_log() == 0) relanzar_registros_2pc();
+    tramo_fin("rotar_log", tramo, 0);
+}
+
+// Ruta del índice de movimientos: el log de transacciones con extensión .idx
+static void ruta_indice_movimientos(char *ruta, size_t tam) {
+    const Config *cfg = configuracion();
+    const char *log_filename = strlen(cfg->archivo_log) > 0 ? cfg->archivo_log : LOG_FILE;
+    snprintf(ruta, tam, "%s.idx", log_filename);
+}
+
+// Añade un movimiento al ring de la cuenta (llamar dentro del seqlock de escritura)
+static void anadir_movimiento_ring(CuentaAlmacen *c, const Movimiento *m) {
+    RingMovimientos *ring = c->movimientos;
+    ring->entradas[ring->siguiente] = *m;
+    ring->siguiente = (ring->siguiente + 1) % TAM_RING_MOVIMIENTOS;
+    if (ring->num < TAM_RING_MOVIMIENTOS) ring->num++;
+    c->ultimo_indice = m->posicion_indice;
+}
+
+#define MAGIA_PUNTO_INDICE "IDXPUNT1"
+#define PERIODO_PUNTO_INDICE_MS 60000
+
+// Punto de control del índice de movimientos (<ARCHIVO_LOG>.idx.punto). El primario lo escribe
+// entre dos COMMIT, cuando el archivo de cuentas ya refleja todo el índice hasta "posicion", y
+// guarda la cabeza de la lista de cada cuenta con movimientos. Detrás van las CabezaIndice.
+typedef struct {
+    char magia[8];
+    uint64_t inodo;           // Del índice al que se refiere: otro índice invalida el punto
+    int64_t posicion;
+    int32_t num_cabezas;
+    int32_t reservado;
+} CabeceraPuntoIndice;
+
+typedef struct {
+    int32_t cuenta;
+    int32_t reservado;
+    int64_t ultimo_indice;
+} CabezaIndice;
+
+// Punto de control leído al arrancar; sin punto válido, posicion = 0 y ninguna cabeza
+typedef struct {
+    int64_t posicion;
+    CabezaIndice *cabezas;
+    int num_cabezas;
+} PuntoIndice;
+
+int64_t posicion_punto_indice = 0;   // Lo que cubre el último punto escrito o leído
+
+static void ruta_punto_indice(char *ruta, size_t tam) {
+    char ruta_indice[300];
+    ruta_indice_movimientos(ruta_indice, sizeof(ruta_indice));
+    snprintf(ruta, tam, "%s.punto", ruta_indice);
+}
+
+/// @brief Lee el punto de control del índice. Se lee antes que el archivo de cuentas: como el
+///        primario sólo lo adelanta, lo que se cargue después refleja como mínimo lo que cubre.
+/// @return El punto, o uno vacío si no hay o no corresponde al índice actual
+PuntoIndice leer_punto_indice() {
+    PuntoIndice punto = {0, NULL, 0};
+    char ruta[320], ruta_indice[300];
+    ruta_punto_indice(ruta, sizeof(ruta));
+    ruta_indice_movimientos(ruta_indice, sizeof(ruta_indice));
+
+    struct stat st;
+    CabeceraPuntoIndice cabecera;
+    FILE *f = fopen(ruta, "rb");
+    if (f == NULL) return punto;
+    if (stat(ruta_indice, &st) == 0 && fread(&cabecera, sizeof(cabecera), 1, f) == 1 &&
+        memcmp(cabecera.magia, MAGIA_PUNTO_INDICE, 8) == 0 && cabecera.inodo == (uint64_t)st.st_ino &&
+        cabecera.posicion <= st.st_size && cabecera.num_cabezas >= 0 &&
+        (punto.cabezas = reservar_memoria_ceros(cabecera.num_cabezas + 1, sizeof(CabezaIndice))) != NULL &&
+        fread(punto.cabezas, sizeof(CabezaIndice), cabecera.num_cabezas, f) == (size_t)cabecera.num_cabezas) {
+        punto.posicion = cabecera.posicion;
+        punto.num_cabezas = cabecera.num_cabezas;
+    } else {
+        free(punto.cabezas);
+        punto.cabezas = NULL;
+        printf("Aviso: punto de control %s no válido, se lee el índice desde el principio\n", ruta);
+    }
+    fclose(f);
+    return punto;
+}
+
+// Fija las cabezas de las listas por cuenta que guardó el punto de control
+static void aplicar_punto_indice(const PuntoIndice *punto) {
+    for (int i = 0; i < punto->num_cabezas; i++) {
+        CuentaAlmacen *c = buscar_cuenta_almacen(punto->cabezas[i].cuenta);
+        if (c != NULL) c->ultimo_indice = punto->cabezas[i].ultimo_indice;
+    }
+    posicion_punto_indice = punto->posicion;
+}
+
+/// @brief Escribe un punto de control con todo el índice actual. Lo llama el hilo principal
+///        del primario fuera de los COMMIT. Primero llegan a disco el índice y las cuentas.
+/// @return 0 si se escribió, -1 si no
+int guardar_punto_indice() {
+    struct stat st;
+    if (modo_replica || indice_movimientos_fd < 0 || almacen.mapa == NULL ||
+        fstat(indice_movimientos_fd, &st) < 0) {
+        return -1;
+    }
+    if (st.st_size == posicion_punto_indice) return 0;   // Nada nuevo desde el último
+    if (fdatasync(indice_movimientos_fd) < 0 || msync(almacen.mapa, almacen.tam_mapa, MS_SYNC) < 0) return -1;
+
+    char ruta[320], ruta_temporal[330];
+    ruta_punto_indice(ruta, sizeof(ruta));
+    snprintf(ruta_temporal, sizeof(ruta_temporal), "%s.tmp", ruta);
+    FILE *f = fopen(ruta_temporal, "wb");
+    if (f == NULL) return -1;
+
+    CabeceraPuntoIndice cabecera;
+    memset(&cabecera, 0, sizeof(cabecera));
+    memcpy(cabecera.magia, MAGIA_PUNTO_INDICE, 8);
+    cabecera.inodo = st.st_ino;
+    cabecera.posicion = st.st_size;
+    int error = fwrite(&cabecera, sizeof(cabecera), 1, f) != 1;
+    for (int i = 0; i < almacen.num_cuentas && !error; i++) {
+        if (almacen.cuentas[i].ultimo_indice < 0) continue;
+        CabezaIndice cabeza = {almacen.cuentas[i].datos.numero_cuenta, 0, almacen.cuentas[i].ultimo_indice};
+        error = fwrite(&cabeza, sizeof(cabeza), 1, f) != 1;
+        cabecera.num_cabezas++;
+    }
+    if (!error) {
+        fseek(f, 0, SEEK_SET);
+        error = fwrite(&cabecera, sizeof(cabecera), 1, f) != 1;
+        error |= fflush(f) != 0 || fsync(fileno(f)) != 0;
+    }
+    fclose(f);
+    if (error || rename(ruta_temporal, ruta) != 0) {
+        unlink(ruta_temporal);
+        return -1;
+    }
+    posicion_punto_indice = cabecera.posicion;
+    debug_log("Punto de control del índice: %lld bytes, %d cuentas", (long long)cabecera.posicion, cabecera.num_cabezas);
+    return 0;
+}
+
+static void guardar_punto_indice_periodico(Temporizador *t) {
+    if (guardar_punto_indice() < 0) perror("Error al guardar el punto de control del índice");
+    programar_temporizador(t, PERIODO_PUNTO_INDICE_MS);
+}
+
+Temporizador t_punto_indice = {NULL, NULL, 0, guardar_punto_indice_periodico, -1, 0};
+
+/// @brief Abre el índice de movimientos y reconstruye los rings y cabezas por cuenta a partir
+///        del punto de control: los movimientos anteriores se leen de disco cuando se piden.
+/// @return 0 si el índice está disponible, -1 si no
+int cargar_indice_movimientos(const PuntoIndice *punto) {
+    char ruta[300];
+    ruta_indice_movimientos(ruta, sizeof(ruta));
+
+    indice_movimientos_fd = open(ruta, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (indice_movimientos_fd < 0) {
+        printf("[ERROR] No se pudo abrir el índice de movimientos %s: %s\n", ruta, strerror(errno));
+        return -1;
+    }
+
+    aplicar_punto_indice(punto);
+    RegistroIndice reg;
+    int64_t posicion = punto->posicion;
+    long cargados = 0;
+    while (pread(indice_movimientos_fd, &reg, sizeof(reg), posicion) == sizeof(reg)) {
+        CuentaAlmacen *c = buscar_cuenta_almacen(reg.cuenta);
+        if (c != NULL && (c->movimientos != NULL ||
+                          (c->movimientos = reservar_memoria_ceros(1, sizeof(RingMovimientos))) != NULL)) {
+            Movimiento m = {reg.instante, reg.monto, reg.saldo, reg.desplazamiento_log, posicion, reg.anterior};
+            anadir_movimiento_ring(c, &m);
+            cargados++;
+        }
+        posicion += sizeof(reg);
+    }
+    indice_aplicado = posicion;
+    debug_log("Índice de movimientos %s cargado: %ld movimientos desde la posición %lld",
+              ruta, cargados, (long long)punto->posicion);
+    return 0;
+}
+
+/// @brief Escribe el movimiento en el log y en el índice antes de aplicarlo en memoria
+/// @return 0 si se registró, -1 si no hay índice o falló la escritura
+static int registrar_movimiento(CuentaAlmacen *c, const EscrituraTx *e, uint32_t transferencia, Movimiento *m) {
+    if (indice_movimientos_fd < 0) return -1;
+    if (c->movimientos == NULL && (c->movimientos = reservar_memoria_ceros(1, sizeof(RingMovimientos))) == NULL) return -1;
+
+    m->instante = time(NULL);
+    m->monto = e->delta;
+    m->saldo = c->datos.saldo + e->delta;
+    m->anterior = c->ultimo_indice;
+
+    m->desplazamiento_log = posicion_log_actual();
+    registrar_log("Movimiento (Cuenta %d): %+.2f saldo=%.2f retiros=%d transferencias=%d", c->datos.numero_cuenta,
+                  m->monto, m->saldo, e->retiros, e->transferencias);
+
+    RegistroIndice reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.cuenta = c->datos.numero_cuenta;
+    reg.transferencia = transferencia;
+    reg.instante = m->instante;
+    reg.monto = m->monto;
+    reg.saldo = m->saldo;
+    reg.desplazamiento_log = m->desplazamiento_log;
+    reg.anterior = m->anterior;
+
+    m->posicion_indice = lseek(indice_movimientos_fd, 0, SEEK_END);
+    if (write(indice_movimientos_fd, &reg, sizeof(reg)) != sizeof(reg)) {
+        perror("Error al escribir en el índice de movimientos");
+        return -1;
+    }
+    return 0;
+}
+
+/// @brief Recorre los movimientos de una cuenta del más reciente al más antiguo.
+///        Primero el ring en memoria y después la lista enlazada del índice en disco,
+///        de modo que el coste es O(limite) sin importar el tamaño del log.
+/// @return número de movimientos copiados en salida
+int consultar_movimientos(int numero_cuenta, int limite, int64_t desde, int64_t hasta, Movimiento *salida) {
+    CuentaAlmacen *c = buscar_cuenta_almacen(numero_cuenta);
+    if (c == NULL) return 0;
+
+    // Copia estable del ring y de la cabeza bajo el seqlock de la cuenta
+    RingMovimientos ring;
+    int64_t cabeza;
+    unsigned long antes, despues;
+    do {
+        antes = atomic_load_explicit(&c->version, memory_order_acquire);
+        RingMovimientos *actual = c->movimientos;
+        if (actual != NULL) memcpy(&ring, actual, sizeof(ring));
+        else memset(&ring, 0, sizeof(ring));
+        cabeza = c->ultimo_indice;
+        atomic_thread_fence(memory_order_acquire);
+        despues = atomic_load_explicit(&c->version, memory_order_relaxed);
+    } while ((antes & 1) || antes != despues);
+
+    int n = 0;
+    int64_t siguiente = cabeza;
+    for (int i = 0; i < ring.num && n < limite; i++) {
+        Movimiento *m = &ring.entradas[(ring.siguiente - 1 - i + TAM_RING_MOVIMIENTOS) % TAM_RING_MOVIMIENTOS];
+        siguiente = m->anterior;
+        if (m->instante > hasta) continue;
+        if (m->instante < desde) return n;
+        salida[n++] = *m;
+    }
+
+    RegistroIndice reg;
+    while (n < limite && siguiente >= 0 && indice_movimientos_fd >= 0 &&
+           pread(indice_movimientos_fd, &reg, sizeof(reg), siguiente) == sizeof(reg)) {
+        Movimiento m = {reg.instante, reg.monto, reg.saldo, reg.desplazamiento_log, siguiente, reg.anterior};
+        siguiente = reg.anterior;
+        if (m.instante > hasta) continue;
+        if (m.instante < desde) break;
+        salida[n++] = m;
+    }
+    return n;
+}
+
+// Registra la versión observada de una cuenta (solo la primera lectura cuenta)
+static void tx_registrar_lectura(Transaccion *tx, CuentaAlmacen *c) {
+    for (int i = 0; i < tx->num_lecturas; i++) {
+        if (tx->lecturas[i].cuenta == c->datos.numero_cuenta) return;
+    }
+    tx->lecturas[tx->num_lecturas].cuenta = c->datos.numero_cuenta;
+    tx->lecturas[tx->num_lecturas].version = atomic_load(&c->version);
+    tx->num_lecturas++;
+}
+
+// Acumula el cambio de saldo de la cuenta; "tipo" es la operación (TX_OP_*) que lo causa
+static void tx_sumar_delta(Transaccion *tx, int cuenta, double delta, int tipo) {
+    EscrituraTx *e = NULL;
+    for (int i = 0; i < tx->num_escrituras && e == NULL; i++) {
+        if (tx->escrituras[i].cuenta == cuenta) e = &tx->escrituras[i];
+    }
+    if (e == NULL) {
+        e = &tx->escrituras[tx->num_escrituras++];
+        memset(e, 0, sizeof(*e));
+        e->cuenta = cuenta;
+    }
+    e->delta += delta;
+    if (delta < 0 && tipo == TX_OP_RETIRO) e->retiros++;
+    if (delta < 0 && tipo == TX_OP_MOVER) e->transferencias++;
+}
+
+// Saldo que ve la transacción: el confirmado más sus propios cambios pendientes
+static double tx_saldo_visible(Transaccion *tx, CuentaAlmacen *c) {
+    double saldo = c->datos.saldo;
+    for (int i = 0; i < tx->num_escrituras; i++) {
+        if (tx->escrituras[i].cuenta == c->datos.numero_cuenta) saldo += tx->escrituras[i].delta;
+    }
+    return saldo;
+}
+
+/// @brief Ejecuta una operación contra el estado actual sin modificarlo
+/// @return 0 si la operación es válida, -1 con el motivo en error
+int tx_ejecutar_operacion(Transaccion *tx, const OperacionTx *op, char *error, size_t tam_error) {
+    const Config *cfg = configuracion();
+    CuentaAlmacen *origen = buscar_cuenta_almacen(op->origen);
+    if (origen == NULL) {
+        snprintf(error, tam_error, "La cuenta %d no existe", op->origen);
+        return -1;
+    }
+
+    switch (op->tipo) {
+        case TX_OP_LEER:
+            tx_registrar_lectura(tx, origen);
+            return 0;
+        case TX_OP_DEPOSITO:
+            if (op->monto <= 0) {
+                snprintf(error, tam_error, "Monto inválido %.2f", op->monto);
+                return -1;
+            }
+            // Los depósitos son conmutativos: no necesitan validar la versión leída
+            tx_sumar_delta(tx, op->origen, op->monto, op->tipo);
+            return 0;
+        case TX_OP_RETIRO:
+            if (op->monto <= 0 || (cfg->limite_retiro > 0 && op->monto > cfg->limite_retiro)) {
+                snprintf(error, tam_error, "Retiro de %.2f fuera del límite (%d)", op->monto, cfg->limite_retiro);
+                return -1;
+            }
+            tx_registrar_lectura(tx, origen);
+            if (tx_saldo_visible(tx, origen) - origen->retenido < op->monto) {
+                snprintf(error, tam_error, "Saldo insuficiente en la cuenta %d", op->origen);
+                return -1;
+            }
+            tx_sumar_delta(tx, op->origen, -op->monto, op->tipo);
+            return 0;
+        case TX_OP_MOVER: {
+            CuentaAlmacen *destino = buscar_cuenta_almacen(op->destino);
+            if (destino == NULL || destino == origen) {
+                snprintf(error, tam_error, "Cuenta destino %d inválida", op->destino);
+                return -1;
+            }
+            if (op->monto <= 0 || (cfg->limite_transferencia > 0 && op->monto > cfg->limite_transferencia)) {
+                snprintf(error, tam_error, "Transferencia de %.2f fuera del límite (%d)",
+                         op->monto, cfg->limite_transferencia);
+                return -1;
+            }
+            tx_registrar_lectura(tx, origen);
+            if (tx_saldo_visible(tx, origen) - origen->retenido < op->monto) {
+                snprintf(error, tam_error, "Saldo insuficiente en la cuenta %d", op->origen);
+                return -1;
+            }
+            tx_sumar_delta(tx, op->origen, -op->monto, op->tipo);
+            tx_sumar_delta(tx, op->destino, op->monto, op->tipo);
+            return 0;
+        }
+    }
+    snprintf(error, tam_error, "Operación %d desconocida", op->tipo);
+    return -1;
+}
+
+// Añade una operación a la transacción y la ejecuta sobre el estado actual
+int tx_agregar_operacion(Transaccion *tx, const OperacionTx *op, char *error, size_t tam_error) {
+    if (tx->num_ops >= MAX_OPS_TRANSACCION) {
+        snprintf(error, tam_error, "Máximo de %d operaciones por transacción", MAX_OPS_TRANSACCION);
+        return -1;
+    }
+    if (tx_ejecutar_operacion(tx, op, error, tam_error) < 0) return -1;
+    tx->ops[tx->num_ops++] = *op;
+    return 0;
+}
+
+// Comprueba que ninguna cuenta leída haya cambiado desde que se leyó
+static int tx_validar(const Transaccion *tx) {
+    for (int i = 0; i < tx->num_lecturas; i++) {
+        CuentaAlmacen *c = buscar_cuenta_almacen(tx->lecturas[i].cuenta);
+        if (c == NULL || atomic_load(&c->version) != tx->lecturas[i].version) return 0;
+    }
+    return 1;
+}
+
+// Descarta lecturas y escrituras y vuelve a ejecutar las operaciones registradas
+static int tx_reejecutar(Transaccion *tx, char *error, size_t tam_error) {
+    tx->num_lecturas = 0;
+    tx->num_escrituras = 0;
+    for (int i = 0; i < tx->num_ops; i++) {
+        if (tx_ejecutar_operacion(tx, &tx->ops[i], error, tam_error) < 0) return -1;
+    }
+    return 0;
+}
+
+// Envía a los usuarios suscritos a la cuenta su saldo nuevo tras un COMMIT
+void notificar_cambio_saldo(CuentaAlmacen *c) {
+    for (int slot = 0; c->suscriptores != 0 && slot < MAX_USUARIOS_SIMULTANEOS; slot++) {
+        if (!(c->suscriptores & (1u << slot)) || usuarios[slot].pid == 0) continue;
+        char aviso[96];
+        int largo = snprintf(aviso, sizeof(aviso), "[NOTIF:SALDO:%d=%.2f]\nFIN-MSG\n",
+                             c->datos.numero_cuenta, c->datos.saldo);
+        if (encolar_salida(slot, usuarios[slot].generacion, aviso, largo) < 0) {
+            debug_log("❌ Aviso de saldo de la cuenta %d descartado para el slot %d", c->datos.numero_cuenta, slot);
+        }
+    }
+}
+
+/// @brief Valida y confirma la transacción, reintentándola si hubo conflicto
+/// @return número de reintentos usados, o -1 con el motivo en error
+int tx_commit(Transaccion *tx, char *error, size_t tam_error) {
+    for (int intento = 0; ; intento++) {
+        // Las transacciones de solo lectura se validan sin tomar el semáforo
+        int escribe = tx->num_escrituras > 0;
+        if (escribe && sem_cuentas != SEM_FAILED) sem_wait(sem_cuentas);
+
+        if (tx_validar(tx)) {
+            if (escribe) seqlock_escritura_inicio(&epoca_almacen);
+            for (int i = 0; i < tx->num_escrituras; i++) {
+                CuentaAlmacen *c = buscar_cuenta_almacen(tx->escrituras[i].cuenta);
+                Movimiento m;
+                int registrado = registrar_movimiento(c, &tx->escrituras[i], tx->transferencia, &m) == 0;
+                seqlock_escritura_inicio(&c->version);
+                c->datos.saldo += (float)tx->escrituras[i].delta;
+                c->datos.num_transacciones++;
+                if (registrado) anadir_movimiento_ring(c, &m);
+                seqlock_escritura_fin(&c->version);
+                persistir_cuenta(c);
+            }
+            if (escribe) seqlock_escritura_fin(&epoca_almacen);
+            if (escribe && sem_cuentas != SEM_FAILED) sem_post(sem_cuentas);
+            for (int i = 0; i < tx->num_escrituras; i++) {
+                notificar_cambio_saldo(buscar_cuenta_almacen(tx->escrituras[i].cuenta));
+            }
+            return intento;
+        }
+
+        if (escribe && sem_cuentas != SEM_FAILED) sem_post(sem_cuentas);
+
+        if (intento >= MAX_REINTENTOS_TX) {
+            snprintf(error, tam_error, "Conflicto persistente tras %d reintentos", intento);
+            return -1;
+        }
+        debug_log("Conflicto de versiones en COMMIT, reintentando (%d/%d)", intento + 1, MAX_REINTENTOS_TX);
+        if (tx_reejecutar(tx, error, tam_error) < 0) return -1;
+    }
+}
+
+// Añade al mensaje los saldos de las cuentas leídas tal como los vio el COMMIT
+static void tx_formatear_lecturas(Transaccion *tx, char *salida, size_t tam) {
+    size_t usados = strlen(salida);
+    for (int i = 0; i < tx->num_ops && usados < tam; i++) {
+        if (tx->ops[i].tipo != TX_OP_LEER) continue;
+        CuentaAlmacen *c = buscar_cuenta_almacen(tx->ops[i].origen);
+        if (c == NULL) continue;
+        usados += snprintf(salida + usados, tam - usados, ":%d=%.2f", c->datos.numero_cuenta, c->datos.saldo);
+    }
+}
+
+// Encola una respuesta para el usuario; el bucle principal la envía por su FIFO persistente
+void enviar_respuesta_usuario(int slot, const char *respuesta) {
+    Arena *a = arena_hilo();
+    size_t marca = arena_marca(a);
+    size_t largo;
+    char *mensaje = formatear_respuesta(&largo, "%s", respuesta);
+    if (mensaje == NULL) {
+        debug_log("❌ ERROR: Respuesta demasiado larga para el slot %d", slot);
+        return;
+    }
+    if (usuarios[slot].capturando && usuarios[slot].captura_usada + largo <= sizeof(usuarios[slot].captura)) {
+        memcpy(usuarios[slot].captura + usuarios[slot].captura_usada, mensaje, largo);
+        usuarios[slot].captura_usada += largo;
+    }
+    if (encolar_salida(slot, usuarios[slot].generacion, mensaje, largo) < 0) {
+        debug_log("❌ ERROR: No se pudo encolar respuesta al usuario del slot %d", slot);
+    }
+    arena_volver(a, marca);
+}
+
+/// @brief Una sesión sólo consulta su propia cuenta, salvo que sea de CUENTAS_SUPERVISORAS
+/// @return 1 si el slot puede leer la cuenta, 0 si no
+int puede_consultar_cuenta(int slot, int cuenta) {
+    if (cuenta == usuarios[slot].cuenta) return 1;
+    const Config *cfg = configuracion();
+    for (int k = 0; k < cfg->num_supervisoras; k++) {
+        if (cfg->supervisoras[k] == usuarios[slot].cuenta) return 1;
+    }
+    return 0;
+}
+
+#define PREFIJO_SUSCRIBIR "SUSCRIBIR:"
+#define PREFIJO_DESUSCRIBIR "DESUSCRIBIR:"
+
+// Quita todas las suscripciones del slot (al liberarlo)
+void cancelar_suscripciones(int slot) {
+    for (int k = 0; k < usuarios[slot].num_suscripciones; k++) {
+        CuentaAlmacen *c = buscar_cuenta_almacen(usuarios[slot].suscripciones[k]);
+        if (c != NULL) c->suscriptores &= ~(1u << slot);
+    }
+    usuarios[slot].num_suscripciones = 0;
+}
+
+/// @brief Atiende SUSCRIBIR:c1,c2,... y DESUSCRIBIR:c1,c2,...
+///        Al suscribirse se responde con los saldos actuales ([SUSCRITO:c=s:...]); a partir
+///        de ahí cada COMMIT que toque esas cuentas envía [NOTIF:SALDO:c=s].
+void procesar_mensaje_suscripcion(int slot, char *mensaje) {
+    InfoUsuario *u = &usuarios[slot];
+    char *desuscribir = strstr(mensaje, PREFIJO_DESUSCRIBIR);
+    char *lista = desuscribir != NULL ? desuscribir + strlen(PREFIJO_DESUSCRIBIR)
+                                      : strstr(mensaje, PREFIJO_SUSCRIBIR) + strlen(PREFIJO_SUSCRIBIR);
+    char respuesta[BUFFER_SIZE];
+    size_t usados = snprintf(respuesta, sizeof(respuesta), desuscribir != NULL ? "[DESUSCRITO" : "[SUSCRITO");
+
+    if (!almacen_cargado()) {
+        enviar_respuesta_usuario(slot, "[SUSCRITO:ERROR:Almacén de cuentas no disponible]");
+        return;
+    }
+    // Darse de baja siempre se puede; suscribirse, sólo a las cuentas que la sesión puede consultar
+    for (const char *campo = lista; desuscribir == NULL && *campo != '\0' && *campo != '\n'; campo++) {
+        int numero = atoi(campo);
+        if (numero > 0 && !puede_consultar_cuenta(slot, numero)) {
+            debug_log("❌ Suscripción a la cuenta %d rechazada: la sesión es de la cuenta %d", numero, u->cuenta);
+            snprintf(respuesta, sizeof(respuesta), "[SUSCRITO:ERROR:La cuenta %d no es la de la sesión]", numero);
+            enviar_respuesta_usuario(slot, respuesta);
+            return;
+        }
+        if ((campo = strchr(campo, ',')) == NULL) break;
+    }
+
+    char *guardado = NULL;
+    for (char *campo = strtok_r(lista, ",\n", &guardado); campo != NULL; campo = strtok_r(NULL, ",\n", &guardado)) {
+        int numero = atoi(campo);
+        CuentaAlmacen *c = buscar_cuenta_almacen(numero);
+        if (c == NULL) continue;
+
+        int k = 0;
+        while (k < u->num_suscripciones && u->suscripciones[k] != numero) k++;
+        if (desuscribir != NULL) {
+            if (k == u->num_suscripciones) continue;
+            u->suscripciones[k] = u->suscripciones[--u->num_suscripciones];
+            c->suscriptores &= ~(1u << slot);
+            usados += snprintf(respuesta + usados, sizeof(respuesta) - usados, ":%d", numero);
+        } else {
+            if (k == u->num_suscripciones) {
+                if (u->num_suscripciones == MAX_SUSCRIPCIONES) continue;
+                u->suscripciones[u->num_suscripciones++] = numero;
+                c->suscriptores |= 1u << slot;
+            }
+            // Sólo el hilo principal modifica saldos, así que aquí se leen sin seqlock
+            usados += snprintf(respuesta + usados, sizeof(respuesta) - usados, ":%d=%.2f", numero, c->datos.saldo);
+        }
+        if (usados >= sizeof(respuesta) - 2) break;
+    }
+    if (usados < sizeof(respuesta) - 1) strcat(respuesta, "]");
+    debug_log("Suscripciones de la cuenta %d: %s", u->cuenta, respuesta);
+    enviar_respuesta_usuario(slot, respuesta);
+}
+
+/// @brief Procesa una línea TX:BEGIN, TX:LEER, TX:MOVER, TX:DEPOSITO, TX:RETIRO, TX:COMMIT o TX:ABORT
+void procesar_comando_tx(int slot, const char *linea, char *respuesta, size_t tam) {
+    Transaccion *tx = &usuarios[slot].transaccion;
+    char error[128];
+    OperacionTx op = {0, 0, 0, 0.0};
+
+    if (strncmp(linea, "TX:BEGIN", 8) == 0) {
+        if (tx->activa) {
+            snprintf(respuesta, tam, "[TX:ERROR:Ya hay una transacción abierta]");
+            return;
+        }
+        memset(tx, 0, sizeof(Transaccion));
+        tx->activa = 1;
+        snprintf(respuesta, tam, "[TX:OK:BEGIN]");
+        return;
+    }
+
+    if (!tx->activa) {
+        snprintf(respuesta, tam, "[TX:ERROR:No hay transacción abierta]");
+        return;
+    }
+
+    if (strncmp(linea, "TX:ABORT", 8) == 0) {
+        memset(tx, 0, sizeof(Transaccion));
+        snprintf(respuesta, tam, "[TX:OK:ABORT]");
+        return;
+    }
+
+    if (strncmp(linea, "TX:COMMIT", 9) == 0) {
+        int reintentos = tx_commit(tx, error, sizeof(error));
+        if (reintentos < 0) {
+            snprintf(respuesta, tam, "[TX:ERROR:%s]", error);
+            registrar_log("[ERROR] Transacción abortada para cuenta %d: %s", usuarios[slot].cuenta, error);
+        } else {
+            snprintf(respuesta, tam, "[TX:OK:COMMIT:reintentos=%d", reintentos);
+            tx_formatear_lecturas(tx, respuesta, tam - 1);
+            strncat(respuesta, "]", tam - strlen(respuesta) - 1);
+            registrar_log("Transacción (Cuenta %d): COMMIT de %d operaciones, %d reintentos",
+                          usuarios[slot].cuenta, tx->num_ops, reintentos);
+        }
+        memset(tx, 0, sizeof(Transaccion));
+        return;
+    }
+
+    if (sscanf(linea, "TX:LEER:%d", &op.origen) == 1) {
+        op.tipo = TX_OP_LEER;
+    } else if (sscanf(linea, "TX:MOVER:%d:%d:%lf", &op.origen, &op.destino, &op.monto) == 3) {
+        op.tipo = TX_OP_MOVER;
+    } else if (sscanf(linea, "TX:DEPOSITO:%d:%lf", &op.origen, &op.monto) == 2) {
+        op.tipo = TX_OP_DEPOSITO;
+    } else if (sscanf(linea, "TX:RETIRO:%d:%lf", &op.origen, &op.monto) == 2) {
+        op.tipo = TX_OP_RETIRO;
+    } else {
+        snprintf(respuesta, tam, "[TX:ERROR:Comando no reconocido]");
+        return;
+    }
+
+    // Como en las operaciones sueltas, sólo se mueve dinero de la cuenta de la sesión
+    if (op.tipo != TX_OP_LEER && op.origen != usuarios[slot].cuenta) {
+        debug_log("❌ Operación TX sobre cuenta %d rechazada: la sesión es de la cuenta %d",
+                  op.origen, usuarios[slot].cuenta);
+        snprintf(respuesta, tam, "[TX:ERROR:La cuenta %d no es la de la sesión]", op.origen);
+    } else if (tx_agregar_operacion(tx, &op, error, sizeof(error)) < 0) {
+        snprintf(respuesta, tam, "[TX:ERROR:%s]", error);
+    } else if (op.tipo == TX_OP_LEER) {
+        snprintf(respuesta, tam, "[TX:OK:LEER:%d=%.2f]", op.origen,
+                 tx_saldo_visible(tx, buscar_cuenta_almacen(op.origen)));
+    } else {
+        snprintf(respuesta, tam, "[TX:OK:%d]", tx->num_ops);
+    }
+}
+
+// Procesa cada línea TX: del mensaje y responde a cada una por separado
+void procesar_mensaje_tx(int slot, char *mensaje) {
+    char *guardado = NULL;
+    for (char *linea = strtok_r(mensaje, "\n", &guardado); linea != NULL;
+         linea = strtok_r(NULL, "\n", &guardado)) {
+        char *inicio = strstr(linea, "TX:");
+        if (inicio == NULL) continue;
+
+        char respuesta[BUFFER_SIZE];
+        procesar_comando_tx(slot, inicio, respuesta, sizeof(respuesta));
+        debug_log("Respuesta transaccional para cuenta %d: '%s'", usuarios[slot].cuenta, respuesta);
+        enviar_respuesta_usuario(slot, respuesta);
+    }
+}
+
+/// @brief Aplica un depósito o retiro enviado por el menú de usuario como transacción de una operación
+/// @return 1 si el mensaje era una operación de saldo, 0 en otro caso
+int procesar_operacion_simple(int slot, const char *mensaje) {
+    OperacionTx op = {0, 0, 0, 0.0};
+    const char *p;
+
+    if ((p = strstr(mensaje, "Depósito de ")) != NULL &&
+        sscanf(p, "Depósito de %lf en la cuenta %d", &op.monto, &op.origen) == 2) {
+        op.tipo = TX_OP_DEPOSITO;
+    } else if ((p = strstr(mensaje, "Retiro de ")) != NULL &&
+               sscanf(p, "Retiro de %lf de la cuenta %d", &op.monto, &op.origen) == 2) {
+        op.tipo = TX_OP_RETIRO;
+    } else {
+        return 0;
+    }
+
+    char respuesta[192];
+    if (op.origen != usuarios[slot].cuenta) {
+        debug_log("❌ Operación sobre cuenta %d rechazada: la sesión es de la cuenta %d",
+                  op.origen, usuarios[slot].cuenta);
+        snprintf(respuesta, sizeof(respuesta), "[ERROR:La cuenta %d no es la de la sesión]", op.origen);
+    } else {
+        Transaccion tx;
+        char error[128];
+        memset(&tx, 0, sizeof(tx));
+        if (tx_agregar_operacion(&tx, &op, error, sizeof(error)) < 0 || tx_commit(&tx, error, sizeof(error)) < 0) {
+            debug_log("❌ Operación rechazada para cuenta %d: %s", op.origen, error);
+            registrar_log("[ERROR] Operación fallida para cuenta %d: %s", op.origen, error);
+            snprintf(respuesta, sizeof(respuesta), "[ERROR:%s]", error);
+        } else {
+            debug_log("✅ Operación aplicada en cuenta %d (%.2f)", op.origen, op.monto);
+            snprintf(respuesta, sizeof(respuesta), "[OK:%s de %.2f aplicado]",
+                     op.tipo == TX_OP_DEPOSITO ? "Depósito" : "Retiro", op.monto);
+        }
+    }
+
+    // Sólo las operaciones con clave de idempotencia esperan confirmación
+    if (usuarios[slot].capturando) enviar_respuesta_usuario(slot, respuesta);
+    return 1;
+}
+
+#define MAX_HILOS_LECTURA 64
+#define TAM_COLA_LECTURAS 256
+#define MAX_CUENTAS_CONSULTA 8
+
+#define MAX_MOVIMIENTOS_CONSULTA 50
+
+#define LECTURA_SALDO 1
+#define LECTURA_SALDOS 2
+#define LECTURA_MOVIMIENTOS 3
+
+// Consulta que el hilo principal delega a los hilos lectores
+typedef struct {
+    int tipo;                            // LECTURA_SALDO, LECTURA_SALDOS o LECTURA_MOVIMIENTOS
+    int num_cuentas;
+    int cuentas[MAX_CUENTAS_CONSULTA];
+    int limite;                          // Movimientos pedidos (LECTURA_MOVIMIENTOS)
+    int64_t desde;                       // Rango de tiempo de los movimientos
+    int64_t hasta;
+    int slot;                            // Sesión a la que se responde
+    unsigned int generacion;             // Generación de la sesión al encolar
+    uint32_t traza;                      // Petición trazada de la que viene (0 = no se traza)
+    uint64_t encolada_traza;             // traza_reloj() al encolarla, si se traza
+} PeticionLectura;
+
+// Cola circular de consultas pendientes
+typedef struct {
+    PeticionLectura peticiones[TAM_COLA_LECTURAS];
+    int inicio;
+    int num;
+    int terminar;
+    pthread_mutex_t mutex;
+    pthread_cond_t hay_trabajo;
+} ColaLecturas;
+
+ColaLecturas cola_lecturas = {.mutex = PTHREAD_MUTEX_INITIALIZER, .hay_trabajo = PTHREAD_COND_INITIALIZER};
+pthread_t hilos_lectores[MAX_HILOS_LECTURA];
+int num_hilos_lectores = 0;
+
+// Responde a SALDOS:<c1>,<c2>,... con saldos tomados de la misma versión del almacén
+void procesar_consulta_saldos(const int *cuentas, int n, int slot, unsigned int generacion) {
+    Cuenta resultado[MAX_CUENTAS_CONSULTA];
+    char saldos[BUFFER_SIZE];
+    size_t usados = 0;
+
+    leer_cuentas_snapshot(cuentas, n, resultado);
+    for (int i = 0; i < n && usados < sizeof(saldos); i++) {
+        if (resultado[i].numero_cuenta == 0) {
+            usados += snprintf(saldos + usados, sizeof(saldos) - usados, "%c%d=ERROR", i ? ',' : ':', cuentas[i]);
+        } else {
+            usados += snprintf(saldos + usados, sizeof(saldos) - usados, "%c%d=%.2f",
+                               i ? ',' : ':', cuentas[i], resultado[i].saldo);
+        }
+    }
+    size_t largo;
+    char *respuesta = formatear_respuesta(&largo, "[SALDOS%s:OK]", saldos);
+    if (respuesta != NULL) encolar_salida(slot, generacion, respuesta, largo);
+}
+
+// Responde a MOVIMIENTOS con una línea por movimiento, del más reciente al más antiguo.
+// La respuesta se compone directamente en la arena del hilo, sin pasar de PIPE_BUF bytes.
+void procesar_consulta_movimientos(int cuenta, int limite, int64_t desde, int64_t hasta,
+                                   int slot, unsigned int generacion) {
+    static const char fin[] = "[MOVIMIENTOS:OK]\nFIN-MSG\n";
+    Movimiento movimientos[MAX_MOVIMIENTOS_CONSULTA];
+    Arena *a = arena_hilo();
+    size_t tam;
+    char *respuesta = arena_hueco(a, &tam);
+    size_t usados;
+
+    if (tam > PIPE_BUF) tam = PIPE_BUF;
+    if (tam < BUFFER_SIZE) {
+        a->agotada++;
+        return;
+    }
+    tam -= sizeof(fin);   // Sitio reservado para el cierre, que siempre se añade
+    int n = consultar_movimientos(cuenta, limite, desde, hasta, movimientos);
+    usados = snprintf(respuesta, tam, "[MOVIMIENTOS:%d:%d]\n", cuenta, n);
+    for (int i = 0; i < n; i++) {
+        char fecha[30];
+        time_t instante = (time_t)movimientos[i].instante;
+        struct tm tm_info;
+        strftime(fecha, sizeof(fecha), "%Y-%m-%d %H:%M:%S", localtime_r(&instante, &tm_info));
+        int linea = snprintf(respuesta + usados, tam - usados, "%s %+.2f saldo=%.2f\n",
+                             fecha, movimientos[i].monto, movimientos[i].saldo);
+        if (linea < 0 || (size_t)linea >= tam - usados) break;
+        usados += linea;
+    }
+    memcpy(respuesta + usados, fin, sizeof(fin));
+    usados += sizeof(fin) - 1;
+    arena_confirmar(a, usados + 1);
+    encolar_salida(slot, generacion, respuesta, usados);
+}
+
+// Periodos de gracia de la configuración (RCU por estados de reposo). Cada recarga avanza
+// periodo_config; cada hilo lector anuncia el periodo que ha visto antes de atender una
+// consulta, o PERIODO_EN_REPOSO mientras espera trabajo y no usa ninguna configuración.
+#define PERIODO_EN_REPOSO ULONG_MAX
+atomic_ulong periodo_config = 1;
+atomic_ulong periodo_visto[MAX_HILOS_LECTURA];
+
+void *hilo_lector(void *arg) {
+    int hilo = (int)(intptr_t)arg;
+    char nombre[16];
+    snprintf(nombre, sizeof(nombre), "lector-%d", hilo);
+    traza_registrar_hilo(nombre);
+    while (1) {
+        pthread_mutex_lock(&cola_lecturas.mutex);
+        atomic_store(&periodo_visto[hilo], PERIODO_EN_REPOSO);
+        while (cola_lecturas.num == 0 && !cola_lecturas.terminar) {
+            pthread_cond_wait(&cola_lecturas.hay_trabajo, &cola_lecturas.mutex);
+        }
+        if (cola_lecturas.num == 0) {
+            pthread_mutex_unlock(&cola_lecturas.mutex);
+            break;
+        }
+        PeticionLectura p = cola_lecturas.peticiones[cola_lecturas.inicio];
+        cola_lecturas.inicio = (cola_lecturas.inicio + 1) % TAM_COLA_LECTURAS;
+        cola_lecturas.num--;
+        pthread_mutex_unlock(&cola_lecturas.mutex);
+        atomic_store(&periodo_visto[hilo], atomic_load(&periodo_config));
+
+        peticion_trazada = p.traza;
+        if (p.traza != 0) traza_registrar("espera_lectores", p.encolada_traza, traza_reloj(), p.traza, p.slot);
+        uint64_t tramo = tramo_inicio(p.traza != 0);
+        empezar_peticion();
+        if (p.tipo == LECTURA_SALDO) {
+            procesar_consulta_saldo(p.cuentas[0], p.slot, p.generacion);
+        } else if (p.tipo == LECTURA_MOVIMIENTOS) {
+            procesar_consulta_movimientos(p.cuentas[0], p.limite, p.desde, p.hasta, p.slot, p.generacion);
+        } else {
+            procesar_consulta_saldos(p.cuentas, p.num_cuentas, p.slot, p.generacion);
+        }
+        terminar_peticion();
+        tramo_fin("consulta", tramo, p.slot);
+        peticion_trazada = 0;
+    }
+    return NULL;
+}
+
+int encolar_peticion_lectura(const PeticionLectura *peticion);
+
+/// @brief Delega una consulta a los hilos lectores
+/// @return 0 si se encoló, -1 si no hay hilos o la cola está llena (el llamador la atiende en línea)
+int encolar_lectura(int tipo, const int *cuentas, int n, int slot) {
+    PeticionLectura p = {.tipo = tipo, .num_cuentas = n, .slot = slot, .generacion = usuarios[slot].generacion};
+    if (n < 1 || n > MAX_CUENTAS_CONSULTA) return -1;
+    memcpy(p.cuentas, cuentas, n * sizeof(int));
+    return encolar_peticion_lectura(&p);
+}
+
+int encolar_peticion_lectura(const PeticionLectura *peticion) {
+    if (num_hilos_lectores == 0) return -1;
+
+    pthread_mutex_lock(&cola_lecturas.mutex);
+    if (cola_lecturas.num == TAM_COLA_LECTURAS) {
+        pthread_mutex_unlock(&cola_lecturas.mutex);
+        return -1;
+    }
+    PeticionLectura *destino = &cola_lecturas.peticiones[(cola_lecturas.inicio + cola_lecturas.num) % TAM_COLA_LECTURAS];
+    *destino = *peticion;
+    destino->traza = peticion_trazada;
+    destino->encolada_traza = tramo_inicio(peticion_trazada != 0);
+    cola_lecturas.num++;
+    pthread_cond_signal(&cola_lecturas.hay_trabajo);
+    pthread_mutex_unlock(&cola_lecturas.mutex);
+    return 0;
+}
+
+// Atiende MOVIMIENTOS:<cuenta>:<K> y MOVIMIENTOS:<cuenta>:<K>:<desde>:<hasta> (segundos desde epoch)
+void procesar_mensaje_movimientos(int slot, const char *mensaje) {
+    PeticionLectura p = {.tipo = LECTURA_MOVIMIENTOS, .num_cuentas = 1, .hasta = INT64_MAX,
+                         .slot = slot, .generacion = usuarios[slot].generacion};
+    long long desde, hasta;
+    const char *inicio = strstr(mensaje, "MOVIMIENTOS:");
+
+    int campos = sscanf(inicio, "MOVIMIENTOS:%d:%d:%lld:%lld", &p.cuentas[0], &p.limite, &desde, &hasta);
+    if (campos == 4) {
+        p.desde = desde;
+        p.hasta = hasta;
+    }
+
+    if (campos != 2 && campos != 4) {
+        debug_log("❌ ERROR: Consulta MOVIMIENTOS inválida del slot %d", slot);
+        return;
+    }
+    if (!puede_consultar_cuenta(slot, p.cuentas[0])) {
+        debug_log("❌ MOVIMIENTOS de la cuenta %d rechazado: la sesión es de la cuenta %d",
+                  p.cuentas[0], usuarios[slot].cuenta);
+        char respuesta[96];
+        snprintf(respuesta, sizeof(respuesta), "[MOVIMIENTOS:ERROR:La cuenta %d no es la de la sesión]", p.cuentas[0]);
+        enviar_respuesta_usuario(slot, respuesta);
+        return;
+    }
+    if (p.limite < 1 || p.limite > MAX_MOVIMIENTOS_CONSULTA) p.limite = MAX_MOVIMIENTOS_CONSULTA;
+
+    if (encolar_peticion_lectura(&p) < 0) {
+        procesar_consulta_movimientos(p.cuentas[0], p.limite, p.desde, p.hasta, slot, p.generacion);
+    }
+}
+
+void iniciar_hilos_lectores(int n) {
+    if (n > MAX_HILOS_LECTURA) n = MAX_HILOS_LECTURA;
+    for (int i = 0; i < n; i++) {
+        atomic_store(&periodo_visto[i], PERIODO_EN_REPOSO);
+        if (pthread_create(&hilos_lectores[i], NULL, hilo_lector, (void *)(intptr_t)i) != 0) {
+            perror("Error al crear hilo lector");
+            break;
+        }
+        num_hilos_lectores++;
+    }
+    debug_log("%d hilos lectores iniciados", num_hilos_lectores);
+}
+
+void detener_hilos_lectores() {
+    pthread_mutex_lock(&cola_lecturas.mutex);
+    cola_lecturas.terminar = 1;
+    pthread_cond_broadcast(&cola_lecturas.hay_trabajo);
+    pthread_mutex_unlock(&cola_lecturas.mutex);
+    for (int i = 0; i < num_hilos_lectores; i++) {
+        pthread_join(hilos_lectores[i], NULL);
+    }
+    num_hilos_lectores = 0;
+}
+
+#define MAX_CONFIGS_RETIRADAS 8
+
+// Versión de la configuración sustituida que algún hilo lector puede estar usando todavía
+typedef struct {
+    const Config *cfg;
+    unsigned long periodo;   // Se puede liberar cuando todos los hilos hayan visto este periodo
+} ConfigRetirada;
+
+ConfigRetirada configs_retiradas[MAX_CONFIGS_RETIRADAS];
+int num_configs_retiradas = 0;
+
+// Libera las versiones retiradas que ya no puede estar usando ningún hilo lector
+void liberar_configs_retiradas() {
+    int k = 0;
+    while (k < num_configs_retiradas) {
+        int en_uso = 0;
+        for (int h = 0; h < num_hilos_lectores && !en_uso; h++) {
+            en_uso = atomic_load(&periodo_visto[h]) < configs_retiradas[k].periodo;
+        }
+        if (en_uso) {
+            k++;
+            continue;
+        }
+        free((void *)configs_retiradas[k].cfg);
+        configs_retiradas[k] = configs_retiradas[--num_configs_retiradas];
+    }
+}
+
+/// @brief Publica una configuración nueva con un intercambio atómico y retira la anterior.
+///        Sólo la llama el hilo principal, que no guarda punteros a la configuración entre
+///        una vuelta del bucle y la siguiente.
+/// @return 0 si se publicó, -1 si aún quedan demasiadas versiones anteriores por liberar
+int publicar_configuracion(Config *nueva) {
+    liberar_configs_retiradas();
+    if (num_configs_retiradas == MAX_CONFIGS_RETIRADAS) return -1;
+    const Config *anterior = atomic_exchange(&config_vigente, nueva);
+    unsigned long periodo = atomic_fetch_add(&periodo_config, 1) + 1;
+    if (anterior != &config_inicial) {
+        configs_retiradas[num_configs_retiradas].cfg = anterior;
+        configs_retiradas[num_configs_retiradas].periodo = periodo;
+        num_configs_retiradas++;
+    }
+    return 0;
+}
+
+// Atiende SALDOS:<c1>,<c2>,... en un hilo lector (o en línea si la cola está llena)
+void procesar_mensaje_saldos(int slot, const char *mensaje) {
+    int cuentas[MAX_CUENTAS_CONSULTA];
+    int n = 0;
+    const char *p = strstr(mensaje, "SALDOS:") + 7;
+
+    while (n < MAX_CUENTAS_CONSULTA && sscanf(p, "%d", &cuentas[n]) == 1) {
+        n++;
+        p = strchr(p, ',');
+        if (p == NULL) break;
+        p++;
+    }
+
+    if (n == 0) {
+        debug_log("❌ ERROR: Consulta SALDOS inválida del slot %d", slot);
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        if (puede_consultar_cuenta(slot, cuentas[i])) continue;
+        debug_log("❌ SALDOS de la cuenta %d rechazado: la sesión es de la cuenta %d", cuentas[i], usuarios[slot].cuenta);
+        char respuesta[96];
+        snprintf(respuesta, sizeof(respuesta), "[SALDOS:ERROR:La cuenta %d no es la de la sesión]", cuentas[i]);
+        enviar_respuesta_usuario(slot, respuesta);
+        return;
+    }
+    if (encolar_lectura(LECTURA_SALDOS, cuentas, n, slot) < 0) {
+        procesar_consulta_saldos(cuentas, n, slot, usuarios[slot].generacion);
+    }
+}
+
+// Procesa un mensaje recibido del usuario del slot i
+void procesar_mensaje_usuario(int i, char *buffer, ssize_t nbytes) {
+    // Categorize the message for better logging
+    int is_login = strstr(buffer, "ha iniciado sesión") != NULL;
+    int is_logout = strstr(buffer, "ha cerrado sesión") != NULL;
+    int is_balance_query = strstr(buffer, "Consulta de saldo") != NULL || 
+                          strstr(buffer, "consulta de saldo") != NULL ||
+                          strstr(buffer, "saldo") != NULL;
+    
+    if (is_login && usuarios[i].es_socket && usuarios[i].cuenta == 0 && identificar_sesion_socket(i, buffer) < 0) {
+        debug_log("❌ Sesión por socket rechazada en el slot %d: '%s'", i, buffer);
+        return;
+    }
+
+    if (is_login) {
+        debug_log("✅ Mensaje de conexión detectado: Usuario %d ha iniciado sesión", usuarios[i].cuenta);
+    } else if (is_logout) {
+        debug_log("👋 Mensaje de desconexión detectado: Usuario %d ha cerrado sesión", usuarios[i].cuenta);
+    } else {
+        debug_log("📩 Mensaje regular recibido de usuario %d (cuenta %d) - %d bytes: '%s'", 
+                i, usuarios[i].cuenta, (int)nbytes, buffer);
+    }
+    
+    // Log to transaction log
+    registrar_log("Usuario (Cuenta %d): %s", usuarios[i].cuenta, buffer);
+    
+    // Print to console in a more formatted way
+    printf("Mensaje de usuario %d (Cuenta %d): %s", i, usuarios[i].cuenta, buffer);
+    
+    // Only check for operations in non-connection messages
+    if (!is_login && !is_logout) {
+        debug_log("Analizando mensaje para detectar operaciones...");
+        
+        // Transaction commands take precedence over free-text detection
+        if (modo_replica && procesar_mensaje_replica(i, buffer)) {
+            debug_log("Mensaje de la réplica atendido para cuenta %d", usuarios[i].cuenta);
+        } else if (strstr(buffer, PREFIJO_SUSCRIBIR) != NULL) {
+            procesar_mensaje_suscripcion(i, buffer);
+        } else if (strstr(buffer, "MOVIMIENTOS:") != NULL) {
+            procesar_mensaje_movimientos(i, buffer);
+        } else if (strstr(buffer, "SALDOS:") != NULL) {
+            procesar_mensaje_saldos(i, buffer);
+        } else if (strstr(buffer, "TX:") != NULL) {
+            procesar_mensaje_tx(i, buffer);
+        } else if (procesar_operacion_simple(i, buffer)) {
+            debug_log("Operación de depósito/retiro procesada para cuenta %d", usuarios[i].cuenta);
+        } else if (procesar_transferencia(i, buffer)) {
+            debug_log("Transferencia procesada para cuenta %d", usuarios[i].cuenta);
+        } else if (is_balance_query) {
+            debug_log("🔍 Detectada consulta de saldo de cuenta %d", usuarios[i].cuenta);
+            
+            // Las sesiones por socket ya tienen su conexión; las demás necesitan el FIFO
+            if (!usuarios[i].es_socket) {
+                // Verify that the FIFO exists
+                if (access(usuarios[i].fifo_escritura, F_OK) == -1) {
+                    debug_log("❌ ERROR: El FIFO %s no existe", usuarios[i].fifo_escritura);
+                    return;
+                }
+
+                // Get the persistent connection instead of opening a new one
+                int fifo_escritura_fd = get_fifo_connection(i, usuarios[i].fifo_escritura);
+                if (fifo_escritura_fd < 0) {
+                    debug_log("❌ ERROR: No se pudo obtener la conexión FIFO persistente");
+                    return;
+                }
+
+                debug_log("✅ FIFO abierto correctamente (fd=%d)", fifo_escritura_fd);
+            }
+            int cuenta_consulta = usuarios[i].cuenta;
+            if (encolar_lectura(LECTURA_SALDO, &cuenta_consulta, 1, i) < 0) {
+                procesar_consulta_saldo(usuarios[i].cuenta, i, usuarios[i].generacion);
+            }
+        } else {
+            debug_log("ℹ️ No se detectó ninguna operación en el mensaje");
+        }
+    } else {
+        debug_log("ℹ️ Mensaje administrativo procesado, no requiere respuesta");
+    }
+}
+
+// Lee lo disponible en el FIFO del usuario y lo encola por líneas; cierra el FIFO al recibir EOF
+/// @brief Incorpora los nbytes que ya están a continuación de la entrada del usuario y extrae
+///        sus peticiones; con nbytes == 0 (EOF) cierra la lectura y programa el fin de la sesión
+void recibir_datos_usuario(int i, ssize_t nbytes) {
+    const Config *cfg = configuracion();
+    InfoUsuario *u = &usuarios[i];
+    if (nbytes > 0) {
+        u->entrada_usados += nbytes;
+        if (cfg->sesion_inactiva_segundos > 0) {
+            programar_temporizador(&u->t_inactividad, cfg->sesion_inactiva_segundos * 1000LL);
+        }
+    }
+    else if (nbytes == 0) { // EOF - el usuario cerró su extremo: la sesión termina
+        close(u->fifo_lectura_fd);
+        u->fifo_lectura_fd = 0;
+        programar_temporizador(&u->t_cierre, 0);
+    }
+    uint64_t tramo = tramo_inicio(traza_muestrear());
+    extraer_peticiones(i);
+    tramo_fin("interpretar", tramo, i);
+}
+
+void atender_lectura_usuario(int i) {
+    InfoUsuario *u = &usuarios[i];
+    uint64_t tramo = tramo_inicio(traza_muestrear());
+    ssize_t leidos = read(u->fifo_lectura_fd, u->entrada + u->entrada_usados, sizeof(u->entrada) - 1 - u->entrada_usados);
+    tramo_fin("recibir", tramo, (int32_t)leidos);
+    recibir_datos_usuario(i, leidos);
+}
+
+// Rearma el plazo de un carril con la petición más antigua, o lo cancela si está vacío
+void armar_plazo_cola(int i, int carril) {
+    const Config *cfg = configuracion();
+    ColaPeticiones *cola = &usuarios[i].colas[carril];
+    Temporizador *t = &usuarios[i].t_plazo[carril];
+    if (cfg->plazo_peticion_ms <= 0 || cola->num == 0) {
+        cancelar_temporizador(t);
+        return;
+    }
+    programar_temporizador(t, cola->peticiones[cola->inicio].llegada_ms + cfg->plazo_peticion_ms - reloj_ms());
+}
+
+void desconectar_usuario(int i, const char *motivo) {
+    printf("Usuario (Cuenta: %d, PID: %d) desconectado: %s.\n", usuarios[i].cuenta, usuarios[i].pid, motivo);
+    registrar_log("Usuario desconectado: Cuenta %d (PID %d) - %s", usuarios[i].cuenta, usuarios[i].pid, motivo);
+    limpiar_recursos_usuario(i);
+}
+
+// Descarta las peticiones que llevan más de PLAZO_PETICION_MS en cola
+static void vencer_plazo_peticiones(Temporizador *t) {
+    ColaPeticiones *cola = &usuarios[t->slot].colas[t->dato];
+    int64_t ahora = reloj_ms();
+    while (cola->num > 0 && ahora - cola->peticiones[cola->inicio].llegada_ms >= configuracion()->plazo_peticion_ms) {
+        debug_log("⏱️ Petición de cuenta %d descartada tras %d ms en cola", usuarios[t->slot].cuenta,
+                  (int)(ahora - cola->peticiones[cola->inicio].llegada_ms));
+        enviar_respuesta_usuario(t->slot, "[ERROR:Plazo de la petición vencido]");
+        cola->inicio = (cola->inicio + 1) % MAX_PETICIONES_SESION;
+        cola->num--;
+    }
+    armar_plazo_cola(t->slot, t->dato);
+}
+
+static void vencer_inactividad(Temporizador *t) {
+    desconectar_usuario(t->slot, "sesión inactiva");
+}
+
+// Un FIFO de respuestas sin lector da POLLERR: el usuario se fue aunque no haya cerrado su escritura
+static void comprobar_latido(Temporizador *t) {
+    int fd = fd_conexion_usuario(t->slot);
+    if (fd >= 0) {
+        struct pollfd pfd = {fd, 0, 0};
+        if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLERR | POLLHUP))) {
+            desconectar_usuario(t->slot, "cerró su FIFO de respuestas");
+            return;
+        }
+    }
+    programar_temporizador(t, configuracion()->latido_segundos * 1000LL);
+}
+
+// Tras el EOF se terminan de atender las peticiones ya recibidas antes de liberar el slot
+static void cerrar_tras_eof(Temporizador *t) {
+    InfoUsuario *u = &usuarios[t->slot];
+    if (u->entrada_usados > 0 || u->colas[CARRIL_GENERAL].num > 0 || u->colas[CARRIL_LECTURAS].num > 0) {
+        programar_temporizador(t, TICK_TEMPORIZADOR_MS);
+        return;
+    }
+    desconectar_usuario(t->slot, "fin de la conexión");
+}
+
+// Prepara los temporizadores de una sesión recién conectada
+void iniciar_temporizadores_sesion(int i) {
+    const Config *cfg = configuracion();
+    Temporizador *todos[] = {&usuarios[i].t_inactividad, &usuarios[i].t_latido, &usuarios[i].t_cierre,
+                             &usuarios[i].t_plazo[CARRIL_GENERAL], &usuarios[i].t_plazo[CARRIL_LECTURAS]};
+    for (size_t k = 0; k < sizeof(todos) / sizeof(todos[0]); k++) {
+        cancelar_temporizador(todos[k]);
+        todos[k]->slot = i;
+    }
+    usuarios[i].t_inactividad.accion = vencer_inactividad;
+    usuarios[i].t_latido.accion = comprobar_latido;
+    usuarios[i].t_cierre.accion = cerrar_tras_eof;
+    usuarios[i].t_plazo[CARRIL_GENERAL].accion = vencer_plazo_peticiones;
+    usuarios[i].t_plazo[CARRIL_GENERAL].dato = CARRIL_GENERAL;
+    usuarios[i].t_plazo[CARRIL_LECTURAS].accion = vencer_plazo_peticiones;
+    usuarios[i].t_plazo[CARRIL_LECTURAS].dato = CARRIL_LECTURAS;
+
+    if (cfg->sesion_inactiva_segundos > 0) {
+        programar_temporizador(&usuarios[i].t_inactividad, cfg->sesion_inactiva_segundos * 1000LL);
+    }
+    programar_temporizador(&usuarios[i].t_latido, cfg->latido_segundos * 1000LL);
+}
+
+#define PERIODO_MANTENIMIENTO_MS 3000
+
+// Recoge los procesos lanzadores de terminal que ya terminaron y avisa de que el banco sigue activo
+static void mantenimiento_periodico(Temporizador *t) {
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+    }
+    printf("Banco activo - Esperando mensajes de usuarios o nuevas conexiones...\n");
+    programar_temporizador(t, PERIODO_MANTENIMIENTO_MS);
+}
+
+Temporizador t_mantenimiento = {NULL, NULL, 0, mantenimiento_periodico, -1, 0};
+
+// Las consultas de solo lectura son baratas y van al carril prioritario si está activado
+static int es_peticion_lectura(const char *linea) {
+    if (strstr(linea, "MOVIMIENTOS:") != NULL || strstr(linea, "SALDOS:") != NULL) return 1;
+    if (strstr(linea, "TX:") != NULL || strstr(linea, "Depósito de ") != NULL ||
+        strstr(linea, "Retiro de ") != NULL) return 0;
+    return strstr(linea, "saldo") != NULL;
+}
+
+// Peso DRR de una cuenta según PESOS_CUENTAS (1 si no aparece)
+int peso_cuenta(int cuenta) {
+    const Config *cfg = configuracion();
+    for (int i = 0; i < cfg->num_pesos; i++) {
+        if (cfg->pesos[i].cuenta == cuenta) return cfg->pesos[i].peso;
+    }
+    return 1;
+}
+
+static int cola_llena(const ColaPeticiones *cola) {
+    return cola->num == MAX_PETICIONES_SESION;
+}
+
+// Indica si el usuario puede aceptar más entrada: hay hueco en el buffer y en las colas
+int puede_leer_usuario(int i) {
+    return usuarios[i].entrada_usados < sizeof(usuarios[i].entrada) - 1 &&
+           !cola_llena(&usuarios[i].colas[CARRIL_GENERAL]) &&
+           !cola_llena(&usuarios[i].colas[CARRIL_LECTURAS]);
+}
+
+#define MAX_CUBOS_CUENTAS 64
+
+// Cubo de tokens: se rellena a "tasa" tokens por segundo hasta "rafaga"
+typedef struct {
+    double tokens;
+    int64_t ultimo_ms;
+} CuboTokens;
+
+typedef struct {
+    int cuenta;              // 0 = entrada libre
+    CuboTokens cubo;
+} CuboCuenta;
+
+// Sólo el hilo principal admite peticiones, así que los cubos no necesitan cerrojo
+static CuboCuenta cubos_cuentas[MAX_CUBOS_CUENTAS];
+static CuboTokens cubo_global;
+
+// Contadores que consulta el socket de administración (sólo los toca el hilo principal)
+typedef struct {
+    int64_t arranque_ms;
+    unsigned long peticiones_atendidas;
+    unsigned long peticiones_rechazadas;  // Por el control de admisión
+    unsigned long sesiones_aceptadas;
+} EstadisticasBanco;
+
+EstadisticasBanco estadisticas = {0, 0, 0, 0};
+
+// Rellena el cubo hasta el instante "ahora"; un cubo sin estrenar empieza lleno
+static void rellenar_cubo(CuboTokens *cubo, double tasa, int rafaga, int64_t ahora) {
+    if (cubo->ultimo_ms == 0) {
+        cubo->tokens = rafaga;
+    } else {
+        cubo->tokens += tasa * (ahora - cubo->ultimo_ms) / 1000.0;
+        if (cubo->tokens > rafaga) cubo->tokens = rafaga;
+    }
+    cubo->ultimo_ms = ahora;
+}
+
+// Milisegundos hasta que el cubo tenga un token
+static int espera_token_ms(const CuboTokens *cubo, double tasa) {
+    return (int)((1.0 - cubo->tokens) * 1000.0 / tasa) + 1;
+}
+
+// Devuelve el cubo de la cuenta; reutiliza entradas que ya se habrían rellenado del todo
+static CuboTokens *cubo_de_cuenta(int cuenta, int64_t ahora) {
+    const Config *cfg = configuracion();
+    CuboCuenta *libre = NULL;
+    for (int i = 0; i < MAX_CUBOS_CUENTAS; i++) {
+        CuboCuenta *c = &cubos_cuentas[i];
+        if (c->cuenta == cuenta) return &c->cubo;
+        if (libre == NULL && (c->cuenta == 0 ||
+            c->cubo.tokens + cfg->tasa_cuenta * (ahora - c->cubo.ultimo_ms) / 1000.0 >= cfg->rafaga_cuenta)) {
+            libre = c;
+        }
+    }
+    if (libre == NULL) return NULL;
+    libre->cuenta = cuenta;
+    memset(&libre->cubo, 0, sizeof(CuboTokens));
+    return &libre->cubo;
+}
+
+// Peticiones en cola de todas las sesiones y antigüedad de la más vieja
+static int estado_colas(int64_t ahora, int64_t *espera_max_ms) {
+    int total = 0;
+    *espera_max_ms = 0;
+    for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) {
+        for (int carril = 0; carril < 2; carril++) {
+            ColaPeticiones *cola = &usuarios[i].colas[carril];
+            if (cola->num == 0) continue;
+            total += cola->num;
+            int64_t espera = ahora - cola->peticiones[cola->inicio].llegada_ms;
+            if (espera > *espera_max_ms) *espera_max_ms = espera;
+        }
+    }
+    return total;
+}
+
+/// @brief Control de admisión de una petición nueva del slot i.
+///        Rechaza si las colas están por encima de MAX_COLA_GLOBAL o MAX_ESPERA_COLA_MS,
+///        o si el cubo de la cuenta o el global no tienen tokens.
+/// @return 0 si se admite, o los milisegundos tras los que conviene reintentar
+int admitir_peticion(int i, int64_t ahora) {
+    const Config *cfg = configuracion();
+    int64_t espera_max;
+    int en_cola = estado_colas(ahora, &espera_max);
+
+    if (cfg->max_cola_global > 0 && en_cola >= cfg->max_cola_global) {
+        return espera_max > 0 ? (int)espera_max : 100;
+    }
+    if (cfg->max_espera_cola_ms > 0 && espera_max > cfg->max_espera_cola_ms) {
+        return (int)espera_max;
+    }
+
+    CuboTokens *cubo_cuenta = NULL;
+    if (cfg->tasa_cuenta > 0) {
+        cubo_cuenta = cubo_de_cuenta(usuarios[i].cuenta, ahora);
+        if (cubo_cuenta == NULL) return 1000;
+        rellenar_cubo(cubo_cuenta, cfg->tasa_cuenta, cfg->rafaga_cuenta, ahora);
+        if (cubo_cuenta->tokens < 1.0) return espera_token_ms(cubo_cuenta, cfg->tasa_cuenta);
+    }
+    if (cfg->tasa_global > 0) {
+        rellenar_cubo(&cubo_global, cfg->tasa_global, cfg->rafaga_global, ahora);
+        if (cubo_global.tokens < 1.0) return espera_token_ms(&cubo_global, cfg->tasa_global);
+        cubo_global.tokens -= 1.0;
+    }
+    if (cubo_cuenta != NULL) cubo_cuenta->tokens -= 1.0;
+    return 0;
+}
+
+// Registra en la captura una línea recibida del slot i; la primera de la sesión la numera
+static void capturar_linea(int i, const char *linea, size_t largo) {
+    InfoUsuario *u = &usuarios[i];
+    while (largo > 0 && (linea[largo - 1] == '\n' || linea[largo - 1] == '\r')) largo--;
+    uint32_t sesion = atomic_load_explicit(&u->sesion_trafico, memory_order_relaxed);
+    if (sesion == 0) {
+        sesion = iniciar_sesion_trafico();
+        atomic_store_explicit(&u->sesion_trafico, sesion, memory_order_relaxed);
+        if (strstr(linea, "ha iniciado sesión") != NULL) {
+            registrar_trafico(sesion, TRAFICO_INICIO, linea, largo);
+            return;
+        }
+        // La sesión ya estaba abierta al empezar la captura: se reconstruye su mensaje de inicio
+        char inicio[96];
+        int n = snprintf(inicio, sizeof(inicio), "Usuario con cuenta %d ha iniciado sesión.", u->cuenta);
+        registrar_trafico(sesion, TRAFICO_INICIO, inicio, (size_t)n);
+    }
+    registrar_trafico(sesion, TRAFICO_PETICION, linea, largo);
+}
+
+/// @brief Pasa las líneas completas del buffer de entrada a las colas de la sesión.
+///        Se detiene si la cola de destino está llena; el resto queda en el buffer.
+///        Las peticiones que no pasan el control de admisión se responden al momento
+///        con [SOBRECARGA:reintentar_ms=N] en lugar de encolarse.
+void extraer_peticiones(int i) {
+    InfoUsuario *u = &usuarios[i];
+    while (u->entrada_usados > 0) {
+        char *salto = memchr(u->entrada, '\n', u->entrada_usados);
+        size_t largo;
+        if (salto != NULL) {
+            largo = salto - u->entrada + 1;
+        } else if (u->entrada_usados >= sizeof(u->entrada) - 1 || u->fifo_lectura_fd <= 0) {
+            largo = u->entrada_usados;  // Línea demasiado larga o sin terminar al cerrar el FIFO
+        } else {
+            return;
+        }
+
+        Peticion p;
+        size_t copiar = largo < sizeof(p.linea) - 1 ? largo : sizeof(p.linea) - 1;
+        memcpy(p.linea, u->entrada, copiar);
+        p.linea[copiar] = '\0';
+
+        if (copiar > 1 || p.linea[0] != '\n') {
+            int carril = configuracion()->prioridad_lecturas && es_peticion_lectura(p.linea) ? CARRIL_LECTURAS
+                                                                                            : CARRIL_GENERAL;
+            ColaPeticiones *cola = &u->colas[carril];
+            if (cola_llena(cola)) return;
+            if (capturando_trafico()) capturar_linea(i, p.linea, copiar);
+
+            int64_t ahora = reloj_ms();
+            int reintentar_ms = admitir_peticion(i, ahora);
+            if (reintentar_ms > 0) {
+                char respuesta[64];
+                snprintf(respuesta, sizeof(respuesta), "[SOBRECARGA:reintentar_ms=%d]", reintentar_ms);
+                debug_log("⚠️ Petición de cuenta %d rechazada por sobrecarga (reintentar en %d ms)",
+                          u->cuenta, reintentar_ms);
+                enviar_respuesta_usuario(i, respuesta);
+                estadisticas.peticiones_rechazadas++;
+            } else {
+                p.coste = es_peticion_lectura(p.linea) ? COSTE_LECTURA : COSTE_ESCRITURA;
+                p.llegada_ms = ahora;
+                p.traza = traza_muestrear() ? atomic_fetch_add(&siguiente_peticion_traza, 1) : 0;
+                p.llegada_traza = tramo_inicio(p.traza != 0);
+                cola->peticiones[(cola->inicio + cola->num) % MAX_PETICIONES_SESION] = p;
+                cola->num++;
+                if (cola->num == 1) armar_plazo_cola(i, carril);
+            }
+        }
+
+        memmove(u->entrada, u->entrada + largo, u->entrada_usados - largo);
+        u->entrada_usados -= largo;
+    }
+}
+
+int hay_peticiones_pendientes() {
+    for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) {
+        if (usuarios[i].colas[CARRIL_GENERAL].num > 0 || usuarios[i].colas[CARRIL_LECTURAS].num > 0) return 1;
+    }
+    return 0;
+}
+
+/// @brief Separa el prefijo "ID:<clave>|" de una petición.
+/// @return Puntero al mensaje sin el prefijo; clave queda vacía si no había
+static char *separar_clave_idempotencia(char *linea, char *clave, size_t tam) {
+    clave[0] = '\0';
+    if (strncmp(linea, "ID:", 3) != 0) return linea;
+    char *fin = strchr(linea + 3, '|');
+    if (fin == NULL || fin == linea + 3 || (size_t)(fin - linea - 3) >= tam) return linea;
+    memcpy(clave, linea + 3, fin - linea - 3);
+    clave[fin - linea - 3] = '\0';
+    return fin + 1;
+}
+
+/// @brief Atiende una petición sacada de la cola. Las escrituras con clave de idempotencia
+///        se ejecutan una sola vez: su respuesta se guarda en la caché de la cuenta y una
+///        repetición con la misma clave recibe esa respuesta sin volver a ejecutarse.
+void atender_peticion(int i, char *linea) {
+    char clave[MAX_CLAVE_IDEMPOTENCIA];
+    char *mensaje = separar_clave_idempotencia(linea, clave, sizeof(clave));
+    CuentaAlmacen *c = clave[0] != '\0' ? buscar_cuenta_almacen(usuarios[i].cuenta) : NULL;
+    usuarios[i].clave_actual[0] = '\0';
+    usuarios[i].respuesta_diferida = 0;
+    estadisticas.peticiones_atendidas++;
+
+    // Las consultas no cambian nada: repetirlas es inofensivo
+    if (c == NULL || es_peticion_lectura(mensaje)) {
+        procesar_mensaje_usuario(i, mensaje, strlen(mensaje));
+        return;
+    }
+
+    const EntradaIdempotencia *previa = buscar_idempotencia(c, clave);
+    if (previa != NULL && previa->largo == 0) {
+        // Sigue en curso (transferencia entre shards): la respuesta llegará con la decisión
+        debug_log("🔁 Petición repetida de cuenta %d con clave %s todavía en curso", usuarios[i].cuenta, clave);
+        return;
+    }
+    if (previa != NULL) {
+        debug_log("🔁 Petición repetida de cuenta %d con clave %s: se reenvía la respuesta guardada",
+                  usuarios[i].cuenta, clave);
+        registrar_log("Usuario (Cuenta %d): petición repetida con clave %s", usuarios[i].cuenta, clave);
+        encolar_salida(i, usuarios[i].generacion, previa->respuesta, previa->largo);
+        return;
+    }
+
+    usuarios[i].capturando = 1;
+    usuarios[i].captura_usada = 0;
+    snprintf(usuarios[i].clave_actual, sizeof(usuarios[i].clave_actual), "%s", clave);
+    procesar_mensaje_usuario(i, mensaje, strlen(mensaje));
+    if (usuarios[i].pid == 0) return;   // La sesión se cerró mientras se atendía
+    if (usuarios[i].respuesta_diferida) {
+        // Se guarda la clave sin respuesta para que un reenvío no inicie otra transferencia
+        usuarios[i].capturando = 0;
+        guardar_idempotencia(c, clave, "", 0);
+        return;
+    }
+    if (usuarios[i].captura_usada == 0) {
+        char respuesta[MAX_CLAVE_IDEMPOTENCIA + 32];
+        snprintf(respuesta, sizeof(respuesta), "[ID:%s:RECIBIDO]", clave);
+        enviar_respuesta_usuario(i, respuesta);
+    }
+    usuarios[i].capturando = 0;
+    guardar_idempotencia(c, clave, usuarios[i].captura, usuarios[i].captura_usada);
+}
+
+/// @brief Una ronda de deficit round robin sobre un carril. Cada sesión con peticiones
+///        recibe QUANTUM_DRR * peso de crédito y atiende peticiones mientras le alcance.
+///        La ronda empieza cada vez en un slot distinto para no favorecer los primeros.
+static void ronda_drr(int carril) {
+    static int inicio_ronda[2] = {0, 0};
+
+    for (int k = 0; k < MAX_USUARIOS_SIMULTANEOS; k++) {
+        int i = (inicio_ronda[carril] + k) % MAX_USUARIOS_SIMULTANEOS;
+        ColaPeticiones *cola = &usuarios[i].colas[carril];
+        if (usuarios[i].pid == 0 || cola->num == 0) {
+            cola->deficit = 0;
+            continue;
+        }
+
+        cola->deficit += configuracion()->quantum_drr * usuarios[i].peso;
+        while (cola->num > 0 && cola->peticiones[cola->inicio].coste <= cola->deficit && usuarios[i].pid != 0) {
+            Peticion p = cola->peticiones[cola->inicio];
+            cola->inicio = (cola->inicio + 1) % MAX_PETICIONES_SESION;
+            cola->num--;
+            cola->deficit -= p.coste;
+            peticion_trazada = p.traza;
+            if (p.traza != 0) traza_registrar("espera_cola", p.llegada_traza, traza_reloj(), p.traza, i);
+            uint64_t tramo = tramo_inicio(p.traza != 0);
+            empezar_peticion();
+            atender_peticion(i, p.linea);
+            terminar_peticion();
+            tramo_fin("ejecutar", tramo, i);
+            peticion_trazada = 0;
+        }
+        if (cola->num == 0) cola->deficit = 0;
+        if (usuarios[i].pid != 0) {
+            armar_plazo_cola(i, carril);
+            extraer_peticiones(i);
+        }
+    }
+    inicio_ronda[carril] = (inicio_ronda[carril] + 1) % MAX_USUARIOS_SIMULTANEOS;
+}
+
+// Atiende primero el carril de lecturas (si está activado) y después el general
+void planificar_peticiones() {
+    if (configuracion()->prioridad_lecturas) ronda_drr(CARRIL_LECTURAS);
+    ronda_drr(CARRIL_GENERAL);
+}
+
+/// @brief Crea el archivo de cuentas del shard con las cuentas que le corresponden
+///        del archivo maestro. Si ya existe se deja como está: es el estado del shard.
+int preparar_archivo_shard(const char *ruta_maestro, const char *ruta_shard) {
+    if (access(ruta_shard, F_OK) == 0) return 0;
+
+    FILE *maestro = fopen(ruta_maestro, "rb");
+    if (maestro == NULL) {
+        printf("[ERROR] No se pudo abrir el archivo maestro de cuentas %s: %s\n", ruta_maestro, strerror(errno));
+        return -1;
+    }
+    char temporal[300];
+    snprintf(temporal, sizeof(temporal), "%s.tmp", ruta_shard);
+    FILE *destino = fopen(temporal, "wb");
+    if (destino == NULL) {
+        perror("Error al crear el archivo de cuentas del shard");
+        fclose(maestro);
+        return -1;
+    }
+
+    Cuenta c;
+    int copiadas = 0;
+    while (fread(&c, sizeof(Cuenta), 1, maestro) == 1) {
+        if (shard_de_cuenta(&configuracion()->shards, c.numero_cuenta) != shard_id) continue;
+        fwrite(&c, sizeof(Cuenta), 1, destino);
+        copiadas++;
+    }
+    fclose(maestro);
+    if (fclose(destino) != 0 || rename(temporal, ruta_shard) != 0) {
+        perror("Error al guardar el archivo de cuentas del shard");
+        unlink(temporal);
+        return -1;
+    }
+    debug_log("Shard %d: %d cuentas copiadas de %s a %s", shard_id, copiadas, ruta_maestro, ruta_shard);
+    return 0;
+}
+
+// Abre un socket Unix de escucha no bloqueante en la ruta indicada
+int abrir_socket_escucha(const char *ruta, int pendientes) {
+    struct sockaddr_un dir;
+    memset(&dir, 0, sizeof(dir));
+    dir.sun_family = AF_UNIX;
+    snprintf(dir.sun_path, sizeof(dir.sun_path), "%s", ruta);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(dir.sun_path);
+    if (bind(fd, (struct sockaddr *)&dir, sizeof(dir)) < 0 || listen(fd, pendientes) < 0) {
+        close(fd);
+        return -1;
+    }
+    debug_log("Escuchando en %s", dir.sun_path);
+    return fd;
+}
+
+// Abre el socket Unix por el que banco_router entrega las sesiones de este shard
+int abrir_socket_shard() {
+    char ruta[108];
+    ruta_socket_shard(&configuracion()->shards, shard_id, ruta, sizeof(ruta));
+    return abrir_socket_escucha(ruta, 64);
+}
+
+/// @brief Acepta una sesión llegada por el socket del shard. La cuenta se conoce con el
+///        primer mensaje ("Usuario con cuenta N ha iniciado sesión").
+void aceptar_sesion_socket() {
+    int fd = accept4(fd_escucha, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+
+    int slot = -1;
+    for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS && slot < 0; i++) {
+        if (usuarios[i].pid == 0) slot = i;
+    }
+    int fd_escritura = slot >= 0 ? dup(fd) : -1;
+    if (slot < 0 || fd_escritura < 0) {
+        const char *lleno = "[ERROR:No hay sesiones libres en el shard]\nFIN-MSG\n";
+        if (write(fd, lleno, strlen(lleno)) < 0) debug_log("No se pudo avisar del rechazo: %s", strerror(errno));
+        close(fd);
+        return;
+    }
+
+    struct ucred credenciales;
+    socklen_t largo = sizeof(credenciales);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credenciales, &largo) < 0) credenciales.pid = getpid();
+
+    usuarios[slot].pid = credenciales.pid;
+    usuarios[slot].es_socket = 1;
+    usuarios[slot].cuenta = 0;
+    usuarios[slot].peso = 1;
+    usuarios[slot].fifo_lectura_fd = fd;
+    registrar_conexion_socket(slot, fd_escritura);
+    iniciar_temporizadores_sesion(slot);
+    estadisticas.sesiones_aceptadas++;
+    debug_log("Nueva sesión por socket en el slot %d (PID remoto %d)", slot, (int)credenciales.pid);
+}
+
+/// @brief Asigna la cuenta a una sesión por socket a partir de su mensaje de inicio.
+/// @return 0 si la cuenta es de este shard, -1 si hay que rechazarla
+int identificar_sesion_socket(int slot, const char *mensaje) {
+    const char *p = strstr(mensaje, "Usuario con cuenta ");
+    int cuenta;
+    if (p == NULL || sscanf(p, "Usuario con cuenta %d", &cuenta) != 1) return -1;
+    if (modo_shard && shard_de_cuenta(&configuracion()->shards, cuenta) != shard_id) {
+        char respuesta[96];
+        snprintf(respuesta, sizeof(respuesta), "[ERROR:La cuenta %d no pertenece al shard %d]", cuenta, shard_id);
+        enviar_respuesta_usuario(slot, respuesta);
+        return -1;
+    }
+    usuarios[slot].cuenta = cuenta;
+    usuarios[slot].peso = peso_cuenta(cuenta);
+    printf("Usuario con cuenta %d conectado por socket (slot %d)\n", cuenta, slot);
+    registrar_log("Usuario conectado: Cuenta %d (socket, PID remoto %d)", cuenta, usuarios[slot].pid);
+    return 0;
+}
+
+#define MAX_TRANSFERENCIAS_2PC 256
+#define MAX_CONEXIONES_2PC (2 * MAX_SHARDS)
+#define TAM_BUFFER_2PC (16 * 1024)
+#define MAX_ID_2PC 40
+
+#define ROL_COORDINADOR 0
+#define ROL_PARTICIPANTE 1
+
+#define FASE_PREPARADA 0    // Coordinador: esperando el voto. Participante: esperando la decisión
+#define FASE_CONFIRMADA 1   // Coordinador: decidida, esperando el ACK del participante
+#define FASE_ABORTADA 2
+
+// Transferencia entre una cuenta de este shard y una de otro, todavía sin terminar
+typedef struct {
+    int activa;
+    char id[MAX_ID_2PC];     // "<shard coordinador>-<arranque>.<pid>-<n>", único entre reinicios
+    int rol;
+    int fase;
+    int cuenta;              // Cuenta de este shard
+    double monto;            // El coordinador lo retira de su cuenta y el participante lo ingresa
+    int shard_remoto;        // El otro extremo: participante o coordinador
+    int cuenta_remota;
+    int aplicada;            // El cambio de saldo local ya se aplicó
+    int recuperada;          // Reconstruida del log al arrancar: puede estar aplicada sin APLICADO
+    int64_t preparada;       // Instante del PREPARADO
+    int slot;                // Sesión que espera la respuesta (sólo coordinador, -1 si ninguna)
+    unsigned int generacion;
+    char clave[MAX_CLAVE_IDEMPOTENCIA];
+    char respuesta[192];     // Respuesta decidida que espera al fdatasync del lote ("" si ninguna)
+    Temporizador plazo;      // Voto que no llega, decisión sin ACK o duda por resolver
+} Transferencia2PC;
+
+// Conexión con otro shard. Por las salientes este shard envía PREPARAR, CONFIRMAR,
+// ABORTAR y ESTADO y recibe las respuestas; por las entrantes llegan las de los demás.
+typedef struct {
+    int fd;                  // -1 si está libre
+    int shard;               // Shard al que se conectó (salientes), -1 en las entrantes
+    char entrada[TAM_BUFFER_2PC];
+    size_t entrada_usados;
+    char salida[TAM_BUFFER_2PC];
+    size_t salida_usados;
+} ConexionShard;
+
+Transferencia2PC transferencias[MAX_TRANSFERENCIAS_2PC];
+ConexionShard conexiones_2pc[MAX_CONEXIONES_2PC];
+int fd_escucha_2pc = -1;
+int sincronizar_log_2pc = 0;            // Hay registros que deben llegar a disco antes de enviar
+unsigned long registros_2pc = 0;
+unsigned long sincronizaciones_2pc = 0;
+
+static void vencer_plazo_2pc(Temporizador *t);
+static void entregar_respuestas_2pc();
+
+void iniciar_2pc() {
+    for (int k = 0; k < MAX_CONEXIONES_2PC; k++) conexiones_2pc[k].fd = -1;
+    for (int k = 0; k < MAX_TRANSFERENCIAS_2PC; k++) {
+        Temporizador plazo = {NULL, NULL, 0, vencer_plazo_2pc, k, 0};
+        transferencias[k].plazo = plazo;
+    }
+}
+
+static void ruta_socket_2pc(int shard, char *ruta, size_t tam) {
+    char base[100];
+    ruta_socket_shard(&configuracion()->shards, shard, base, sizeof(base));
+    snprintf(ruta, tam, "%s.2pc", base);
+}
+
+// Abre el socket por el que los demás shards envían las órdenes del commit en dos fases
+int abrir_socket_2pc() {
+    char ruta[108];
+    ruta_socket_2pc(shard_id, ruta, sizeof(ruta));
+    return abrir_socket_escucha(ruta, MAX_CONEXIONES_2PC);
+}
+
+static ConexionShard *conexion_libre_2pc() {
+    for (int k = 0; k < MAX_CONEXIONES_2PC; k++) {
+        if (conexiones_2pc[k].fd < 0) {
+            conexiones_2pc[k].entrada_usados = 0;
+            conexiones_2pc[k].salida_usados = 0;
+            return &conexiones_2pc[k];
+        }
+    }
+    return NULL;
+}
+
+static void cerrar_conexion_2pc(ConexionShard *c) {
+    close(c->fd);
+    c->fd = -1;
+    c->shard = -1;
+    c->entrada_usados = 0;
+    c->salida_usados = 0;
+}
+
+void aceptar_conexion_2pc() {
+    int fd = accept4(fd_escucha_2pc, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+    ConexionShard *c = conexion_libre_2pc();
+    if (c == NULL) {
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    c->shard = -1;
+}
+
+// Conexión saliente hacia el shard; se abre la primera vez que hace falta
+static ConexionShard *conexion_hacia_shard(int shard) {
+    for (int k = 0; k < MAX_CONEXIONES_2PC; k++) {
+        if (conexiones_2pc[k].fd >= 0 && conexiones_2pc[k].shard == shard) return &conexiones_2pc[k];
+    }
+    ConexionShard *c = conexion_libre_2pc();
+    if (c == NULL) return NULL;
+
+    struct sockaddr_un dir;
+    memset(&dir, 0, sizeof(dir));
+    dir.sun_family = AF_UNIX;
+    ruta_socket_2pc(shard, dir.sun_path, sizeof(dir.sun_path));
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return NULL;
+    if (connect(fd, (struct sockaddr *)&dir, sizeof(dir)) < 0) {
+        debug_log("❌ No se pudo conectar con el shard %d (%s): %s", shard, dir.sun_path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    c->fd = fd;
+    c->shard = shard;
+    return c;
+}
+
+/// @brief Lleva a disco los registros pendientes del log con un único fdatasync y después
+///        envía todo lo acumulado para los demás shards y las respuestas retenidas de las
+///        sesiones. Los votos y decisiones de una vuelta del bucle salen juntos, así que una
+///        sincronización cubre el lote entero. Si falla, no sale nada y se reintenta en la próxima.
+void enviar_lote_2pc() {
+    if (sincronizar_log_2pc) {
+        uint64_t tramo = tramo_inicio(traza_activa());
+        vaciar_log();
+        int fallo = fdatasync(fileno(log_file)) < 0;
+        tramo_fin("fdatasync", tramo, 0);
+        if (fallo) {
+            perror("fdatasync del log");
+            return;
+        }
+        sincronizar_log_2pc = 0;
+        sincronizaciones_2pc++;
+        entregar_respuestas_2pc();
+    }
+    for (int k = 0; k < MAX_CONEXIONES_2PC; k++) {
+        ConexionShard *c = &conexiones_2pc[k];
+        if (c->fd < 0 || c->salida_usados == 0) continue;
+        ssize_t n = write(c->fd, c->salida, c->salida_usados);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) cerrar_conexion_2pc(c);
+            continue;
+        }
+        memmove(c->salida, c->salida + n, c->salida_usados - n);
+        c->salida_usados -= n;
+    }
+}
+
+// Añade una orden o respuesta al buffer de la conexión; sale en el próximo lote
+static void enviar_a_shard(ConexionShard *c, const char *formato, ...) {
+    char linea[160];
+    va_list args;
+    va_start(args, formato);
+    int largo = vsnprintf(linea, sizeof(linea), formato, args);
+    va_end(args);
+    if (largo <= 0 || largo >= (int)sizeof(linea)) return;
+
+    if (c->salida_usados + largo > sizeof(c->salida)) enviar_lote_2pc();
+    if (c->fd < 0 || c->salida_usados + largo > sizeof(c->salida)) {
+        debug_log("❌ Buffer hacia el shard lleno, se descarta: %s", linea);   // Los plazos lo reenviarán
+        return;
+    }
+    memcpy(c->salida + c->salida_usados, linea, largo);
+    c->salida_usados += largo;
+}
+
+static Transferencia2PC *buscar_transferencia(const char *id) {
+    for (int k = 0; k < MAX_TRANSFERENCIAS_2PC; k++) {
+        if (transferencias[k].activa && strcmp(transferencias[k].id, id) == 0) return &transferencias[k];
+    }
+    return NULL;
+}
+
+/// @brief Reserva una entrada para una transferencia. Sin id, se genera uno nuevo.
+static Transferencia2PC *nueva_transferencia(const char *id) {
+    static unsigned int contador = 0;
+    static time_t arranque = 0;
+    if (arranque == 0) arranque = time(NULL);
+
+    for (int k = 0; k < MAX_TRANSFERENCIAS_2PC; k++) {
+        Transferencia2PC *t = &transferencias[k];
+        if (t->activa) continue;
+        cancelar_temporizador(&t->plazo);
+        t->activa = 1;
+        if (id != NULL) {
+            snprintf(t->id, sizeof(t->id), "%s", id);
+        } else {
+            snprintf(t->id, sizeof(t->id), "%d-%ld.%d-%u", shard_id, (long)arranque, (int)getpid(), ++contador);
+        }
+        t->fase = FASE_PREPARADA;
+        t->aplicada = 0;
+        t->recuperada = 0;
+        t->preparada = time(NULL);
+        t->slot = -1;
+        t->clave[0] = '\0';
+        t->respuesta[0] = '\0';
+        return t;
+    }
+    return NULL;
+}
+
+static void liberar_transferencia(Transferencia2PC *t) {
+    cancelar_temporizador(&t->plazo);
+    t->activa = 0;
+}
+
+// Registros del commit en dos fases en el log de transacciones
+static void registrar_2pc(const Transferencia2PC *t, const char *estado) {
+    registros_2pc++;
+    if (strcmp(estado, "PREPARADO") == 0) {
+        registrar_log("2PC PREPARADO %s: cuenta %d, monto %.2f, rol %s, remota %d en shard %d",
+                      t->id, t->cuenta, t->monto, t->rol == ROL_COORDINADOR ? "coordinador" : "participante",
+                      t->cuenta_remota, t->shard_remoto);
+    } else {
+        registrar_log("2PC %s %s: cuenta %d", estado, t->id, t->cuenta);
+    }
+}
+
+static uint32_t huella_transferencia(const char *id) {
+    uint64_t h = hash_clave(id);
+    uint32_t huella = (uint32_t)(h ^ (h >> 32));
+    return huella != 0 ? huella : 1;
+}
+
+/// @brief Busca en el índice de movimientos un registro de la cuenta con la huella de la
+///        transferencia. El registro se escribe en el mismo COMMIT que cambia el saldo, así que
+///        una caída entre el COMMIT y el "2PC APLICADO" del log deja aquí la prueba de que se aplicó.
+/// @return 1 si el cambio de saldo ya está en el almacén, 0 si no
+static int transferencia_en_indice(const Transferencia2PC *t) {
+    CuentaAlmacen *c = buscar_cuenta_almacen(t->cuenta);
+    uint32_t huella = huella_transferencia(t->id);
+    RegistroIndice reg;
+    // La lista de la cuenta va del más reciente al más antiguo; nada anterior al PREPARADO puede aplicarla
+    for (int64_t p = c != NULL ? c->ultimo_indice : -1; p >= 0 && indice_movimientos_fd >= 0; p = reg.anterior) {
+        if (pread(indice_movimientos_fd, &reg, sizeof(reg), p) != sizeof(reg) || reg.instante < t->preparada) break;
+        if (reg.transferencia == huella && reg.cuenta == t->cuenta) return 1;
+    }
+    return 0;
+}
+
+// Aplica el cambio de saldo de la transferencia como una transacción de una escritura
+static void aplicar_transferencia_local(Transferencia2PC *t) {
+    Transaccion tx;
+    char error[128];
+    if (t->recuperada && transferencia_en_indice(t)) {
+        debug_log("Transferencia %s ya aplicada en la cuenta %d antes del reinicio", t->id, t->cuenta);
+        t->aplicada = 1;
+        registrar_2pc(t, "APLICADO");
+        return;
+    }
+    memset(&tx, 0, sizeof(tx));
+    tx.transferencia = huella_transferencia(t->id);
+    tx_sumar_delta(&tx, t->cuenta, t->rol == ROL_COORDINADOR ? -t->monto : t->monto, TX_OP_MOVER);
+    if (tx_commit(&tx, error, sizeof(error)) < 0) {
+        registrar_log("[ERROR] No se pudo aplicar la transferencia %s en la cuenta %d: %s", t->id, t->cuenta, error);
+        return;
+    }
+    t->aplicada = 1;
+    registrar_2pc(t, "APLICADO");
+}
+
+// Entrega la respuesta diferida a la sesión que pidió la transferencia
+static void responder_sesion_2pc(Transferencia2PC *t) {
+    Arena *a = arena_hilo();
+    size_t marca = arena_marca(a);
+    size_t largo;
+    char *mensaje = formatear_respuesta(&largo, "%s", t->respuesta);
+    if (mensaje != NULL) {
+        CuentaAlmacen *c = buscar_cuenta_almacen(t->cuenta);
+        if (t->clave[0] != '\0' && c != NULL) guardar_idempotencia(c, t->clave, mensaje, largo);
+        encolar_salida(t->slot, t->generacion, mensaje, largo);
+    }
+    arena_volver(a, marca);
+    t->slot = -1;
+    t->respuesta[0] = '\0';
+}
+
+// Tras el fdatasync del lote, las decisiones ya están en disco y sus respuestas pueden salir
+static void entregar_respuestas_2pc() {
+    for (int k = 0; k < MAX_TRANSFERENCIAS_2PC; k++) {
+        Transferencia2PC *t = &transferencias[k];
+        if (t->activa && t->respuesta[0] != '\0') responder_sesion_2pc(t);
+    }
+}
+
+/// @brief El coordinador decide. La decisión llega a disco (en el próximo lote) antes de
+///        que salgan la orden al participante y la respuesta al usuario.
+static void decidir_transferencia(Transferencia2PC *t, int confirmar, const char *motivo) {
+    CuentaAlmacen *c = buscar_cuenta_almacen(t->cuenta);
+    if (c != NULL) c->retenido -= t->monto;
+
+    // La respuesta queda retenida hasta que enviar_lote_2pc sincronice la decisión
+    if (confirmar) {
+        t->fase = FASE_CONFIRMADA;
+        registrar_2pc(t, "CONFIRMADO");
+        aplicar_transferencia_local(t);
+        if (t->slot >= 0) {
+            snprintf(t->respuesta, sizeof(t->respuesta), "[OK:Transferencia de %.2f a la cuenta %d confirmada]",
+                     t->monto, t->cuenta_remota);
+        }
+    } else {
+        t->fase = FASE_ABORTADA;
+        registrar_2pc(t, "ABORTADO");
+        if (t->slot >= 0) {
+            snprintf(t->respuesta, sizeof(t->respuesta), "[ERROR:Transferencia a la cuenta %d abortada: %s]",
+                     t->cuenta_remota, motivo);
+        }
+    }
+    sincronizar_log_2pc = 1;
+    debug_log("%s Transferencia %s %s", confirmar ? "✅" : "❌", t->id, confirmar ? "confirmada" : "abortada");
+
+    ConexionShard *conexion = conexion_hacia_shard(t->shard_remoto);
+    if (conexion != NULL) enviar_a_shard(conexion, "%s %s\n", confirmar ? "CONFIRMAR" : "ABORTAR", t->id);
+    programar_temporizador(&t->plazo, configuracion()->plazo_2pc_ms);
+}
+
+/// @brief Coordinador: retiene los fondos, registra el PREPARADO y pide el voto al shard
+///        dueño de la cuenta destino. La respuesta a la sesión llega con la decisión.
+/// @return 0 si la transferencia quedó en curso, -1 con el motivo en error
+int iniciar_transferencia_2pc(int slot, int origen, int destino, double monto, int shard_destino,
+                              char *error, size_t tam_error) {
+    const Config *cfg = configuracion();
+    CuentaAlmacen *c = buscar_cuenta_almacen(origen);
+    if (c == NULL) {
+        snprintf(error, tam_error, "La cuenta %d no existe", origen);
+        return -1;
+    }
+    if (monto <= 0 || (cfg->limite_transferencia > 0 && monto > cfg->limite_transferencia)) {
+        snprintf(error, tam_error, "Transferencia de %.2f fuera del límite (%d)", monto, cfg->limite_transferencia);
+        return -1;
+    }
+    if (c->datos.saldo - c->retenido < monto) {
+        snprintf(error, tam_error, "Saldo insuficiente en la cuenta %d", origen);
+        return -1;
+    }
+    ConexionShard *conexion = conexion_hacia_shard(shard_destino);
+    if (conexion == NULL) {
+        snprintf(error, tam_error, "El shard %d de la cuenta %d no está disponible", shard_destino, destino);
+        return -1;
+    }
+    Transferencia2PC *t = nueva_transferencia(NULL);
+    if (t == NULL) {
+        snprintf(error, tam_error, "Demasiadas transferencias entre shards en curso");
+        return -1;
+    }
+
+    t->rol = ROL_COORDINADOR;
+    t->cuenta = origen;
+    t->monto = monto;
+    t->shard_remoto = shard_destino;
+    t->cuenta_remota = destino;
+    t->slot = slot;
+    t->generacion = usuarios[slot].generacion;
+    snprintf(t->clave, sizeof(t->clave), "%s", usuarios[slot].clave_actual);
+    c->retenido += monto;
+
+    // Sin decisión registrada la transferencia se da por abortada, así que este
+    // PREPARADO no necesita llegar a disco antes de pedir el voto
+    registrar_2pc(t, "PREPARADO");
+    enviar_a_shard(conexion, "PREPARAR %s %d %.2f %d\n", t->id, destino, monto, origen);
+    programar_temporizador(&t->plazo, cfg->plazo_2pc_ms);
+    return 0;
+}
+
+// Participante: registra el PREPARADO (llega a disco antes del voto) y vota
+static void preparar_participante(ConexionShard *c, const char *id, int cuenta, double monto, int origen) {
+    const Config *cfg = configuracion();
+    if (buscar_transferencia(id) != NULL) {
+        enviar_a_shard(c, "VOTO %s SI\n", id);   // PREPARAR repetido: el voto ya está registrado
+        return;
+    }
+    CuentaAlmacen *destino = buscar_cuenta_almacen(cuenta);
+    Transferencia2PC *t = NULL;
+    const char *motivo = NULL;
+    if (destino == NULL || shard_de_cuenta(&cfg->shards, cuenta) != shard_id) {
+        motivo = "la cuenta destino no existe";
+    } else if (monto <= 0) {
+        motivo = "monto inválido";
+    } else if ((t = nueva_transferencia(id)) == NULL) {
+        motivo = "demasiadas transferencias en curso";
+    }
+    if (motivo != NULL) {
+        enviar_a_shard(c, "VOTO %s NO %s\n", id, motivo);
+        return;
+    }
+
+    t->rol = ROL_PARTICIPANTE;
+    t->cuenta = cuenta;
+    t->monto = monto;
+    t->shard_remoto = atoi(id);
+    t->cuenta_remota = origen;
+    registrar_2pc(t, "PREPARADO");
+    sincronizar_log_2pc = 1;
+    enviar_a_shard(c, "VOTO %s SI\n", id);
+    // Si la decisión no llega, se pregunta al coordinador
+    programar_temporizador(&t->plazo, 2LL * cfg->plazo_2pc_ms);
+}
+
+// Participante: aplica o descarta la transferencia según la decisión del coordinador
+static void resolver_participante(const char *id, int confirmar) {
+    Transferencia2PC *t = buscar_transferencia(id);
+    if (t == NULL || t->rol != ROL_PARTICIPANTE) return;   // Ya resuelta
+    if (confirmar) {
+        aplicar_transferencia_local(t);
+    } else {
+        registrar_2pc(t, "ABORTADO");
+    }
+    sincronizar_log_2pc = 1;
+    liberar_transferencia(t);
+}
+
+/// @brief Atiende una línea de otro shard. Órdenes (PREPARAR, CONFIRMAR, ABORTAR, ESTADO)
+///        y respuestas (VOTO, ACK, DECISION) comparten formato: "<orden> <id> [datos]".
+static void procesar_linea_2pc(ConexionShard *c, const char *linea) {
+    char orden[16], id[MAX_ID_2PC];
+    if (sscanf(linea, "%15s %39s", orden, id) != 2) return;
+    Transferencia2PC *t = buscar_transferencia(id);
+
+    if (strcmp(orden, "PREPARAR") == 0) {
+        int cuenta, origen;
+        double monto;
+        if (sscanf(linea, "PREPARAR %*s %d %lf %d", &cuenta, &monto, &origen) == 3) {
+            preparar_participante(c, id, cuenta, monto, origen);
+        }
+    } else if (strcmp(orden, "CONFIRMAR") == 0 || strcmp(orden, "ABORTAR") == 0) {
+        resolver_participante(id, orden[0] == 'C');
+        enviar_a_shard(c, "ACK %s\n", id);
+    } else if (strcmp(orden, "ESTADO") == 0) {
+        // Sin registro de la transferencia, se da por abortada
+        if (t == NULL || t->rol != ROL_COORDINADOR) {
+            enviar_a_shard(c, "DECISION %s ABORTAR\n", id);
+        } else if (t->fase != FASE_PREPARADA) {
+            enviar_a_shard(c, "DECISION %s %s\n", id, t->fase == FASE_CONFIRMADA ? "CONFIRMAR" : "ABORTAR");
+        }
+    } else if (strcmp(orden, "VOTO") == 0) {
+        if (t != NULL && t->rol == ROL_COORDINADOR && t->fase == FASE_PREPARADA) {
+            const char *resto = linea + strlen("VOTO ") + strlen(id);
+            int si = strncmp(resto, " SI", 3) == 0;
+            decidir_transferencia(t, si, si ? "" : (strlen(resto) > 4 ? resto + 4 : "voto negativo"));
+        }
+    } else if (strcmp(orden, "ACK") == 0) {
+        if (t != NULL && t->rol == ROL_COORDINADOR && t->fase != FASE_PREPARADA) {
+            registrar_2pc(t, "TERMINADO");
+            liberar_transferencia(t);
+        }
+    } else if (strcmp(orden, "DECISION") == 0) {
+        resolver_participante(id, strstr(linea, " CONFIRMAR") != NULL);
+    }
+}
+
+void atender_conexion_2pc(int k) {
+    ConexionShard *c = &conexiones_2pc[k];
+    ssize_t n = read(c->fd, c->entrada + c->entrada_usados, sizeof(c->entrada) - 1 - c->entrada_usados);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        cerrar_conexion_2pc(c);
+        return;
+    }
+    if (n < 0) return;
+    c->entrada_usados += n;
+    c->entrada[c->entrada_usados] = '\0';
+
+    // Todas las líneas leídas se atienden antes del próximo lote de envíos
+    char *inicio = c->entrada, *fin;
+    while ((fin = strchr(inicio, '\n')) != NULL) {
+        *fin = '\0';
+        procesar_linea_2pc(c, inicio);
+        if (c->fd < 0) return;
+        inicio = fin + 1;
+    }
+    c->entrada_usados -= inicio - c->entrada;
+    memmove(c->entrada, inicio, c->entrada_usados);
+    if (c->entrada_usados == sizeof(c->entrada) - 1) cerrar_conexion_2pc(c);   // Línea sin fin
+}
+
+// Vence el plazo de una transferencia: sin voto se aborta; si no, se reenvía la decisión o se pregunta
+static void vencer_plazo_2pc(Temporizador *tp) {
+    Transferencia2PC *t = &transferencias[tp->slot];
+    if (!t->activa) return;
+    if (t->rol == ROL_COORDINADOR && t->fase == FASE_PREPARADA) {
+        decidir_transferencia(t, 0, "el shard de destino no respondió a tiempo");
+        return;
+    }
+    ConexionShard *conexion = conexion_hacia_shard(t->shard_remoto);
+    if (conexion != NULL && t->rol == ROL_COORDINADOR) {
+        enviar_a_shard(conexion, "%s %s\n", t->fase == FASE_CONFIRMADA ? "CONFIRMAR" : "ABORTAR", t->id);
+    } else if (conexion != NULL) {
+        enviar_a_shard(conexion, "ESTADO %s\n", t->id);
+    }
+    programar_temporizador(tp, configuracion()->plazo_2pc_ms);
+}
+
+/// @brief Tras rotar el log, vuelve a escribir el estado de las transferencias en curso
+///        para que la recuperación, que sólo lee el log activo, las siga encontrando.
+void relanzar_registros_2pc() {
+    for (int k = 0; k < MAX_TRANSFERENCIAS_2PC; k++) {
+        Transferencia2PC *t = &transferencias[k];
+        if (!t->activa) continue;
+        registrar_2pc(t, "PREPARADO");
+        if (t->fase == FASE_CONFIRMADA) registrar_2pc(t, "CONFIRMADO");
+        if (t->fase == FASE_ABORTADA) registrar_2pc(t, "ABORTADO");
+        if (t->aplicada) registrar_2pc(t, "APLICADO");
+        sincronizar_log_2pc = 1;
+    }
+}
+
+/// @brief Reconstruye al arrancar las transferencias que quedaron a medias según el log.
+///        Coordinador sin decisión: se aborta, salvo que el débito ya esté en el índice, que
+///        prueba que se confirmó. Decisión sin ACK: se reenvía.
+///        Participante preparado sin decisión: se pregunta al coordinador.
+void recuperar_transferencias_2pc() {
+    FILE *log = fopen(estado_log.ruta, "r");
+    if (log == NULL) return;
+
+    char linea[1024];
+    while (fgets(linea, sizeof(linea), log)) {
+        const char *p = strstr(linea, "] 2PC ");
+        char estado[16], id[MAX_ID_2PC], rol[16];
+        if (p == NULL || sscanf(p, "] 2PC %15s %39[^:]", estado, id) != 2) continue;
+        Transferencia2PC *t = buscar_transferencia(id);
+
+        if (strcmp(estado, "PREPARADO") == 0) {
+            if (t != NULL) continue;   // Repetido tras una rotación
+            Transferencia2PC leida;
+            if (sscanf(p, "] 2PC PREPARADO %*[^:]: cuenta %d, monto %lf, rol %15[^,], remota %d en shard %d",
+                       &leida.cuenta, &leida.monto, rol, &leida.cuenta_remota, &leida.shard_remoto) != 5 ||
+                (t = nueva_transferencia(id)) == NULL) {
+                continue;
+            }
+            t->rol = strcmp(rol, "coordinador") == 0 ? ROL_COORDINADOR : ROL_PARTICIPANTE;
+            t->recuperada = 1;
+            if (instante_linea_log(linea) != 0) t->preparada = instante_linea_log(linea);
+            t->cuenta = leida.cuenta;
+            t->monto = leida.monto;
+            t->cuenta_remota = leida.cuenta_remota;
+            t->shard_remoto = leida.shard_remoto;
+            CuentaAlmacen *c = buscar_cuenta_almacen(t->cuenta);
+            if (t->rol == ROL_COORDINADOR && c != NULL) c->retenido += t->monto;
+        } else if (t == NULL) {
+            continue;
+        } else if (strcmp(estado, "CONFIRMADO") == 0 || strcmp(estado, "ABORTADO") == 0) {
+            CuentaAlmacen *c = buscar_cuenta_almacen(t->cuenta);
+            if (t->rol == ROL_COORDINADOR && t->fase == FASE_PREPARADA && c != NULL) c->retenido -= t->monto;
+            t->fase = estado[0] == 'C' ? FASE_CONFIRMADA : FASE_ABORTADA;
+            if (t->rol == ROL_PARTICIPANTE) liberar_transferencia(t);
+        } else if (strcmp(estado, "APLICADO") == 0) {
+            t->aplicada = 1;
+            if (t->rol == ROL_PARTICIPANTE) liberar_transferencia(t);
+        } else if (strcmp(estado, "TERMINADO") == 0) {
+            liberar_transferencia(t);
+        }
+    }
+    fclose(log);
+
+    int pendientes = 0;
+    for (int k = 0; k < MAX_TRANSFERENCIAS_2PC; k++) {
+        Transferencia2PC *t = &transferencias[k];
+        if (!t->activa) continue;
+        pendientes++;
+        if (t->rol == ROL_COORDINADOR && t->fase == FASE_PREPARADA) {
+            // El débito se aplica justo después de escribir el CONFIRMADO, que puede no haber
+            // llegado a disco. Si el índice ya lo tiene, la decisión fue confirmar y se reenvía.
+            if (transferencia_en_indice(t)) {
+                decidir_transferencia(t, 1, "");
+            } else {
+                decidir_transferencia(t, 0, "el coordinador se reinició antes de decidir");
+            }
+            continue;
+        }
+        if (t->rol == ROL_COORDINADOR && t->fase == FASE_CONFIRMADA && !t->aplicada) aplicar_transferencia_local(t);
+        programar_temporizador(&t->plazo, TICK_TEMPORIZADOR_MS);
+    }
+    if (pendientes > 0) {
+        printf("Shard %d: %d transferencias entre shards pendientes recuperadas del log\n", shard_id, pendientes);
+        registrar_log("Recuperación 2PC: %d transferencias pendientes", pendientes);
+    }
+}
+
+/// @brief Transferencia pedida desde el menú ("Transferencia de X desde la cuenta O a la cuenta D").
+///        Si las dos cuentas están en este banco es una transacción normal; si la destino es
+///        de otro shard, se coordina con él en dos fases y la respuesta llega con la decisión.
+/// @return 1 si el mensaje era una transferencia, 0 en otro caso
+int procesar_transferencia(int slot, const char *mensaje) {
+    OperacionTx op = {TX_OP_MOVER, 0, 0, 0.0};
+    const char *p = strstr(mensaje, "Transferencia de ");
+    if (p == NULL || sscanf(p, "Transferencia de %lf desde la cuenta %d a la cuenta %d",
+                            &op.monto, &op.origen, &op.destino) != 3) {
+        return 0;
+    }
+
+    char respuesta[192], error[128];
+    int shard_destino = modo_shard ? shard_de_cuenta(&configuracion()->shards, op.destino) : shard_id;
+    int resultado = -1;
+    if (op.origen != usuarios[slot].cuenta) {
+        snprintf(error, sizeof(error), "La cuenta %d no es la de la sesión", op.origen);
+    } else if (shard_destino < 0) {
+        snprintf(error, sizeof(error), "La cuenta %d no pertenece a ningún shard", op.destino);
+    } else if (shard_destino != shard_id) {
+        if (iniciar_transferencia_2pc(slot, op.origen, op.destino, op.monto, shard_destino, error, sizeof(error)) == 0) {
+            usuarios[slot].respuesta_diferida = 1;
+            return 1;
+        }
+    } else {
+        Transaccion tx;
+        memset(&tx, 0, sizeof(tx));
+        resultado = tx_agregar_operacion(&tx, &op, error, sizeof(error)) < 0 ? -1 : tx_commit(&tx, error, sizeof(error));
+    }
+
+    if (resultado < 0) {
+        debug_log("❌ Transferencia rechazada para cuenta %d: %s", op.origen, error);
+        registrar_log("[ERROR] Transferencia fallida para cuenta %d: %s", op.origen, error);
+        snprintf(respuesta, sizeof(respuesta), "[ERROR:%s]", error);
+    } else {
+        snprintf(respuesta, sizeof(respuesta), "[OK:Transferencia de %.2f a la cuenta %d aplicada]", op.monto, op.destino);
+    }
+    if (usuarios[slot].capturando) enviar_respuesta_usuario(slot, respuesta);
+    return 1;
+}
+
+// Estado de la réplica: movimientos del índice del primario ya aplicados
+typedef struct {
+    unsigned long aplicados;     // Movimientos aplicados desde el arranque
+    int fd_inotify;              // Avisa de cada escritura del primario en el índice
+    double retraso_ms;           // De la escritura del primario a su aplicación, en la última tanda
+} EstadoReplica;
+
+EstadoReplica replica = {0, -1, 0.0};
+
+static double ms_desde(const struct timespec *instante) {
+    struct timespec ahora;
+    clock_gettime(CLOCK_REALTIME, &ahora);
+    return (ahora.tv_sec - instante->tv_sec) * 1000.0 + (ahora.tv_nsec - instante->tv_nsec) / 1e6;
+}
+
+/// @brief Aplica los movimientos que el primario ha añadido al índice desde la última vez.
+///        Cada registro lleva el saldo resultante, así que se copia en lugar de sumar el delta:
+///        volver a aplicar un registro no cambia nada. Lo usan la réplica y el proceso que
+///        recibe un relevo para ponerse al día.
+/// @return número de movimientos aplicados
+int aplicar_indice_replica(int en_vivo) {
+    struct stat st;
+    if (indice_movimientos_fd < 0 || fstat(indice_movimientos_fd, &st) < 0) return 0;
+
+    RegistroIndice reg;
+    int aplicados = 0;
+    while (indice_aplicado + (int64_t)sizeof(reg) <= st.st_size &&
+           pread(indice_movimientos_fd, &reg, sizeof(reg), indice_aplicado) == sizeof(reg)) {
+        CuentaAlmacen *c = buscar_cuenta_almacen(reg.cuenta);
+        if (c != NULL && (c->movimientos != NULL ||
+                          (c->movimientos = reservar_memoria_ceros(1, sizeof(RingMovimientos))) != NULL)) {
+            Movimiento m = {reg.instante, reg.monto, reg.saldo, reg.desplazamiento_log, indice_aplicado, reg.anterior};
+            seqlock_escritura_inicio(&epoca_almacen);
+            seqlock_escritura_inicio(&c->version);
+            c->datos.saldo = (float)reg.saldo;
+            if (en_vivo) c->datos.num_transacciones++;   // El archivo cargado ya cuenta los anteriores
+            anadir_movimiento_ring(c, &m);
+            seqlock_escritura_fin(&c->version);
+            seqlock_escritura_fin(&epoca_almacen);
+            if (en_vivo) notificar_cambio_saldo(c);
+        }
+        indice_aplicado += sizeof(reg);
+        aplicados++;
+    }
+    if (aplicados > 0) {
+        replica.aplicados += aplicados;
+        replica.retraso_ms = ms_desde(&st.st_mtim);
+    }
+    return aplicados;
+}
+
+/// @brief Abre en sólo lectura el índice de movimientos del primario, aplica lo que contiene
+///        desde su punto de control y vigila con inotify las escrituras siguientes.
+/// @return 0 si se abrió, -1 si no
+int abrir_indice_replica(const PuntoIndice *punto) {
+    char ruta[300];
+    ruta_indice_movimientos(ruta, sizeof(ruta));
+    indice_movimientos_fd = open(ruta, O_RDONLY | O_CLOEXEC);
+    if (indice_movimientos_fd < 0) {
+        printf("[ERROR] No se pudo abrir el índice de movimientos del primario %s: %s\n", ruta, strerror(errno));
+        return -1;
+    }
+
+    replica.fd_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (replica.fd_inotify >= 0 && inotify_add_watch(replica.fd_inotify, ruta, IN_MODIFY) < 0) {
+        close(replica.fd_inotify);
+        replica.fd_inotify = -1;
+    }
+    if (replica.fd_inotify < 0) debug_log("Sin inotify: la réplica revisará el índice cada segundo");
+
+    aplicar_punto_indice(punto);
+    indice_aplicado = punto->posicion;
+    int cargados = aplicar_indice_replica(0);
+    printf("Réplica: %d movimientos aplicados desde %s (posición %lld)\n", cargados, ruta, (long long)punto->posicion);
+    return 0;
+}
+
+// Vacía los avisos de inotify y aplica lo nuevo del índice
+void atender_aviso_replica() {
+    char eventos[4096];
+    while (read(replica.fd_inotify, eventos, sizeof(eventos)) > 0) {
+    }
+    aplicar_indice_replica(1);
+}
+
+// Movimientos escritos por el primario que la réplica todavía no ha aplicado
+long movimientos_pendientes_replica() {
+    struct stat st;
+    if (indice_movimientos_fd < 0 || fstat(indice_movimientos_fd, &st) < 0) return 0;
+    return (long)((st.st_size - indice_aplicado) / (int64_t)sizeof(RegistroIndice));
+}
+
+#define PERIODO_REPLICA_MS 1000
+
+// Red de seguridad por si se pierde un aviso de inotify (o no hay inotify)
+static void revisar_indice_replica(Temporizador *t) {
+    if (aplicar_indice_replica(1) > 0 && replica.fd_inotify >= 0) {
+        debug_log("Réplica: movimientos aplicados sin aviso de inotify");
+    }
+    programar_temporizador(t, PERIODO_REPLICA_MS);
+}
+
+Temporizador t_replica = {NULL, NULL, 0, revisar_indice_replica, -1, 0};
+
+/// @brief En la réplica, rechaza las escrituras y responde a REPLICA:ESTADO con el retraso.
+/// @return 1 si el mensaje quedó atendido, 0 si se atiende como en el primario
+int procesar_mensaje_replica(int slot, const char *mensaje) {
+    char respuesta[160];
+    if (strstr(mensaje, "REPLICA:ESTADO") != NULL) {
+        long pendientes = movimientos_pendientes_replica();
+        snprintf(respuesta, sizeof(respuesta), "[REPLICA:aplicados=%lu:pendientes=%ld:retraso_ms=%.3f]",
+                 replica.aplicados, pendientes, replica.retraso_ms);
+    } else if (strstr(mensaje, "TX:") != NULL || strstr(mensaje, "Depósito de ") != NULL ||
+               strstr(mensaje, "Retiro de ") != NULL || strstr(mensaje, "Transferencia de ") != NULL) {
+        snprintf(respuesta, sizeof(respuesta), "[ERROR:Réplica de sólo lectura: envíe las escrituras al banco primario]");
+    } else {
+        return 0;
+    }
+    enviar_respuesta_usuario(slot, respuesta);
+    return 1;
+}
+
+#define VARIABLE_RELEVO "BANCO_RELEVO_FD"
+#define PLAZO_ARRANQUE_RELEVO_MS 30000   // Tiempo que tiene el binario nuevo para cargar el estado
+
+#define RELEVO_ESCUCHA 1        // fd: socket de sesiones del shard o de la réplica
+#define RELEVO_ESCUCHA_2PC 2    // fd: socket de transferencias entre shards
+#define RELEVO_SESION 3         // fds: lectura (si sigue abierta) y respuestas de la sesión
+#define RELEVO_IDEMPOTENCIA 4   // Carga: la caché de claves de idempotencia de la cuenta
+#define RELEVO_FIN 5
+#define RELEVO_ESCUCHA_ADMIN 6  // fd: socket de administración
+
+// Registro que el proceso saliente envía al nuevo por el canal del relevo. Los descriptores
+// viajan con SCM_RIGHTS y los bytes de la carga van justo detrás del registro.
+typedef struct {
+    int tipo;
+    int slot;
+    int num_fds;
+    pid_t pid;
+    int cuenta;
+    int es_socket;
+    int peso;
+    char fifo_lectura[100];
+    char fifo_escritura[100];
+    Transaccion transaccion;
+    int suscripciones[MAX_SUSCRIPCIONES];
+    int num_suscripciones;
+    size_t bytes_cola;           // Carga: peticiones en cola, una por línea...
+    size_t bytes_entrada;        // ...entrada aún sin formar una línea...
+    size_t bytes_salida;         // ...y respuestas aún sin enviar
+} RegistroRelevo;
+
+// Carga más grande de un registro: las dos colas llenas, la entrada y la salida de una sesión
+#define TAM_CARGA_RELEVO (2 * MAX_PETICIONES_SESION * BUFFER_SIZE + 2 * BUFFER_SIZE + TAM_BUFFER_SALIDA)
+
+// Relevo en curso hacia un binario nuevo (en el proceso saliente) o desde el anterior (en el nuevo)
+typedef struct {
+    int canal;                   // Socket con el otro proceso (-1 si no hay relevo)
+    pid_t pid_nuevo;
+    int listo;                   // El proceso nuevo ya cargó el estado y espera los descriptores
+    int completado;              // Los descriptores se entregaron: salir sin cerrar las sesiones
+    int64_t inicio_ms;           // Petición del relevo o, una vez listo, inicio del drenaje
+} EstadoRelevo;
+
+EstadoRelevo relevo = {-1, 0, 0, 0, 0};
+volatile sig_atomic_t relevo_solicitado = 0;
+char **argv_banco = NULL;        // Para volver a ejecutar el binario con los mismos argumentos
+
+void manejador_relevo(int sig) {
+    (void)sig;
+    relevo_solicitado = 1;
+}
+
+/// @brief Arranca el binario (ya actualizado) como hijo, con un extremo de un socketpair en
+///        BANCO_RELEVO_FD. Este proceso sigue atendiendo hasta que el nuevo avisa de que está listo.
+/// @return 0 si el proceso nuevo arrancó, -1 si no
+int iniciar_relevo() {
+    int extremos[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, extremos) < 0) {
+        perror("Error al crear el canal del relevo");
+        return -1;
+    }
+    fcntl(extremos[0], F_SETFD, FD_CLOEXEC);
+
+    // La variable se prepara antes del fork: en el hijo sólo se cierra y se ejecuta
+    char valor[16];
+    snprintf(valor, sizeof(valor), "%d", extremos[1]);
+    setenv(VARIABLE_RELEVO, valor, 1);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        for (int fd = 3; fd < 1024; fd++) {
+            if (fd != extremos[1]) close(fd);
+        }
+        execv(argv_banco[0], argv_banco);
+        execvp(argv_banco[0], argv_banco);
+        _exit(127);
+    }
+    unsetenv(VARIABLE_RELEVO);
+    close(extremos[1]);
+    if (pid < 0) {
+        perror("Error al arrancar el binario nuevo");
+        close(extremos[0]);
+        return -1;
+    }
+
+    relevo.canal = extremos[0];
+    relevo.pid_nuevo = pid;
+    relevo.listo = 0;
+    relevo.inicio_ms = reloj_ms();
+    printf("Relevo iniciado: arrancando %s (PID %d)\n", argv_banco[0], (int)pid);
+    registrar_log("Relevo iniciado hacia el PID %d", (int)pid);
+    return 0;
+}
+
+// El proceso nuevo falló o no contestó: se sigue como si no se hubiera pedido el relevo
+void cancelar_relevo(const char *motivo) {
+    printf("Relevo cancelado: %s\n", motivo);
+    registrar_log("Relevo cancelado: %s", motivo);
+    close(relevo.canal);
+    kill(relevo.pid_nuevo, SIGTERM);
+    waitpid(relevo.pid_nuevo, NULL, 0);
+    relevo.canal = -1;
+    relevo.listo = 0;
+}
+
+// Lee el aviso "LISTO" del proceso nuevo; el EOF significa que terminó sin llegar a estarlo
+void atender_canal_relevo() {
+    char aviso[16];
+    ssize_t n = read(relevo.canal, aviso, sizeof(aviso) - 1);
+    if (n <= 0) {
+        cancelar_relevo("el binario nuevo terminó antes de estar listo");
+        return;
+    }
+    aviso[n] = '\0';
+    if (strstr(aviso, "LISTO") != NULL && !relevo.listo) {
+        relevo.listo = 1;
+        relevo.inicio_ms = reloj_ms();
+        debug_log("🔁 Binario nuevo listo: se deja de leer a los usuarios y se drenan las peticiones");
+    }
+}
+
+// Sin peticiones en cola, transferencias entre shards abiertas ni órdenes a otros shards por enviar
+int relevo_drenado() {
+    if (hay_peticiones_pendientes()) return 0;
+    for (int k = 0; k < MAX_TRANSFERENCIAS_2PC; k++) {
+        if (transferencias[k].activa) return 0;
+    }
+    for (int k = 0; k < MAX_CONEXIONES_2PC; k++) {
+        if (conexiones_2pc[k].fd >= 0 && conexiones_2pc[k].salida_usados > 0) return 0;
+    }
+    return 1;
+}
+
+static int escribir_completo(int fd, const void *datos, size_t largo) {
+    const char *p = datos;
+    while (largo > 0) {
+        ssize_t n = write(fd, p, largo);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        largo -= n;
+    }
+    return 0;
+}
+
+static int leer_completo(int fd, void *datos, size_t largo) {
+    char *p = datos;
+    while (largo > 0) {
+        ssize_t n = read(fd, p, largo);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        largo -= n;
+    }
+    return 0;
+}
+
+static int enviar_registro_relevo(const RegistroRelevo *r, const int *fds, const void *carga, size_t largo) {
+    struct iovec parte = {(void *)r, sizeof(*r)};
+    union {
+        char buffer[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr alineacion;
+    } control;
+    struct msghdr mensaje = {0};
+    mensaje.msg_iov = &parte;
+    mensaje.msg_iovlen = 1;
+    if (r->num_fds > 0) {
+        mensaje.msg_control = control.buffer;
+        mensaje.msg_controllen = CMSG_SPACE(r->num_fds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mensaje);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(r->num_fds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, r->num_fds * sizeof(int));
+    }
+    if (sendmsg(relevo.canal, &mensaje, 0) != sizeof(*r)) return -1;
+    return largo > 0 ? escribir_completo(relevo.canal, carga, largo) : 0;
+}
+
+/// @brief Envía una sesión al proceso nuevo con las peticiones que sigan en cola (si venció
+///        PLAZO_RELEVO_MS antes de atenderlas), su entrada pendiente y sus respuestas sin
+///        enviar, sacadas del buffer circular en orden.
+static int enviar_sesion_relevo(int i) {
+    InfoUsuario *u = &usuarios[i];
+    RegistroRelevo r;
+    memset(&r, 0, sizeof(r));
+    r.tipo = RELEVO_SESION;
+    r.slot = i;
+    r.pid = u->pid;
+    r.cuenta = u->cuenta;
+    r.es_socket = u->es_socket;
+    r.peso = u->peso;
+    memcpy(r.fifo_lectura, u->fifo_lectura, sizeof(r.fifo_lectura));
+    memcpy(r.fifo_escritura, u->fifo_escritura, sizeof(r.fifo_escritura));
+    r.transaccion = u->transaccion;
+    memcpy(r.suscripciones, u->suscripciones, sizeof(r.suscripciones));
+    r.num_suscripciones = u->num_suscripciones;
+
+    // fds[0] es el de respuestas; el de lectura falta si el usuario ya cerró su extremo
+    int fds[2];
+    fds[r.num_fds++] = fd_conexion_usuario(i);
+    if (fds[0] < 0) return 0;
+    if (u->fifo_lectura_fd > 0) fds[r.num_fds++] = u->fifo_lectura_fd;
+
+    static char carga[TAM_CARGA_RELEVO];
+    for (int carril = CARRIL_GENERAL; carril <= CARRIL_LECTURAS; carril++) {
+        ColaPeticiones *cola = &u->colas[carril];
+        for (int k = 0; k < cola->num; k++) {
+            const char *linea = cola->peticiones[(cola->inicio + k) % MAX_PETICIONES_SESION].linea;
+            size_t largo = strcspn(linea, "\n");
+            memcpy(carga + r.bytes_cola, linea, largo);
+            carga[r.bytes_cola + largo] = '\n';
+            r.bytes_cola += largo + 1;
+        }
+    }
+    memcpy(carga + r.bytes_cola, u->entrada, u->entrada_usados);
+    r.bytes_entrada = u->entrada_usados;
+    size_t desde = r.bytes_cola + r.bytes_entrada;
+    BufferSalida *salida = &u->salida;
+    pthread_mutex_lock(&salida->mutex);
+    for (size_t k = 0; k < salida->usados; k++) {
+        carga[desde + k] = salida->datos[(salida->inicio + k) % TAM_BUFFER_SALIDA];
+    }
+    r.bytes_salida = salida->usados;
+    pthread_mutex_unlock(&salida->mutex);
+    return enviar_registro_relevo(&r, fds, carga, desde + r.bytes_salida);
+}
+
+/// @brief Entrega al proceso nuevo los sockets de escucha, las sesiones y las cachés de
+///        idempotencia. Las peticiones que sigan en cola viajan con su sesión; las consultas
+///        que aún tengan los hilos lectores terminan antes de copiar las respuestas pendientes.
+void completar_relevo() {
+    detener_hilos_lectores();
+    detener_operaciones_uring();
+    vaciar_log();
+
+    RegistroRelevo r;
+    memset(&r, 0, sizeof(r));
+    int ok = 0;
+    if (fd_escucha >= 0) {
+        r.tipo = RELEVO_ESCUCHA;
+        r.num_fds = 1;
+        ok |= enviar_registro_relevo(&r, &fd_escucha, NULL, 0);
+    }
+    if (fd_escucha_2pc >= 0) {
+        r.tipo = RELEVO_ESCUCHA_2PC;
+        r.num_fds = 1;
+        ok |= enviar_registro_relevo(&r, &fd_escucha_2pc, NULL, 0);
+    }
+    if (fd_escucha_admin >= 0) {
+        r.tipo = RELEVO_ESCUCHA_ADMIN;
+        r.num_fds = 1;
+        ok |= enviar_registro_relevo(&r, &fd_escucha_admin, NULL, 0);
+    }
+    int sesiones = 0;
+    for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS && ok == 0; i++) {
+        if (usuarios[i].pid == 0) continue;
+        ok |= enviar_sesion_relevo(i);
+        sesiones++;
+    }
+    for (int i = 0; i < almacen.num_cuentas && ok == 0; i++) {
+        if (almacen.cuentas[i].idempotencia == NULL) continue;
+        memset(&r, 0, sizeof(r));
+        r.tipo = RELEVO_IDEMPOTENCIA;
+        r.cuenta = almacen.cuentas[i].datos.numero_cuenta;
+        r.bytes_salida = sizeof(CacheIdempotencia);
+        ok |= enviar_registro_relevo(&r, NULL, almacen.cuentas[i].idempotencia, sizeof(CacheIdempotencia));
+    }
+    memset(&r, 0, sizeof(r));
+    r.tipo = RELEVO_FIN;
+    ok |= enviar_registro_relevo(&r, NULL, NULL, 0);
+    if (ok != 0) perror("Error al entregar el estado al binario nuevo");
+
+    close(relevo.canal);
+    relevo.canal = -1;
+    relevo.completado = 1;
+    continuar_ejecucion = 0;
+    printf("Relevo completado: %d sesiones entregadas al PID %d tras %d ms de drenaje\n",
+           sesiones, (int)relevo.pid_nuevo, (int)(reloj_ms() - relevo.inicio_ms));
+    registrar_log("Relevo completado: %d sesiones entregadas al PID %d", sesiones, (int)relevo.pid_nuevo);
+}
+
+// Recibe un registro del relevo con los descriptores que lo acompañan
+static int recibir_registro_relevo(RegistroRelevo *r, int *fds) {
+    struct iovec parte = {r, sizeof(*r)};
+    union {
+        char buffer[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr alineacion;
+    } control;
+    struct msghdr mensaje = {0};
+    mensaje.msg_iov = &parte;
+    mensaje.msg_iovlen = 1;
+    mensaje.msg_control = control.buffer;
+    mensaje.msg_controllen = sizeof(control.buffer);
+    if (recvmsg(relevo.canal, &mensaje, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(*r)) return -1;
+
+    int recibidos = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mensaje); cmsg != NULL; cmsg = CMSG_NXTHDR(&mensaje, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            recibidos = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), recibidos * sizeof(int));
+        }
+    }
+    return recibidos == r->num_fds ? 0 : -1;
+}
+
+// Reconstruye en el mismo slot una sesión recibida del proceso anterior
+static void restaurar_sesion_relevo(const RegistroRelevo *r, const int *fds, const char *carga) {
+    InfoUsuario *u = &usuarios[r->slot];
+    u->pid = r->pid;
+    u->cuenta = r->cuenta;
+    u->es_socket = r->es_socket;
+    u->peso = r->peso;
+    memcpy(u->fifo_lectura, r->fifo_lectura, sizeof(u->fifo_lectura));
+    memcpy(u->fifo_escritura, r->fifo_escritura, sizeof(u->fifo_escritura));
+    u->transaccion = r->transaccion;
+    u->fifo_lectura_fd = r->num_fds > 1 ? fds[1] : 0;
+    if (u->fifo_lectura_fd > 0) fcntl(u->fifo_lectura_fd, F_SETFL, fcntl(u->fifo_lectura_fd, F_GETFL) | O_NONBLOCK);
+    registrar_conexion_socket(r->slot, fds[0]);
+
+    for (int k = 0; k < r->num_suscripciones; k++) {
+        CuentaAlmacen *c = buscar_cuenta_almacen(r->suscripciones[k]);
+        if (c == NULL) continue;
+        c->suscriptores |= 1u << r->slot;
+        u->suscripciones[u->num_suscripciones++] = r->suscripciones[k];
+    }
+
+    iniciar_temporizadores_sesion(r->slot);
+
+    // Las peticiones ya admitidas por el proceso anterior vuelven a la cola sin pasar otra vez
+    // por el control de admisión; el plazo de cada una cuenta desde ahora
+    int64_t ahora = reloj_ms();
+    for (size_t k = 0; k < r->bytes_cola;) {
+        size_t largo = strcspn(carga + k, "\n") + 1;
+        Peticion p;
+        memset(&p, 0, sizeof(p));
+        size_t copiar = largo < sizeof(p.linea) - 1 ? largo : sizeof(p.linea) - 1;
+        memcpy(p.linea, carga + k, copiar);
+        k += largo;
+        int carril = configuracion()->prioridad_lecturas && es_peticion_lectura(p.linea) ? CARRIL_LECTURAS
+                                                                                        : CARRIL_GENERAL;
+        ColaPeticiones *cola = &u->colas[carril];
+        if (cola_llena(cola)) continue;
+        p.coste = es_peticion_lectura(p.linea) ? COSTE_LECTURA : COSTE_ESCRITURA;
+        p.llegada_ms = ahora;
+        cola->peticiones[(cola->inicio + cola->num) % MAX_PETICIONES_SESION] = p;
+        cola->num++;
+        if (cola->num == 1) armar_plazo_cola(r->slot, carril);
+    }
+
+    carga += r->bytes_cola;
+    memcpy(u->entrada, carga, r->bytes_entrada);
+    u->entrada_usados = r->bytes_entrada;
+    if (r->bytes_salida > 0) encolar_salida(r->slot, u->generacion, carga + r->bytes_entrada, r->bytes_salida);
+    if (u->fifo_lectura_fd == 0) programar_temporizador(&u->t_cierre, 0);
+    extraer_peticiones(r->slot);
+}
+
+/// @brief En el proceso nuevo: avisa al anterior de que el estado está cargado y recibe sus
+///        sockets y sesiones. Después se pone al día con lo que el anterior escribió mientras
+///        tanto: el archivo de cuentas proyectado ya tiene los saldos finales y el índice los
+///        movimientos que faltan en los rings.
+/// @return 0 si el relevo se completó, -1 si el proceso anterior no llegó a entregar el estado
+int recibir_relevo() {
+    int64_t inicio = reloj_ms();
+    if (escribir_completo(relevo.canal, "LISTO\n", 6) < 0) return -1;
+
+    static char carga[TAM_CARGA_RELEVO];
+    RegistroRelevo r;
+    int fds[2];
+    int sesiones = 0;
+    int resultado = -1;
+    while (recibir_registro_relevo(&r, fds) == 0) {
+        size_t largo = r.bytes_cola + r.bytes_entrada + r.bytes_salida;
+        if (largo > sizeof(carga) || (largo > 0 && leer_completo(relevo.canal, carga, largo) < 0)) break;
+        if (r.tipo == RELEVO_FIN) {
+            resultado = 0;
+            break;
+        } else if (r.tipo == RELEVO_ESCUCHA) {
+            fd_escucha = fds[0];
+        } else if (r.tipo == RELEVO_ESCUCHA_2PC) {
+            fd_escucha_2pc = fds[0];
+        } else if (r.tipo == RELEVO_ESCUCHA_ADMIN) {
+            fd_escucha_admin = fds[0];
+        } else if (r.tipo == RELEVO_SESION && r.slot >= 0 && r.slot < MAX_USUARIOS_SIMULTANEOS) {
+            restaurar_sesion_relevo(&r, fds, carga);
+            sesiones++;
+        } else if (r.tipo == RELEVO_IDEMPOTENCIA) {
+            CuentaAlmacen *c = buscar_cuenta_almacen(r.cuenta);
+            if (c != NULL && (c->idempotencia != NULL ||
+                              (c->idempotencia = reservar_memoria(sizeof(CacheIdempotencia))) != NULL)) {
+                memcpy(c->idempotencia, carga, sizeof(CacheIdempotencia));
+            }
+        }
+    }
+    close(relevo.canal);
+    relevo.canal = -1;
+    if (resultado < 0) return -1;
+
+    // Lo que el proceso anterior escribió desde que éste cargó el almacén
+    if (!modo_replica) {
+        aplicar_indice_replica(0);
+        for (int i = 0; i < almacen.num_cuentas && almacen.mapa != NULL; i++) {
+            CuentaAlmacen *c = &almacen.cuentas[i];
+            seqlock_escritura_inicio(&epoca_almacen);
+            seqlock_escritura_inicio(&c->version);
+            c->datos = almacen.mapa[c->posicion];
+            seqlock_escritura_fin(&c->version);
+            seqlock_escritura_fin(&epoca_almacen);
+        }
+    }
+    // El anterior pudo rotar el log mientras drenaba: se vuelve a abrir el activo
+    char ruta_log[256];
+    snprintf(ruta_log, sizeof(ruta_log), "%s", estado_log.ruta);
+    fclose(log_file);
+    if (abrir_log(ruta_log) < 0) {
+        perror("Error al volver a abrir el archivo de log");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Relevo recibido: %d sesiones; atendiendo tras %d ms\n", sesiones, (int)(reloj_ms() - inicio));
+    registrar_log("Relevo recibido: %d sesiones en %d ms", sesiones, (int)(reloj_ms() - inicio));
+    return 0;
+}
+
+/// @brief Abre la terminal de un usuario con la cuenta indicada y espera a que conecte sus FIFOs.
+/// @return 0 si el usuario quedó conectado, -1 si no
+int abrir_sesion_terminal(int cuenta_usuario) {
+    int slot = -1;
+    for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS && slot < 0; i++) {
+        if (usuarios[i].pid == 0) slot = i;
+    }
+    if (slot < 0) {
+        printf("No hay slots libres para otro usuario.\n");
+        return -1;
+    }
+
+    // Crear dos FIFOs para este usuario: banco->usuario y usuario->banco
+    char fifo_to_usuario[100], fifo_from_usuario[100];
+    sprintf(fifo_to_usuario, "%s%d_to_user", FIFO_BASE_PATH, slot);
+    sprintf(fifo_from_usuario, "%s%d_from_user", FIFO_BASE_PATH, slot);
+    
+    // Guardar las rutas de los FIFOs en la estructura del usuario
+    strcpy(usuarios[slot].fifo_escritura, fifo_to_usuario);
+    strcpy(usuarios[slot].fifo_lectura, fifo_from_usuario);
+    
+    // Crear los FIFOs
+    if (crear_fifo(fifo_to_usuario) < 0 || crear_fifo(fifo_from_usuario) < 0) {
+        fprintf(stderr, "Error al crear FIFOs para el usuario %d\n", cuenta_usuario);
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Error al crear el proceso hijo");
+        return -1;
+    } else if (pid == 0) {
+        // Proceso hijo
+        
+        // Primero cerramos los FIFOs que podría tener abiertos el proceso padre
+        // para evitar bloqueos
+        for (int j = 0; j < MAX_USUARIOS_SIMULTANEOS; j++) {
+            if (usuarios[j].fifo_lectura_fd > 0) {
+                close(usuarios[j].fifo_lectura_fd);
+            }
+        }
+        
+        // Convertir cuenta_usuario a string y preparar argumentos
+        char cuenta_str[20];
+        sprintf(cuenta_str, "%d", cuenta_usuario);
+        
+        // Crear el comando para ejecutar en la nueva terminal
+        char command[512];
+        if (system("command -v xterm > /dev/null") == 0) {
+            sprintf(command, "xterm -T \"Usuario Banco - Cuenta %d\" -e \"./usuario %s %s %s\"",
+                    cuenta_usuario, cuenta_str, fifo_from_usuario, fifo_to_usuario);
+        } else if (system("command -v gnome-terminal > /dev/null") == 0) {
+            sprintf(command, "gnome-terminal -- ./usuario %s %s %s",
+                    cuenta_str, fifo_from_usuario, fifo_to_usuario);
+        } else {
+            fprintf(stderr, "Error: No se encontró xterm ni gnome-terminal\n");
+            exit(EXIT_FAILURE);
+        }
+        
+        // Ejecutar el comando
+        system(command);
+        exit(EXIT_SUCCESS);
+    } else {
+        // Proceso padre
+        usuarios[slot].pid = pid;
+        usuarios[slot].cuenta = cuenta_usuario;
+        usuarios[slot].peso = peso_cuenta(cuenta_usuario);
+        
+        // Primero abrimos el FIFO para lectura (bloqueante)
+        printf("Esperando a que el usuario abra el FIFO para lectura...\n");
+        usuarios[slot].fifo_lectura_fd = open(fifo_from_usuario, O_RDONLY);
+        if (usuarios[slot].fifo_lectura_fd < 0) {
+            perror("Error al abrir FIFO para lectura");
+            limpiar_recursos_usuario(slot);
+            return -1;
+        }
+        
+        // Ahora configuramos como no bloqueante
+        int flags = fcntl(usuarios[slot].fifo_lectura_fd, F_GETFL);
+        fcntl(usuarios[slot].fifo_lectura_fd, F_SETFL, flags | O_NONBLOCK);
+        
+        // Establecer una conexión FIFO persistente para escritura
+        printf("Esperando a que el usuario abra el FIFO para escritura...\n");
+        int fifo_escritura_fd = get_fifo_connection(slot, fifo_to_usuario);
+        if (fifo_escritura_fd < 0) {
+            perror("Error al obtener conexión FIFO persistente");
+            limpiar_recursos_usuario(slot);
+            return -1;
+        }
+        
+        iniciar_temporizadores_sesion(slot);
+        printf("Usuario con cuenta %d conectado (PID: %d)\n", cuenta_usuario, pid);
+        registrar_log("Usuario conectado: Cuenta %d (PID: %d)", cuenta_usuario, pid);
+        estadisticas.sesiones_aceptadas++;
+    }
+    return 0;
+}
+
+#define MAX_CONEXIONES_ADMIN 4
+
+// Conexión al socket de administración: una orden por línea, respuesta terminada en FIN-MSG
+typedef struct {
+    int fd;                      // -1 si está libre
+    char entrada[BUFFER_SIZE];
+    size_t entrada_usados;
+} ConexionAdmin;
+
+ConexionAdmin conexiones_admin[MAX_CONEXIONES_ADMIN] = {{.fd = -1}, {.fd = -1}, {.fd = -1}, {.fd = -1}};
+
+// Socket de administración: <SOCKET_ADMIN>, con .shard<id> o .replica según el modo
+void ruta_socket_admin(char *ruta, size_t tam) {
+    const Config *cfg = configuracion();
+    if (modo_shard) {
+        snprintf(ruta, tam, "%.90s.shard%d%s", cfg->socket_admin, shard_id, modo_replica ? ".replica" : "");
+    } else {
+        snprintf(ruta, tam, "%.90s%s", cfg->socket_admin, modo_replica ? ".replica" : "");
+    }
+}
+
+int sesiones_activas() {
+    int activas = 0;
+    for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) {
+        if (usuarios[i].pid > 0) activas++;
+    }
+    return activas;
+}
+
+volatile sig_atomic_t recarga_solicitada = 0;
+
+void manejador_recarga(int sig) {
+    (void)sig;
+    recarga_solicitada = 1;
+}
+
+/// @brief Lee el archivo de configuración en una copia nueva y la publica (SIGHUP o la orden
+///        "recargar-config"). Las rutas, los sockets, el reparto en shards, el número de
+///        hilos y el motor de E/S se fijan al arrancar y se conservan.
+/// @return 0 si se recargó, -1 si el archivo no se puede leer o no se pudo publicar
+int recargar_configuracion() {
+    const Config *cfg = configuracion();
+    if (access(CONFIG_FILE, R_OK) != 0) return -1;
+    Config *nueva = reservar_memoria_ceros(1, sizeof(Config));
+    if (nueva == NULL) return -1;
+    leer_configuracion(CONFIG_FILE, nueva);
+    nueva->shards = cfg->shards;
+    nueva->num_hilos = cfg->num_hilos;
+    memcpy(nueva->archivo_cuentas, cfg->archivo_cuentas, sizeof(nueva->archivo_cuentas));
+    memcpy(nueva->archivo_log, cfg->archivo_log, sizeof(nueva->archivo_log));
+    memcpy(nueva->socket_replica, cfg->socket_replica, sizeof(nueva->socket_replica));
+    memcpy(nueva->socket_admin, cfg->socket_admin, sizeof(nueva->socket_admin));
+    nueva->motor_io = cfg->motor_io;
+    if (publicar_configuracion(nueva) < 0) {
+        free(nueva);
+        return -1;
+    }
+    registrar_log("Configuración recargada desde %s: LIMITE_RETIRO=%d LIMITE_TRANSFERENCIA=%d",
+                  CONFIG_FILE, nueva->limite_retiro, nueva->limite_transferencia);
+    return 0;
+}
+
+/// @brief Cambia el muestreo de trazas publicando una copia de la configuración vigente,
+///        igual que una recarga; una recarga posterior vuelve al valor de TRAZA_MUESTREO
+/// @return 0 si se publicó, -1 si no
+int cambiar_muestreo_traza(int cada) {
+    Config *nueva = reservar_memoria(sizeof(Config));
+    if (nueva == NULL) return -1;
+    *nueva = *configuracion();
+    nueva->traza_muestreo = cada > 0 ? cada : 0;
+    if (publicar_configuracion(nueva) < 0) {
+        free(nueva);
+        return -1;
+    }
+    return 0;
+}
+
+/// @brief Empieza a capturar el tráfico de las sesiones en ruta. Las sesiones ya abiertas
+///        entran en la captura con su siguiente petición.
+/// @return 0 si empezó, -1 si ya había una captura en curso o no se pudo crear el archivo
+int iniciar_captura_trafico(const char *ruta) {
+    int resultado = -1;
+    pthread_mutex_lock(&captura_trafico.mutex);
+    if (captura_trafico.archivo == NULL) {
+        struct timespec ahora;
+        clock_gettime(CLOCK_REALTIME, &ahora);
+        FILE *f = fopen(ruta, "wb");
+        char *buffer = f != NULL ? reservar_memoria(TAM_BUFFER_CAPTURA) : NULL;
+        if (buffer != NULL) setvbuf(f, buffer, _IOFBF, TAM_BUFFER_CAPTURA);
+        int64_t inicio_us = (int64_t)ahora.tv_sec * 1000000LL + ahora.tv_nsec / 1000;
+        if (buffer != NULL && escribir_cabecera_trafico(f, 0, inicio_us, 0) == 0) {
+            for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) atomic_store(&usuarios[i].sesion_trafico, 0);
+            captura_trafico.archivo = f;
+            captura_trafico.buffer = buffer;
+            snprintf(captura_trafico.ruta, sizeof(captura_trafico.ruta), "%s", ruta);
+            captura_trafico.inicio_ns = traza_ns();
+            captura_trafico.inicio_us = inicio_us;
+            captura_trafico.sesiones = 0;
+            captura_trafico.registros = 0;
+            captura_trafico.fallo = 0;
+            atomic_store(&captura_activa, 1);
+            resultado = 0;
+        } else if (f != NULL) {
+            fclose(f);
+            free(buffer);
+        }
+    }
+    pthread_mutex_unlock(&captura_trafico.mutex);
+    if (resultado == 0) registrar_log("Captura de tráfico iniciada en %s", ruta);
+    return resultado;
+}
+
+/// @brief Termina la captura en curso: completa la cabecera con el número de sesiones y de
+///        registros y cierra el archivo
+/// @return Registros capturados, o -1 si no había captura o el archivo quedó incompleto
+long detener_captura_trafico() {
+    long registros = -1;
+    pthread_mutex_lock(&captura_trafico.mutex);
+    FILE *f = captura_trafico.archivo;
+    if (f != NULL) {
+        atomic_store(&captura_activa, 0);
+        captura_trafico.archivo = NULL;
+        int fallo = captura_trafico.fallo || fflush(f) != 0 || fseek(f, 0, SEEK_SET) != 0 ||
+                    escribir_cabecera_trafico(f, captura_trafico.sesiones, captura_trafico.inicio_us,
+                                              captura_trafico.registros) != 0;
+        if (fclose(f) != 0) fallo = 1;
+        free(captura_trafico.buffer);
+        captura_trafico.buffer = NULL;
+        captura_trafico.fallo = fallo;
+        registros = fallo ? -1 : (long)captura_trafico.registros;
+    }
+    pthread_mutex_unlock(&captura_trafico.mutex);
+    if (f != NULL) {
+        registrar_log("Captura de tráfico terminada: %llu registros de %u sesiones en %s",
+                      (unsigned long long)captura_trafico.registros, captura_trafico.sesiones, captura_trafico.ruta);
+    }
+    return registros;
+}
+
+/// @brief Vuelca los tramos guardados en los anillos de todos los hilos a un JSON de trace events
+/// @return Eventos escritos, o -1 si no se pudo crear el archivo
+long volcar_traza(const char *ruta) {
+    FILE *f = fopen(ruta, "w");
+    if (f == NULL) return -1;
+    long eventos = traza_volcar(f, (int)getpid());
+    if (fclose(f) != 0) return -1;
+    return eventos;
+}
+
+/// @brief Ejecuta una orden de administración. Todas se responden con el estado en memoria
+///        del hilo principal; sólo "instantanea" y "volcar-log" esperan al disco.
+/// @return bytes escritos en respuesta
+size_t ejecutar_orden_admin(const char *orden, char *respuesta, size_t tam) {
+    size_t usados = 0;
+    int slot;
+
+    if (strcmp(orden, "estadisticas") == 0) {
+        int64_t ahora = reloj_ms(), espera_max;
+        int en_cola = estado_colas(ahora, &espera_max);
+        pthread_mutex_lock(&cola_lecturas.mutex);
+        int lecturas = cola_lecturas.num;
+        pthread_mutex_unlock(&cola_lecturas.mutex);
+        int en_curso = 0;
+        for (int k = 0; k < MAX_TRANSFERENCIAS_2PC; k++) en_curso += transferencias[k].activa;
+        usados = snprintf(respuesta, tam,
+                          "[ESTADISTICAS:activo_s=%lld:sesiones=%d:en_cola=%d:espera_max_ms=%lld:lecturas_en_cola=%d"
+                          ":atendidas=%lu:rechazadas=%lu:sesiones_aceptadas=%lu:cuentas=%d:transferencias_2pc=%d"
+                          ":log_bytes=%lld:drenando=%d:motor_io=%s:operaciones_uring=%lu:llamadas_uring=%lu"
+                          ":mallocs=%lu:mallocs_peticiones=%lu:pico_arena=%lu]\n",
+                          (long long)(ahora - estadisticas.arranque_ms) / 1000, sesiones_activas(), en_cola,
+                          (long long)espera_max, lecturas, estadisticas.peticiones_atendidas,
+                          estadisticas.peticiones_rechazadas, estadisticas.sesiones_aceptadas, almacen.num_cuentas,
+                          en_curso, (long long)posicion_log_actual(), modo_drenaje, motor.activo ? "io_uring" : "poll",
+                          motor.operaciones, motor.llamadas, atomic_load(&reservas_memoria),
+                          atomic_load(&reservas_en_peticiones), atomic_load(&pico_arenas));
+    } else if (strcmp(orden, "sesiones") == 0) {
+        for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS && usados < tam; i++) {
+            InfoUsuario *u = &usuarios[i];
+            if (u->pid == 0) continue;
+            usados += snprintf(respuesta + usados, tam - usados,
+                               "[SESION:slot=%d:cuenta=%d:pid=%d:tipo=%s:cola=%d+%d:salida=%zu:pausada=%d"
+                               ":suscripciones=%d:tx=%d]\n",
+                               i, u->cuenta, (int)u->pid, u->es_socket ? "socket" : "fifo",
+                               u->colas[CARRIL_GENERAL].num, u->colas[CARRIL_LECTURAS].num,
+                               bytes_salida_pendientes(i), u->lectura_pausada, u->num_suscripciones,
+                               u->transaccion.activa);
+        }
+        if (usados < tam) usados += snprintf(respuesta + usados, tam - usados, "[SESIONES:%d]\n", sesiones_activas());
+    } else if (strcmp(orden, "drenar") == 0) {
+        modo_drenaje = 1;
+        registrar_log("Drenaje solicitado: %d sesiones abiertas", sesiones_activas());
+        usados = snprintf(respuesta, tam, "[OK:Drenando: %d sesiones abiertas; el banco termina al cerrarse la última]\n",
+                          sesiones_activas());
+    } else if (sscanf(orden, "cerrar-sesion %d", &slot) == 1) {
+        if (slot < 0 || slot >= MAX_USUARIOS_SIMULTANEOS || usuarios[slot].pid == 0) {
+            usados = snprintf(respuesta, tam, "[ERROR:No hay ninguna sesión en el slot %d]\n", slot);
+        } else {
+            int cuenta = usuarios[slot].cuenta;
+            desconectar_usuario(slot, "cerrada por el administrador");
+            usados = snprintf(respuesta, tam, "[OK:Sesión del slot %d (cuenta %d) cerrada]\n", slot, cuenta);
+        }
+    } else if (strcmp(orden, "recargar-config") == 0) {
+        if (recargar_configuracion() == 0) {
+            usados = snprintf(respuesta, tam, "[OK:Configuración recargada]\n");
+        } else {
+            usados = snprintf(respuesta, tam, "[ERROR:No se pudo recargar %s]\n", CONFIG_FILE);
+        }
+    } else if (strcmp(orden, "instantanea") == 0) {
+        // Sólo el hilo principal escribe en el mapa, así que aquí no hay un COMMIT a medias
+        int64_t inicio = reloj_ms();
+        if (almacen.mapa == NULL || msync(almacen.mapa, almacen.tam_mapa, MS_SYNC) < 0 ||
+            (indice_movimientos_fd >= 0 && !modo_replica && fdatasync(indice_movimientos_fd) < 0)) {
+            usados = snprintf(respuesta, tam, "[ERROR:No hay archivo de cuentas proyectado que guardar]\n");
+        } else {
+            usados = snprintf(respuesta, tam, "[OK:Instantánea en disco: %d cuentas en %lld ms]\n",
+                              almacen.num_cuentas, (long long)(reloj_ms() - inicio));
+        }
+    } else if (strcmp(orden, "volcar-log") == 0) {
+        if (vaciar_log() != 0 || fdatasync(fileno(log_file)) < 0) {
+            usados = snprintf(respuesta, tam, "[ERROR:No se pudo volcar el log: %s]\n", strerror(errno));
+        } else {
+            usados = snprintf(respuesta, tam, "[OK:Log en disco hasta la posición %lld]\n",
+                              (long long)posicion_log_actual());
+        }
+    } else if (strcmp(orden, "traza") == 0) {
+        usados = snprintf(respuesta, tam, "[TRAZA:muestreo=%d:hilos=%d]\n", configuracion()->traza_muestreo,
+                          atomic_load(&num_anillos_traza));
+    } else if (sscanf(orden, "traza %d", &slot) == 1) {
+        if (cambiar_muestreo_traza(slot) < 0) {
+            usados = snprintf(respuesta, tam, "[ERROR:No se pudo cambiar el muestreo]\n");
+        } else if (slot <= 0) {
+            usados = snprintf(respuesta, tam, "[OK:Trazas desactivadas]\n");
+        } else {
+            usados = snprintf(respuesta, tam, "[OK:Se traza una de cada %d peticiones]\n", slot);
+        }
+    } else if (strncmp(orden, "volcar-traza", 12) == 0 && (orden[12] == '\0' || orden[12] == ' ')) {
+        char ruta[256];
+        if (sscanf(orden + 12, "%255s", ruta) != 1) snprintf(ruta, sizeof(ruta), "/tmp/banco_traza.%d.json", (int)getpid());
+        long eventos = volcar_traza(ruta);
+        if (eventos < 0) {
+            usados = snprintf(respuesta, tam, "[ERROR:No se pudo escribir %s: %s]\n", ruta, strerror(errno));
+        } else {
+            usados = snprintf(respuesta, tam, "[OK:%ld tramos en %s]\n", eventos, ruta);
+        }
+    } else if (strcmp(orden, "capturar") == 0) {
+        pthread_mutex_lock(&captura_trafico.mutex);
+        usados = snprintf(respuesta, tam, "[CAPTURA:activa=%d:ruta=%s:sesiones=%u:registros=%llu:error=%d]\n",
+                          captura_trafico.archivo != NULL, captura_trafico.ruta, captura_trafico.sesiones,
+                          (unsigned long long)captura_trafico.registros, captura_trafico.fallo);
+        pthread_mutex_unlock(&captura_trafico.mutex);
+    } else if (strcmp(orden, "capturar parar") == 0) {
+        if (!capturando_trafico()) {
+            usados = snprintf(respuesta, tam, "[ERROR:No hay ninguna captura en curso]\n");
+        } else if (detener_captura_trafico() < 0) {
+            usados = snprintf(respuesta, tam, "[ERROR:La captura en %s quedó incompleta]\n", captura_trafico.ruta);
+        } else {
+            usados = snprintf(respuesta, tam, "[OK:%llu registros de %u sesiones en %s]\n",
+                              (unsigned long long)captura_trafico.registros, captura_trafico.sesiones,
+                              captura_trafico.ruta);
+        }
+    } else if (strncmp(orden, "capturar ", 9) == 0) {
+        char ruta[256];
+        if (sscanf(orden + 9, "%255s", ruta) != 1) {
+            usados = snprintf(respuesta, tam, "[ERROR:Uso: capturar <ruta>]\n");
+        } else if (capturando_trafico()) {
+            usados = snprintf(respuesta, tam, "[ERROR:Ya se está capturando en %s]\n", captura_trafico.ruta);
+        } else if (iniciar_captura_trafico(ruta) < 0) {
+            usados = snprintf(respuesta, tam, "[ERROR:No se pudo crear %s: %s]\n", ruta, strerror(errno));
+        } else {
+            usados = snprintf(respuesta, tam, "[OK:Capturando el tráfico en %s]\n", ruta);
+        }
+    } else if (strcmp(orden, "relevo") == 0) {
+        relevo_solicitado = 1;
+        usados = snprintf(respuesta, tam, "[OK:Relevo solicitado]\n");
+    } else if (strcmp(orden, "salir") == 0) {
+        continuar_ejecucion = 0;
+        usados = snprintf(respuesta, tam, "[OK:Cerrando el banco]\n");
+    } else {
+        usados = snprintf(respuesta, tam, "[ERROR:Órdenes: estadisticas, sesiones, drenar, cerrar-sesion <slot>, "
+                                          "recargar-config, instantanea, volcar-log, traza [N], volcar-traza [ruta], "
+                                          "capturar [ruta|parar], relevo, salir]\n");
+    }
+    if (usados >= tam) usados = tam - 1;
+    if (usados + 9 < tam) usados += snprintf(respuesta + usados, tam - usados, "FIN-MSG\n");
+    return usados;
+}
+
+void aceptar_conexion_admin() {
+    int fd = accept4(fd_escucha_admin, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+    for (int k = 0; k < MAX_CONEXIONES_ADMIN; k++) {
+        if (conexiones_admin[k].fd < 0) {
+            conexiones_admin[k].fd = fd;
+            conexiones_admin[k].entrada_usados = 0;
+            return;
+        }
+    }
+    const char *lleno = "[ERROR:Demasiadas conexiones de administración]\nFIN-MSG\n";
+    if (write(fd, lleno, strlen(lleno)) < 0) debug_log("No se pudo avisar del rechazo: %s", strerror(errno));
+    close(fd);
+}
+
+static void cerrar_conexion_admin(ConexionAdmin *c) {
+    close(c->fd);
+    c->fd = -1;
+    c->entrada_usados = 0;
+}
+
+// Lee las órdenes recibidas y responde a cada línea completa
+void atender_conexion_admin(int k) {
+    ConexionAdmin *c = &conexiones_admin[k];
+    ssize_t n = read(c->fd, c->entrada + c->entrada_usados, sizeof(c->entrada) - 1 - c->entrada_usados);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        cerrar_conexion_admin(c);
+        return;
+    }
+    if (n < 0) return;
+    c->entrada_usados += n;
+
+    char *salto;
+    while (c->fd >= 0 && (salto = memchr(c->entrada, '\n', c->entrada_usados)) != NULL) {
+        size_t largo = salto - c->entrada + 1;
+        char orden[BUFFER_SIZE];
+        memcpy(orden, c->entrada, largo - 1);
+        orden[largo - 1] = '\0';
+        orden[strcspn(orden, "\r")] = '\0';
+        memmove(c->entrada, c->entrada + largo, c->entrada_usados - largo);
+        c->entrada_usados -= largo;
+
+        static char respuesta[MAX_USUARIOS_SIMULTANEOS * 160 + 256];
+        size_t largo_respuesta = ejecutar_orden_admin(orden, respuesta, sizeof(respuesta));
+        if (write(c->fd, respuesta, largo_respuesta) < 0) cerrar_conexion_admin(c);
+    }
+    // Una orden que no cabe en el buffer no es una orden
+    if (c->fd >= 0 && c->entrada_usados >= sizeof(c->entrada) - 1) cerrar_conexion_admin(c);
+}
+
+// Línea a medio escribir en la consola del banco
+char entrada_consola[BUFFER_SIZE];
+size_t consola_usados = 0;
+int consola_abierta = 1;
+
+/// @brief Lee la entrada estándar sin bloquear y atiende sus líneas completas: un número de
+///        cuenta abre la terminal de ese usuario (0 termina el banco) y cualquier otra cosa es
+///        una orden de administración, respondida por la salida estándar.
+void atender_consola() {
+    ssize_t n = read(STDIN_FILENO, entrada_consola + consola_usados, sizeof(entrada_consola) - 1 - consola_usados);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        consola_abierta = 0;
+        return;
+    }
+    if (n < 0) return;
+    consola_usados += n;
+
+    char *salto;
+    while ((salto = memchr(entrada_consola, '\n', consola_usados)) != NULL ||
+           consola_usados >= sizeof(entrada_consola) - 1) {
+        size_t largo = salto != NULL ? (size_t)(salto - entrada_consola + 1) : consola_usados;
+        char linea[BUFFER_SIZE];
+        memcpy(linea, entrada_consola, largo);
+        linea[largo] = '\0';
+        linea[strcspn(linea, "\r\n")] = '\0';
+        memmove(entrada_consola, entrada_consola + largo, consola_usados - largo);
+        consola_usados -= largo;
+
+        char *fin;
+        long cuenta = strtol(linea, &fin, 10);
+        if (fin != linea && *fin == '\0') {
+            if (cuenta == 0) {
+                printf("Solicitud de cierre recibida.\n");
+                continuar_ejecucion = 0;
+                return;
+            }
+            abrir_sesion_terminal((int)cuenta);
+        } else if (linea[0] != '\0') {
+            static char respuesta[MAX_USUARIOS_SIMULTANEOS * 160 + 256];
+            ejecutar_orden_admin(linea, respuesta, sizeof(respuesta));
+            fputs(respuesta, stdout);
+        }
+        printf("Ingrese el número de cuenta (o 0 para salir): ");
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    // Inicializar array de usuarios
+    for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) {
+        usuarios[i].pid = 0;
+        usuarios[i].cuenta = 0;
+        usuarios[i].fifo_lectura_fd = 0;
+        usuarios[i].fifo_lectura[0] = '\0';
+        usuarios[i].fifo_escritura[0] = '\0';
+        pthread_mutex_init(&usuarios[i].salida.mutex, NULL);
+    }
+
+    // Leer el fichero de configuración.
+    leer_configuracion(CONFIG_FILE, &config_inicial);
+    traza_iniciar();
+    traza_registrar_hilo("principal");
+
+    // Arrancado por "kill -USR2" de otro banco: los sockets y las sesiones llegan por este canal
+    argv_banco = argv;
+    if (getenv(VARIABLE_RELEVO) != NULL) {
+        relevo.canal = atoi(getenv(VARIABLE_RELEVO));
+        fcntl(relevo.canal, F_SETFD, FD_CLOEXEC);
+        unsetenv(VARIABLE_RELEVO);
+    }
+
+    // banco -s <id>: arrancar como uno de los NUM_SHARDS procesos, con su propio almacén y log.
+    // banco -r: réplica de sólo lectura del primario (o del shard, con -s)
+    int opcion;
+    while ((opcion = getopt(argc, argv, "s:r")) != -1) {
+        if (opcion == 's') {
+            modo_shard = 1;
+            shard_id = atoi(optarg);
+        } else if (opcion == 'r') {
+            modo_replica = 1;
+        } else {
+            fprintf(stderr, "Uso: %s [-s <shard>] [-r]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    char nombre_semaforo[64] = "/cuentas_semaphore";
+    if (modo_shard) {
+        if (config_inicial.shards.num_shards < 1 || shard_id < 0 || shard_id >= config_inicial.shards.num_shards) {
+            fprintf(stderr, "Shard %d fuera de rango: NUM_SHARDS=%d\n", shard_id, config_inicial.shards.num_shards);
+            exit(EXIT_FAILURE);
+        }
+        char maestro[256];
+        snprintf(maestro, sizeof(maestro), "%s", strlen(config_inicial.archivo_cuentas) > 0 ? config_inicial.archivo_cuentas : "../data/cuentas.dat");
+        snprintf(config_inicial.archivo_cuentas, sizeof(config_inicial.archivo_cuentas), "%.240s.shard%d", maestro, shard_id);
+        char log_base[256];
+        snprintf(log_base, sizeof(log_base), "%s", strlen(config_inicial.archivo_log) > 0 ? config_inicial.archivo_log : LOG_FILE);
+        snprintf(config_inicial.archivo_log, sizeof(config_inicial.archivo_log), "%.240s.shard%d", log_base, shard_id);
+        snprintf(nombre_semaforo, sizeof(nombre_semaforo), "/cuentas_semaphore_shard%d", shard_id);
+        if (!modo_replica && access(maestro, R_OK) == 0) preparar_archivo_shard(maestro, config_inicial.archivo_cuentas);
+    }
+    if (modo_replica) {
+        size_t largo = strlen(nombre_semaforo);
+        snprintf(nombre_semaforo + largo, sizeof(nombre_semaforo) - largo, "_replica");
+    }
+
+    // Configuración de manejadores de señales para terminación adecuada
+    signal(SIGINT, manejador_senales);
+    signal(SIGTERM, manejador_senales);
+    // Un usuario que cierra su FIFO no debe matar al banco: write devolverá EPIPE
+    signal(SIGPIPE, SIG_IGN);
+    // kill -USR2: relevo sin cortes hacia el binario actual del disco
+    signal(SIGUSR2, manejador_relevo);
+    // kill -HUP: volver a leer la configuración sin reiniciar
+    signal(SIGHUP, manejador_recarga);
+
+    // Verificar la existencia del archivo de cuentas al iniciar
+    const char* ruta_cuentas = strlen(config_inicial.archivo_cuentas) > 0 ? 
+                          config_inicial.archivo_cuentas : "../data/cuentas.dat";
+    
+    if (access(ruta_cuentas, F_OK) != 0) {
+        printf("\n");
+        printf("┌──────────────────────────────────────────────────┐\n");
+        printf("│               ¡¡ ADVERTENCIA !!                  │\n");
+        printf("│     NO SE ENCONTRÓ EL ARCHIVO DE CUENTAS:        │\n");
+        printf("│     %-42s │\n", ruta_cuentas);
+        printf("└──────────────────────────────────────────────────┘\n");
+        printf("  Se iniciará con valores temporales al consultar saldos.\n");
+        printf("  Para crear un archivo permanente ejecute: ./init_cuentas\n\n");
+    } else if (access(ruta_cuentas, R_OK) != 0) {
+        printf("\n");
+        printf("┌──────────────────────────────────────────────────┐\n");
+        printf("│               ¡¡ ADVERTENCIA !!                  │\n");
+        printf("│   NO TIENE PERMISOS PARA LEER ARCHIVO CUENTAS:   │\n");
+        printf("│     %-42s │\n", ruta_cuentas);
+        printf("└──────────────────────────────────────────────────┘\n");
+        printf("  Corrija los permisos con: chmod 644 %s\n\n", ruta_cuentas);
+    }
+
+    // Crear un semáforo nombrado para controlar el acceso al archivo de cuentas.
+    sem_cuentas = sem_open(nombre_semaforo, O_CREAT, 0644, 1);
+    if (sem_cuentas == SEM_FAILED) {
+        perror("Error al crear el semáforo");
+        exit(EXIT_FAILURE);
+    }
+
+    // Cargar las cuentas en memoria para las transacciones. La réplica sólo lee el archivo
+    // del primario y sigue su índice de movimientos. Los dos empiezan en el punto de control.
+    PuntoIndice punto = leer_punto_indice();
+    if (access(ruta_cuentas, modo_replica ? R_OK : R_OK | W_OK) == 0 && cargar_almacen_cuentas(ruta_cuentas) == 0) {
+        if (modo_replica) {
+            abrir_indice_replica(&punto);
+        } else {
+            cargar_indice_movimientos(&punto);
+        }
+    }
+    free(punto.cabezas);
+
+    // Abrir el archivo de log (la réplica usa uno propio para no tocar el del primario)
+    char log_filename[300];
+    snprintf(log_filename, sizeof(log_filename), "%s%s", strlen(config_inicial.archivo_log) > 0 ? config_inicial.archivo_log : LOG_FILE,
+             modo_replica ? ".replica" : "");
+    if (abrir_log(log_filename) < 0) {
+        perror("Error al abrir el archivo de log");
+        exit(EXIT_FAILURE);
+    }
+
+    // Initialize FIFO connections
+    init_fifo_connections();
+
+    fd_despertar = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd_despertar < 0) {
+        perror("Error al crear eventfd");
+        exit(EXIT_FAILURE);
+    }
+
+    // En un relevo los sockets de escucha llegan ya abiertos del proceso anterior
+    int relevando = relevo.canal >= 0;
+    if (modo_replica && !relevando && (fd_escucha = abrir_socket_escucha(config_inicial.socket_replica, 64)) < 0) {
+        perror("Error al abrir el socket de la réplica");
+        exit(EXIT_FAILURE);
+    }
+    if (modo_shard && !modo_replica && !relevando && (fd_escucha = abrir_socket_shard()) < 0) {
+        perror("Error al abrir el socket del shard");
+        exit(EXIT_FAILURE);
+    }
+    // Las transferencias con cuentas de otros shards se coordinan por un segundo socket
+    iniciar_2pc();
+    if (modo_shard && !modo_replica && !relevando && (fd_escucha_2pc = abrir_socket_2pc()) < 0) {
+        perror("Error al abrir el socket de transferencias entre shards");
+        exit(EXIT_FAILURE);
+    }
+    // Órdenes de administración, fuera del camino de las peticiones
+    char ruta_admin[108];
+    ruta_socket_admin(ruta_admin, sizeof(ruta_admin));
+    if (!relevando && (fd_escucha_admin = abrir_socket_escucha(ruta_admin, 4)) < 0) {
+        perror("Error al abrir el socket de administración");
+    }
+    estadisticas.arranque_ms = reloj_ms();
+
+    // Las consultas de saldo se sirven desde NUM_HILOS hilos lectores
+    iniciar_hilos_lectores(config_inicial.num_hilos > 0 ? config_inicial.num_hilos : 1);
+    // Tras un relevo no se reabre la captura: el archivo es del proceso anterior
+    if (config_inicial.archivo_captura[0] != '\0' && !relevando &&
+        iniciar_captura_trafico(config_inicial.archivo_captura) < 0) {
+        perror("Error al abrir el archivo de captura de tráfico");
+    }
+
+    printf("Banco iniciado. Esperando conexiones de usuario...\n");
+    printf("Presione Ctrl+C para terminar. Administración: %s\n\n", ruta_admin);
+
+    // Plazos de sesión, latidos y mantenimiento periódico van en la rueda de temporizadores
+    iniciar_rueda(reloj_ms());
+    programar_temporizador(&t_mantenimiento, PERIODO_MANTENIMIENTO_MS);
+    if (!modo_replica && indice_movimientos_fd >= 0) programar_temporizador(&t_punto_indice, PERIODO_PUNTO_INDICE_MS);
+    if (relevando && recibir_relevo() < 0) {
+        fprintf(stderr, "El proceso anterior no entregó sus sesiones; se cancela el relevo\n");
+        exit(EXIT_FAILURE);
+    }
+    if (config_inicial.motor_io == MOTOR_IO_URING && iniciar_motor_uring() == 0) {
+        printf("Motor de E/S: io_uring%s.\n", motor.buffers_fijos ? " con buffers registrados" : "");
+    }
+    if (fd_escucha_2pc >= 0) recuperar_transferencias_2pc();
+    if (modo_replica) programar_temporizador(&t_replica, PERIODO_REPLICA_MS);
+    if (fd_escucha < 0) {
+        printf("Ingrese el número de cuenta (o 0 para salir): ");
+        fflush(stdout);
+    }
+
+    // Bucle principal para aceptar conexiones de usuarios
+    while (continuar_ejecucion) {
+        // Esperar a la vez a todos los usuarios: lectura si no están pausados,
+        // escritura si tienen respuestas pendientes
+        // Durante el drenaje de un relevo no se aceptan sesiones ni se lee a los usuarios:
+        // las conexiones nuevas esperan en la cola del socket a que las acepte el proceso nuevo
+        int drenando = relevo.canal >= 0 && relevo.listo;
+        struct pollfd fds[8 + MAX_CONEXIONES_ADMIN + MAX_CONEXIONES_2PC + 2 * MAX_USUARIOS_SIMULTANEOS];
+        int slot_de[8 + MAX_CONEXIONES_ADMIN + MAX_CONEXIONES_2PC + 2 * MAX_USUARIOS_SIMULTANEOS];
+        int nfds = 0;
+        fds[nfds].fd = fd_despertar;
+        fds[nfds].events = POLLIN;
+        slot_de[nfds++] = -1;
+        if (fd_escucha >= 0 && !drenando && !modo_drenaje) {
+            fds[nfds].fd = fd_escucha;
+            fds[nfds].events = POLLIN;
+            slot_de[nfds++] = -2;
+        }
+        if (relevo.canal >= 0) {
+            fds[nfds].fd = relevo.canal;
+            fds[nfds].events = POLLIN;
+            slot_de[nfds++] = -5;
+        }
+        if (fd_escucha_admin >= 0 && !drenando) {
+            fds[nfds].fd = fd_escucha_admin;
+            fds[nfds].events = POLLIN;
+            slot_de[nfds++] = -6;
+        }
+        // La consola sólo abre terminales de usuario cuando las sesiones no llegan por un socket
+        if (fd_escucha < 0 && consola_abierta && relevo.canal < 0) {
+            fds[nfds].fd = STDIN_FILENO;
+            fds[nfds].events = POLLIN;
+            slot_de[nfds++] = -7;
+        }
+        // Conexiones de administración: slot_de = -100 - k
+        for (int k = 0; k < MAX_CONEXIONES_ADMIN; k++) {
+            if (conexiones_admin[k].fd < 0) continue;
+            fds[nfds].fd = conexiones_admin[k].fd;
+            fds[nfds].events = POLLIN;
+            slot_de[nfds++] = -100 - k;
+        }
+        if (fd_escucha_2pc >= 0 && !drenando) {
+            fds[nfds].fd = fd_escucha_2pc;
+            fds[nfds].events = POLLIN;
+            slot_de[nfds++] = -3;
+        }
+        if (replica.fd_inotify >= 0) {
+            fds[nfds].fd = replica.fd_inotify;
+            fds[nfds].events = POLLIN;
+            slot_de[nfds++] = -4;
+        }
+        // Conexiones con otros shards: slot_de = -10 - k
+        for (int k = 0; k < MAX_CONEXIONES_2PC; k++) {
+            if (conexiones_2pc[k].fd < 0) continue;
+            fds[nfds].fd = conexiones_2pc[k].fd;
+            fds[nfds].events = POLLIN | (conexiones_2pc[k].salida_usados > 0 ? POLLOUT : 0);
+            slot_de[nfds++] = -10 - k;
+        }
+        // Con io_uring las sesiones y el log van al anillo en una sola llamada y el poll
+        // sólo espera a que haya terminaciones: slot_de = -8
+        if (motor.activo) {
+            preparar_operaciones_uring(drenando);
+            fds[nfds].fd = motor.anillo.fd;
+            fds[nfds].events = POLLIN;
+            slot_de[nfds++] = -8;
+        }
+        for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS && !motor.activo; i++) {
+            if (usuarios[i].fifo_lectura_fd > 0 && !usuarios[i].lectura_pausada && puede_leer_usuario(i) && !drenando) {
+                fds[nfds].fd = usuarios[i].fifo_lectura_fd;
+                fds[nfds].events = POLLIN;
+                slot_de[nfds++] = i;
+            }
+            int fd_salida = fd_conexion_usuario(i);
+            if (fd_salida >= 0 && bytes_salida_pendientes(i) > 0) {
+                fds[nfds].fd = fd_salida;
+                fds[nfds].events = POLLOUT;
+                slot_de[nfds++] = i;
+            }
+        }
+
+        // 100ms timeout keeps the periodic checks below running when idle;
+        // don't sleep at all while requests are still queued
+        int espera_ms = hay_peticiones_pendientes() || motor.num_aplazadas > 0 ? 0 : 100;
+        uint64_t tramo = tramo_inicio(traza_muestrear());
+        if (poll(fds, nfds, espera_ms) < 0 && errno != EINTR) {
+            perror("poll");
+        }
+        tramo_fin("poll", tramo, espera_ms);
+
+        for (int k = 0; k < nfds; k++) {
+            int i = slot_de[k];
+            if (fds[k].revents == 0) continue;
+            if (i == -2) {
+                aceptar_sesion_socket();
+            } else if (i == -3) {
+                aceptar_conexion_2pc();
+            } else if (i == -4) {
+                atender_aviso_replica();
+            } else if (i == -5) {
+                atender_canal_relevo();
+            } else if (i == -6) {
+                aceptar_conexion_admin();
+            } else if (i == -7) {
+                atender_consola();
+            } else if (i == -8) {
+                atender_terminaciones_uring();
+            } else if (i <= -100) {
+                atender_conexion_admin(-100 - i);
+            } else if (i <= -10) {
+                if (fds[k].revents & (POLLIN | POLLHUP | POLLERR)) atender_conexion_2pc(-10 - i);
+                if ((fds[k].revents & POLLOUT) && conexiones_2pc[-10 - i].fd >= 0) enviar_lote_2pc();
+            } else if (i < 0) {
+                uint64_t avisos;
+                if (read(fd_despertar, &avisos, sizeof(avisos)) < 0 && errno != EAGAIN) perror("read eventfd");
+            } else if (fds[k].events == POLLIN) {
+                atender_lectura_usuario(i);
+            } else if (vaciar_salida(i, fds[k].fd) < 0) {
+                debug_log("❌ El usuario %d cerró su FIFO de respuestas: %s", usuarios[i].cuenta, strerror(errno));
+                close_fifo_connection(i);
+            }
+        }
+
+        // Terminaciones que llegaron mientras se esperaba al log, si el anillo no tenía otras
+        if (motor.num_aplazadas > 0) atender_terminaciones_uring();
+
+        // Atender las peticiones encoladas de forma equitativa entre sesiones
+        planificar_peticiones();
+
+        // Contrapresión y desconexión de usuarios que no leen sus respuestas
+        time_t ahora = time(NULL);
+        for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) {
+            if (usuarios[i].pid > 0 && aplicar_contrapresion(i, ahora)) {
+                printf("Usuario (Cuenta: %d, PID: %d) desconectado: no lee sus respuestas.\n",
+                       usuarios[i].cuenta, usuarios[i].pid);
+                registrar_log("Usuario desconectado: Cuenta %d (PID %d) - %d s sin leer respuestas",
+                              usuarios[i].cuenta, usuarios[i].pid, configuracion()->plazo_salida_segundos);
+                limpiar_recursos_usuario(i);
+            }
+        }
+
+        // Disparar los temporizadores vencidos (inactividad, plazos, latidos, cierres)
+        avanzar_rueda(reloj_ms());
+
+        // La rotación vuelve a registrar las transferencias en curso, que entran en el lote siguiente
+        rotar_log_pendiente();
+
+        // Un solo fdatasync por vuelta para todos los registros 2PC y después los envíos a otros shards
+        if (fd_escucha_2pc >= 0) enviar_lote_2pc();
+
+        if (recarga_solicitada) {
+            recarga_solicitada = 0;
+            printf("%s\n", recargar_configuracion() == 0 ? "Configuración recargada."
+                                                          : "No se pudo recargar la configuración.");
+        }
+        if (num_configs_retiradas > 0) liberar_configs_retiradas();
+
+        if (relevo_solicitado) {
+            relevo_solicitado = 0;
+            if (relevo.canal < 0) iniciar_relevo();
+        }
+        if (relevo.canal >= 0 && !relevo.listo && reloj_ms() - relevo.inicio_ms > PLAZO_ARRANQUE_RELEVO_MS) {
+            cancelar_relevo("el binario nuevo no estuvo listo a tiempo");
+        }
+        if (relevo.canal >= 0 && relevo.listo) {
+            if (relevo_drenado() || reloj_ms() - relevo.inicio_ms > configuracion()->plazo_relevo_ms) completar_relevo();
+            continue;
+        }
+
+        if (modo_drenaje && sesiones_activas() == 0) {
+            printf("Drenaje completado: no quedan sesiones abiertas.\n");
+            continuar_ejecucion = 0;
+        }
+    }
+
+    // Tras un relevo las sesiones, los sockets y el semáforo siguen en manos del proceso nuevo
+    if (relevo.completado) {
+        if (replica.fd_inotify >= 0) close(replica.fd_inotify);
+        close(fd_despertar);
+        detener_captura_trafico();
+        vaciar_log();
+        cerrar_motor_uring();
+        fclose(log_file);
+        liberar_almacen_cuentas();
+        sem_close(sem_cuentas);
+        printf("Proceso del banco relevado por el PID %d.\n", (int)relevo.pid_nuevo);
+        return EXIT_SUCCESS;
+    }
+
+    // Esperar a que todos los procesos hijos terminen
+    printf("Finalizando todos los procesos de usuario...\n");
+    for (int i = 0; i < MAX_USUARIOS_SIMULTANEOS; i++) {
+        if (usuarios[i].pid > 0) {
+            if (usuarios[i].es_socket) {
+                limpiar_recursos_usuario(i);
+                continue;
+            }
+            kill(usuarios[i].pid, SIGTERM);
+            waitpid(usuarios[i].pid, NULL, 0);
             limpiar_recursos_usuario(i);
         }
     }
@@ -783,9 +5766,44 @@ int main() {
     }
 
     // Cierre de recursos.
+    detener_captura_trafico();
+    if (fd_escucha >= 0) {
+        char ruta[108];
+        if (modo_replica) {
+            snprintf(ruta, sizeof(ruta), "%s", config_inicial.socket_replica);
+        } else {
+            ruta_socket_shard(&config_inicial.shards, shard_id, ruta, sizeof(ruta));
+        }
+        close(fd_escucha);
+        unlink(ruta);
+    }
+    if (replica.fd_inotify >= 0) close(replica.fd_inotify);
+    for (int k = 0; k < MAX_CONEXIONES_ADMIN; k++) {
+        if (conexiones_admin[k].fd >= 0) close(conexiones_admin[k].fd);
+    }
+    if (fd_escucha_admin >= 0) {
+        close(fd_escucha_admin);
+        unlink(ruta_admin);
+    }
+    if (fd_escucha_2pc >= 0) {
+        char ruta[108];
+        ruta_socket_2pc(shard_id, ruta, sizeof(ruta));
+        close(fd_escucha_2pc);
+        unlink(ruta);
+        enviar_lote_2pc();
+        printf("Transferencias entre shards: %lu registros en el log, %lu sincronizaciones\n",
+               registros_2pc, sincronizaciones_2pc);
+    }
+    detener_hilos_lectores();
+    liberar_configs_retiradas();
+    if (!modo_replica && guardar_punto_indice() < 0) perror("Error al guardar el punto de control del índice");
+    close(fd_despertar);
+    vaciar_log();
+    cerrar_motor_uring();
     fclose(log_file);
-    sem_close(sem);
-    sem_unlink("/cuentas_semaphore");
+    liberar_almacen_cuentas();
+    sem_close(sem_cuentas);
+    sem_unlink(nombre_semaforo);
 
     printf("Proceso del banco finalizado correctamente.\n");
     return EXIT_SUCCESS;
@@ -0,0 +1,440 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <zlib.h>
+
+/**
+ * Análisis offline del log de transacciones en paralelo.
+ *
+ * Proyecta en memoria (mmap) los segmentos rotados y el log activo, los reparte
+ * en trozos que empiezan y terminan en un salto de línea (cada bloque comprimido
+ * de un segmento ya es un trozo) y los agrega con varios hilos, cada uno con su
+ * propia tabla hash. Al final se fusionan las tablas.
+ *
+ * Por cuenta y día calcula ingresos y egresos (líneas "Movimiento") y el número
+ * de retiros y de transferencias salientes aplicados, que cada línea lleva en
+ * "retiros=N transferencias=N". Marca los días que superan UMBRAL_RETIROS o
+ * UMBRAL_TRANSFERENCIAS, como las reglas de velocidad del monitor. En los logs
+ * anteriores a esos campos, cada movimiento negativo cuenta como un retiro.
+ *
+ * Uso: ./banco_analisis [-f archivo_log] [-t hilos] [-n top] [-u umbral] [-T umbral] [-j]
+ *   -f  Log activo (por defecto ARCHIVO_LOG de ../config/config.txt)
+ *   -t  Hilos de trabajo (por defecto, los núcleos disponibles)
+ *   -n  En lugar del informe diario, las N cuentas con más volumen
+ *   -u  Umbral de retiros por día (por defecto UMBRAL_RETIROS)
+ *   -T  Umbral de transferencias salientes por día (por defecto UMBRAL_TRANSFERENCIAS)
+ *   -j  Salida JSON en lugar de CSV
+ *
+ * Ejemplo: ./banco_analisis -n 10 -j > top10.json
+ */
+
+#define CONFIG_FILE "../config/config.txt"
+#define LOG_FILE "../data/transacciones.log"
+#define MAGIA_SEGMENTO "BLOGSEG1"
+#define BITS_BLOOM_BLOQUE 512
+#define TAM_TROZO_TEXTO (8 * 1024 * 1024)
+#define MAX_HILOS 64
+
+// Mismo formato que escribe rotar_log() en banco.c
+typedef struct {
+    char magia[8];
+    uint32_t version;
+    uint32_t num_bloques;
+    int64_t desplazamiento_base;
+    int64_t bytes_originales;
+    int64_t posicion_indice;
+    int64_t instante_min;
+    int64_t instante_max;
+} CabeceraSegmento;
+
+typedef struct {
+    int64_t posicion;
+    uint32_t tam_comprimido;
+    uint32_t tam_original;
+    uint32_t num_lineas;
+    int32_t cuenta_min;
+    int32_t cuenta_max;
+    uint32_t bits_bloom;
+    int64_t instante_min;
+    int64_t instante_max;
+    int64_t desplazamiento_log;
+    uint8_t bloom[BITS_BLOOM_BLOQUE / 8];
+} EntradaBloque;
+
+// Trozo de trabajo: texto plano del log activo o un bloque comprimido de un segmento
+typedef struct {
+    const char *datos;
+    size_t tam;
+    size_t tam_original;   // > 0 si el trozo está comprimido con zlib
+} Trozo;
+
+// Agregado por cuenta y día (dia = AAAAMMDD, 0 si la línea no tiene fecha)
+typedef struct {
+    int32_t cuenta;        // 0 = hueco libre
+    int32_t dia;
+    double ingresos;
+    double egresos;
+    long retiros;
+    long transferencias;   // Salientes
+    long movimientos;
+} Agregado;
+
+// Tabla hash de direccionamiento abierto
+typedef struct {
+    Agregado *entradas;
+    size_t capacidad;
+    size_t num;
+} TablaAgregados;
+
+typedef struct {
+    Trozo *trozos;
+    int num_trozos;
+    atomic_int siguiente;
+} ColaTrozos;
+
+typedef struct {
+    ColaTrozos *cola;
+    TablaAgregados tabla;
+    long lineas;
+} TrabajoHilo;
+
+static int tabla_iniciar(TablaAgregados *t, size_t capacidad) {
+    t->entradas = calloc(capacidad, sizeof(Agregado));
+    t->capacidad = capacidad;
+    t->num = 0;
+    return t->entradas != NULL ? 0 : -1;
+}
+
+static size_t hash_clave(int32_t cuenta, int32_t dia) {
+    uint64_t h = ((uint64_t)(uint32_t)cuenta << 32) | (uint32_t)dia;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+
+static Agregado *tabla_obtener(TablaAgregados *t, int32_t cuenta, int32_t dia);
+
+static int tabla_crecer(TablaAgregados *t) {
+    TablaAgregados nueva;
+    if (tabla_iniciar(&nueva, t->capacidad * 2) < 0) return -1;
+    for (size_t i = 0; i < t->capacidad; i++) {
+        Agregado *a = &t->entradas[i];
+        if (a->cuenta == 0) continue;
+        *tabla_obtener(&nueva, a->cuenta, a->dia) = *a;
+    }
+    free(t->entradas);
+    *t = nueva;
+    return 0;
+}
+
+// Devuelve la entrada de (cuenta, dia), creándola si no existe
+static Agregado *tabla_obtener(TablaAgregados *t, int32_t cuenta, int32_t dia) {
+    if ((t->num + 1) * 10 > t->capacidad * 7 && tabla_crecer(t) < 0) {
+        perror("Error al ampliar la tabla de agregados");
+        exit(EXIT_FAILURE);
+    }
+    size_t i = hash_clave(cuenta, dia) & (t->capacidad - 1);
+    while (t->entradas[i].cuenta != 0) {
+        if (t->entradas[i].cuenta == cuenta && t->entradas[i].dia == dia) return &t->entradas[i];
+        i = (i + 1) & (t->capacidad - 1);
+    }
+    t->entradas[i].cuenta = cuenta;
+    t->entradas[i].dia = dia;
+    t->num++;
+    return &t->entradas[i];
+}
+
+// Fecha AAAAMMDD de la marca "[YYYY-MM-DD HH:MM:SS]" al inicio de la línea
+static int32_t dia_linea_log(const char *linea, const char *fin) {
+    if (fin - linea < 12 || linea[0] != '[' || linea[5] != '-' || linea[8] != '-') return 0;
+    int anio = atoi(linea + 1), mes = atoi(linea + 6), dia = atoi(linea + 9);
+    return anio * 10000 + mes * 100 + dia;
+}
+
+// Agrega una línea del log a la tabla del hilo. Sólo cuentan los movimientos: la petición
+// ("Usuario (Cuenta N): Retiro de ...") y su posible [ERROR] no dicen si el retiro se aplicó.
+static void agregar_linea(TablaAgregados *t, const char *linea, const char *fin) {
+    const char *p;
+    if ((p = memmem(linea, fin - linea, "Movimiento (Cuenta ", 19)) != NULL) {
+        int cuenta = atoi(p + 19);
+        const char *monto = memchr(p, ':', fin - p);
+        if (cuenta <= 0 || monto == NULL) return;
+        double valor = strtod(monto + 1, NULL);
+        Agregado *a = tabla_obtener(t, cuenta, dia_linea_log(linea, fin));
+        if (valor >= 0) a->ingresos += valor;
+        else a->egresos -= valor;
+
+        const char *retiros = memmem(monto, fin - monto, " retiros=", 9);
+        const char *transferencias = memmem(monto, fin - monto, " transferencias=", 16);
+        if (retiros != NULL && transferencias != NULL) {
+            a->retiros += atol(retiros + 9);
+            a->transferencias += atol(transferencias + 16);
+        } else if (valor < 0) {
+            a->retiros++;   // Línea sin el tipo de operación
+        }
+        a->movimientos++;
+    }
+}
+
+static void agregar_texto(TrabajoHilo *trabajo, const char *texto, size_t tam) {
+    const char *p = texto, *fin = texto + tam;
+    while (p < fin) {
+        const char *salto = memchr(p, '\n', fin - p);
+        const char *fin_linea = salto ? salto : fin;
+        agregar_linea(&trabajo->tabla, p, fin_linea);
+        trabajo->lineas++;
+        p = fin_linea + 1;
+    }
+}
+
+void *hilo_analisis(void *arg) {
+    TrabajoHilo *trabajo = arg;
+    char *buffer = NULL;
+    size_t tam_buffer = 0;
+
+    while (1) {
+        int i = atomic_fetch_add(&trabajo->cola->siguiente, 1);
+        if (i >= trabajo->cola->num_trozos) break;
+        Trozo *trozo = &trabajo->cola->trozos[i];
+
+        if (trozo->tam_original == 0) {
+            agregar_texto(trabajo, trozo->datos, trozo->tam);
+            continue;
+        }
+        if (trozo->tam_original > tam_buffer) {
+            free(buffer);
+            tam_buffer = trozo->tam_original;
+            buffer = malloc(tam_buffer);
+            if (buffer == NULL) {
+                perror("Error al reservar el buffer de descompresión");
+                exit(EXIT_FAILURE);
+            }
+        }
+        uLongf tam_texto = trozo->tam_original;
+        if (uncompress((Bytef *)buffer, &tam_texto, (const Bytef *)trozo->datos, trozo->tam) != Z_OK) {
+            fprintf(stderr, "Aviso: bloque comprimido inválido, se omite\n");
+            continue;
+        }
+        agregar_texto(trabajo, buffer, tam_texto);
+    }
+    free(buffer);
+    return NULL;
+}
+
+static int anadir_trozo(ColaTrozos *cola, int *capacidad, Trozo trozo) {
+    if (cola->num_trozos == *capacidad) {
+        *capacidad = *capacidad ? *capacidad * 2 : 256;
+        Trozo *nuevos = realloc(cola->trozos, *capacidad * sizeof(Trozo));
+        if (nuevos == NULL) return -1;
+        cola->trozos = nuevos;
+    }
+    cola->trozos[cola->num_trozos++] = trozo;
+    return 0;
+}
+
+// Proyecta un archivo en memoria de solo lectura (NULL si no existe o está vacío)
+static const char *proyectar_archivo(const char *ruta, size_t *tam) {
+    int fd = open(ruta, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    void *datos = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (datos == MAP_FAILED) return NULL;
+    madvise(datos, st.st_size, MADV_SEQUENTIAL);
+    *tam = st.st_size;
+    return datos;
+}
+
+// Cada bloque comprimido de un segmento es un trozo
+static void repartir_segmento(const char *datos, size_t tam, ColaTrozos *cola, int *capacidad) {
+    const CabeceraSegmento *cabecera = (const CabeceraSegmento *)datos;
+    if (tam < sizeof(CabeceraSegmento) || memcmp(cabecera->magia, MAGIA_SEGMENTO, 8) != 0 ||
+        cabecera->posicion_indice + (int64_t)(cabecera->num_bloques * sizeof(EntradaBloque)) > (int64_t)tam) {
+        fprintf(stderr, "Aviso: segmento inválido, se omite\n");
+        return;
+    }
+    const EntradaBloque *entradas = (const EntradaBloque *)(datos + cabecera->posicion_indice);
+    for (uint32_t b = 0; b < cabecera->num_bloques; b++) {
+        Trozo trozo = {datos + entradas[b].posicion, entradas[b].tam_comprimido, entradas[b].tam_original};
+        anadir_trozo(cola, capacidad, trozo);
+    }
+}
+
+// El texto plano se corta en trozos de ~8 MB ajustados al siguiente salto de línea
+static void repartir_texto(const char *datos, size_t tam, ColaTrozos *cola, int *capacidad) {
+    size_t inicio = 0;
+    while (inicio < tam) {
+        size_t fin = inicio + TAM_TROZO_TEXTO < tam ? inicio + TAM_TROZO_TEXTO : tam;
+        const char *salto = fin < tam ? memchr(datos + fin, '\n', tam - fin) : NULL;
+        fin = salto ? (size_t)(salto - datos) + 1 : tam;
+        Trozo trozo = {datos + inicio, fin - inicio, 0};
+        anadir_trozo(cola, capacidad, trozo);
+        inicio = fin;
+    }
+}
+
+// Lee ARCHIVO_LOG, UMBRAL_RETIROS y UMBRAL_TRANSFERENCIAS del archivo de configuración, como banco.c
+static void leer_configuracion_analisis(char *ruta, size_t tam, int *umbral, int *umbral_transferencias) {
+    char line[256];
+    snprintf(ruta, tam, "%s", LOG_FILE);
+    FILE *file = fopen(CONFIG_FILE, "r");
+    if (file == NULL) return;
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = 0;
+        if (strncmp(line, "ARCHIVO_LOG=", 12) == 0 && line[12] != '\0') {
+            snprintf(ruta, tam, "%s", line + 12);
+        } else if (strncmp(line, "UMBRAL_RETIROS=", 15) == 0) {
+            *umbral = atoi(line + 15);
+        } else if (strncmp(line, "UMBRAL_TRANSFERENCIAS=", 22) == 0) {
+            *umbral_transferencias = atoi(line + 22);
+        }
+    }
+    fclose(file);
+}
+
+static int comparar_cuenta_dia(const void *a, const void *b) {
+    const Agregado *x = a, *y = b;
+    if (x->cuenta != y->cuenta) return (x->cuenta > y->cuenta) - (x->cuenta < y->cuenta);
+    return (x->dia > y->dia) - (x->dia < y->dia);
+}
+
+static int comparar_volumen(const void *a, const void *b) {
+    const Agregado *x = a, *y = b;
+    double vx = x->ingresos + x->egresos, vy = y->ingresos + y->egresos;
+    return (vx < vy) - (vx > vy);
+}
+
+static void imprimir_dia(int32_t dia, char *salida, size_t tam) {
+    if (dia == 0) snprintf(salida, tam, "sin-fecha");
+    else snprintf(salida, tam, "%04d-%02d-%02d", dia / 10000, (dia / 100) % 100, dia % 100);
+}
+
+int main(int argc, char *argv[]) {
+    char ruta_log[256];
+    int num_hilos = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int top = 0, umbral = 3, umbral_transferencias = 2, json = 0, opcion;
+
+    leer_configuracion_analisis(ruta_log, sizeof(ruta_log), &umbral, &umbral_transferencias);
+    while ((opcion = getopt(argc, argv, "f:t:n:u:T:j")) != -1) {
+        switch (opcion) {
+            case 'f': snprintf(ruta_log, sizeof(ruta_log), "%s", optarg); break;
+            case 't': num_hilos = atoi(optarg); break;
+            case 'n': top = atoi(optarg); break;
+            case 'u': umbral = atoi(optarg); break;
+            case 'T': umbral_transferencias = atoi(optarg); break;
+            case 'j': json = 1; break;
+            default:
+                fprintf(stderr, "Uso: %s [-f archivo_log] [-t hilos] [-n top] [-u umbral] [-T umbral] [-j]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (num_hilos < 1) num_hilos = 1;
+    if (num_hilos > MAX_HILOS) num_hilos = MAX_HILOS;
+
+    // Repartir segmentos (<log>.1.seg, <log>.2.seg, ...) y el log activo en trozos
+    ColaTrozos cola = {NULL, 0, 0};
+    int capacidad = 0;
+    char ruta_segmento[300];
+    size_t tam;
+    for (int n = 1; ; n++) {
+        snprintf(ruta_segmento, sizeof(ruta_segmento), "%s.%d.seg", ruta_log, n);
+        if (access(ruta_segmento, R_OK) != 0) break;
+        const char *datos = proyectar_archivo(ruta_segmento, &tam);
+        if (datos != NULL) repartir_segmento(datos, tam, &cola, &capacidad);
+    }
+    const char *activo = proyectar_archivo(ruta_log, &tam);
+    if (activo != NULL) repartir_texto(activo, tam, &cola, &capacidad);
+
+    // Agregar en paralelo con una tabla por hilo
+    pthread_t hilos[MAX_HILOS];
+    TrabajoHilo trabajos[MAX_HILOS];
+    for (int i = 0; i < num_hilos; i++) {
+        trabajos[i].cola = &cola;
+        trabajos[i].lineas = 0;
+        if (tabla_iniciar(&trabajos[i].tabla, 1024) < 0 ||
+            pthread_create(&hilos[i], NULL, hilo_analisis, &trabajos[i]) != 0) {
+            perror("Error al crear hilo de análisis");
+            return 1;
+        }
+    }
+
+    // Fusionar las tablas locales
+    TablaAgregados total;
+    long lineas = 0;
+    tabla_iniciar(&total, 1024);
+    for (int i = 0; i < num_hilos; i++) {
+        pthread_join(hilos[i], NULL);
+        lineas += trabajos[i].lineas;
+        for (size_t j = 0; j < trabajos[i].tabla.capacidad; j++) {
+            Agregado *a = &trabajos[i].tabla.entradas[j];
+            if (a->cuenta == 0) continue;
+            // En el modo top se acumula por cuenta, sin separar días
+            Agregado *t = tabla_obtener(&total, a->cuenta, top > 0 ? 0 : a->dia);
+            t->ingresos += a->ingresos;
+            t->egresos += a->egresos;
+            t->retiros += a->retiros;
+            t->transferencias += a->transferencias;
+            t->movimientos += a->movimientos;
+        }
+        free(trabajos[i].tabla.entradas);
+    }
+
+    // Compactar y ordenar
+    size_t n = 0;
+    for (size_t j = 0; j < total.capacidad; j++) {
+        if (total.entradas[j].cuenta != 0) total.entradas[n++] = total.entradas[j];
+    }
+    qsort(total.entradas, n, sizeof(Agregado), top > 0 ? comparar_volumen : comparar_cuenta_dia);
+    if (top > 0 && (size_t)top < n) n = top;
+
+    if (json) printf("{\"lineas\": %ld, \"%s\": [\n", lineas, top > 0 ? "top" : "diario");
+    else if (top > 0) printf("cuenta,ingresos,egresos,volumen,movimientos,retiros,transferencias\n");
+    else printf("cuenta,dia,ingresos,egresos,movimientos,retiros,transferencias,"
+                "supera_umbral_retiros,supera_umbral_transferencias\n");
+
+    for (size_t j = 0; j < n; j++) {
+        Agregado *a = &total.entradas[j];
+        char dia[16];
+        imprimir_dia(a->dia, dia, sizeof(dia));
+        int alerta = a->retiros > umbral;
+        int alerta_transferencias = a->transferencias > umbral_transferencias;
+        if (json && top > 0) {
+            printf("  {\"cuenta\": %d, \"ingresos\": %.2f, \"egresos\": %.2f, \"volumen\": %.2f, "
+                   "\"movimientos\": %ld, \"retiros\": %ld, \"transferencias\": %ld}%s\n", a->cuenta, a->ingresos,
+                   a->egresos, a->ingresos + a->egresos, a->movimientos, a->retiros, a->transferencias,
+                   j + 1 < n ? "," : "");
+        } else if (json) {
+            printf("  {\"cuenta\": %d, \"dia\": \"%s\", \"ingresos\": %.2f, \"egresos\": %.2f, "
+                   "\"movimientos\": %ld, \"retiros\": %ld, \"transferencias\": %ld, "
+                   "\"supera_umbral_retiros\": %s, \"supera_umbral_transferencias\": %s}%s\n",
+                   a->cuenta, dia, a->ingresos, a->egresos, a->movimientos, a->retiros, a->transferencias,
+                   alerta ? "true" : "false", alerta_transferencias ? "true" : "false", j + 1 < n ? "," : "");
+        } else if (top > 0) {
+            printf("%d,%.2f,%.2f,%.2f,%ld,%ld,%ld\n", a->cuenta, a->ingresos, a->egresos,
+                   a->ingresos + a->egresos, a->movimientos, a->retiros, a->transferencias);
+        } else {
+            printf("%d,%s,%.2f,%.2f,%ld,%ld,%ld,%d,%d\n", a->cuenta, dia, a->ingresos, a->egresos,
+                   a->movimientos, a->retiros, a->transferencias, alerta, alerta_transferencias);
+        }
+    }
+    if (json) printf("]}\n");
+
+    fprintf(stderr, "Analizadas %ld líneas en %d trozos con %d hilos\n", lineas, cola.num_trozos, num_hilos);
+    free(total.entradas);
+    free(cola.trozos);
+    return EXIT_SUCCESS;
+}
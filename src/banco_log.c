@@ -0,0 +1,353 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <zlib.h>
+
+/**
+ * Consulta el log de transacciones del banco: los segmentos rotados y
+ * comprimidos (<ARCHIVO_LOG>.<N>.seg) y el log activo.
+ *
+ * Usa el índice disperso de cada segmento (rango de tiempo, rango de cuentas
+ * y filtro de Bloom por bloque) para descomprimir solo los bloques que pueden
+ * contener líneas que coincidan.
+ *
+ * Uso: ./banco_log [-f archivo_log] [-c cuenta] [-d desde] [-h hasta] [-o posicion] [-e]
+ *   -f  Log activo (por defecto ARCHIVO_LOG de ../config/config.txt)
+ *   -c  Solo líneas de esa cuenta
+ *   -d  Desde "YYYY-MM-DD HH:MM:SS" o segundos desde epoch
+ *   -h  Hasta "YYYY-MM-DD HH:MM:SS" o segundos desde epoch
+ *   -o  Muestra la línea en esa posición lógica (desplazamiento_log del índice .idx)
+ *   -e  Muestra estadísticas de segmentos y compresión
+ *
+ * Ejemplo: ./banco_log -c 1001 -d "2026-10-01 00:00:00"
+ */
+
+#define CONFIG_FILE "../config/config.txt"
+#define LOG_FILE "../data/transacciones.log"
+#define BITS_BLOOM_BLOQUE 512   // Filtro fijo de los segmentos de versión 1
+#define HASHES_BLOOM 7          // Versión 2: filtro de tamaño variable detrás de cada bloque
+#define MAGIA_SEGMENTO "BLOGSEG1"
+
+// Mismo formato que escribe rotar_log() en banco.c
+typedef struct {
+    char magia[8];
+    uint32_t version;
+    uint32_t num_bloques;
+    int64_t desplazamiento_base;
+    int64_t bytes_originales;
+    int64_t posicion_indice;
+    int64_t instante_min;
+    int64_t instante_max;
+} CabeceraSegmento;
+
+typedef struct {
+    int64_t posicion;
+    uint32_t tam_comprimido;
+    uint32_t tam_original;
+    uint32_t num_lineas;
+    int32_t cuenta_min;
+    int32_t cuenta_max;
+    uint32_t bits_bloom;   // Versión 2 (0 en la 1)
+    int64_t instante_min;
+    int64_t instante_max;
+    int64_t desplazamiento_log;
+    uint8_t bloom[BITS_BLOOM_BLOQUE / 8];
+} EntradaBloque;
+
+// Filtros de la consulta
+typedef struct {
+    int cuenta;          // 0 = todas
+    int64_t desde;       // 0 = sin límite
+    int64_t hasta;       // 0 = sin límite
+    int64_t posicion;    // -1 = no buscar por posición
+} Filtro;
+
+// Contadores para las estadísticas (-e)
+typedef struct {
+    int segmentos;
+    long bloques;
+    long bloques_leidos;
+    int64_t bytes_originales;
+    int64_t bytes_comprimidos;
+    long lineas;
+    int errores;             // Segmentos o bloques que no se pudieron leer
+} Estadisticas;
+
+static int64_t instante_linea_log(const char *linea) {
+    struct tm tm_info;
+    memset(&tm_info, 0, sizeof(tm_info));
+    if (linea[0] != '[' || strptime(linea + 1, "%Y-%m-%d %H:%M:%S]", &tm_info) == NULL) return 0;
+    tm_info.tm_isdst = -1;
+    return (int64_t)mktime(&tm_info);
+}
+
+static int cuenta_linea_log(const char *linea) {
+    const char *p = linea;
+    while ((p = strstr(p, "uenta ")) != NULL) {
+        if (p > linea && (p[-1] == 'C' || p[-1] == 'c')) {
+            int cuenta = atoi(p + 6);
+            if (cuenta > 0) return cuenta;
+        }
+        p += 6;
+    }
+    return 0;
+}
+
+// Versión 1: dos funciones hash sobre 512 bits. Versión 2: h1 + i * h2 sobre "bits" bits
+static int bloom_contiene(const uint8_t *bloom, uint32_t bits, int cuenta) {
+    uint32_t h1 = (uint32_t)cuenta * 2654435761u;
+    uint32_t h2 = ((uint32_t)cuenta ^ 0x5bd1e995u) * 2246822519u;
+    if (bits == 0) {
+        return (bloom[(h1 % BITS_BLOOM_BLOQUE) / 8] & (1 << (h1 % 8))) &&
+               (bloom[(h2 % BITS_BLOOM_BLOQUE) / 8] & (1 << (h2 % 8)));
+    }
+    for (int i = 0; i < HASHES_BLOOM; i++, h1 += h2) {
+        uint32_t bit = h1 % bits;
+        if (!(bloom[bit / 8] & (1 << (bit % 8)))) return 0;
+    }
+    return 1;
+}
+
+// Comprueba la cuenta contra el filtro del bloque; en la versión 2 se lee de detrás del bloque comprimido
+static int bloque_contiene_cuenta(FILE *segmento, const EntradaBloque *e, int cuenta) {
+    if (e->bits_bloom == 0) return bloom_contiene(e->bloom, 0, cuenta);
+    uint8_t *bloom = malloc(e->bits_bloom / 8);
+    int contiene = 1;   // Ante un filtro ilegible se descomprime el bloque
+    if (bloom != NULL && fseek(segmento, e->posicion + e->tam_comprimido, SEEK_SET) == 0 &&
+        fread(bloom, 1, e->bits_bloom / 8, segmento) == e->bits_bloom / 8) {
+        contiene = bloom_contiene(bloom, e->bits_bloom, cuenta);
+    }
+    free(bloom);
+    return contiene;
+}
+
+// Acepta "YYYY-MM-DD HH:MM:SS", "YYYY-MM-DD" o segundos desde epoch
+static int64_t parsear_instante(const char *texto) {
+    struct tm tm_info;
+    memset(&tm_info, 0, sizeof(tm_info));
+    const char *fin = strptime(texto, "%Y-%m-%d %H:%M:%S", &tm_info);
+    if (fin == NULL) fin = strptime(texto, "%Y-%m-%d", &tm_info);
+    if (fin != NULL) {
+        tm_info.tm_isdst = -1;
+        return (int64_t)mktime(&tm_info);
+    }
+    return atoll(texto);
+}
+
+// Lee ARCHIVO_LOG del archivo de configuración, como banco.c
+static void ruta_log_configurada(char *ruta, size_t tam) {
+    char line[256];
+    snprintf(ruta, tam, "%s", LOG_FILE);
+    FILE *file = fopen(CONFIG_FILE, "r");
+    if (file == NULL) return;
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = 0;
+        if (strncmp(line, "ARCHIVO_LOG=", 12) == 0 && line[12] != '\0') {
+            snprintf(ruta, tam, "%s", line + 12);
+        }
+    }
+    fclose(file);
+}
+
+// Comprueba una línea contra los filtros de cuenta y tiempo
+static int linea_coincide(const char *linea, const Filtro *filtro) {
+    if (filtro->cuenta > 0 && cuenta_linea_log(linea) != filtro->cuenta) return 0;
+    if (filtro->desde > 0 || filtro->hasta > 0) {
+        int64_t instante = instante_linea_log(linea);
+        if (instante == 0) return 0;
+        if (filtro->desde > 0 && instante < filtro->desde) return 0;
+        if (filtro->hasta > 0 && instante > filtro->hasta) return 0;
+    }
+    return 1;
+}
+
+// Decide con el índice disperso si hace falta descomprimir el bloque
+static int bloque_puede_coincidir(FILE *segmento, const EntradaBloque *e, const Filtro *filtro) {
+    if (filtro->posicion >= 0) {
+        return filtro->posicion >= e->desplazamiento_log &&
+               filtro->posicion < e->desplazamiento_log + (int64_t)e->tam_original;
+    }
+    if (filtro->cuenta > 0) {
+        if (filtro->cuenta < e->cuenta_min || filtro->cuenta > e->cuenta_max) return 0;
+        if (!bloque_contiene_cuenta(segmento, e, filtro->cuenta)) return 0;
+    }
+    if ((filtro->desde > 0 || filtro->hasta > 0) && e->instante_min == 0) return 0;
+    if (filtro->desde > 0 && e->instante_max < filtro->desde) return 0;
+    if (filtro->hasta > 0 && e->instante_min > filtro->hasta) return 0;
+    return 1;
+}
+
+// Imprime las líneas que coinciden de un texto ya descomprimido que empieza en la posición lógica "base".
+// El texto debe tener espacio para un terminador en texto[tam].
+static void filtrar_texto(char *texto, size_t tam, int64_t base, const Filtro *filtro, Estadisticas *est) {
+    size_t inicio = 0;
+    texto[tam] = '\0';
+    while (inicio < tam) {
+        char *salto = memchr(texto + inicio, '\n', tam - inicio);
+        size_t fin = salto ? (size_t)(salto - texto) : tam;
+        texto[fin] = '\0';
+
+        if (filtro->posicion >= 0) {
+            if (filtro->posicion >= base + (int64_t)inicio && filtro->posicion <= base + (int64_t)fin) {
+                printf("%s\n", texto + inicio);
+                est->lineas++;
+            }
+        } else if (linea_coincide(texto + inicio, filtro)) {
+            printf("%s\n", texto + inicio);
+            est->lineas++;
+        }
+
+        inicio = fin + 1;
+    }
+}
+
+/// @brief Consulta un segmento comprimido usando su índice. Con una cabecera válida deja en
+///        "fin" la posición lógica siguiente al segmento, como hace abrir_log en banco.c.
+/// @return 0 si se leyó, -1 si el segmento no existe o es inválido
+static int consultar_segmento(const char *ruta, const Filtro *filtro, Estadisticas *est, int64_t *fin) {
+    FILE *segmento = fopen(ruta, "rb");
+    if (segmento == NULL) return -1;
+
+    CabeceraSegmento cabecera;
+    if (fread(&cabecera, sizeof(cabecera), 1, segmento) != 1 || memcmp(cabecera.magia, MAGIA_SEGMENTO, 8) != 0) {
+        fprintf(stderr, "Error: %s no es un segmento válido\n", ruta);
+        est->errores++;
+        fclose(segmento);
+        return -1;
+    }
+    *fin = cabecera.desplazamiento_base + cabecera.bytes_originales;
+    est->segmentos++;
+    est->bloques += cabecera.num_bloques;
+    est->bytes_originales += cabecera.bytes_originales;
+    est->bytes_comprimidos += cabecera.posicion_indice;
+
+    // Descartar el segmento entero por rango de tiempo o de posición
+    int descartar = 0;
+    if (filtro->posicion >= 0) {
+        descartar = filtro->posicion < cabecera.desplazamiento_base ||
+                    filtro->posicion >= cabecera.desplazamiento_base + cabecera.bytes_originales;
+    } else if (filtro->desde > 0 || filtro->hasta > 0) {
+        descartar = cabecera.instante_min == 0 ||
+                    (filtro->desde > 0 && cabecera.instante_max < filtro->desde) ||
+                    (filtro->hasta > 0 && cabecera.instante_min > filtro->hasta);
+    }
+    if (descartar) {
+        fclose(segmento);
+        return 0;
+    }
+
+    EntradaBloque *entradas = malloc(cabecera.num_bloques * sizeof(EntradaBloque) + 1);
+    fseek(segmento, cabecera.posicion_indice, SEEK_SET);
+    if (entradas == NULL || fread(entradas, sizeof(EntradaBloque), cabecera.num_bloques, segmento) != cabecera.num_bloques) {
+        fprintf(stderr, "Error: índice corrupto en %s\n", ruta);
+        est->errores++;
+        free(entradas);
+        fclose(segmento);
+        return -1;
+    }
+
+    for (uint32_t b = 0; b < cabecera.num_bloques; b++) {
+        EntradaBloque *e = &entradas[b];
+        if (!bloque_puede_coincidir(segmento, e, filtro)) continue;
+
+        Bytef *comprimido = malloc(e->tam_comprimido);
+        char *texto = malloc(e->tam_original + 1);
+        uLongf tam_texto = e->tam_original;
+        fseek(segmento, e->posicion, SEEK_SET);
+        if (comprimido != NULL && texto != NULL &&
+            fread(comprimido, 1, e->tam_comprimido, segmento) == e->tam_comprimido &&
+            uncompress((Bytef *)texto, &tam_texto, comprimido, e->tam_comprimido) == Z_OK) {
+            est->bloques_leidos++;
+            filtrar_texto(texto, tam_texto, e->desplazamiento_log, filtro, est);
+        } else {
+            fprintf(stderr, "Error: no se pudo descomprimir el bloque %u de %s\n", b, ruta);
+            est->errores++;
+        }
+        free(comprimido);
+        free(texto);
+    }
+
+    free(entradas);
+    fclose(segmento);
+    return 0;
+}
+
+// El log activo no tiene índice: se recorre completo (su tamaño está acotado por TAM_MAX_LOG)
+static void consultar_log_activo(const char *ruta, int64_t base, const Filtro *filtro, Estadisticas *est) {
+    FILE *archivo = fopen(ruta, "r");
+    if (archivo == NULL) {
+        fprintf(stderr, "Aviso: no se pudo abrir %s (%s)\n", ruta, strerror(errno));
+        return;
+    }
+    char linea[4096];
+    int64_t posicion = base;
+    while (fgets(linea, sizeof(linea), archivo)) {
+        size_t largo = strlen(linea);
+        int coincide = filtro->posicion >= 0
+                           ? (filtro->posicion >= posicion && filtro->posicion < posicion + (int64_t)largo)
+                           : linea_coincide(linea, filtro);
+        if (coincide) {
+            fputs(linea, stdout);
+            est->lineas++;
+        }
+        posicion += largo;
+    }
+    fclose(archivo);
+}
+
+int main(int argc, char *argv[]) {
+    char ruta_log[256];
+    Filtro filtro = {0, 0, 0, -1};
+    Estadisticas est;
+    int mostrar_estadisticas = 0;
+    int opcion;
+
+    memset(&est, 0, sizeof(est));
+    ruta_log_configurada(ruta_log, sizeof(ruta_log));
+
+    while ((opcion = getopt(argc, argv, "f:c:d:h:o:e")) != -1) {
+        switch (opcion) {
+            case 'f': snprintf(ruta_log, sizeof(ruta_log), "%s", optarg); break;
+            case 'c': filtro.cuenta = atoi(optarg); break;
+            case 'd': filtro.desde = parsear_instante(optarg); break;
+            case 'h': filtro.hasta = parsear_instante(optarg); break;
+            case 'o': filtro.posicion = atoll(optarg); break;
+            case 'e': mostrar_estadisticas = 1; break;
+            default:
+                fprintf(stderr, "Uso: %s [-f archivo_log] [-c cuenta] [-d desde] [-h hasta] [-o posicion] [-e]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    // Segmentos en orden (<log>.1.seg, <log>.2.seg, ...) y al final el log activo. La base del
+    // activo sale de la cabecera del último segmento válido, no de sumar los que se leyeron.
+    char ruta_segmento[300];
+    int64_t base_activo = 0;
+    for (int n = 1; ; n++) {
+        snprintf(ruta_segmento, sizeof(ruta_segmento), "%s.%d.seg", ruta_log, n);
+        if (access(ruta_segmento, R_OK) != 0) break;
+        consultar_segmento(ruta_segmento, &filtro, &est, &base_activo);
+    }
+    consultar_log_activo(ruta_log, base_activo, &filtro, &est);
+
+    if (mostrar_estadisticas) {
+        fprintf(stderr, "\nSegmentos: %d, bloques: %ld (leídos %ld), líneas mostradas: %ld\n",
+                est.segmentos, est.bloques, est.bloques_leidos, est.lineas);
+        if (est.bytes_comprimidos > 0) {
+            fprintf(stderr, "Texto original: %lld bytes, comprimido: %lld bytes (%.1fx)\n",
+                    (long long)est.bytes_originales, (long long)est.bytes_comprimidos,
+                    (double)est.bytes_originales / est.bytes_comprimidos);
+        }
+    }
+    if (est.errores > 0) {
+        fprintf(stderr, "Error: %d segmentos o bloques no se pudieron leer; el resultado puede estar incompleto\n",
+                est.errores);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,679 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "shards.h"
+#include "trafico.h"
+
+/**
+ * Reproducción de tráfico grabado contra un banco, para pruebas de regresión de rendimiento.
+ *
+ * Lee un archivo de tráfico (trafico.h): una captura de banco (orden de administración
+ * "capturar <ruta>" o CAPTURA_TRAFICO) o el tráfico sintético de generar_cuentas. Abre
+ * una conexión por sesión con el socket del banco y envía cada línea en su instante: al
+ * ritmo de la grabación (-x 1), N veces más rápido (-x N) o sin esperas (-m). Como el
+ * banco tiene un número fijo de sesiones por shard, una sesión nueva espera a que se
+ * cierre otra si ya están todas ocupadas; sus líneas se acumulan mientras tanto y su
+ * latencia cuenta desde el instante en que tocaba enviarlas.
+ *
+ * Con -m cada sesión se comporta como un cliente: envía su siguiente línea en cuanto tiene
+ * la respuesta de la anterior, así que mide el rendimiento máximo sin amontonar peticiones.
+ *
+ * Mide la latencia de cada respuesta (desde el envío de la petición) y, si la grabación
+ * las tiene, compara las respuestas de cada sesión con las grabadas (sin tener en cuenta
+ * el orden, porque las consultas pueden adelantar a las escrituras, ni las fechas) y las
+ * latencias con las de la grabación, que mide el banco desde que recibe la línea hasta
+ * que encola la respuesta. Los avisos [NOTIF:...] no se comparan ni cuentan como respuesta.
+ *
+ * Uso: ./banco_replay [-x velocidad | -m] [-s socket] [-c sesiones] [-w segundos] [-d N] [-j] archivo
+ *   -x  Factor de velocidad (por defecto 1, el ritmo de la grabación)
+ *   -m  Lo más rápido posible
+ *   -s  Socket del banco (por defecto SOCKET_ROUTER si NUM_SHARDS > 1, si no el del shard 0)
+ *   -c  Sesiones abiertas a la vez como máximo (por defecto, 10 por shard)
+ *   -w  Espera máxima de las últimas respuestas (por defecto 10 s)
+ *   -d  Diferencias de respuesta que se muestran (por defecto 10)
+ *   -j  Resumen en JSON
+ *
+ * Termina con 1 si alguna respuesta difiere de la grabada o se quedó sin respuesta. Para
+ * una comparación exacta, el banco debe arrancar con las cuentas que tenía al empezar la
+ * captura; aun así, los saldos pueden diferir si sesiones que comparten cuentas se
+ * intercalan de otra forma que en la grabación.
+ *
+ * Ejemplo: ./banco_replay -x 4 ../data/captura.bin
+ */
+
+#define CONFIG_FILE "../config/config.txt"
+#define TAM_ENTRADA_REPLAY (64 * 1024)
+#define REGISTROS_POR_VUELTA 4096      // Con -m, registros que se envían entre dos poll
+#define SESIONES_POR_SHARD 10          // MAX_USUARIOS_SIMULTANEOS de banco
+
+#define SESION_SIN_ABRIR 0
+#define SESION_EN_ESPERA 1             // Todas las sesiones del banco ocupadas: se acumulan sus líneas
+#define SESION_ABIERTA 2
+#define SESION_CERRANDO 3              // Se cerró la escritura; se esperan las últimas respuestas
+#define SESION_CERRADA 4
+
+typedef struct {
+    uint64_t instante_us;
+    uint32_t sesion;
+    uint8_t tipo;
+    uint16_t largo;
+    char *texto;                       // Terminado en '\0'
+} Registro;
+
+typedef struct {
+    char *texto;
+    size_t largo;
+} Mensaje;
+
+typedef struct {
+    Mensaje *datos;
+    size_t num;
+    size_t tam;
+} VectorMensajes;
+
+typedef struct {
+    int64_t *datos;
+    size_t num;
+    size_t tam;
+} VectorInstantes;
+
+typedef struct {
+    double *us;
+    size_t num;
+    size_t tam;
+} Latencias;
+
+typedef struct {
+    int fd;
+    int estado;
+    int fin_pedido;                    // La grabación cerró la sesión: se cierra al vaciar la salida
+    char *salida;
+    size_t salida_usados;
+    size_t salida_tam;
+    char *entrada;
+    size_t entrada_usados;
+    VectorInstantes envios;            // Instantes de envío (ns) de las peticiones que esperan respuesta
+    size_t respondidas;
+    VectorMensajes grabadas;           // Respuestas de la grabación, con las fechas enmascaradas
+    VectorMensajes obtenidas;          // Respuestas recibidas (copias), para compararlas al cerrar
+    size_t *cola;                      // Con -m: registros de la sesión pendientes de enviar
+    size_t cola_inicio;
+    size_t cola_num;
+    size_t cola_tam;
+} SesionReplay;
+
+typedef struct {
+    unsigned long enviadas;
+    unsigned long respuestas;
+    unsigned long sin_respuesta;
+    unsigned long avisos;
+    unsigned long sobrecargas;
+    unsigned long comparadas;
+    unsigned long distintas;
+    unsigned long errores_conexion;
+    unsigned long no_enviadas;         // Líneas de sesiones que no se pudieron abrir
+} Resultado;
+
+static Registro *registros;
+static size_t num_registros;
+static SesionReplay *sesiones;
+static uint32_t num_sesiones;
+static Resultado resultado;
+static Latencias latencias_grabadas, latencias_replay;
+static int diferencias_mostradas = 10;
+
+static int64_t ahora_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void *crecer(void *datos, size_t *tam, size_t elemento) {
+    size_t nuevo = *tam > 0 ? *tam * 2 : 16;
+    void *p = realloc(datos, nuevo * elemento);
+    if (p == NULL) {
+        fprintf(stderr, "Sin memoria\n");
+        exit(1);
+    }
+    *tam = nuevo;
+    return p;
+}
+
+static void anadir_latencia(Latencias *l, double us) {
+    if (l->num == l->tam) l->us = crecer(l->us, &l->tam, sizeof(double));
+    l->us[l->num++] = us;
+}
+
+static void anadir_instante(VectorInstantes *v, int64_t instante) {
+    if (v->num == v->tam) v->datos = crecer(v->datos, &v->tam, sizeof(int64_t));
+    v->datos[v->num++] = instante;
+}
+
+static void anadir_mensaje(VectorMensajes *v, char *texto, size_t largo) {
+    if (v->num == v->tam) v->datos = crecer(v->datos, &v->tam, sizeof(Mensaje));
+    v->datos[v->num++] = (Mensaje){texto, largo};
+}
+
+// Peticiones que el banco contesta; las demás (login, depósitos sin clave) sólo generan avisos
+static int espera_respuesta(const char *linea) {
+    return strncmp(linea, "ID:", 3) == 0 || strstr(linea, "MOVIMIENTOS:") != NULL || strstr(linea, "SALDOS:") != NULL ||
+           strstr(linea, "TX:") != NULL || strstr(linea, "SUSCRIBIR:") != NULL || strstr(linea, "saldo") != NULL;
+}
+
+static int es_aviso(const char *texto, size_t largo) {
+    return largo >= 7 && memcmp(texto, "[NOTIF:", 7) == 0;
+}
+
+/// @brief Separa el siguiente mensaje terminado en "FIN-MSG\n"
+/// @return Bytes consumidos, o 0 si no hay un mensaje completo
+static size_t siguiente_mensaje(char *datos, size_t largo, Mensaje *m) {
+    char *fin = memmem(datos, largo, "FIN-MSG\n", 8);
+    if (fin == NULL) return 0;
+    m->texto = datos;
+    m->largo = fin - datos;
+    if (m->largo > 0 && datos[m->largo - 1] == '\n') m->largo--;
+    return fin + 8 - datos;
+}
+
+// Las fechas "AAAA-MM-DD hh:mm:ss" (extractos de MOVIMIENTOS) cambian en cada ejecución
+static void enmascarar_fechas(char *s, size_t largo) {
+    static const char patron[] = "0000-00-00 00:00:00";
+    size_t n = sizeof(patron) - 1;
+    for (size_t i = 0; i + n <= largo; i++) {
+        size_t k = 0;
+        while (k < n && (patron[k] == '0' ? (s[i + k] >= '0' && s[i + k] <= '9') : s[i + k] == patron[k])) k++;
+        if (k < n) continue;
+        for (k = 0; k < n; k++) {
+            if (patron[k] == '0') s[i + k] = '#';
+        }
+        i += n - 1;
+    }
+}
+
+static int comparar_mensajes(const void *a, const void *b) {
+    const Mensaje *x = a, *y = b;
+    if (x->largo != y->largo) return x->largo < y->largo ? -1 : 1;
+    return memcmp(x->texto, y->texto, x->largo);
+}
+
+/// @brief Carga el archivo de tráfico en memoria y prepara, por sesión, las respuestas grabadas
+///        y las latencias de la grabación
+/// @return Sesiones abiertas a la vez como máximo en la grabación, o -1 si el archivo no es válido
+static int cargar_trafico(const char *ruta, CabeceraTrafico *cabecera) {
+    FILE *f = fopen(ruta, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Error al abrir %s: %s\n", ruta, strerror(errno));
+        return -1;
+    }
+    if (leer_cabecera_trafico(f, cabecera) < 0) {
+        fprintf(stderr, "%s no es un archivo de tráfico (versión %d)\n", ruta, VERSION_TRAFICO);
+        fclose(f);
+        return -1;
+    }
+
+    size_t tam_registros = 0;
+    static char texto[MAX_TEXTO_TRAFICO + 1];
+    RegistroTrafico r;
+    int leido;
+    while ((leido = leer_registro_trafico(f, &r, texto)) == 1) {
+        if (num_registros == tam_registros) registros = crecer(registros, &tam_registros, sizeof(Registro));
+        char *copia = malloc(r.largo + 1);
+        if (copia == NULL) {
+            fprintf(stderr, "Sin memoria\n");
+            exit(1);
+        }
+        memcpy(copia, texto, r.largo + 1);
+        registros[num_registros++] = (Registro){r.instante_us, r.sesion, r.tipo, r.largo, copia};
+        if (r.sesion >= num_sesiones) num_sesiones = r.sesion + 1;
+    }
+    fclose(f);
+    if (leido < 0) fprintf(stderr, "Aviso: %s está truncado; se reproducen %zu registros\n", ruta, num_registros);
+
+    sesiones = calloc(num_sesiones > 0 ? num_sesiones : 1, sizeof(SesionReplay));
+    if (sesiones == NULL) {
+        fprintf(stderr, "Sin memoria\n");
+        exit(1);
+    }
+    int abiertas = 0, max_abiertas = 0;
+    for (size_t k = 0; k < num_registros; k++) {
+        Registro *reg = &registros[k];
+        SesionReplay *s = &sesiones[reg->sesion];
+        if (reg->tipo == TRAFICO_INICIO) {
+            if (++abiertas > max_abiertas) max_abiertas = abiertas;
+        } else if (reg->tipo == TRAFICO_FIN) {
+            abiertas--;
+        } else if (reg->tipo == TRAFICO_PETICION && espera_respuesta(reg->texto)) {
+            anadir_instante(&s->envios, (int64_t)reg->instante_us);
+        } else if (reg->tipo == TRAFICO_RESPUESTA) {
+            Mensaje m;
+            size_t usado, pos = 0;
+            while ((usado = siguiente_mensaje(reg->texto + pos, reg->largo - pos, &m)) > 0) {
+                pos += usado;
+                if (es_aviso(m.texto, m.largo)) continue;
+                enmascarar_fechas(m.texto, m.largo);
+                anadir_mensaje(&s->grabadas, m.texto, m.largo);
+                if (s->respondidas < s->envios.num) {
+                    anadir_latencia(&latencias_grabadas, (double)(reg->instante_us - s->envios.datos[s->respondidas++]));
+                }
+            }
+        }
+    }
+    // Las mismas estructuras se reutilizan para la reproducción
+    for (uint32_t i = 0; i < num_sesiones; i++) {
+        sesiones[i].envios.num = 0;
+        sesiones[i].respondidas = 0;
+        sesiones[i].fd = -1;
+    }
+    return max_abiertas > 0 ? max_abiertas : 1;
+}
+
+/// @return Número de shards configurados
+static int socket_por_defecto(char *ruta, size_t tam) {
+    ConfigShards cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    FILE *archivo = fopen(CONFIG_FILE, "r");
+    if (archivo != NULL) {
+        char linea[256];
+        while (fgets(linea, sizeof(linea), archivo)) {
+            linea[strcspn(linea, "\n")] = '\0';
+            leer_config_shards(linea, &cfg);
+        }
+        fclose(archivo);
+    }
+    completar_config_shards(&cfg);
+    if (ruta[0] == '\0' && cfg.num_shards > 1) snprintf(ruta, tam, "%s", cfg.socket_router);
+    else if (ruta[0] == '\0') ruta_socket_shard(&cfg, 0, ruta, tam);
+    return cfg.num_shards > 1 ? cfg.num_shards : 1;
+}
+
+static void vaciar_salida_sesion(SesionReplay *s) {
+    while (s->salida_usados > 0) {
+        ssize_t escritos = write(s->fd, s->salida, s->salida_usados);
+        if (escritos < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) s->fin_pedido = 1;   // El banco cerró la sesión
+            return;
+        }
+        memmove(s->salida, s->salida + escritos, s->salida_usados - escritos);
+        s->salida_usados -= escritos;
+    }
+}
+
+static int abrir_sesion(SesionReplay *s, const char *ruta) {
+    struct sockaddr_un dir;
+    memset(&dir, 0, sizeof(dir));
+    dir.sun_family = AF_UNIX;
+    snprintf(dir.sun_path, sizeof(dir.sun_path), "%s", ruta);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&dir, sizeof(dir)) < 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    s->entrada = malloc(TAM_ENTRADA_REPLAY);
+    if (s->entrada == NULL) {
+        close(fd);
+        return -1;
+    }
+    s->fd = fd;
+    s->estado = SESION_ABIERTA;
+    s->entrada_usados = 0;
+    vaciar_salida_sesion(s);
+    return 0;
+}
+
+static void mostrar_diferencia(uint32_t sesion, const char *cual, const Mensaje *m) {
+    if (resultado.distintas > (unsigned long)diferencias_mostradas) return;
+    fprintf(stderr, "Sesión %u, %s: %.*s\n", sesion, cual, (int)m->largo, m->texto);
+}
+
+// Empareja las respuestas obtenidas con las grabadas de la sesión, sin tener en cuenta el orden
+static void comparar_sesion(SesionReplay *s) {
+    VectorMensajes *g = &s->grabadas, *o = &s->obtenidas;
+    if (g->num == 0) return;
+    qsort(g->datos, g->num, sizeof(Mensaje), comparar_mensajes);
+    qsort(o->datos, o->num, sizeof(Mensaje), comparar_mensajes);
+    uint32_t sesion = (uint32_t)(s - sesiones);
+    size_t i = 0, j = 0;
+    while (i < g->num || j < o->num) {
+        int orden = i == g->num ? 1 : j == o->num ? -1 : comparar_mensajes(&g->datos[i], &o->datos[j]);
+        if (orden == 0) {
+            i++;
+            j++;
+        } else if (orden < 0) {
+            resultado.distintas++;
+            mostrar_diferencia(sesion, "grabada y no obtenida", &g->datos[i++]);
+        } else {
+            resultado.distintas++;
+            mostrar_diferencia(sesion, "obtenida y no grabada", &o->datos[j++]);
+        }
+    }
+    resultado.comparadas += g->num;
+}
+
+static void cerrar_sesion(SesionReplay *s) {
+    if (s->fd >= 0) close(s->fd);
+    s->fd = -1;
+    s->estado = SESION_CERRADA;
+    resultado.sin_respuesta += s->envios.num - s->respondidas;
+    resultado.no_enviadas += s->cola_num - s->cola_inicio;
+    comparar_sesion(s);
+    for (size_t k = 0; k < s->obtenidas.num; k++) free(s->obtenidas.datos[k].texto);
+    free(s->obtenidas.datos);
+    free(s->entrada);
+    free(s->salida);
+    free(s->cola);
+    memset(&s->obtenidas, 0, sizeof(s->obtenidas));
+    s->entrada = NULL;
+    s->salida = NULL;
+    s->cola = NULL;
+    s->cola_inicio = s->cola_num = s->cola_tam = 0;
+    s->salida_usados = s->salida_tam = 0;
+}
+
+static void enviar_linea(SesionReplay *s, const char *texto, size_t largo) {
+    while (s->salida_usados + largo + 1 > s->salida_tam) s->salida = crecer(s->salida, &s->salida_tam, 1);
+    memcpy(s->salida + s->salida_usados, texto, largo);
+    s->salida[s->salida_usados + largo] = '\n';
+    s->salida_usados += largo + 1;
+    if (s->fd >= 0) vaciar_salida_sesion(s);
+}
+
+static void enviar_registro(SesionReplay *s, const Registro *r) {
+    if (r->tipo == TRAFICO_PETICION && espera_respuesta(r->texto)) anadir_instante(&s->envios, ahora_ns());
+    enviar_linea(s, r->texto, r->largo);
+    resultado.enviadas++;
+}
+
+static void encolar_registro(SesionReplay *s, size_t indice) {
+    if (s->cola_num == s->cola_tam) s->cola = crecer(s->cola, &s->cola_tam, sizeof(size_t));
+    s->cola[s->cola_num++] = indice;
+}
+
+// Con -m: envía las líneas pendientes de la sesión hasta la primera que espera respuesta
+static void bombear_sesion(SesionReplay *s) {
+    while (s->fd >= 0 && s->cola_inicio < s->cola_num && s->respondidas == s->envios.num) {
+        enviar_registro(s, &registros[s->cola[s->cola_inicio++]]);
+    }
+}
+
+// Atiende los mensajes completos recibidos en la sesión
+static void procesar_entrada(SesionReplay *s, int64_t ahora) {
+    Mensaje m;
+    size_t usado, pos = 0;
+    while ((usado = siguiente_mensaje(s->entrada + pos, s->entrada_usados - pos, &m)) > 0) {
+        pos += usado;
+        if (es_aviso(m.texto, m.largo)) {
+            resultado.avisos++;
+            continue;
+        }
+        resultado.respuestas++;
+        if (m.largo >= 12 && memcmp(m.texto, "[SOBRECARGA:", 12) == 0) resultado.sobrecargas++;
+        if (s->respondidas < s->envios.num) {
+            anadir_latencia(&latencias_replay, (ahora - s->envios.datos[s->respondidas++]) / 1000.0);
+        }
+        if (s->grabadas.num > 0) {
+            char *copia = malloc(m.largo + 1);
+            if (copia == NULL) {
+                fprintf(stderr, "Sin memoria\n");
+                exit(1);
+            }
+            memcpy(copia, m.texto, m.largo);
+            copia[m.largo] = '\0';
+            enmascarar_fechas(copia, m.largo);
+            anadir_mensaje(&s->obtenidas, copia, m.largo);
+        }
+    }
+    memmove(s->entrada, s->entrada + pos, s->entrada_usados - pos);
+    s->entrada_usados -= pos;
+    // Un mensaje que no cabe en el buffer se descarta entero
+    if (s->entrada_usados == TAM_ENTRADA_REPLAY) s->entrada_usados = 0;
+}
+
+/// @return 0 si la sesión sigue abierta, -1 si el banco la cerró
+static int leer_sesion(SesionReplay *s) {
+    for (;;) {
+        ssize_t leidos = read(s->fd, s->entrada + s->entrada_usados, TAM_ENTRADA_REPLAY - s->entrada_usados);
+        if (leidos > 0) {
+            s->entrada_usados += leidos;
+            procesar_entrada(s, ahora_ns());
+            continue;
+        }
+        if (leidos < 0 && errno == EINTR) continue;
+        if (leidos < 0 && errno == EAGAIN) return 0;
+        return -1;
+    }
+}
+
+static int comparar_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentil(const Latencias *l, double q) {
+    return l->num > 0 ? l->us[(size_t)(q * (l->num - 1))] : 0;
+}
+
+static double media(const Latencias *l) {
+    double suma = 0;
+    for (size_t k = 0; k < l->num; k++) suma += l->us[k];
+    return l->num > 0 ? suma / l->num : 0;
+}
+
+static void imprimir_latencias(const char *nombre, const Latencias *l, int json) {
+    if (json) {
+        printf("\"%s\":{\"n\":%zu,\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,"
+               "\"media_us\":%.1f}",
+               nombre, l->num, percentil(l, 0.5), percentil(l, 0.9), percentil(l, 0.99), percentil(l, 0.999),
+               percentil(l, 1.0), media(l));
+    } else if (l->num > 0) {
+        printf("  %-12s %9zu %9.1f %9.1f %9.1f %9.1f %10.1f %9.1f\n", nombre, l->num, percentil(l, 0.5),
+               percentil(l, 0.9), percentil(l, 0.99), percentil(l, 0.999), percentil(l, 1.0), media(l));
+    } else {
+        printf("  %-12s %9s\n", nombre, "-");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    double velocidad = 1.0;
+    int maximo = 0, json = 0, max_abiertas = 0;
+    double espera_final_s = 10.0;
+    char ruta_socket[108] = "";
+    int opcion;
+
+    while ((opcion = getopt(argc, argv, "x:ms:c:w:d:j")) != -1) {
+        switch (opcion) {
+            case 'x': velocidad = atof(optarg); break;
+            case 'm': maximo = 1; break;
+            case 's': snprintf(ruta_socket, sizeof(ruta_socket), "%s", optarg); break;
+            case 'c': max_abiertas = atoi(optarg); break;
+            case 'w': espera_final_s = atof(optarg); break;
+            case 'd': diferencias_mostradas = atoi(optarg); break;
+            case 'j': json = 1; break;
+            default:
+                fprintf(stderr, "Uso: %s [-x velocidad | -m] [-s socket] [-c sesiones] [-w segundos] [-d N] [-j] archivo\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc || velocidad <= 0) {
+        fprintf(stderr, "Uso: %s [-x velocidad | -m] [-s socket] [-c sesiones] [-w segundos] [-d N] [-j] archivo\n",
+                argv[0]);
+        return 1;
+    }
+    int num_shards = socket_por_defecto(ruta_socket, sizeof(ruta_socket));
+    signal(SIGPIPE, SIG_IGN);
+
+    CabeceraTrafico cabecera;
+    int abiertas_grabacion = cargar_trafico(argv[optind], &cabecera);
+    if (abiertas_grabacion < 0) return 1;
+    if (max_abiertas <= 0) max_abiertas = SESIONES_POR_SHARD * num_shards;
+    if (max_abiertas < abiertas_grabacion) {
+        fprintf(stderr, "Aviso: la grabación tuvo %d sesiones a la vez; se abren como mucho %d\n", abiertas_grabacion,
+                max_abiertas);
+    }
+    uint64_t duracion_us = num_registros > 0 ? registros[num_registros - 1].instante_us : 0;
+
+    // Sesiones con la conexión abierta (o cerrando), para el poll, y las que esperan sitio
+    SesionReplay **activas = calloc(max_abiertas, sizeof(SesionReplay *));
+    struct pollfd *fds = calloc(max_abiertas, sizeof(struct pollfd));
+    SesionReplay **en_espera = calloc(num_sesiones > 0 ? num_sesiones : 1, sizeof(SesionReplay *));
+    if (activas == NULL || fds == NULL || en_espera == NULL) return 1;
+    int num_activas = 0;
+    size_t primera_espera = 0, num_espera = 0;
+
+    int64_t t0 = ahora_ns(), fin_envio = 0;
+    size_t siguiente = 0;
+    while (siguiente < num_registros || num_activas > 0 || num_espera > 0) {
+        // Las sesiones en espera entran por orden de llegada en cuanto el banco cierra otras
+        while (num_espera > 0 && num_activas < max_abiertas) {
+            SesionReplay *s = en_espera[primera_espera++];
+            num_espera--;
+            if (abrir_sesion(s, ruta_socket) < 0) {
+                resultado.errores_conexion++;
+                cerrar_sesion(s);
+            } else {
+                activas[num_activas++] = s;
+                bombear_sesion(s);
+            }
+        }
+
+        int64_t ahora = ahora_ns();
+        int enviados = 0;
+        while (siguiente < num_registros && (!maximo || enviados < REGISTROS_POR_VUELTA)) {
+            Registro *r = &registros[siguiente];
+            if (r->tipo == TRAFICO_RESPUESTA) {
+                siguiente++;
+                continue;
+            }
+            if (!maximo && t0 + (int64_t)(r->instante_us * 1000.0 / velocidad) > ahora) break;
+            SesionReplay *s = &sesiones[r->sesion];
+            if (s->estado == SESION_SIN_ABRIR && r->tipo != TRAFICO_FIN) {
+                if (num_activas >= max_abiertas || num_espera > 0) {
+                    s->estado = SESION_EN_ESPERA;
+                    en_espera[primera_espera + num_espera++] = s;
+                } else if (abrir_sesion(s, ruta_socket) < 0) {
+                    resultado.errores_conexion++;
+                    s->estado = SESION_CERRADA;
+                } else {
+                    activas[num_activas++] = s;
+                }
+            }
+            if ((s->estado == SESION_ABIERTA || s->estado == SESION_EN_ESPERA) && !s->fin_pedido) {
+                if (r->tipo == TRAFICO_FIN) {
+                    s->fin_pedido = 1;
+                } else if (maximo) {
+                    encolar_registro(s, siguiente);
+                    bombear_sesion(s);
+                } else {
+                    enviar_registro(s, r);
+                }
+            } else if (r->tipo == TRAFICO_PETICION) {
+                resultado.no_enviadas++;
+            }
+            siguiente++;
+            enviados++;
+        }
+        if (siguiente == num_registros && fin_envio == 0) {
+            // Las sesiones sin FIN (captura detenida con sesiones abiertas) también se cierran
+            fin_envio = ahora_ns();
+            for (int k = 0; k < num_activas; k++) activas[k]->fin_pedido = 1;
+            for (size_t k = 0; k < num_espera; k++) en_espera[primera_espera + k]->fin_pedido = 1;
+        }
+
+        // Cierra la escritura de las sesiones terminadas, como un cliente, cuando ya tienen todas
+        // sus respuestas; el banco cierra entonces la sesión
+        for (int k = 0; k < num_activas; k++) {
+            SesionReplay *s = activas[k];
+            if (s->estado == SESION_ABIERTA && s->fin_pedido && s->salida_usados == 0 &&
+                s->respondidas == s->envios.num && s->cola_inicio == s->cola_num) {
+                shutdown(s->fd, SHUT_WR);
+                s->estado = SESION_CERRANDO;
+            }
+        }
+
+        int espera_ms = 100;
+        if (fin_envio != 0) {
+            if (ahora_ns() - fin_envio > (int64_t)(espera_final_s * 1e9)) {
+                for (int k = 0; k < num_activas; k++) cerrar_sesion(activas[k]);
+                for (size_t k = 0; k < num_espera; k++) cerrar_sesion(en_espera[primera_espera + k]);
+                num_activas = 0;
+                num_espera = 0;
+                break;
+            }
+        } else if (maximo) {
+            espera_ms = 0;
+        } else {
+            int64_t proximo = t0 + (int64_t)(registros[siguiente].instante_us * 1000.0 / velocidad) - ahora_ns();
+            espera_ms = proximo <= 0 ? 0 : proximo < 100000000 ? (int)((proximo + 999999) / 1000000) : 100;
+        }
+
+        for (int k = 0; k < num_activas; k++) {
+            fds[k].fd = activas[k]->fd;
+            fds[k].events = POLLIN | (activas[k]->salida_usados > 0 ? POLLOUT : 0);
+            fds[k].revents = 0;
+        }
+        if (poll(fds, num_activas, espera_ms) < 0 && errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
+        for (int k = num_activas - 1; k >= 0; k--) {
+            SesionReplay *s = activas[k];
+            if (fds[k].revents & POLLOUT) vaciar_salida_sesion(s);
+            if ((fds[k].revents & (POLLIN | POLLHUP | POLLERR)) && leer_sesion(s) < 0) {
+                cerrar_sesion(s);
+                activas[k] = activas[--num_activas];
+            } else {
+                bombear_sesion(s);
+            }
+        }
+    }
+    double duracion_replay = (ahora_ns() - t0) / 1e9;
+
+    qsort(latencias_grabadas.us, latencias_grabadas.num, sizeof(double), comparar_double);
+    qsort(latencias_replay.us, latencias_replay.num, sizeof(double), comparar_double);
+    if (json) {
+        printf("{\"archivo\":\"%s\",\"registros\":%zu,\"sesiones\":%u,\"duracion_grabada_s\":%.3f,"
+               "\"velocidad\":%.3f,\"duracion_s\":%.3f,\"enviadas\":%lu,\"respuestas\":%lu,\"sin_respuesta\":%lu,"
+               "\"avisos\":%lu,\"sobrecargas\":%lu,\"errores_conexion\":%lu,\"comparadas\":%lu,\"distintas\":%lu,",
+               argv[optind], num_registros, cabecera.num_sesiones, duracion_us / 1e6, maximo ? 0.0 : velocidad,
+               duracion_replay, resultado.enviadas, resultado.respuestas, resultado.sin_respuesta, resultado.avisos,
+               resultado.sobrecargas, resultado.errores_conexion, resultado.comparadas, resultado.distintas);
+        imprimir_latencias("grabada", &latencias_grabadas, 1);
+        printf(",");
+        imprimir_latencias("reproducida", &latencias_replay, 1);
+        printf("}\n");
+    } else {
+        printf("Tráfico: %s, %zu registros, %u sesiones, %.2f s grabados\n", argv[optind], num_registros,
+               cabecera.num_sesiones, duracion_us / 1e6);
+        if (maximo) printf("Reproducción a la máxima velocidad en %s: %.2f s\n", ruta_socket, duracion_replay);
+        else printf("Reproducción a %gx en %s: %.2f s\n", velocidad, ruta_socket, duracion_replay);
+        printf("Peticiones enviadas: %lu, respuestas: %lu, sin respuesta: %lu, avisos: %lu, sobrecargas: %lu\n",
+               resultado.enviadas, resultado.respuestas, resultado.sin_respuesta, resultado.avisos,
+               resultado.sobrecargas);
+        if (resultado.errores_conexion > 0) {
+            printf("Sesiones que no se pudieron abrir: %lu (%lu peticiones sin enviar)\n", resultado.errores_conexion,
+                   resultado.no_enviadas);
+        }
+        printf("Latencia (µs)   respuestas       p50       p90       p99     p99.9        máx     media\n");
+        imprimir_latencias("grabada", &latencias_grabadas, 0);
+        imprimir_latencias("reproducida", &latencias_replay, 0);
+        if (resultado.comparadas > 0) {
+            printf("Respuestas comparadas con la grabación: %lu, distintas: %lu\n", resultado.comparadas,
+                   resultado.distintas);
+        }
+    }
+    return resultado.distintas > 0 || resultado.sin_respuesta > 0 ? 1 : 0;
+}
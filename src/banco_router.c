@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "shards.h"
+
+/**
+ * Router de sesiones entre varios procesos banco (shards).
+ *
+ * Cada shard (./banco -s <id>) tiene su propio almacén de cuentas y su log, y
+ * escucha en SOCKET_SHARDS. El router escucha en SOCKET_ROUTER. Del primer
+ * mensaje de cada cliente ("Usuario con cuenta N ha iniciado sesión") deduce
+ * el shard dueño de la cuenta, se conecta a él y a partir de ahí copia los
+ * bytes en ambos sentidos sin interpretarlos.
+ *
+ * Si un shard se reinicia, solo se cortan las sesiones de sus cuentas.
+ *
+ * Uso: ./banco_router
+ * Los clientes se conectan con: ./usuario <cuenta> unix:<SOCKET_ROUTER>
+ */
+
+#define CONFIG_FILE "../config/config.txt"
+#define MAX_CONEXIONES 256
+#define TAM_BUFFER_ROUTER 16384
+
+// Bytes pendientes de copiar en un sentido
+typedef struct {
+    char datos[TAM_BUFFER_ROUTER];
+    size_t usados;
+} Tramo;
+
+typedef struct {
+    int fd_cliente;          // -1 = libre
+    int fd_shard;            // -1 hasta recibir el mensaje de inicio
+    int shard;
+    Tramo hacia_shard;
+    Tramo hacia_cliente;
+    int cerrando;            // El shard cerró: se termina de enviar al cliente y se cierra
+} Conexion;
+
+static Conexion conexiones[MAX_CONEXIONES];
+static ConfigShards config_shards;
+static volatile sig_atomic_t continuar_ejecucion = 1;
+static long sesiones_por_shard[MAX_SHARDS];
+
+static void debug_log(const char *format, ...) {
+    char timestamp[30];
+    time_t now = time(NULL);
+    struct tm tm_info;
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &tm_info));
+
+    va_list args;
+    va_start(args, format);
+    printf("[ROUTER %s] ", timestamp);
+    vprintf(format, args);
+    printf("\n");
+    fflush(stdout);
+    va_end(args);
+}
+
+static void manejador_senales(int sig) {
+    (void)sig;
+    continuar_ejecucion = 0;
+}
+
+static void leer_configuracion(const char *ruta) {
+    FILE *archivo = fopen(ruta, "r");
+    if (archivo != NULL) {
+        char linea[256];
+        while (fgets(linea, sizeof(linea), archivo)) {
+            linea[strcspn(linea, "\n")] = 0;
+            leer_config_shards(linea, &config_shards);
+        }
+        fclose(archivo);
+    } else {
+        perror("Error al abrir el archivo de configuración");
+    }
+    completar_config_shards(&config_shards);
+}
+
+static int escuchar(const char *ruta) {
+    struct sockaddr_un dir;
+    memset(&dir, 0, sizeof(dir));
+    dir.sun_family = AF_UNIX;
+    snprintf(dir.sun_path, sizeof(dir.sun_path), "%s", ruta);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(ruta);
+    if (bind(fd, (struct sockaddr *)&dir, sizeof(dir)) < 0 || listen(fd, 128) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int conectar_shard(int shard) {
+    struct sockaddr_un dir;
+    memset(&dir, 0, sizeof(dir));
+    dir.sun_family = AF_UNIX;
+    ruta_socket_shard(&config_shards, shard, dir.sun_path, sizeof(dir.sun_path));
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&dir, sizeof(dir)) < 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static int vaciar_hacia(int destino, Tramo *t);
+
+static void cerrar_conexion(Conexion *c) {
+    // Lo último que envió el cliente (normalmente el cierre de sesión) aún debe llegar al shard
+    if (c->fd_shard >= 0 && c->hacia_shard.usados > 0) vaciar_hacia(c->fd_shard, &c->hacia_shard);
+    if (c->fd_cliente >= 0) close(c->fd_cliente);
+    if (c->fd_shard >= 0) close(c->fd_shard);
+    c->fd_cliente = c->fd_shard = -1;
+    c->hacia_shard.usados = c->hacia_cliente.usados = 0;
+    c->cerrando = 0;
+}
+
+static void responder_error(Conexion *c, const char *texto) {
+    char mensaje[160];
+    int largo = snprintf(mensaje, sizeof(mensaje), "[ERROR:%s]\nFIN-MSG\n", texto);
+    if (write(c->fd_cliente, mensaje, largo) < 0) debug_log("No se pudo avisar al cliente: %s", strerror(errno));
+}
+
+/// @brief Elige el shard con la primera línea del cliente y abre la conexión con él.
+/// @return 0 si ya hay shard, 1 si aún falta la línea completa, -1 si hay que cerrar
+static int asignar_shard(Conexion *c) {
+    char *salto = memchr(c->hacia_shard.datos, '\n', c->hacia_shard.usados);
+    if (salto == NULL) return c->hacia_shard.usados == sizeof(c->hacia_shard.datos) ? -1 : 1;
+
+    char linea[256];
+    size_t largo = salto - c->hacia_shard.datos;
+    if (largo >= sizeof(linea)) largo = sizeof(linea) - 1;
+    memcpy(linea, c->hacia_shard.datos, largo);
+    linea[largo] = '\0';
+
+    int cuenta;
+    const char *p = strstr(linea, "Usuario con cuenta ");
+    if (p == NULL || sscanf(p, "Usuario con cuenta %d", &cuenta) != 1) {
+        responder_error(c, "El primer mensaje debe ser el de inicio de sesión");
+        return -1;
+    }
+    int shard = shard_de_cuenta(&config_shards, cuenta);
+    if (shard < 0) {
+        responder_error(c, "Ningún shard atiende esa cuenta");
+        return -1;
+    }
+    c->fd_shard = conectar_shard(shard);
+    if (c->fd_shard < 0) {
+        char texto[64];
+        snprintf(texto, sizeof(texto), "Shard %d no disponible", shard);
+        responder_error(c, texto);
+        debug_log("Shard %d no disponible para la cuenta %d: %s", shard, cuenta, strerror(errno));
+        return -1;
+    }
+    c->shard = shard;
+    sesiones_por_shard[shard]++;
+    debug_log("Cuenta %d -> shard %d", cuenta, shard);
+    return 0;
+}
+
+// Lee de "origen" hacia el tramo; devuelve -1 en EOF o error
+static int leer_hacia(int origen, Tramo *t) {
+    ssize_t n = read(origen, t->datos + t->usados, sizeof(t->datos) - t->usados);
+    if (n > 0) {
+        t->usados += n;
+        return 0;
+    }
+    return (n < 0 && (errno == EAGAIN || errno == EINTR)) ? 0 : -1;
+}
+
+// Escribe lo que admita "destino"; devuelve -1 si el otro extremo ya no existe
+static int vaciar_hacia(int destino, Tramo *t) {
+    ssize_t n = write(destino, t->datos, t->usados);
+    if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    memmove(t->datos, t->datos + n, t->usados - n);
+    t->usados -= n;
+    return 0;
+}
+
+static void aceptar_clientes(int fd_escucha) {
+    int fd;
+    while ((fd = accept4(fd_escucha, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        int libre = -1;
+        for (int i = 0; i < MAX_CONEXIONES && libre < 0; i++) {
+            if (conexiones[i].fd_cliente < 0) libre = i;
+        }
+        if (libre < 0) {
+            debug_log("Sin conexiones libres: cliente rechazado");
+            close(fd);
+            continue;
+        }
+        conexiones[libre].fd_cliente = fd;
+        conexiones[libre].fd_shard = -1;
+    }
+}
+
+int main() {
+    leer_configuracion(CONFIG_FILE);
+    if (config_shards.num_shards < 1) {
+        fprintf(stderr, "Configure NUM_SHARDS o RANGOS_SHARDS en %s\n", CONFIG_FILE);
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, manejador_senales);
+    signal(SIGTERM, manejador_senales);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < MAX_CONEXIONES; i++) {
+        conexiones[i].fd_cliente = conexiones[i].fd_shard = -1;
+    }
+
+    int fd_escucha = escuchar(config_shards.socket_router);
+    if (fd_escucha < 0) {
+        perror("Error al abrir el socket del router");
+        return EXIT_FAILURE;
+    }
+    debug_log("Router escuchando en %s con %d shards", config_shards.socket_router, config_shards.num_shards);
+
+    struct pollfd fds[1 + 2 * MAX_CONEXIONES];
+    int conexion_de[1 + 2 * MAX_CONEXIONES];
+
+    while (continuar_ejecucion) {
+        int nfds = 0;
+        fds[nfds].fd = fd_escucha;
+        fds[nfds].events = POLLIN;
+        conexion_de[nfds++] = -1;
+
+        for (int i = 0; i < MAX_CONEXIONES; i++) {
+            Conexion *c = &conexiones[i];
+            if (c->fd_cliente < 0) continue;
+            short eventos_cliente = 0, eventos_shard = 0;
+            if (!c->cerrando && c->hacia_shard.usados < sizeof(c->hacia_shard.datos)) eventos_cliente |= POLLIN;
+            if (c->hacia_cliente.usados > 0) eventos_cliente |= POLLOUT;
+            if (c->fd_shard >= 0) {
+                if (c->hacia_cliente.usados < sizeof(c->hacia_cliente.datos)) eventos_shard |= POLLIN;
+                if (c->hacia_shard.usados > 0) eventos_shard |= POLLOUT;
+            }
+            fds[nfds].fd = c->fd_cliente;
+            fds[nfds].events = eventos_cliente;
+            conexion_de[nfds++] = i;
+            if (c->fd_shard >= 0) {
+                fds[nfds].fd = c->fd_shard;
+                fds[nfds].events = eventos_shard;
+                conexion_de[nfds++] = i;
+            }
+        }
+
+        if (poll(fds, nfds, 1000) < 0) {
+            if (errno != EINTR) perror("poll");
+            continue;
+        }
+
+        for (int k = 0; k < nfds; k++) {
+            if (fds[k].revents == 0) continue;
+            if (conexion_de[k] < 0) {
+                aceptar_clientes(fd_escucha);
+                continue;
+            }
+            Conexion *c = &conexiones[conexion_de[k]];
+            if (c->fd_cliente < 0) continue;  // Cerrada por un evento anterior de esta vuelta
+            int error = 0;
+
+            if (fds[k].fd == c->fd_cliente) {
+                if ((fds[k].revents & (POLLIN | POLLHUP | POLLERR)) && !c->cerrando &&
+                    leer_hacia(c->fd_cliente, &c->hacia_shard) < 0) {
+                    error = 1;
+                }
+                if (!error && c->fd_shard < 0 && c->hacia_shard.usados > 0) {
+                    int r = asignar_shard(c);
+                    if (r < 0) error = 1;
+                }
+                if (!error && (fds[k].revents & POLLOUT) && vaciar_hacia(c->fd_cliente, &c->hacia_cliente) < 0) {
+                    error = 1;
+                }
+            } else {
+                if ((fds[k].revents & (POLLIN | POLLHUP | POLLERR)) &&
+                    leer_hacia(c->fd_shard, &c->hacia_cliente) < 0) {
+                    debug_log("Shard %d cerró una sesión", c->shard);
+                    c->cerrando = 1;
+                }
+                if ((fds[k].revents & POLLOUT) && vaciar_hacia(c->fd_shard, &c->hacia_shard) < 0) {
+                    c->cerrando = 1;
+                }
+            }
+
+            if (error || (c->cerrando && c->hacia_cliente.usados == 0)) cerrar_conexion(c);
+        }
+    }
+
+    for (int i = 0; i < MAX_CONEXIONES; i++) {
+        if (conexiones[i].fd_cliente >= 0) cerrar_conexion(&conexiones[i]);
+    }
+    close(fd_escucha);
+    unlink(config_shards.socket_router);
+
+    for (int s = 0; s < config_shards.num_shards; s++) {
+        debug_log("Shard %d: %ld sesiones encaminadas", s, sesiones_por_shard[s]);
+    }
+    return EXIT_SUCCESS;
+}
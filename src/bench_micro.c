@@ -0,0 +1,453 @@
+// Microbenchmarks de las primitivas del banco: búsqueda de cuentas (archivo frente a almacén),
+// interpretación y formato de mensajes, registro y volcado del log, lectura de la configuración
+// y análisis de alertas del monitor. Incluye banco.c y monitor.c para medir sus funciones tal
+// cual, sin procesos ni sockets, y cuenta las reservas de memoria con sus propios envoltorios.
+//
+// Uso: bench_micro [-f filtro] [-n factor] [-r repeticiones] [-w calentamiento] [-c cuentas]
+//                  [-C config] [-j resultados.json] [-b base.json] [-u umbral_%] [-l]
+#define main main_banco
+#include "banco.c"
+#undef main
+
+#define ALERT_PIPE "/dev/null"   // Las alertas se escriben igual, pero no bloquean sin lector
+#define main main_monitor
+#include "monitor.c"
+#undef main
+
+// Reservas de memoria durante las mediciones. Con glibc se sustituyen malloc, calloc y realloc
+// por envoltorios que cuentan cada llamada, también las de la propia biblioteca (localtime,
+// stdio...); con otra biblioteca sólo se ven las que banco.c cuenta en reservas_memoria. Con
+// -DCONTAR_RESERVAS_LIBC las sustituciones son las de banco.c y cuentan en reservas_memoria.
+#if defined(__GLIBC__) && !defined(CONTAR_RESERVAS_LIBC)
+extern void *__libc_malloc(size_t tam);
+extern void *__libc_calloc(size_t num, size_t tam);
+extern void *__libc_realloc(void *ptr, size_t tam);
+
+static atomic_ulong reservas_bench;
+
+void *malloc(size_t tam) {
+    atomic_fetch_add_explicit(&reservas_bench, 1, memory_order_relaxed);
+    return __libc_malloc(tam);
+}
+
+void *calloc(size_t num, size_t tam) {
+    atomic_fetch_add_explicit(&reservas_bench, 1, memory_order_relaxed);
+    return __libc_calloc(num, tam);
+}
+
+void *realloc(void *ptr, size_t tam) {
+    atomic_fetch_add_explicit(&reservas_bench, 1, memory_order_relaxed);
+    return __libc_realloc(ptr, tam);
+}
+
+static unsigned long reservas_medidas() {
+    return atomic_load(&reservas_bench);
+}
+#else
+static unsigned long reservas_medidas() {
+    return atomic_load(&reservas_memoria);
+}
+#endif
+
+#define MAX_BENCHMARKS 16
+#define MAX_REPETICIONES 50
+
+typedef struct {
+    const char *nombre;
+    const char *descripcion;
+    long iteraciones;             // Por repetición, antes de aplicar -n
+    int (*preparar)();            // 0 si el benchmark puede ejecutarse
+    void (*ejecutar)(long n);
+} Benchmark;
+
+typedef struct {
+    char nombre[64];
+    long iteraciones;
+    double ns_op;                 // Mediana de las repeticiones
+    double ns_op_min;
+    double allocs_op;
+} Resultado;
+
+// Opciones y entorno de los benchmarks
+static char dir_trabajo[] = "/tmp/bench_micro.XXXXXX";
+static char ruta_cuentas[200];
+static char ruta_log[200];
+static const char *ruta_config = CONFIG_FILE;
+static int num_cuentas = 1000;
+static FILE *salida;              // stdout original: el de banco va a /dev/null
+static volatile double sumidero;  // Evita que el compilador descarte los resultados
+
+#define SEMILLA_ALEATORIA 88172645463325252ULL
+static uint64_t estado_aleatorio = SEMILLA_ALEATORIA;
+
+// xorshift64: la misma secuencia en cada ejecución
+static inline uint64_t aleatorio() {
+    estado_aleatorio ^= estado_aleatorio << 13;
+    estado_aleatorio ^= estado_aleatorio >> 7;
+    estado_aleatorio ^= estado_aleatorio << 17;
+    return estado_aleatorio;
+}
+
+static inline int cuenta_aleatoria() {
+    return 1000 + (int)(aleatorio() % (uint64_t)num_cuentas);
+}
+
+static int64_t ahora_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// --- Búsqueda de cuentas ---
+
+static int preparar_cuentas() {
+    if (ruta_cuentas[0] != '\0') return 0;
+    snprintf(ruta_cuentas, sizeof(ruta_cuentas), "%s/cuentas.dat", dir_trabajo);
+    FILE *f = fopen(ruta_cuentas, "wb");
+    if (f == NULL) return -1;
+    for (int i = 0; i < num_cuentas; i++) {
+        Cuenta c;
+        memset(&c, 0, sizeof(c));
+        c.numero_cuenta = 1000 + i;
+        snprintf(c.titular, sizeof(c.titular), "Titular %d", c.numero_cuenta);
+        c.saldo = (float)(aleatorio() % 100000) / 10.0f;
+        fwrite(&c, sizeof(c), 1, f);
+    }
+    fclose(f);
+    snprintf(config_inicial.archivo_cuentas, sizeof(config_inicial.archivo_cuentas), "%s", ruta_cuentas);
+    return cargar_almacen_cuentas(ruta_cuentas);
+}
+
+static void bench_saldo_archivo(long n) {
+    for (long i = 0; i < n; i++) sumidero = obtener_saldo_cuenta(cuenta_aleatoria());
+}
+
+static void bench_saldo_almacen(long n) {
+    Cuenta c;
+    for (long i = 0; i < n; i++) {
+        if (leer_cuenta_snapshot(cuenta_aleatoria(), &c) == 0) sumidero = c.saldo;
+    }
+}
+
+// --- Mensajes ---
+
+static const char *lineas_prueba[] = {
+    "ID:4242-1700000000-17|[2024-01-01 10:00:00] Depósito de 150.00 en la cuenta 1001 completado.\n",
+    "Consulta de saldo en la cuenta 1001\n",
+    "TX:MOVER:1001:1002:25.50\n",
+    "MOVIMIENTOS:1001:10\n",
+};
+
+// Sesión ficticia en el slot 0 para las funciones que trabajan sobre usuarios[]
+static int preparar_sesion() {
+    if (preparar_cuentas() < 0) return -1;
+    usuarios[0].pid = getpid();
+    usuarios[0].cuenta = 1001;
+    usuarios[0].generacion = 1;
+    usuarios[0].peso = 1;
+    return 0;
+}
+
+// Separa la línea en la entrada de la sesión, la admite y la encola (extraer_peticiones),
+// y la saca de la cola como haría el planificador, separando la clave y clasificándola
+static void bench_interpretar_peticion(long n) {
+    InfoUsuario *u = &usuarios[0];
+    for (long i = 0; i < n; i++) {
+        const char *linea = lineas_prueba[i & 3];
+        size_t largo = strlen(linea);
+        memcpy(u->entrada, linea, largo);
+        u->entrada_usados = largo;
+        extraer_peticiones(0);
+        for (int carril = 0; carril < 2; carril++) {
+            ColaPeticiones *cola = &u->colas[carril];
+            if (cola->num == 0) continue;
+            Peticion *p = &cola->peticiones[cola->inicio];
+            char clave[MAX_CLAVE_IDEMPOTENCIA];
+            char *mensaje = separar_clave_idempotencia(p->linea, clave, sizeof(clave));
+            sumidero = es_peticion_lectura(mensaje) + clave[0];
+            cola->inicio = (cola->inicio + 1) % MAX_PETICIONES_SESION;
+            cola->num--;
+        }
+    }
+}
+
+// Formatea una respuesta en la arena del hilo y la copia al buffer de salida de la sesión
+static void bench_formatear_respuesta(long n) {
+    BufferSalida *s = &usuarios[0].salida;
+    for (long i = 0; i < n; i++) {
+        size_t largo;
+        char *respuesta = formatear_respuesta(&largo, "[SALDO:%.2f:OK]", (double)(i % 100000) / 10.0);
+        if (respuesta != NULL) encolar_salida(0, usuarios[0].generacion, respuesta, largo);
+        arena_vaciar(arena_hilo());
+        s->inicio = 0;
+        s->usados = 0;
+    }
+}
+
+// --- Log ---
+
+static int preparar_log() {
+    if (log_file != NULL) return 0;
+    snprintf(ruta_log, sizeof(ruta_log), "%s/transacciones.log", dir_trabajo);
+    return abrir_log(ruta_log);
+}
+
+static void bench_log_registrar(long n) {
+    for (long i = 0; i < n; i++) {
+        registrar_log("Transacción (Cuenta %d): COMMIT de %d operaciones, %d reintentos", cuenta_aleatoria(), 1, 0);
+        rotar_log_pendiente();   // Como el bucle principal, si TAM_MAX_LOG lo pide
+    }
+}
+
+static void bench_log_commit(long n) {
+    for (long i = 0; i < n; i++) {
+        registrar_log("2PC CONFIRMADO %ld: cuenta %d", i, cuenta_aleatoria());
+        if (vaciar_log() != 0 || fdatasync(fileno(log_file)) < 0) perror("fdatasync del log");
+    }
+}
+
+// --- Configuración ---
+
+static int preparar_config() {
+    return access(ruta_config, R_OK);
+}
+
+static void bench_leer_configuracion(long n) {
+    Config *cfg = malloc(sizeof(Config));
+    for (long i = 0; i < n; i++) {
+        memset(cfg, 0, sizeof(Config));
+        leer_configuracion(ruta_config, cfg);
+        sumidero = cfg->limite_retiro;
+    }
+    free(cfg);
+}
+
+// --- Monitor ---
+
+// Retiros y transferencias de cuentas al azar: uno de cada 500 supera MAX_AMOUNT y alguna
+// racha de retiros de la misma cuenta dispara la regla de velocidad. analyze_transaction
+// acumula los lotes, así que cada BATCH_SIZE iteraciones se evalúan las reglas de config
+#define TRANSACCIONES_MONITOR 4096
+static struct transaction transacciones_monitor[TRANSACCIONES_MONITOR];
+
+static int preparar_monitor() {
+    int cuenta = 1000;
+    for (int i = 0; i < TRANSACCIONES_MONITOR; i++) {
+        struct transaction *t = &transacciones_monitor[i];
+        t->msg_type = MSG_TYPE_COUNTERPARTY;
+        if (aleatorio() % 8 != 0) cuenta = cuenta_aleatoria();
+        t->account_id = cuenta;
+        t->amount = aleatorio() % 500 == 0 ? MAX_AMOUNT + 1 : (double)(aleatorio() % 5000);
+        strcpy(t->type, aleatorio() % 4 == 0 ? "transfer" : "withdrawal");
+        t->counterparty_id = t->type[0] == 't' ? cuenta_aleatoria() : 0;
+    }
+    load_rules(ruta_config);
+    return 0;
+}
+
+static void bench_monitor_analizar(long n) {
+    for (long i = 0; i < n; i++) analyze_transaction(&transacciones_monitor[i & (TRANSACCIONES_MONITOR - 1)]);
+    analyze_pending();
+}
+
+static Benchmark benchmarks[] = {
+    {"saldo_archivo", "obtener_saldo_cuenta: recorrido del archivo de cuentas", 2000, preparar_cuentas,
+     bench_saldo_archivo},
+    {"saldo_almacen", "leer_cuenta_snapshot: búsqueda binaria y seqlock en el almacén", 2000000, preparar_cuentas,
+     bench_saldo_almacen},
+    {"interpretar_peticion", "extraer_peticiones + clave de idempotencia + clasificación", 500000, preparar_sesion,
+     bench_interpretar_peticion},
+    {"formatear_respuesta", "respuesta con FIN-MSG en la arena + encolar_salida", 2000000, preparar_sesion,
+     bench_formatear_respuesta},
+    {"log_registrar", "registrar_log: una línea con marca de tiempo", 100000, preparar_log, bench_log_registrar},
+    {"log_commit", "registrar_log + vaciar_log + fdatasync", 200, preparar_log, bench_log_commit},
+    {"leer_configuracion", "leer_configuracion del archivo de configuración", 20000, preparar_config,
+     bench_leer_configuracion},
+    {"monitor_analizar", "analyze_transaction de monitor.c", 2000000, preparar_monitor, bench_monitor_analizar},
+};
+
+static int comparar_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void medir(const Benchmark *b, long iteraciones, long calentamiento, int repeticiones, Resultado *r) {
+    double ns[MAX_REPETICIONES];
+    b->ejecutar(calentamiento);
+    unsigned long reservas = reservas_medidas();
+    for (int k = 0; k < repeticiones; k++) {
+        int64_t inicio = ahora_ns();
+        b->ejecutar(iteraciones);
+        ns[k] = (double)(ahora_ns() - inicio) / iteraciones;
+    }
+    qsort(ns, repeticiones, sizeof(double), comparar_double);
+    snprintf(r->nombre, sizeof(r->nombre), "%s", b->nombre);
+    r->iteraciones = iteraciones;
+    r->ns_op = ns[repeticiones / 2];
+    r->ns_op_min = ns[0];
+    r->allocs_op = (double)(reservas_medidas() - reservas) / ((double)iteraciones * repeticiones);
+}
+
+static void escribir_resultado_json(FILE *f, const Resultado *r, int ultimo) {
+    fprintf(f, "{\"nombre\":\"%s\",\"iteraciones\":%ld,\"ns_op\":%.2f,\"ns_op_min\":%.2f,\"allocs_op\":%.3f}%s\n",
+            r->nombre, r->iteraciones, r->ns_op, r->ns_op_min, r->allocs_op, ultimo ? "" : ",");
+}
+
+// Un resultado por línea, para poder compararlos con diff y leerlos sin un parser de JSON
+static int escribir_json(const char *ruta, const Resultado *resultados, int n, int repeticiones) {
+    FILE *f = fopen(ruta, "w");
+    if (f == NULL) return -1;
+    fprintf(f, "{\"repeticiones\":%d,\"cuentas\":%d,\"resultados\":[\n", repeticiones, num_cuentas);
+    for (int i = 0; i < n; i++) escribir_resultado_json(f, &resultados[i], i == n - 1);
+    fprintf(f, "]}\n");
+    return fclose(f);
+}
+
+/// @return Resultados leídos de un archivo escrito por escribir_json, o -1 si no se pudo abrir
+static int leer_json(const char *ruta, Resultado *resultados, int max) {
+    FILE *f = fopen(ruta, "r");
+    if (f == NULL) return -1;
+    char linea[512];
+    int n = 0;
+    while (n < max && fgets(linea, sizeof(linea), f) != NULL) {
+        Resultado *r = &resultados[n];
+        if (sscanf(linea, "{\"nombre\":\"%63[^\"]\",\"iteraciones\":%ld,\"ns_op\":%lf,\"ns_op_min\":%lf,\"allocs_op\":%lf",
+                   r->nombre, &r->iteraciones, &r->ns_op, &r->ns_op_min, &r->allocs_op) == 5) {
+            n++;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+static const Resultado *buscar_resultado(const Resultado *resultados, int n, const char *nombre) {
+    for (int i = 0; i < n; i++) {
+        if (strcmp(resultados[i].nombre, nombre) == 0) return &resultados[i];
+    }
+    return NULL;
+}
+
+static void limpiar_dir_trabajo() {
+    char ruta[300];
+    const char *archivos[] = {"cuentas.dat", "transacciones.log", "transacciones.log.idx"};
+    for (size_t i = 0; i < sizeof(archivos) / sizeof(archivos[0]); i++) {
+        snprintf(ruta, sizeof(ruta), "%s/%s", dir_trabajo, archivos[i]);
+        unlink(ruta);
+    }
+    rmdir(dir_trabajo);
+}
+
+static void uso(const char *programa) {
+    fprintf(stderr,
+            "Uso: %s [-f filtro] [-n factor] [-r repeticiones] [-w calentamiento] [-c cuentas]\n"
+            "          [-C config] [-j resultados.json] [-b base.json] [-u umbral_%%] [-l]\n"
+            "  -f  sólo los benchmarks cuyo nombre contiene el filtro\n"
+            "  -n  multiplica las iteraciones de cada benchmark (por defecto 1)\n"
+            "  -r  repeticiones medidas; se informa la mediana (por defecto 5)\n"
+            "  -w  iteraciones de calentamiento (por defecto, un 10%% de las medidas)\n"
+            "  -c  cuentas del archivo de cuentas generado (por defecto 1000)\n"
+            "  -C  archivo de configuración para leer_configuracion (por defecto %s)\n"
+            "  -j  escribe los resultados en JSON\n"
+            "  -b  compara con unos resultados anteriores; termina con 1 si alguno empeora más que el umbral\n"
+            "  -u  umbral de empeoramiento en %% de ns/op (por defecto 10)\n"
+            "  -l  lista los benchmarks\n",
+            programa, CONFIG_FILE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *filtro = NULL, *ruta_json = NULL, *ruta_base = NULL;
+    double factor = 1.0, umbral = 10.0;
+    int repeticiones = 5;
+    long calentamiento = -1;
+    int num_benchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    int opcion;
+
+    while ((opcion = getopt(argc, argv, "f:n:r:w:c:C:j:b:u:lh")) != -1) {
+        switch (opcion) {
+            case 'f': filtro = optarg; break;
+            case 'n': factor = atof(optarg); break;
+            case 'r': repeticiones = atoi(optarg); break;
+            case 'w': calentamiento = atol(optarg); break;
+            case 'c': num_cuentas = atoi(optarg); break;
+            case 'C': ruta_config = optarg; break;
+            case 'j': ruta_json = optarg; break;
+            case 'b': ruta_base = optarg; break;
+            case 'u': umbral = atof(optarg); break;
+            case 'l':
+                for (int i = 0; i < num_benchmarks; i++) {
+                    printf("%-22s %s\n", benchmarks[i].nombre, benchmarks[i].descripcion);
+                }
+                return 0;
+            default:
+                uso(argv[0]);
+                return opcion == 'h' ? 0 : 2;
+        }
+    }
+    if (factor <= 0 || num_cuentas < 1) {
+        uso(argv[0]);
+        return 2;
+    }
+    if (repeticiones < 1) repeticiones = 1;
+    if (repeticiones > MAX_REPETICIONES) repeticiones = MAX_REPETICIONES;
+
+    if (mkdtemp(dir_trabajo) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    // Las funciones de banco escriben trazas por stdout: los resultados van por una copia
+    salida = fdopen(dup(STDOUT_FILENO), "w");
+    if (salida == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("stdout");
+        return 1;
+    }
+    config_inicial.tam_max_log = 0;   // Sin rotaciones a mitad de una medida
+    traza_iniciar();
+
+    Resultado resultados[MAX_BENCHMARKS], base[MAX_BENCHMARKS];
+    int n = 0, num_base = 0, empeorados = 0;
+    if (ruta_base != NULL && (num_base = leer_json(ruta_base, base, MAX_BENCHMARKS)) < 0) {
+        fprintf(stderr, "No se pudo leer %s: %s\n", ruta_base, strerror(errno));
+        return 1;
+    }
+
+    fprintf(salida, "%-22s %12s %14s %14s %10s%s\n", "benchmark", "iteraciones", "ns/op", "ns/op (mín)", "allocs/op",
+            num_base > 0 ? "   frente a la base" : "");
+    for (int i = 0; i < num_benchmarks && n < MAX_BENCHMARKS; i++) {
+        const Benchmark *b = &benchmarks[i];
+        if (filtro != NULL && strstr(b->nombre, filtro) == NULL) continue;
+        estado_aleatorio = SEMILLA_ALEATORIA;   // Mismos datos aunque se filtren otros benchmarks
+        if (b->preparar() != 0) {
+            fprintf(salida, "%-22s (omitido: no se pudo preparar)\n", b->nombre);
+            continue;
+        }
+        long iteraciones = (long)(b->iteraciones * factor);
+        if (iteraciones < 1) iteraciones = 1;
+        medir(b, iteraciones, calentamiento >= 0 ? calentamiento : iteraciones / 10, repeticiones, &resultados[n]);
+
+        const Resultado *r = &resultados[n++];
+        fprintf(salida, "%-22s %12ld %14.1f %14.1f %10.2f", r->nombre, r->iteraciones, r->ns_op, r->ns_op_min,
+                r->allocs_op);
+        const Resultado *anterior = buscar_resultado(base, num_base, r->nombre);
+        if (anterior != NULL && anterior->ns_op > 0) {
+            double cambio = 100.0 * (r->ns_op - anterior->ns_op) / anterior->ns_op;
+            int peor = cambio > umbral || r->allocs_op > anterior->allocs_op + 0.001;
+            empeorados += peor;
+            fprintf(salida, "   %+7.1f%% ns/op, %+.2f allocs/op%s", cambio, r->allocs_op - anterior->allocs_op,
+                    peor ? "  EMPEORA" : "");
+        }
+        fprintf(salida, "\n");
+        fflush(salida);
+    }
+
+    if (log_file != NULL) fclose(log_file);
+    limpiar_dir_trabajo();
+    if (ruta_json != NULL && escribir_json(ruta_json, resultados, n, repeticiones) != 0) {
+        fprintf(stderr, "No se pudo escribir %s: %s\n", ruta_json, strerror(errno));
+        return 1;
+    }
+    if (empeorados > 0) {
+        fprintf(salida, "%d benchmarks empeoran respecto a %s\n", empeorados, ruta_base);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,473 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include "trafico.h"
+
+/**
+ * Generador de cuentas y tráfico sintéticos a escala de producción.
+ *
+ * Escribe N cuentas (hasta 100 millones) directamente en el formato binario que
+ * carga banco. Cada hilo rellena un bloque de cuentas en memoria y lo escribe con
+ * pwrite en su posición del archivo, así que los hilos no se coordinan. Los datos de
+ * cada cuenta salen de un generador inicializado con (semilla, número de cuenta):
+ * el archivo es el mismo con cualquier número de hilos.
+ *
+ * Saldos y actividad siguen leyes de Zipf: muchas cuentas con poco saldo y unas pocas
+ * con mucho, y unas pocas cuentas concentran la mayor parte de las operaciones. Las
+ * cuentas más activas se reparten por todo el rango con una permutación, no son las
+ * primeras. num_transacciones refleja esa actividad.
+ *
+ * Con -t escribe además un archivo de tráfico (formato de trafico.h) con sesiones que
+ * se abren y cierran, llegadas de Poisson y una mezcla de consultas, depósitos, retiros,
+ * transferencias, MOVIMIENTOS y transacciones TX, sobre las mismas cuentas y con la
+ * misma ley de actividad. Con la misma semilla, el tráfico es idéntico byte a byte.
+ *
+ * Uso: ./generar_cuentas [-n cuentas] [-o archivo] [-p primera] [-j hilos] [-S semilla]
+ *                        [-z exp_saldos] [-a exp_actividad]
+ *                        [-t archivo_trafico] [-q operaciones] [-s sesiones] [-r tasa]
+ *   -n  Número de cuentas (por defecto 1000, máximo 100000000)
+ *   -o  Archivo de cuentas (por defecto ../data/cuentas.dat)
+ *   -p  Número de la primera cuenta (por defecto 1000)
+ *   -j  Hilos de escritura (por defecto, los núcleos disponibles)
+ *   -S  Semilla (por defecto 1)
+ *   -z  Exponente de Zipf de los saldos (por defecto 1.2)
+ *   -a  Exponente de Zipf de la actividad (por defecto 1.0)
+ *   -t  Escribe también el tráfico en este archivo
+ *   -q  Operaciones del tráfico (por defecto 100000)
+ *   -s  Sesiones abiertas a la vez (por defecto 8; banco admite 10 por shard)
+ *   -r  Peticiones por segundo del tráfico (por defecto 1000)
+ *
+ * Ejemplo: ./generar_cuentas -n 10000000 -t ../data/trafico.bin -q 1000000
+ */
+
+#define ARCHIVO_CUENTAS "../data/cuentas.dat"
+#define MAX_CUENTAS_GENERADAS 100000000L
+#define MAX_HILOS_GENERADOR 64
+#define CUENTAS_POR_BLOQUE 16384        // 1 MB por escritura
+#define SALDO_BASE 10.0                 // Saldo de la cuenta con rango 1; el de rango k es k veces mayor
+#define RANGOS_SALDO 100000
+#define ACTIVIDAD_MAXIMA 1000000.0      // Transacciones históricas de la cuenta más activa
+#define MONTO_BASE 5.0
+#define RANGOS_MONTO 2000               // Montos de 5 a 10000 (el límite del monitor)
+#define OPERACIONES_POR_SESION 20       // Media de operaciones antes de cerrar la sesión
+
+// Mismo formato binario que banco
+typedef struct {
+    int numero_cuenta;
+    char titular[50];
+    float saldo;
+    int num_transacciones;
+} Cuenta;
+
+// Muestreo de Zipf en O(1) por rechazo-inversión (Hörmann y Derflinger),
+// sin tablas: sirve igual para 2000 valores que para 100 millones
+typedef struct {
+    double exponente;
+    double num;
+    double h_integral_x1;
+    double h_integral_n;
+    double s;
+} Zipf;
+
+// Permutación afín de [0, n): reparte los rangos de actividad por todo el archivo
+typedef struct {
+    uint64_t n;
+    uint64_t a;
+    uint64_t b;
+    uint64_t a_inversa;
+} Permutacion;
+
+static long num_cuentas = 1000;
+static int primera_cuenta = 1000;
+static uint64_t semilla = 1;
+static double exponente_saldos = 1.2;
+static double exponente_actividad = 1.0;
+static Zipf zipf_saldos;
+static Permutacion permutacion;
+
+static const char *nombres[] = {"Ana", "Luis", "María", "Carlos", "Lucía", "Javier", "Elena", "Pablo",
+                                "Carmen", "Sergio", "Laura", "Diego", "Marta", "Jorge", "Isabel", "Raúl",
+                                "Paula", "Andrés", "Sara", "Miguel", "Nuria", "Álvaro", "Rosa", "Tomás"};
+static const char *apellidos[] = {"García", "Martínez", "López", "Sánchez", "Pérez", "Gómez", "Martín",
+                                  "Jiménez", "Ruiz", "Hernández", "Díaz", "Moreno", "Álvarez", "Muñoz",
+                                  "Romero", "Alonso", "Gutiérrez", "Navarro", "Torres", "Domínguez",
+                                  "Vázquez", "Ramos", "Gil", "Serrano", "Blanco", "Molina"};
+#define NUM_NOMBRES (sizeof(nombres) / sizeof(nombres[0]))
+#define NUM_APELLIDOS (sizeof(apellidos) / sizeof(apellidos[0]))
+
+typedef struct {
+    long desde;
+    long hasta;
+    int fd;
+    int error;
+    double suma_saldos;
+    double saldo_maximo;
+} TrabajoEscritura;
+
+static inline uint64_t splitmix64(uint64_t *estado) {
+    uint64_t z = (*estado += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Uniforme en [0, 1)
+static inline double uniforme(uint64_t *estado) {
+    return (splitmix64(estado) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double zipf_aux1(double x) {
+    return fabs(x) > 1e-8 ? log1p(x) / x : 1.0 - x * (0.5 - x * (1.0 / 3.0 - x * 0.25));
+}
+
+static double zipf_aux2(double x) {
+    return fabs(x) > 1e-8 ? expm1(x) / x : 1.0 + x * 0.5 * (1.0 + x * (1.0 / 3.0) * (1.0 + x * 0.25));
+}
+
+static double zipf_h(const Zipf *z, double x) {
+    return exp(-z->exponente * log(x));
+}
+
+static double zipf_h_integral(const Zipf *z, double x) {
+    double log_x = log(x);
+    return zipf_aux2((1.0 - z->exponente) * log_x) * log_x;
+}
+
+static double zipf_h_integral_inversa(const Zipf *z, double x) {
+    double t = x * (1.0 - z->exponente);
+    if (t < -1.0) t = -1.0;
+    return exp(zipf_aux1(t) * x);
+}
+
+static void zipf_iniciar(Zipf *z, double exponente, long num) {
+    z->exponente = exponente;
+    z->num = (double)num;
+    z->h_integral_x1 = zipf_h_integral(z, 1.5) - 1.0;
+    z->h_integral_n = zipf_h_integral(z, z->num + 0.5);
+    z->s = 2.0 - zipf_h_integral_inversa(z, zipf_h_integral(z, 2.5) - zipf_h(z, 2.0));
+}
+
+/// @return Un rango en [1, num]; el rango k sale con probabilidad proporcional a 1 / k^exponente
+static long zipf_muestra(const Zipf *z, uint64_t *estado) {
+    for (;;) {
+        double u = z->h_integral_n + uniforme(estado) * (z->h_integral_x1 - z->h_integral_n);
+        double x = zipf_h_integral_inversa(z, u);
+        long k = (long)(x + 0.5);
+        if (k < 1) k = 1;
+        else if (k > (long)z->num) k = (long)z->num;
+        if (k - x <= z->s || u >= zipf_h_integral(z, k + 0.5) - zipf_h(z, (double)k)) return k;
+    }
+}
+
+static uint64_t mcd(uint64_t a, uint64_t b) {
+    while (b != 0) {
+        uint64_t r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+static uint64_t inversa_modular(uint64_t a, uint64_t n) {
+    __int128 t = 0, nuevo_t = 1, r = n, nuevo_r = a;
+    while (nuevo_r != 0) {
+        __int128 q = r / nuevo_r, aux;
+        aux = t - q * nuevo_t; t = nuevo_t; nuevo_t = aux;
+        aux = r - q * nuevo_r; r = nuevo_r; nuevo_r = aux;
+    }
+    return (uint64_t)(t < 0 ? t + n : t);
+}
+
+static void permutacion_iniciar(Permutacion *p, uint64_t n, uint64_t semilla_permutacion) {
+    uint64_t estado = semilla_permutacion;
+    p->n = n;
+    p->a = 1;
+    p->b = 0;
+    if (n > 2) {
+        p->a = splitmix64(&estado) % (n - 1) + 1;
+        while (mcd(p->a, n) != 1) p->a = p->a % (n - 1) + 1;
+        p->b = splitmix64(&estado) % n;
+    }
+    p->a_inversa = inversa_modular(p->a, n);
+}
+
+// Rango de actividad (0 = la más activa) -> posición de la cuenta en el archivo
+static inline uint64_t permutacion_aplicar(const Permutacion *p, uint64_t rango) {
+    return (uint64_t)(((unsigned __int128)p->a * rango + p->b) % p->n);
+}
+
+static inline uint64_t permutacion_invertir(const Permutacion *p, uint64_t posicion) {
+    return (uint64_t)(((unsigned __int128)p->a_inversa * ((posicion + p->n - p->b) % p->n)) % p->n);
+}
+
+// Rellena la cuenta de la posición i; sólo depende de la semilla y de i
+static void generar_cuenta(long i, Cuenta *c) {
+    uint64_t estado = semilla ^ ((uint64_t)i * 0xD1B54A32D192ED03ULL);
+    splitmix64(&estado);
+    memset(c, 0, sizeof(*c));
+    c->numero_cuenta = primera_cuenta + (int)i;
+
+    uint64_t r = splitmix64(&estado);
+    snprintf(c->titular, sizeof(c->titular), "%s %s %s", nombres[r % NUM_NOMBRES],
+             apellidos[(r >> 16) % NUM_APELLIDOS], apellidos[(r >> 32) % NUM_APELLIDOS]);
+
+    long rango_saldo = zipf_muestra(&zipf_saldos, &estado);
+    double centimos = (double)(splitmix64(&estado) % 1000) / 100.0;
+    c->saldo = (float)(SALDO_BASE * rango_saldo + centimos);
+
+    double rango_actividad = (double)permutacion_invertir(&permutacion, (uint64_t)i) + 1.0;
+    c->num_transacciones = (int)(ACTIVIDAD_MAXIMA * pow(rango_actividad, -exponente_actividad));
+}
+
+void *hilo_escritor(void *arg) {
+    TrabajoEscritura *t = arg;
+    Cuenta *bloque = malloc(CUENTAS_POR_BLOQUE * sizeof(Cuenta));
+    if (bloque == NULL) {
+        t->error = ENOMEM;
+        return NULL;
+    }
+
+    for (long inicio = t->desde; inicio < t->hasta && t->error == 0; inicio += CUENTAS_POR_BLOQUE) {
+        long n = t->hasta - inicio < CUENTAS_POR_BLOQUE ? t->hasta - inicio : CUENTAS_POR_BLOQUE;
+        for (long k = 0; k < n; k++) {
+            generar_cuenta(inicio + k, &bloque[k]);
+            t->suma_saldos += bloque[k].saldo;
+            if (bloque[k].saldo > t->saldo_maximo) t->saldo_maximo = bloque[k].saldo;
+        }
+
+        const char *datos = (const char *)bloque;
+        size_t pendiente = (size_t)n * sizeof(Cuenta);
+        off_t posicion = (off_t)inicio * (off_t)sizeof(Cuenta);
+        while (pendiente > 0) {
+            ssize_t escritos = pwrite(t->fd, datos, pendiente, posicion);
+            if (escritos < 0) {
+                if (errno == EINTR) continue;
+                t->error = errno;
+                break;
+            }
+            datos += escritos;
+            pendiente -= (size_t)escritos;
+            posicion += escritos;
+        }
+    }
+    free(bloque);
+    return NULL;
+}
+
+static int escribir_cuentas(const char *ruta, int num_hilos) {
+    int fd = open(ruta, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error al crear %s: %s\n", ruta, strerror(errno));
+        return -1;
+    }
+    // El tamaño final desde el principio: cada hilo escribe en su tramo sin depender de los demás
+    if (ftruncate(fd, (off_t)num_cuentas * (off_t)sizeof(Cuenta)) < 0) {
+        fprintf(stderr, "Error al reservar %s: %s\n", ruta, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (num_hilos > num_cuentas / CUENTAS_POR_BLOQUE + 1) num_hilos = (int)(num_cuentas / CUENTAS_POR_BLOQUE + 1);
+    TrabajoEscritura trabajos[MAX_HILOS_GENERADOR];
+    pthread_t hilos[MAX_HILOS_GENERADOR];
+    int creado[MAX_HILOS_GENERADOR];
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    for (int h = 0; h < num_hilos; h++) {
+        trabajos[h] = (TrabajoEscritura){num_cuentas * h / num_hilos, num_cuentas * (h + 1) / num_hilos, fd, 0, 0, 0};
+        // Si no se puede crear el hilo, este tramo lo escribe el hilo principal
+        creado[h] = pthread_create(&hilos[h], NULL, hilo_escritor, &trabajos[h]) == 0;
+        if (!creado[h]) hilo_escritor(&trabajos[h]);
+    }
+
+    int error = 0;
+    double suma = 0, maximo = 0;
+    for (int h = 0; h < num_hilos; h++) {
+        if (creado[h]) pthread_join(hilos[h], NULL);
+        if (trabajos[h].error != 0 && error == 0) error = trabajos[h].error;
+        suma += trabajos[h].suma_saldos;
+        if (trabajos[h].saldo_maximo > maximo) maximo = trabajos[h].saldo_maximo;
+    }
+    if (error == 0 && fdatasync(fd) < 0) error = errno;
+    close(fd);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (error != 0) {
+        fprintf(stderr, "Error al escribir %s: %s\n", ruta, strerror(error));
+        return -1;
+    }
+    double segundos = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    double mb = (double)num_cuentas * sizeof(Cuenta) / (1024.0 * 1024.0);
+    printf("Generadas %ld cuentas (%d-%ld) en %s: %.1f MB en %.2f s (%.0f MB/s, %d hilos)\n", num_cuentas,
+           primera_cuenta, primera_cuenta + num_cuentas - 1, ruta, mb, segundos,
+           segundos > 0 ? mb / segundos : 0, num_hilos);
+    printf("Saldo total: %.2f, medio: %.2f, máximo: %.2f\n", suma, suma / num_cuentas, maximo);
+    return 0;
+}
+
+typedef struct {
+    int activa;
+    uint32_t sesion;
+    int cuenta;
+    long restantes;
+    unsigned long peticiones;
+} SesionTrafico;
+
+static int cuenta_activa(const Zipf *actividad, uint64_t *estado) {
+    long rango = zipf_muestra(actividad, estado);
+    return primera_cuenta + (int)permutacion_aplicar(&permutacion, (uint64_t)(rango - 1));
+}
+
+static int escribir_linea(FILE *f, uint64_t instante, uint32_t sesion, uint8_t tipo, const char *texto,
+                          uint64_t *registros) {
+    (*registros)++;
+    return escribir_registro_trafico(f, instante, sesion, tipo, texto, strlen(texto));
+}
+
+static int escribir_trafico(const char *ruta, long operaciones, int num_sesiones, double tasa) {
+    FILE *f = fopen(ruta, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Error al crear %s: %s\n", ruta, strerror(errno));
+        return -1;
+    }
+    // La cabecera se reescribe al final con el número de sesiones y de registros
+    escribir_cabecera_trafico(f, 0, 0, 0);
+
+    Zipf actividad, montos;
+    zipf_iniciar(&actividad, exponente_actividad, num_cuentas);
+    zipf_iniciar(&montos, 1.1, RANGOS_MONTO);
+    uint64_t estado = semilla ^ 0x5452414649434FULL;
+    SesionTrafico *sesiones = calloc(num_sesiones, sizeof(SesionTrafico));
+    if (sesiones == NULL) {
+        fclose(f);
+        return -1;
+    }
+
+    char linea[256];
+    uint64_t instante = 0, registros = 0;
+    uint32_t siguiente_sesion = 0;
+    int error = 0;
+    for (long k = 0; k < operaciones && error == 0; k++) {
+        // Llegadas de Poisson: intervalos exponenciales de media 1/tasa
+        instante += (uint64_t)(-log(1.0 - uniforme(&estado)) * 1e6 / tasa);
+        SesionTrafico *s = &sesiones[splitmix64(&estado) % num_sesiones];
+        if (!s->activa) {
+            s->activa = 1;
+            s->sesion = siguiente_sesion++;
+            s->cuenta = cuenta_activa(&actividad, &estado);
+            s->restantes = 1 + (long)(-log(1.0 - uniforme(&estado)) * (OPERACIONES_POR_SESION - 1));
+            s->peticiones = 0;
+            snprintf(linea, sizeof(linea), "Usuario con cuenta %d ha iniciado sesión.", s->cuenta);
+            error |= escribir_linea(f, instante, s->sesion, TRAFICO_INICIO, linea, &registros);
+        }
+
+        // Las operaciones que modifican saldos llevan clave de idempotencia, como las de usuario
+        char clave[64];
+        snprintf(clave, sizeof(clave), "ID:gen%llu-%u-%lu|", (unsigned long long)semilla, s->sesion,
+                 ++s->peticiones);
+        double monto = MONTO_BASE * zipf_muestra(&montos, &estado);
+        unsigned tipo = (unsigned)(splitmix64(&estado) % 100);
+        if (tipo < 40) {
+            snprintf(linea, sizeof(linea), "Consulta de saldo en la cuenta %d solicitada.", s->cuenta);
+        } else if (tipo < 65) {
+            snprintf(linea, sizeof(linea), "%sDepósito de %.2f en la cuenta %d completado.", clave, monto, s->cuenta);
+        } else if (tipo < 85) {
+            snprintf(linea, sizeof(linea), "%sRetiro de %.2f de la cuenta %d completado.", clave, monto, s->cuenta);
+        } else if (tipo < 92 && num_cuentas > 1) {
+            int destino;
+            do destino = cuenta_activa(&actividad, &estado); while (destino == s->cuenta);
+            snprintf(linea, sizeof(linea), "%sTransferencia de %.2f desde la cuenta %d a la cuenta %d.", clave, monto,
+                     s->cuenta, destino);
+        } else if (tipo < 97) {
+            snprintf(linea, sizeof(linea), "MOVIMIENTOS:%d:10", s->cuenta);
+        } else {
+            error |= escribir_linea(f, instante, s->sesion, TRAFICO_PETICION, "TX:BEGIN", &registros);
+            snprintf(linea, sizeof(linea), "TX:LEER:%d", s->cuenta);
+            error |= escribir_linea(f, instante, s->sesion, TRAFICO_PETICION, linea, &registros);
+            snprintf(linea, sizeof(linea), "TX:COMMIT");
+        }
+        error |= escribir_linea(f, instante, s->sesion, TRAFICO_PETICION, linea, &registros);
+
+        if (--s->restantes == 0) {
+            s->activa = 0;
+            error |= escribir_linea(f, instante, s->sesion, TRAFICO_FIN, "", &registros);
+        }
+    }
+    for (int i = 0; i < num_sesiones && error == 0; i++) {
+        if (sesiones[i].activa) error |= escribir_linea(f, instante, sesiones[i].sesion, TRAFICO_FIN, "", &registros);
+    }
+    free(sesiones);
+
+    if (error == 0 && (fseek(f, 0, SEEK_SET) != 0 || escribir_cabecera_trafico(f, siguiente_sesion, 0, registros) != 0)) {
+        error = 1;
+    }
+    if (fclose(f) != 0) error = 1;
+    if (error != 0) {
+        fprintf(stderr, "Error al escribir el tráfico en %s\n", ruta);
+        return -1;
+    }
+    printf("Tráfico: %ld operaciones, %llu registros, %u sesiones, %.1f s a %.0f peticiones/s en %s\n", operaciones,
+           (unsigned long long)registros, siguiente_sesion, instante / 1e6, tasa, ruta);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *ruta = ARCHIVO_CUENTAS;
+    const char *ruta_trafico = NULL;
+    int num_hilos = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    long operaciones = 100000;
+    int num_sesiones = 8;
+    double tasa = 1000;
+    int opcion;
+
+    while ((opcion = getopt(argc, argv, "n:o:p:j:S:z:a:t:q:s:r:")) != -1) {
+        switch (opcion) {
+            case 'n': num_cuentas = atol(optarg); break;
+            case 'o': ruta = optarg; break;
+            case 'p': primera_cuenta = atoi(optarg); break;
+            case 'j': num_hilos = atoi(optarg); break;
+            case 'S': semilla = strtoull(optarg, NULL, 10); break;
+            case 'z': exponente_saldos = atof(optarg); break;
+            case 'a': exponente_actividad = atof(optarg); break;
+            case 't': ruta_trafico = optarg; break;
+            case 'q': operaciones = atol(optarg); break;
+            case 's': num_sesiones = atoi(optarg); break;
+            case 'r': tasa = atof(optarg); break;
+            default:
+                fprintf(stderr, "Uso: %s [-n cuentas] [-o archivo] [-p primera] [-j hilos] [-S semilla] "
+                                "[-z exp_saldos] [-a exp_actividad] [-t archivo_trafico] [-q operaciones] "
+                                "[-s sesiones] [-r tasa]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (num_cuentas < 1 || num_cuentas > MAX_CUENTAS_GENERADAS) {
+        fprintf(stderr, "El número de cuentas debe estar entre 1 y %ld\n", MAX_CUENTAS_GENERADAS);
+        return 1;
+    }
+    if (primera_cuenta < 1 || (long)primera_cuenta + num_cuentas - 1 > 2147483647L) {
+        fprintf(stderr, "Los números de cuenta no caben en un int\n");
+        return 1;
+    }
+    if (exponente_saldos <= 0 || exponente_actividad <= 0 || num_sesiones < 1 || tasa <= 0 || operaciones < 0) {
+        fprintf(stderr, "Los exponentes, las sesiones y la tasa deben ser positivos\n");
+        return 1;
+    }
+    if (num_hilos < 1) num_hilos = 1;
+    if (num_hilos > MAX_HILOS_GENERADOR) num_hilos = MAX_HILOS_GENERADOR;
+
+    zipf_iniciar(&zipf_saldos, exponente_saldos, RANGOS_SALDO);
+    permutacion_iniciar(&permutacion, (uint64_t)num_cuentas, semilla ^ 0x5045524D55544FULL);
+
+    if (escribir_cuentas(ruta, num_hilos) != 0) return 1;
+    if (ruta_trafico != NULL && escribir_trafico(ruta_trafico, operaciones, num_sesiones, tasa) != 0) return 1;
+    return 0;
+}
@@ -0,0 +1,132 @@
+// Memoria para el camino de cada petición sin llamar a malloc. Lo comparten banco y usuario.
+//  - Arena: asignación lineal sobre un buffer fijo, que se vacía de golpe al terminar la petición.
+//  - PoolBloques: bloques de tamaño fijo que se reciclan (slab) con una pila de bloques libres.
+#ifndef MEMORIA_H
+#define MEMORIA_H
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ALINEACION_ARENA 16
+
+typedef struct {
+    char *base;
+    size_t tam;
+    size_t usados;
+    size_t pico;              // Lo más que se ha llegado a usar
+    unsigned long agotada;    // Reservas que no cupieron
+} Arena;
+
+static inline void arena_iniciar(Arena *a, void *memoria, size_t tam) {
+    a->base = memoria;
+    a->tam = tam;
+    a->usados = 0;
+    a->pico = 0;
+    a->agotada = 0;
+}
+
+static inline size_t arena_alinear(size_t posicion) {
+    return (posicion + ALINEACION_ARENA - 1) & ~(size_t)(ALINEACION_ARENA - 1);
+}
+
+/// @return largo bytes alineados de la arena, o NULL si no caben
+static inline void *arena_reservar(Arena *a, size_t largo) {
+    size_t inicio = arena_alinear(a->usados);
+    if (inicio > a->tam || largo > a->tam - inicio) {
+        a->agotada++;
+        return NULL;
+    }
+    a->usados = inicio + largo;
+    if (a->usados > a->pico) a->pico = a->usados;
+    return a->base + inicio;
+}
+
+/// @brief Espacio libre al final de la arena, para escribir antes de saber el largo exacto.
+///        Lo escrito se queda en la arena con arena_confirmar.
+static inline char *arena_hueco(Arena *a, size_t *libre) {
+    size_t inicio = arena_alinear(a->usados);
+    *libre = inicio < a->tam ? a->tam - inicio : 0;
+    return a->base + (inicio < a->tam ? inicio : a->tam);
+}
+
+static inline void arena_confirmar(Arena *a, size_t largo) {
+    a->usados = arena_alinear(a->usados) + largo;
+    if (a->usados > a->pico) a->pico = a->usados;
+}
+
+/// @return El texto formateado dentro de la arena, o NULL si no cabe
+static inline char *arena_printf(Arena *a, const char *formato, ...) {
+    size_t libre;
+    char *destino = arena_hueco(a, &libre);
+    va_list args;
+    va_start(args, formato);
+    int largo = vsnprintf(destino, libre, formato, args);
+    va_end(args);
+    if (largo < 0 || (size_t)largo >= libre) {
+        a->agotada++;
+        return NULL;
+    }
+    arena_confirmar(a, largo + 1);
+    return destino;
+}
+
+// Una marca permite devolver a la arena lo reservado desde entonces sin vaciarla entera
+static inline size_t arena_marca(const Arena *a) {
+    return a->usados;
+}
+
+static inline void arena_volver(Arena *a, size_t marca) {
+    a->usados = marca;
+}
+
+static inline void arena_vaciar(Arena *a) {
+    a->usados = 0;
+}
+
+typedef struct {
+    char *bloques;
+    size_t tam_bloque;
+    int num_bloques;
+    int *libres;              // Pila con los índices de los bloques libres
+    int num_libres;
+    unsigned long agotado;    // Veces que se pidió un bloque sin quedar ninguno libre
+    pthread_mutex_t mutex;
+} PoolBloques;
+
+/// @brief Prepara un pool sobre memoria del llamador: num bloques de tam_bloque bytes y
+///        un array de num enteros para la pila de libres. El pool no reserva nada.
+static inline void pool_iniciar(PoolBloques *p, void *bloques, size_t tam_bloque, int num, int *libres) {
+    p->bloques = bloques;
+    p->tam_bloque = tam_bloque;
+    p->num_bloques = num;
+    p->libres = libres;
+    p->num_libres = num;
+    p->agotado = 0;
+    for (int i = 0; i < num; i++) libres[i] = num - 1 - i;
+    pthread_mutex_init(&p->mutex, NULL);
+}
+
+/// @return Un bloque libre (con el contenido que dejó su uso anterior), o NULL si no queda ninguno
+static inline void *pool_tomar(PoolBloques *p) {
+    void *bloque = NULL;
+    pthread_mutex_lock(&p->mutex);
+    if (p->num_libres > 0) {
+        bloque = p->bloques + (size_t)p->libres[--p->num_libres] * p->tam_bloque;
+    } else {
+        p->agotado++;
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return bloque;
+}
+
+static inline void pool_devolver(PoolBloques *p, void *bloque) {
+    if (bloque == NULL) return;
+    pthread_mutex_lock(&p->mutex);
+    p->libres[p->num_libres++] = (int)(((char *)bloque - p->bloques) / p->tam_bloque);
+    pthread_mutex_unlock(&p->mutex);
+}
+
+#endif
@@ -1,43 +1,171 @@
+#include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
 #include <unistd.h>
 
 #define MSG_KEY 1234
+#ifndef ALERT_PIPE
 #define ALERT_PIPE "/tmp/alert_pipe"
+#endif
+#ifndef CONFIG_FILE
+#define CONFIG_FILE "../config/config.txt"
+#endif
 #define MAX_AMOUNT 10000
 
+// Transactions are analyzed in batches: everything waiting in the queue, up to BATCH_SIZE,
+// is copied into columnar buffers and each rule's predicate runs over the whole batch with
+// vector instructions. Only the lanes that match reach the scalar per-account checks.
+#define BATCH_SIZE 256
+#define MAX_BATCH_DELAY_MS 50     // analyze_transaction never holds a transaction longer than this
+#define VECTOR_LANES 4
+#define MAX_RULES 16
+#define DEFAULT_WINDOW_S 60
+#define ACCOUNT_SLOTS (1 << 16)   // Per-account state of the counterparty rules (power of 2)
+#define ACCOUNT_PROBES 8
+#define KNOWN_COUNTERPARTIES 6
+#define DEFAULT_MEMORY_KB 16384   // MEMORIA_MONITOR_KB: shared by the velocity rules
+#define SKETCH_ROWS 3
+#define SKETCH_SPANS 4            // The sliding window moves in steps of window_s / SKETCH_SPANS
+#define EVICTION_SAMPLE 16        // Candidates compared to choose the one to replace
+#define ALERT_BUFFER_SIZE 65536   // Alerts of a batch, written to the pipe with a single open
+
+// Operations, as bits so a rule can apply to several of them
+#define OP_WITHDRAWAL 1
+#define OP_TRANSFER 2
+#define OP_DEPOSIT 4
+
+#define RULE_AMOUNT 1         // amount > threshold
+#define RULE_VELOCITY 2       // more than threshold operations per account within window_s
+#define RULE_ROUND 3          // amount >= threshold and a multiple of it
+#define RULE_COUNTERPARTY 4   // transfer of at least threshold to an account never paid before
+
+// Producers that fill counterparty_id send MSG_TYPE_COUNTERPARTY. Older producers send
+// MSG_TYPE_TRANSACTION with the struct as it was before that field; their padding lands
+// where counterparty_id is, so the field is only trusted in the new message type.
+#define MSG_TYPE_TRANSACTION 1
+#define MSG_TYPE_COUNTERPARTY 2
+
 struct transaction {
     long msg_type;
     int account_id;
     double amount;
-    char type[10]; // "withdrawal" or "transfer"
+    char type[10]; // "withdrawal", "transfer" or "deposit"
+    int counterparty_id; // Destination account of a transfer (0 = unknown)
+};
+
+#define TRANSACTION_PAYLOAD (sizeof(struct transaction) - sizeof(long))
+#define LEGACY_PAYLOAD (offsetof(struct transaction, type) + 10 - sizeof(long))
+
+typedef double vec_double __attribute__((vector_size(VECTOR_LANES * sizeof(double))));
+typedef long long vec_mask __attribute__((vector_size(VECTOR_LANES * sizeof(long long))));
+
+struct transaction_batch {
+    double amount[BATCH_SIZE] __attribute__((aligned(32)));
+    double cents[BATCH_SIZE] __attribute__((aligned(32)));        // Amount in cents, as an exact integer
+    long long operation[BATCH_SIZE] __attribute__((aligned(32))); // OP_* bit, 0 in padding lanes
+    int account_id[BATCH_SIZE];
+    int counterparty_id[BATCH_SIZE];
+    int count;
+};
+
+// Velocity rules never keep a counter per account. Every operation goes into a count-min
+// sketch per span of the window, which never underestimates; an account becomes a candidate
+// when its estimate for the window exceeds the threshold, and only candidates are counted
+// exactly. The candidate table keeps the heaviest ones (space-saving: when it is full, a new
+// candidate replaces the one with the lowest count, here among a sample of EVICTION_SAMPLE),
+// so memory is fixed by the budget.
+struct candidate_entry {
+    int key;                  // account_id + 1 (0 = free slot)
+    long long last_span;      // Span of the last operation
+    long long alerted_span;   // Span of the last alert: at most one per window
+    unsigned int prior[SKETCH_SPANS];   // Sketch estimate of each span before becoming a candidate
+    unsigned int exact[SKETCH_SPANS];   // Exact count of each span since then
+};
+
+struct rate_tracker {
+    long long span_ms;
+    long long span_of[SKETCH_SPANS];    // Span held by each sketch (-1 = empty)
+    unsigned int *sketch;               // [SKETCH_ROWS][width][SKETCH_SPANS]: the spans of a counter share a cache line
+    unsigned int width;
+    struct candidate_entry *candidates; // Open addressing, at most half full
+    unsigned int candidate_mask;
+    int num_candidates;
+    unsigned int eviction_cursor;
+    unsigned long long evictions;
+};
+
+struct counterparty_entry {
+    int key;                  // account_id + 1 (0 = free slot)
+    int next;                 // Ring position of the next counterparty to replace
+    int known[KNOWN_COUNTERPARTIES];
+};
+
+struct rule {
+    int kind;
+    int operations;
+    double threshold;
+    int window_s;
+    char name[48];            // Alert type
+    struct rate_tracker *rate;
+    struct counterparty_entry *counterparties;
 };
 
+static struct rule rules[MAX_RULES];
+static int num_rules = -1;    // -1 until load_rules runs
+static struct transaction_batch pending_batch;
+static long long pending_since_ms;   // Arrival of the oldest transaction in pending_batch
+static char alert_buffer[ALERT_BUFFER_SIZE];
+static size_t alert_buffer_used;
+
+int receive_transaction(int msgid, struct transaction *trans, int flags);
+int load_rules(const char *config_path);
+void batch_add(struct transaction_batch *batch, const struct transaction *trans);
+void analyze_batch(struct transaction_batch *batch);
 void analyze_transaction(struct transaction *trans);
+void analyze_pending();
 void send_alert(int account_id, double amount, const char *type);
+void flush_alerts();
 
 int main() {
     int msgid;
     struct transaction trans;
 
+    load_rules(CONFIG_FILE);
+    printf("Monitor: %d rules\n", num_rules);
+    for (int r = 0; r < num_rules; r++) {
+        if (rules[r].rate != NULL) {
+            printf("  %s (sketch %dx%u per span, %u candidates)\n", rules[r].name, SKETCH_ROWS,
+                   rules[r].rate->width, (rules[r].rate->candidate_mask + 1) / 2);
+        } else {
+            printf("  %s\n", rules[r].name);
+        }
+    }
+
     // Initialize and open the message queue
     if ((msgid = msgget(MSG_KEY, 0666 | IPC_CREAT)) == -1) {
         perror("msgget");
         exit(EXIT_FAILURE);
     }
 
-    // Continuously read messages
+    // Continuously read messages: wait for one, then take whatever else is already queued
     while (1) {
-        if (msgrcv(msgid, &trans, sizeof(struct transaction) - sizeof(long), 0, 0) == -1) {
+        int received = receive_transaction(msgid, &trans, 0);
+        if (received < 0) {
             perror("msgrcv");
             exit(EXIT_FAILURE);
         }
+        if (received > 0) batch_add(&pending_batch, &trans);
+        while (pending_batch.count < BATCH_SIZE && (received = receive_transaction(msgid, &trans, IPC_NOWAIT)) >= 0) {
+            if (received > 0) batch_add(&pending_batch, &trans);
+        }
 
-        // Analyze the transaction
-        analyze_transaction(&trans);
+        // Analyze the batch
+        analyze_batch(&pending_batch);
     }
 
     // Close the message queue (unreachable code in this example)
@@ -49,36 +177,461 @@ int main() {
     return 0;
 }
 
-void analyze_transaction(struct transaction *trans) {
-    static int consecutive_withdrawals = 0;
-    static int last_account_id = -1;
+/// @brief Takes one message from the queue. The buffer is cleared first, so nothing of the
+///        previous message survives a shorter one. Messages too short to hold a transaction are
+///        dropped, and counterparty_id is kept only in MSG_TYPE_COUNTERPARTY messages of full size.
+/// @return 1 with a transaction in trans, 0 if the message was dropped, -1 on error
+///         (errno ENOMSG with IPC_NOWAIT when the queue is empty)
+int receive_transaction(int msgid, struct transaction *trans, int flags) {
+    memset(trans, 0, sizeof(*trans));
+    ssize_t length = msgrcv(msgid, trans, TRANSACTION_PAYLOAD, 0, flags | MSG_NOERROR);
+    if (length < 0) return -1;
+    if ((size_t)length < LEGACY_PAYLOAD) {
+        fprintf(stderr, "Monitor: dropped a %zd-byte message (a transaction needs %zu)\n", length, LEGACY_PAYLOAD);
+        return 0;
+    }
+    if (trans->msg_type != MSG_TYPE_COUNTERPARTY || (size_t)length < TRANSACTION_PAYLOAD) trans->counterparty_id = 0;
+    return 1;
+}
+
+static int parse_operations(const char *text) {
+    int operations = 0;
+    if (strstr(text, "retiro") != NULL) operations |= OP_WITHDRAWAL;
+    if (strstr(text, "transferencia") != NULL) operations |= OP_TRANSFER;
+    if (strstr(text, "deposito") != NULL) operations |= OP_DEPOSIT;
+    return operations;
+}
+
+static const char *operation_names(int operations) {
+    static const char *names[] = {"-", "withdrawal", "transfer", "withdrawal/transfer", "deposit",
+                                  "withdrawal/deposit", "transfer/deposit", "any"};
+    return names[operations & 7];
+}
+
+static int add_rule(int kind, int operations, double threshold, int window_s) {
+    if (num_rules >= MAX_RULES || operations == 0 || threshold <= 0) return -1;
+    struct rule *r = &rules[num_rules];
+    memset(r, 0, sizeof(*r));
+    r->kind = kind;
+    r->operations = operations;
+    r->threshold = threshold;
+    r->window_s = window_s > 0 ? window_s : DEFAULT_WINDOW_S;
+    const char *ops = operation_names(operations);
+    switch (kind) {
+        case RULE_AMOUNT: snprintf(r->name, sizeof(r->name), "%s amount > %.2f", ops, threshold); break;
+        case RULE_VELOCITY:
+            snprintf(r->name, sizeof(r->name), "%s velocity > %.0f/%ds", ops, threshold, r->window_s);
+            break;
+        case RULE_ROUND: snprintf(r->name, sizeof(r->name), "%s round amount (%.2f)", ops, threshold); break;
+        case RULE_COUNTERPARTY:
+            snprintf(r->name, sizeof(r->name), "%s to new counterparty >= %.2f", ops, threshold);
+            r->counterparties = calloc(ACCOUNT_SLOTS, sizeof(struct counterparty_entry));
+            if (r->counterparties == NULL) return -1;
+            break;
+        default: return -1;
+    }
+    num_rules++;
+    return 0;
+}
+
+/// @brief Splits the memory budget of a velocity rule: a quarter for the candidate table
+///        (rounded down to a power of two) and the rest for the sketches
+static struct rate_tracker *create_rate_tracker(size_t budget, int window_s) {
+    struct rate_tracker *t = calloc(1, sizeof(*t));
+    if (t == NULL) return NULL;
+    size_t slots = 64;
+    while (slots * 2 * sizeof(struct candidate_entry) <= budget / 4) slots *= 2;
+    size_t width = (budget - slots * sizeof(struct candidate_entry)) / (SKETCH_SPANS * SKETCH_ROWS * sizeof(unsigned int));
+    if (width < 256) width = 256;
+    t->span_ms = (long long)window_s * 1000 / SKETCH_SPANS;
+    if (t->span_ms <= 0) t->span_ms = 1;
+    for (int s = 0; s < SKETCH_SPANS; s++) t->span_of[s] = -1;
+    t->sketch = calloc(SKETCH_SPANS * SKETCH_ROWS * width, sizeof(unsigned int));
+    t->candidates = calloc(slots, sizeof(struct candidate_entry));
+    if (t->sketch == NULL || t->candidates == NULL) {
+        free(t->sketch);
+        free(t->candidates);
+        free(t);
+        return NULL;
+    }
+    t->width = (unsigned int)width;
+    t->candidate_mask = (unsigned int)slots - 1;
+    return t;
+}
 
-    if (strcmp(trans->type, "withdrawal") == 0) {
-        if (trans->amount > MAX_AMOUNT) {
-            send_alert(trans->account_id, trans->amount, trans->type);
+/// @brief Builds the rule table from the configuration file. UMBRAL_RETIROS and
+///        UMBRAL_TRANSFERENCIAS give the velocity rules; each REGLA=<tipo>:<operaciones>:<umbral>[:<ventana_s>]
+///        line adds one more (tipo: importe, velocidad, redondo or contraparte; operaciones:
+///        retiro, transferencia and/or deposito, separated by commas). Without REGLA lines,
+///        withdrawals above MAX_AMOUNT raise an alert. MEMORIA_MONITOR_KB is split among the
+///        velocity rules.
+/// @return Number of rules
+int load_rules(const char *config_path) {
+    for (int r = 0; r < num_rules; r++) {
+        if (rules[r].rate != NULL) {
+            free(rules[r].rate->sketch);
+            free(rules[r].rate->candidates);
+            free(rules[r].rate);
         }
+        free(rules[r].counterparties);
+    }
+    num_rules = 0;
 
-        if (trans->account_id == last_account_id) {
-            consecutive_withdrawals++;
-            if (consecutive_withdrawals > 3) {
-                send_alert(trans->account_id, trans->amount, "consecutive withdrawals");
+    int withdrawal_threshold = 3, transfer_threshold = 2, explicit_rules = 0, memory_kb = DEFAULT_MEMORY_KB;
+    char line[256];
+    FILE *config = config_path != NULL ? fopen(config_path, "r") : NULL;
+    while (config != NULL && fgets(line, sizeof(line), config) != NULL) {
+        if (strncmp(line, "UMBRAL_RETIROS=", 15) == 0) {
+            withdrawal_threshold = atoi(line + 15);
+        } else if (strncmp(line, "UMBRAL_TRANSFERENCIAS=", 22) == 0) {
+            transfer_threshold = atoi(line + 22);
+        } else if (strncmp(line, "MEMORIA_MONITOR_KB=", 19) == 0) {
+            memory_kb = atoi(line + 19);
+        } else if (strncmp(line, "REGLA=", 6) == 0) {
+            char kind_name[32], operations[64];
+            double threshold;
+            int window_s = 0;
+            if (sscanf(line + 6, "%31[^:]:%63[^:]:%lf:%d", kind_name, operations, &threshold, &window_s) < 3) {
+                fprintf(stderr, "Monitor: ignoring rule %s", line);
+                continue;
+            }
+            int kind = strcmp(kind_name, "importe") == 0       ? RULE_AMOUNT
+                       : strcmp(kind_name, "velocidad") == 0   ? RULE_VELOCITY
+                       : strcmp(kind_name, "redondo") == 0     ? RULE_ROUND
+                       : strcmp(kind_name, "contraparte") == 0 ? RULE_COUNTERPARTY
+                                                               : 0;
+            if (add_rule(kind, parse_operations(operations), threshold, window_s) < 0) {
+                fprintf(stderr, "Monitor: ignoring rule %s", line);
+            } else {
+                explicit_rules++;
             }
-        } else {
-            consecutive_withdrawals = 1;
-            last_account_id = trans->account_id;
         }
-    } else if (strcmp(trans->type, "transfer") == 0) {
-        // Add logic for detecting suspicious transfer patterns
     }
+    if (config != NULL) fclose(config);
+
+    if (withdrawal_threshold > 0) add_rule(RULE_VELOCITY, OP_WITHDRAWAL, withdrawal_threshold, DEFAULT_WINDOW_S);
+    if (transfer_threshold > 0) add_rule(RULE_VELOCITY, OP_TRANSFER, transfer_threshold, DEFAULT_WINDOW_S);
+    if (explicit_rules == 0) add_rule(RULE_AMOUNT, OP_WITHDRAWAL, MAX_AMOUNT, 0);
+
+    int velocity_rules = 0;
+    for (int r = 0; r < num_rules; r++) velocity_rules += rules[r].kind == RULE_VELOCITY;
+    for (int r = 0; r < num_rules; r++) {
+        if (rules[r].kind != RULE_VELOCITY) continue;
+        rules[r].rate = create_rate_tracker((size_t)(memory_kb > 0 ? memory_kb : DEFAULT_MEMORY_KB) * 1024 /
+                                                velocity_rules, rules[r].window_s);
+        if (rules[r].rate == NULL) {
+            perror("Monitor: rate tracker");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return num_rules;
+}
+
+static int operation_bit(const char *type) {
+    if (strcmp(type, "withdrawal") == 0) return OP_WITHDRAWAL;
+    if (strcmp(type, "transfer") == 0) return OP_TRANSFER;
+    if (strcmp(type, "deposit") == 0) return OP_DEPOSIT;
+    return 0;
+}
+
+void batch_add(struct transaction_batch *batch, const struct transaction *trans) {
+    int i = batch->count++;
+    double cents = trans->amount * 100.0;
+    batch->amount[i] = trans->amount;
+    batch->cents[i] = (double)(long long)(cents < 0 ? cents - 0.5 : cents + 0.5);
+    batch->operation[i] = operation_bit(trans->type);
+    batch->account_id[i] = trans->account_id;
+    batch->counterparty_id[i] = trans->counterparty_id;
+}
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned int account_slot(int account_id) {
+    return ((unsigned int)account_id * 2654435761u) & (ACCOUNT_SLOTS - 1);
 }
 
+static unsigned int sketch_hash(int account_id, int row) {
+    static const unsigned int seeds[SKETCH_ROWS] = {0x9E3779B1u, 0x85EBCA77u, 0xC2B2AE3Du};
+    unsigned int h = ((unsigned int)account_id + 1) * seeds[row];
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    return h ^ (h >> 12);
+}
+
+static inline unsigned int sketch_column(const struct rate_tracker *t, int account_id, int row) {
+    return (unsigned int)(((unsigned long long)sketch_hash(account_id, row) * t->width) >> 32);
+}
+
+static inline int span_alive(long long span_of, long long span) {
+    return span_of >= 0 && span_of > span - SKETCH_SPANS;
+}
+
+// Window count of a candidate, from its spans still inside the window
+static unsigned int candidate_count(const struct candidate_entry *e, long long span) {
+    unsigned int count = 0;
+    for (long long k = 0; k < SKETCH_SPANS; k++) {
+        long long old = e->last_span - k;
+        if (old <= span - SKETCH_SPANS) break;
+        count += e->prior[old % SKETCH_SPANS] + e->exact[old % SKETCH_SPANS];
+    }
+    return count;
+}
+
+static struct candidate_entry *find_candidate(struct rate_tracker *t, int account_id) {
+    unsigned int i = sketch_hash(account_id, 0) & t->candidate_mask;
+    while (t->candidates[i].key != 0) {
+        if (t->candidates[i].key == account_id + 1) return &t->candidates[i];
+        i = (i + 1) & t->candidate_mask;
+    }
+    return NULL;
+}
+
+// Linear probing removal: moves back the entries that would no longer be reachable
+static void remove_candidate(struct rate_tracker *t, struct candidate_entry *e) {
+    unsigned int hole = (unsigned int)(e - t->candidates), i = hole;
+    while (1) {
+        i = (i + 1) & t->candidate_mask;
+        if (t->candidates[i].key == 0) break;
+        unsigned int home = sketch_hash(t->candidates[i].key - 1, 0) & t->candidate_mask;
+        if (((i - home) & t->candidate_mask) >= ((i - hole) & t->candidate_mask)) {
+            t->candidates[hole] = t->candidates[i];
+            hole = i;
+        }
+    }
+    t->candidates[hole].key = 0;
+    t->num_candidates--;
+}
+
+// A candidate that leaves the table goes back to the sketch with its counts, so that its
+// estimate still does not fall below the real count
+static void return_to_sketch(struct rate_tracker *t, const struct candidate_entry *e) {
+    for (long long k = 0; k < SKETCH_SPANS && e->last_span - k >= 0; k++) {
+        long long old = e->last_span - k;
+        int sp = (int)(old % SKETCH_SPANS);
+        if (t->span_of[sp] != old) continue;
+        unsigned int value = e->prior[sp] + e->exact[sp];
+        for (int d = 0; d < SKETCH_ROWS; d++) {
+            unsigned int *c = &t->sketch[(d * t->width + sketch_column(t, e->key - 1, d)) * SKETCH_SPANS + sp];
+            if (*c < value) *c = value;
+        }
+    }
+}
+
+static struct candidate_entry *add_candidate(struct rate_tracker *t, int account_id, long long span) {
+    if ((unsigned int)t->num_candidates >= (t->candidate_mask + 1) / 2) {
+        // Full: the candidate with the lowest count among a sample leaves room for the new one
+        struct candidate_entry *lowest = NULL;
+        unsigned int lowest_count = 0;
+        for (int n = 0; n < EVICTION_SAMPLE || lowest == NULL; n++) {
+            unsigned int i = t->eviction_cursor = (t->eviction_cursor + 1) & t->candidate_mask;
+            if (t->candidates[i].key == 0) continue;
+            unsigned int count = candidate_count(&t->candidates[i], span);
+            if (lowest == NULL || count < lowest_count) {
+                lowest = &t->candidates[i];
+                lowest_count = count;
+            }
+        }
+        return_to_sketch(t, lowest);
+        remove_candidate(t, lowest);
+        t->evictions++;
+    }
+    unsigned int i = sketch_hash(account_id, 0) & t->candidate_mask;
+    while (t->candidates[i].key != 0) i = (i + 1) & t->candidate_mask;
+    struct candidate_entry *e = &t->candidates[i];
+    memset(e, 0, sizeof(*e));
+    e->key = account_id + 1;
+    e->last_span = span;
+    e->alerted_span = span - SKETCH_SPANS;
+    t->num_candidates++;
+    return e;
+}
+
+/// @return Operations of the account within the sliding window, counting this one, if they
+///         exceed the threshold and the account had no alert in the last window; 0 otherwise
+static double velocity_update(struct rule *r, int account_id, long long now) {
+    struct rate_tracker *t = r->rate;
+    long long span = now / t->span_ms;
+    int current = (int)(span % SKETCH_SPANS);
+    size_t width = t->width;
+    if (t->span_of[current] != span) {
+        for (size_t c = current; c < SKETCH_ROWS * width * SKETCH_SPANS; c += SKETCH_SPANS) t->sketch[c] = 0;
+        t->span_of[current] = span;
+    }
+
+    struct candidate_entry *e = find_candidate(t, account_id);
+    if (e != NULL) {
+        // Candidates are counted only here. Spans that left the window since the account's last
+        // operation start from zero
+        for (long long k = e->last_span + 1; k <= span && k <= e->last_span + SKETCH_SPANS; k++) {
+            e->prior[k % SKETCH_SPANS] = e->exact[k % SKETCH_SPANS] = 0;
+        }
+        e->last_span = span;
+        e->exact[current]++;
+    } else {
+        // Count it in the current span's sketch, raising only the rows at the minimum (conservative
+        // update: the estimate of the span, the minimum over the rows, grows by exactly one)
+        unsigned int *counters[SKETCH_ROWS], lowest = 0xFFFFFFFFu;
+        for (int d = 0; d < SKETCH_ROWS; d++) {
+            counters[d] = &t->sketch[(d * width + sketch_column(t, account_id, d)) * SKETCH_SPANS];
+            if (counters[d][current] < lowest) lowest = counters[d][current];
+        }
+        if (lowest != 0xFFFFFFFFu) {
+            for (int d = 0; d < SKETCH_ROWS; d++) {
+                if (counters[d][current] == lowest) counters[d][current]++;
+            }
+        }
+
+        // Estimate of each span still in the window, from the same cache lines
+        unsigned int estimate[SKETCH_SPANS] = {0}, window_estimate = 0;
+        for (int sp = 0; sp < SKETCH_SPANS; sp++) {
+            if (!span_alive(t->span_of[sp], span)) continue;
+            unsigned int minimum = 0xFFFFFFFFu;
+            for (int d = 0; d < SKETCH_ROWS; d++) {
+                if (counters[d][sp] < minimum) minimum = counters[d][sp];
+            }
+            estimate[sp] = minimum;
+            window_estimate += minimum;
+        }
+        if (window_estimate <= r->threshold) return 0;
+        // Candidate from now on: the spans so far keep the sketch estimate, this one is exact
+        e = add_candidate(t, account_id, span);
+        for (int sp = 0; sp < SKETCH_SPANS; sp++) e->prior[sp] = estimate[sp];
+        e->prior[current]--;
+        e->exact[current] = 1;
+    }
+
+    unsigned int count = candidate_count(e, span);
+    if (count <= r->threshold || e->alerted_span > span - SKETCH_SPANS) return 0;
+    e->alerted_span = span;
+    return count;
+}
+
+/// @return 1 if the account had paid other counterparties but never this one
+static int counterparty_is_new(struct rule *r, int account_id, int counterparty_id) {
+    unsigned int slot = account_slot(account_id);
+    struct counterparty_entry *e = NULL;
+    for (int p = 0; p < ACCOUNT_PROBES && e == NULL; p++) {
+        struct counterparty_entry *candidate = &r->counterparties[(slot + p) & (ACCOUNT_SLOTS - 1)];
+        if (candidate->key == account_id + 1 || candidate->key == 0) e = candidate;
+    }
+    if (e == NULL) e = &r->counterparties[slot];   // Full neighbourhood: forget the first account
+    if (e->key != account_id + 1) {
+        memset(e, 0, sizeof(*e));
+        e->key = account_id + 1;
+    }
+    int history = 0;
+    for (int k = 0; k < KNOWN_COUNTERPARTIES; k++) {
+        if (e->known[k] == counterparty_id) return 0;
+        if (e->known[k] != 0) history = 1;
+    }
+    e->known[e->next] = counterparty_id;
+    e->next = (e->next + 1) % KNOWN_COUNTERPARTIES;
+    return history;
+}
+
+// Vector predicate of the rule over lanes [i, i + VECTOR_LANES): all ones where it holds
+static inline void rule_predicate(const struct rule *r, const struct transaction_batch *batch, int i,
+                                  vec_mask *result) {
+    vec_mask operation = *(const vec_mask *)&batch->operation[i];
+    vec_double amount = *(const vec_double *)&batch->amount[i];
+    vec_mask applies = (operation & r->operations) != 0;
+    switch (r->kind) {
+        case RULE_AMOUNT: *result = applies & (amount > r->threshold); break;
+        case RULE_COUNTERPARTY: *result = applies & (amount >= r->threshold); break;
+        case RULE_ROUND: {
+            // Whole quotient: adding and subtracting 2^52 rounds it to an integer
+            vec_double quotient = *(const vec_double *)&batch->cents[i] / (r->threshold * 100.0);
+            vec_double rounded = (quotient + 4503599627370496.0) - 4503599627370496.0;
+            *result = applies & (amount >= r->threshold) & (quotient == rounded);
+            break;
+        }
+        default: *result = applies;
+    }
+}
+
+void analyze_batch(struct transaction_batch *batch) {
+    static long long hits[BATCH_SIZE] __attribute__((aligned(32)));
+    if (num_rules < 0) load_rules(CONFIG_FILE);
+    int lanes = (batch->count + VECTOR_LANES - 1) / VECTOR_LANES * VECTOR_LANES;
+    for (int i = batch->count; i < lanes; i++) {
+        batch->operation[i] = 0;
+        batch->amount[i] = batch->cents[i] = 0;
+    }
+    long long now = 0;
+
+    for (int r = 0; r < num_rules; r++) {
+        struct rule *rule = &rules[r];
+        vec_mask any = {0};
+        for (int i = 0; i < lanes; i += VECTOR_LANES) {
+            rule_predicate(rule, batch, i, (vec_mask *)&hits[i]);
+            any |= *(vec_mask *)&hits[i];
+        }
+        long long matched = 0;
+        for (int l = 0; l < VECTOR_LANES; l++) matched |= any[l];
+        if (matched == 0) continue;
+
+        // Lanes that passed the predicate: alert, or check the account's state
+        if (rule->kind == RULE_VELOCITY && now == 0) now = now_ms();
+        for (int i = 0; i < batch->count; i++) {
+            if (hits[i] == 0) continue;
+            int account_id = batch->account_id[i];
+            if (rule->kind == RULE_VELOCITY) {
+                if (velocity_update(rule, account_id, now) == 0) continue;
+            } else if (rule->kind == RULE_COUNTERPARTY) {
+                if (batch->counterparty_id[i] == 0 ||
+                    !counterparty_is_new(rule, account_id, batch->counterparty_id[i])) continue;
+            }
+            send_alert(account_id, batch->amount[i], rule->name);
+        }
+    }
+    batch->count = 0;
+    flush_alerts();
+}
+
+// Coarse clock for the batch delay: a few ns per call, with a resolution of a few ms
+static long long coarse_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/// @brief One transaction at a time: accumulated, and analyzed when the batch fills up or its
+///        oldest transaction has waited MAX_BATCH_DELAY_MS, so alerts are not held back at low
+///        traffic. A caller that goes idle calls analyze_pending.
+void analyze_transaction(struct transaction *trans) {
+    long long now = coarse_ms();
+    if (pending_batch.count == 0) pending_since_ms = now;
+    batch_add(&pending_batch, trans);
+    if (pending_batch.count == BATCH_SIZE || now - pending_since_ms >= MAX_BATCH_DELAY_MS) analyze_batch(&pending_batch);
+}
+
+// Analyzes whatever analyze_transaction is still holding
+void analyze_pending() {
+    if (pending_batch.count > 0) analyze_batch(&pending_batch);
+}
+
+// Alerts are buffered and written by flush_alerts, once per batch
 void send_alert(int account_id, double amount, const char *type) {
+    if (alert_buffer_used + 128 > sizeof(alert_buffer)) flush_alerts();
+    int n = snprintf(alert_buffer + alert_buffer_used, sizeof(alert_buffer) - alert_buffer_used,
+                     "ALERT: Account %d, Amount %.2f, Type %s\n", account_id, amount, type);
+    if (n > 0) alert_buffer_used += n;   // Rule names are short: the line always fits in 128 bytes
+}
+
+void flush_alerts() {
+    if (alert_buffer_used == 0) return;
     FILE *pipe = fopen(ALERT_PIPE, "w");
     if (pipe == NULL) {
         perror("fopen");
+        alert_buffer_used = 0;
         return;
     }
 
-    fprintf(pipe, "ALERT: Account %d, Amount %.2f, Type %s\n", account_id, amount, type);
+    fwrite(alert_buffer, 1, alert_buffer_used, pipe);
     fclose(pipe);
+    alert_buffer_used = 0;
 }
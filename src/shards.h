@@ -0,0 +1,88 @@
+// Reparto de cuentas entre varios procesos banco (shards).
+// Lo comparten banco y banco_router para que ambos asignen cada cuenta al mismo shard.
+#ifndef SHARDS_H
+#define SHARDS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SHARDS 16
+#define SOCKET_SHARDS_DEFECTO "/tmp/banco_shard_%d.sock"
+#define SOCKET_ROUTER_DEFECTO "/tmp/banco_router.sock"
+
+typedef struct {
+    int num_shards;                 // 0 o 1 = un único banco sin reparto
+    int rangos[MAX_SHARDS][2];      // Rango [desde, hasta] de cada shard, si se configuró
+    int num_rangos;
+    char socket_shards[108];        // Patrón con %d para el socket de cada shard
+    char socket_router[108];
+} ConfigShards;
+
+/// @brief Interpreta una línea del archivo de configuración si es de sharding.
+///        NUM_SHARDS=N reparte por cuenta % N; RANGOS_SHARDS=1000-1499,1500-1999
+///        asigna a cada shard un rango, en orden.
+/// @return 1 si la línea era de sharding, 0 en otro caso
+static inline int leer_config_shards(char *linea, ConfigShards *cfg) {
+    if (strncmp(linea, "NUM_SHARDS=", 11) == 0) {
+        cfg->num_shards = atoi(linea + 11);
+    } else if (strncmp(linea, "RANGOS_SHARDS=", 14) == 0) {
+        char *guardado = NULL;
+        cfg->num_rangos = 0;
+        for (char *rango = strtok_r(linea + 14, ",", &guardado); rango != NULL && cfg->num_rangos < MAX_SHARDS;
+             rango = strtok_r(NULL, ",", &guardado)) {
+            if (sscanf(rango, "%d-%d", &cfg->rangos[cfg->num_rangos][0], &cfg->rangos[cfg->num_rangos][1]) == 2) {
+                cfg->num_rangos++;
+            }
+        }
+    } else if (strncmp(linea, "SOCKET_SHARDS=", 14) == 0) {
+        sscanf(linea + 14, "%107s", cfg->socket_shards);
+    } else if (strncmp(linea, "SOCKET_ROUTER=", 14) == 0) {
+        sscanf(linea + 14, "%107s", cfg->socket_router);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// El patrón debe tener exactamente un %d y ningún otro '%': no se usa como formato de printf
+static inline int patron_socket_valido(const char *patron) {
+    const char *marca = strstr(patron, "%d");
+    return marca != NULL && strchr(patron, '%') == marca && strchr(marca + 2, '%') == NULL;
+}
+
+// Completa los valores que no aparecen en el archivo de configuración
+static inline void completar_config_shards(ConfigShards *cfg) {
+    if (cfg->num_rangos > 0) cfg->num_shards = cfg->num_rangos;
+    if (cfg->num_shards > MAX_SHARDS) cfg->num_shards = MAX_SHARDS;
+    if (cfg->socket_shards[0] != '\0' && !patron_socket_valido(cfg->socket_shards)) {
+        fprintf(stderr, "Aviso: SOCKET_SHARDS=%s debe llevar un único %%d y ningún otro %%; se usa %s\n",
+                cfg->socket_shards, SOCKET_SHARDS_DEFECTO);
+        cfg->socket_shards[0] = '\0';
+    }
+    if (cfg->socket_shards[0] == '\0') strcpy(cfg->socket_shards, SOCKET_SHARDS_DEFECTO);
+    if (cfg->socket_router[0] == '\0') strcpy(cfg->socket_router, SOCKET_ROUTER_DEFECTO);
+}
+
+/// @return El shard dueño de la cuenta, o -1 si ningún rango la contiene
+static inline int shard_de_cuenta(const ConfigShards *cfg, int cuenta) {
+    if (cfg->num_rangos > 0) {
+        for (int i = 0; i < cfg->num_rangos; i++) {
+            if (cuenta >= cfg->rangos[i][0] && cuenta <= cfg->rangos[i][1]) return i;
+        }
+        return -1;
+    }
+    if (cfg->num_shards <= 1) return 0;
+    int resto = cuenta % cfg->num_shards;
+    return resto < 0 ? resto + cfg->num_shards : resto;
+}
+
+// Sustituye el %d del patrón por el shard con un formato fijo
+static inline void ruta_socket_shard(const ConfigShards *cfg, int shard, char *ruta, size_t tam) {
+    const char *marca = strstr(cfg->socket_shards, "%d");
+    if (marca == NULL) marca = cfg->socket_shards + strlen(cfg->socket_shards);
+    snprintf(ruta, tam, "%.*s%d%s", (int)(marca - cfg->socket_shards), cfg->socket_shards, shard,
+             *marca != '\0' ? marca + 2 : "");
+}
+
+#endif
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * Cliente de prueba para el socket de un shard de banco. Abre una sesión con
+ * la cuenta indicada, envía las órdenes y escribe en la salida estándar las
+ * respuestas recibidas. Lo usan los escenarios de scripts/build_and_test.sh.
+ *
+ * Uso: ./test_sesion [-r repeticiones] [-p pausa_us] [-e respuestas] [-t ms] <socket> <cuenta> [orden...]
+ *   -r  Envía cada orden este número de veces (por defecto 1)
+ *   -p  Pausa entre envíos, en microsegundos (por defecto 0)
+ *   -e  Respuestas FIN-MSG que se esperan (por defecto, una por orden enviada;
+ *       0 = escuchar hasta el plazo sin esperar ninguna)
+ *   -t  Plazo para recibirlas, en milisegundos (por defecto 3000)
+ *
+ * Termina con 0 si recibió todas las respuestas esperadas y con 1 si no.
+ *
+ * Ejemplo: ./test_sesion /tmp/banco_shard_0.sock 1001 "ID:k1|Depósito de 10 en la cuenta 1001"
+ */
+
+#define BUFFER_SIZE 1024
+#define TAM_RESPUESTAS 65536
+#define TAM_ENVIO 65536
+
+/// @brief Milisegundos de un reloj monótono
+static long long ahora_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/// @brief Escribe todos los bytes en el socket
+/// @return 0 si se escribieron, -1 si la conexión falló
+static int escribir_completo(int fd, const char *datos, size_t largo) {
+    while (largo > 0) {
+        ssize_t n = write(fd, datos, largo);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        datos += n;
+        largo -= n;
+    }
+    return 0;
+}
+
+// Sin pausa entre envíos las órdenes se agrupan en escrituras grandes, como una ráfaga real
+static char envio[TAM_ENVIO];
+static size_t envio_usados = 0;
+
+/// @brief Añade la línea a las pendientes de envío y las escribe si se llena el buffer
+///        o si se pide vaciarlo
+/// @return 0 si se escribió o quedó pendiente, -1 si la conexión falló
+static int enviar_linea(int fd, const char *linea, int vaciar) {
+    size_t largo = strlen(linea);
+    if (largo + 1 > sizeof(envio)) return -1;
+    if (envio_usados + largo + 1 > sizeof(envio)) {
+        if (escribir_completo(fd, envio, envio_usados) < 0) return -1;
+        envio_usados = 0;
+    }
+    memcpy(envio + envio_usados, linea, largo);
+    envio[envio_usados + largo] = '\n';
+    envio_usados += largo + 1;
+    if (!vaciar) return 0;
+    int resultado = escribir_completo(fd, envio, envio_usados);
+    envio_usados = 0;
+    return resultado;
+}
+
+/// @brief Cuenta las apariciones de FIN-MSG en el texto
+static int contar_fin_msg(const char *texto) {
+    int num = 0;
+    for (const char *p = strstr(texto, "FIN-MSG"); p != NULL; p = strstr(p + 7, "FIN-MSG")) num++;
+    return num;
+}
+
+int main(int argc, char *argv[]) {
+    int repeticiones = 1, pausa_us = 0, esperadas = -1, plazo_ms = 3000;
+    int opcion;
+    while ((opcion = getopt(argc, argv, "r:p:e:t:")) != -1) {
+        switch (opcion) {
+            case 'r': repeticiones = atoi(optarg); break;
+            case 'p': pausa_us = atoi(optarg); break;
+            case 'e': esperadas = atoi(optarg); break;
+            case 't': plazo_ms = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Uso: %s [-r repeticiones] [-p pausa_us] [-e respuestas] [-t ms] <socket> <cuenta> [orden...]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind < 2) {
+        fprintf(stderr, "Uso: %s [-r repeticiones] [-p pausa_us] [-e respuestas] [-t ms] <socket> <cuenta> [orden...]\n",
+                argv[0]);
+        return 1;
+    }
+    const char *ruta = argv[optind];
+    int cuenta = atoi(argv[optind + 1]);
+    int num_ordenes = argc - optind - 2;
+    if (esperadas < 0) esperadas = num_ordenes * repeticiones;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un direccion = {.sun_family = AF_UNIX};
+    snprintf(direccion.sun_path, sizeof(direccion.sun_path), "%s", ruta);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&direccion, sizeof(direccion)) < 0) {
+        perror("Error al conectar con el banco");
+        return 1;
+    }
+
+    char linea[BUFFER_SIZE];
+    snprintf(linea, sizeof(linea), "Usuario con cuenta %d ha iniciado sesión.", cuenta);
+    if (enviar_linea(fd, linea, 1) < 0) {
+        fprintf(stderr, "Error al enviar el inicio de sesión\n");
+        return 1;
+    }
+    for (int r = 0; r < repeticiones; r++) {
+        for (int i = 0; i < num_ordenes; i++) {
+            int ultima = r == repeticiones - 1 && i == num_ordenes - 1;
+            if (enviar_linea(fd, argv[optind + 2 + i], pausa_us > 0 || ultima) < 0) {
+                fprintf(stderr, "Error al enviar la orden %d: %s\n", r * num_ordenes + i + 1, argv[optind + 2 + i]);
+                return 1;
+            }
+            if (pausa_us > 0) usleep(pausa_us);
+        }
+    }
+
+    // Lee hasta tener las respuestas esperadas, agotar el plazo o perder la conexión
+    static char respuestas[TAM_RESPUESTAS];
+    size_t recibido = 0;
+    long long limite = ahora_ms() + plazo_ms;
+    int recibidas = 0;
+    while (esperadas == 0 || recibidas < esperadas) {
+        long long resto = limite - ahora_ms();
+        if (resto <= 0) break;
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, (int)resto) <= 0) continue;
+        ssize_t n = read(fd, respuestas + recibido, sizeof(respuestas) - 1 - recibido);
+        if (n <= 0) break;
+        recibido += n;
+        respuestas[recibido] = '\0';
+        recibidas = contar_fin_msg(respuestas);
+        if (recibido == sizeof(respuestas) - 1) break;
+    }
+    close(fd);
+
+    fwrite(respuestas, 1, recibido, stdout);
+    if (recibidas < esperadas) {
+        fprintf(stderr, "Recibidas %d de %d respuestas\n", recibidas, esperadas);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+// Formato binario del tráfico de sesiones. Lo escriben generar_cuentas (tráfico sintético) y
+// banco al capturar sus sesiones, y lo reproduce banco_replay contra un banco nuevo.
+//
+// Archivo = CabeceraTrafico + registros. Cada registro es un RegistroTrafico de 16 bytes
+// seguido de `largo` bytes de texto: la línea que el cliente escribe en el socket, sin '\n',
+// o la respuesta que el banco le encola, con su "FIN-MSG".
+// Los registros van ordenados por instante; cada sesión es una conexión distinta al banco.
+#ifndef TRAFICO_H
+#define TRAFICO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAGIA_TRAFICO "BTRAFIC1"
+#define VERSION_TRAFICO 1
+#define MAX_TEXTO_TRAFICO 8192    // Las respuestas más largas se guardan truncadas
+
+// Tipos de registro
+#define TRAFICO_INICIO 1      // Abre la sesión; el texto es el mensaje "Usuario con cuenta N ha iniciado sesión."
+#define TRAFICO_PETICION 2    // Una línea de petición
+#define TRAFICO_FIN 3         // Cierra la sesión (sin texto)
+#define TRAFICO_RESPUESTA 4   // Respuesta del banco (sólo en las capturas)
+
+typedef struct {
+    char magia[8];
+    uint32_t version;
+    uint32_t num_sesiones;    // Sesiones distintas que aparecen en el archivo
+    int64_t inicio_us;        // Época (µs) del instante 0; 0 en el tráfico sintético
+    uint64_t num_registros;   // 0 si no se conocía al escribir la cabecera
+} CabeceraTrafico;
+
+typedef struct {
+    uint64_t instante_us;     // Desde el inicio del tráfico
+    uint32_t sesion;
+    uint16_t largo;           // Bytes de texto que siguen al registro
+    uint8_t tipo;
+    uint8_t reservado;
+} RegistroTrafico;
+
+static inline int escribir_cabecera_trafico(FILE *f, uint32_t num_sesiones, int64_t inicio_us,
+                                            uint64_t num_registros) {
+    CabeceraTrafico c;
+    memset(&c, 0, sizeof(c));
+    memcpy(c.magia, MAGIA_TRAFICO, sizeof(c.magia));
+    c.version = VERSION_TRAFICO;
+    c.num_sesiones = num_sesiones;
+    c.inicio_us = inicio_us;
+    c.num_registros = num_registros;
+    return fwrite(&c, sizeof(c), 1, f) == 1 ? 0 : -1;
+}
+
+/// @return 0 si la cabecera es válida, -1 si el archivo no es de tráfico o es de otra versión
+static inline int leer_cabecera_trafico(FILE *f, CabeceraTrafico *c) {
+    if (fread(c, sizeof(*c), 1, f) != 1) return -1;
+    if (memcmp(c->magia, MAGIA_TRAFICO, sizeof(c->magia)) != 0 || c->version != VERSION_TRAFICO) return -1;
+    return 0;
+}
+
+static inline int escribir_registro_trafico(FILE *f, uint64_t instante_us, uint32_t sesion, uint8_t tipo,
+                                            const char *texto, size_t largo) {
+    if (largo > MAX_TEXTO_TRAFICO) largo = MAX_TEXTO_TRAFICO;
+    RegistroTrafico r = {instante_us, sesion, (uint16_t)largo, tipo, 0};
+    if (fwrite(&r, sizeof(r), 1, f) != 1) return -1;
+    if (largo > 0 && fwrite(texto, 1, largo, f) != largo) return -1;
+    return 0;
+}
+
+/// @brief Lee el siguiente registro y su texto (terminado en '\0') en texto[MAX_TEXTO_TRAFICO + 1]
+/// @return 1 si leyó un registro, 0 al final del archivo, -1 si está truncado o corrupto
+static inline int leer_registro_trafico(FILE *f, RegistroTrafico *r, char *texto) {
+    if (fread(r, sizeof(*r), 1, f) != 1) return feof(f) ? 0 : -1;
+    if (r->largo > MAX_TEXTO_TRAFICO) return -1;
+    if (r->largo > 0 && fread(texto, 1, r->largo, f) != r->largo) return -1;
+    texto[r->largo] = '\0';
+    return 1;
+}
+
+#endif
@@ -0,0 +1,138 @@
+// Trazas de peticiones: tramos (recibir, interpretar, espera en cola, ejecutar, log, responder...)
+// con marcas del contador de ciclos (TSC), guardados en un anillo por hilo sin cerrojos.
+// Se vuelcan bajo demanda en el formato JSON de trace events que abren chrome://tracing y Perfetto.
+#ifndef TRAZA_H
+#define TRAZA_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define MAX_HILOS_TRAZA 80
+#define EVENTOS_POR_HILO 2048   // Potencia de 2: al llenarse, cada evento nuevo pisa el más antiguo
+
+typedef struct {
+    uint64_t inicio;              // Marcas de traza_reloj()
+    uint64_t fin;
+    const char *nombre;           // Literal: el volcado sólo guarda el puntero
+    uint32_t peticion;            // Petición muestreada a la que pertenece (0 = ninguna)
+    int32_t dato;                 // Slot de la sesión, bytes escritos... según el tramo
+    _Atomic uint64_t numero;      // Secuencia del evento (0 mientras se escribe)
+} EventoTraza;
+
+typedef struct {
+    EventoTraza eventos[EVENTOS_POR_HILO];
+    _Atomic uint64_t escritos;
+    char nombre[24];
+} AnilloTraza;
+
+static AnilloTraza anillos_traza[MAX_HILOS_TRAZA];
+static atomic_int num_anillos_traza;
+static __thread AnilloTraza *anillo_hilo_traza;
+static uint64_t traza_base_ciclos;   // Referencia para pasar ciclos a microsegundos
+static int64_t traza_base_ns;
+
+static inline int64_t traza_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Marca de tiempo barata: el TSC en x86; en otras arquitecturas, nanosegundos del reloj monótono
+static inline uint64_t traza_reloj() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (uint64_t)traza_ns();
+#endif
+}
+
+static inline void traza_iniciar() {
+    traza_base_ns = traza_ns();
+    traza_base_ciclos = traza_reloj();
+}
+
+/// @brief Da nombre al hilo en el volcado; lo registra si aún no tenía anillo
+/// @return El anillo del hilo, o NULL si ya hay MAX_HILOS_TRAZA hilos registrados
+static inline AnilloTraza *traza_registrar_hilo(const char *nombre) {
+    if (anillo_hilo_traza == NULL) {
+        int n = atomic_fetch_add(&num_anillos_traza, 1);
+        if (n >= MAX_HILOS_TRAZA) return NULL;
+        anillo_hilo_traza = &anillos_traza[n];
+    }
+    if (nombre != NULL) snprintf(anillo_hilo_traza->nombre, sizeof(anillo_hilo_traza->nombre), "%s", nombre);
+    return anillo_hilo_traza;
+}
+
+// Guarda un tramo en el anillo del hilo. Sólo escribe el propio hilo; el volcado lee a la vez
+static inline void traza_registrar(const char *nombre, uint64_t inicio, uint64_t fin, uint32_t peticion,
+                                   int32_t dato) {
+    AnilloTraza *a = anillo_hilo_traza != NULL ? anillo_hilo_traza : traza_registrar_hilo(NULL);
+    if (a == NULL) return;
+    uint64_t n = atomic_load_explicit(&a->escritos, memory_order_relaxed);
+    EventoTraza *e = &a->eventos[n & (EVENTOS_POR_HILO - 1)];
+    atomic_store_explicit(&e->numero, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    e->inicio = inicio;
+    e->fin = fin;
+    e->nombre = nombre;
+    e->peticion = peticion;
+    e->dato = dato;
+    atomic_store_explicit(&e->numero, n + 1, memory_order_release);
+    atomic_store_explicit(&a->escritos, n + 1, memory_order_release);
+}
+
+/// @brief Escribe los eventos guardados como JSON de trace events ("ph":"X", tiempos en µs)
+/// @return Eventos escritos
+static inline long traza_volcar(FILE *f, int pid) {
+    // Ciclos por microsegundo medidos entre traza_iniciar y ahora; un intervalo corto los estima mal
+    int64_t ns = traza_ns() - traza_base_ns;
+    if (ns < 10000000) {
+        struct timespec espera = {0, 10000000 - ns};
+        nanosleep(&espera, NULL);
+        ns = traza_ns() - traza_base_ns;
+    }
+    double ciclos_us = (double)(traza_reloj() - traza_base_ciclos) / ((double)ns / 1000.0);
+    long total = 0;
+    const char *separador = "";
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    int hilos = atomic_load(&num_anillos_traza);
+    if (hilos > MAX_HILOS_TRAZA) hilos = MAX_HILOS_TRAZA;
+    for (int h = 0; h < hilos; h++) {
+        AnilloTraza *a = &anillos_traza[h];
+        fprintf(f, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                separador, pid, h, a->nombre[0] != '\0' ? a->nombre : "hilo");
+        separador = ",\n";
+        uint64_t escritos = atomic_load_explicit(&a->escritos, memory_order_acquire);
+        uint64_t desde = escritos > EVENTOS_POR_HILO ? escritos - EVENTOS_POR_HILO : 0;
+        for (uint64_t k = desde; k < escritos; k++) {
+            EventoTraza *e = &a->eventos[k & (EVENTOS_POR_HILO - 1)];
+            uint64_t antes = atomic_load_explicit(&e->numero, memory_order_acquire);
+            EventoTraza copia;
+            copia.inicio = e->inicio;
+            copia.fin = e->fin;
+            copia.nombre = e->nombre;
+            copia.peticion = e->peticion;
+            copia.dato = e->dato;
+            atomic_thread_fence(memory_order_acquire);
+            // Descarta el evento si el hilo lo estaba sustituyendo mientras se copiaba
+            if (antes != k + 1 || atomic_load_explicit(&e->numero, memory_order_relaxed) != antes) continue;
+            if (copia.fin < copia.inicio || copia.inicio < traza_base_ciclos) continue;
+            fprintf(f, ",\n{\"ph\":\"X\",\"cat\":\"banco\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,"
+                       "\"dur\":%.3f,\"args\":{\"peticion\":%u,\"dato\":%d}}",
+                    copia.nombre, pid, h, (copia.inicio - traza_base_ciclos) / ciclos_us,
+                    (copia.fin - copia.inicio) / ciclos_us, copia.peticion, copia.dato);
+            total++;
+        }
+    }
+    fprintf(f, "\n]}\n");
+    return total;
+}
+
+#endif
@@ -0,0 +1,186 @@
+// Anillo de io_uring mínimo sobre las llamadas al sistema, sin depender de liburing.
+// Lo usa banco para enviar en una sola io_uring_enter las lecturas de las sesiones,
+// las respuestas pendientes y las escrituras del log de transacciones.
+#ifndef URING_H
+#define URING_H
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+typedef struct {
+    int fd;
+    unsigned *sq_cabeza;
+    unsigned *sq_cola;
+    unsigned *sq_mascara;
+    unsigned *sq_indices;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entradas;
+    unsigned sq_preparadas;        // SQE rellenadas que aún no se han pasado al núcleo
+    unsigned *cq_cabeza;
+    unsigned *cq_cola;
+    unsigned *cq_mascara;
+    struct io_uring_cqe *cqes;
+    void *mapa_sq;
+    size_t tam_mapa_sq;
+    void *mapa_cq;                 // NULL si comparte mapa con la cola de envío
+    size_t tam_mapa_cq;
+    size_t tam_sqes;
+} AnilloUring;
+
+static inline int uring_setup(unsigned entradas, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entradas, p);
+}
+
+static inline int uring_enter(int fd, unsigned enviar, unsigned minimo, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, enviar, minimo, flags, NULL, 0);
+}
+
+static inline int uring_register(int fd, unsigned orden, void *arg, unsigned num) {
+    return (int)syscall(__NR_io_uring_register, fd, orden, arg, num);
+}
+
+static inline void uring_cerrar(AnilloUring *a) {
+    if (a->sqes != NULL) munmap(a->sqes, a->tam_sqes);
+    if (a->mapa_cq != NULL) munmap(a->mapa_cq, a->tam_mapa_cq);
+    if (a->mapa_sq != NULL) munmap(a->mapa_sq, a->tam_mapa_sq);
+    if (a->fd >= 0) close(a->fd);
+    memset(a, 0, sizeof(*a));
+    a->fd = -1;
+}
+
+/// @brief Crea el anillo y proyecta sus colas de envío y terminación
+/// @return 0 si se creó, -errno si el núcleo no admite io_uring
+static inline int uring_iniciar(AnilloUring *a, unsigned entradas) {
+    struct io_uring_params p;
+    memset(a, 0, sizeof(*a));
+    memset(&p, 0, sizeof(p));
+    a->fd = uring_setup(entradas, &p);
+    if (a->fd < 0) {
+        int error = errno;
+        a->fd = -1;
+        return -error;
+    }
+
+    a->tam_mapa_sq = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    a->tam_mapa_cq = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && a->tam_mapa_cq > a->tam_mapa_sq) a->tam_mapa_sq = a->tam_mapa_cq;
+    a->mapa_sq = mmap(NULL, a->tam_mapa_sq, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->fd,
+                      IORING_OFF_SQ_RING);
+    if (a->mapa_sq == MAP_FAILED) {
+        a->mapa_sq = NULL;
+        uring_cerrar(a);
+        return -ENOMEM;
+    }
+    void *cq = a->mapa_sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = a->mapa_cq = mmap(NULL, a->tam_mapa_cq, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->fd,
+                               IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            a->mapa_cq = NULL;
+            uring_cerrar(a);
+            return -ENOMEM;
+        }
+    }
+    a->tam_sqes = p.sq_entries * sizeof(struct io_uring_sqe);
+    a->sqes = mmap(NULL, a->tam_sqes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->fd, IORING_OFF_SQES);
+    if (a->sqes == MAP_FAILED) {
+        a->sqes = NULL;
+        uring_cerrar(a);
+        return -ENOMEM;
+    }
+
+    char *sq = a->mapa_sq;
+    a->sq_cabeza = (unsigned *)(sq + p.sq_off.head);
+    a->sq_cola = (unsigned *)(sq + p.sq_off.tail);
+    a->sq_mascara = (unsigned *)(sq + p.sq_off.ring_mask);
+    a->sq_indices = (unsigned *)(sq + p.sq_off.array);
+    a->sq_entradas = p.sq_entries;
+    a->cq_cabeza = (unsigned *)((char *)cq + p.cq_off.head);
+    a->cq_cola = (unsigned *)((char *)cq + p.cq_off.tail);
+    a->cq_mascara = (unsigned *)((char *)cq + p.cq_off.ring_mask);
+    a->cqes = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+    return 0;
+}
+
+/// @return 1 si el núcleo implementa todas las operaciones indicadas
+static inline int uring_soporta(AnilloUring *a, const int *operaciones, int num) {
+    size_t tam = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *sonda = calloc(1, tam);
+    if (sonda == NULL) return 0;
+    int ok = uring_register(a->fd, IORING_REGISTER_PROBE, sonda, 256) == 0;
+    for (int i = 0; i < num && ok; i++) {
+        ok = operaciones[i] <= sonda->last_op && (sonda->ops[operaciones[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(sonda);
+    return ok;
+}
+
+/// @brief Fija en memoria los buffers para usarlos con IORING_OP_READ_FIXED y WRITE_FIXED
+/// @return 0 si se registraron, -errno si no (por ejemplo, por RLIMIT_MEMLOCK)
+static inline int uring_registrar_buffers(AnilloUring *a, const struct iovec *buffers, unsigned num) {
+    return uring_register(a->fd, IORING_REGISTER_BUFFERS, (void *)buffers, num) < 0 ? -errno : 0;
+}
+
+// SQE que aún se pueden preparar antes de llenar la cola de envío
+static inline unsigned uring_libres(const AnilloUring *a) {
+    return a->sq_entradas - (*a->sq_cola + a->sq_preparadas - __atomic_load_n(a->sq_cabeza, __ATOMIC_ACQUIRE));
+}
+
+/// @return Una SQE a cero para rellenar, o NULL si la cola de envío está llena
+static inline struct io_uring_sqe *uring_sqe(AnilloUring *a) {
+    if (uring_libres(a) == 0) return NULL;
+    unsigned indice = (*a->sq_cola + a->sq_preparadas) & *a->sq_mascara;
+    struct io_uring_sqe *sqe = &a->sqes[indice];
+    memset(sqe, 0, sizeof(*sqe));
+    a->sq_indices[indice] = indice;
+    a->sq_preparadas++;
+    return sqe;
+}
+
+static inline void uring_preparar(struct io_uring_sqe *sqe, int op, int fd, const void *datos, unsigned largo,
+                                  uint64_t posicion, uint64_t dato_usuario) {
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)datos;
+    sqe->len = largo;
+    sqe->off = posicion;
+    sqe->user_data = dato_usuario;
+}
+
+/// @brief Pasa al núcleo las SQE preparadas y, si minimo > 0, espera ese número de terminaciones
+/// @return SQE aceptadas, o -errno
+static inline int uring_enviar(AnilloUring *a, unsigned minimo) {
+    if (a->sq_preparadas == 0 && minimo == 0) return 0;
+    __atomic_store_n(a->sq_cola, *a->sq_cola + a->sq_preparadas, __ATOMIC_RELEASE);
+    a->sq_preparadas = 0;
+    // Incluye las publicadas en una llamada anterior que el núcleo no llegó a consumir
+    unsigned enviar = *a->sq_cola - __atomic_load_n(a->sq_cabeza, __ATOMIC_ACQUIRE);
+    int r;
+    do {
+        r = uring_enter(a->fd, enviar, minimo, minimo > 0 ? IORING_ENTER_GETEVENTS : 0);
+    } while (r < 0 && errno == EINTR && minimo == 0);
+    return r < 0 ? -errno : r;
+}
+
+/// @brief Saca la siguiente terminación de la cola, si la hay
+/// @return 1 si se copió una CQE en *cqe, 0 si la cola está vacía
+static inline int uring_siguiente(AnilloUring *a, struct io_uring_cqe *cqe) {
+    unsigned cabeza = *a->cq_cabeza;
+    if (cabeza == __atomic_load_n(a->cq_cola, __ATOMIC_ACQUIRE)) return 0;
+    *cqe = a->cqes[cabeza & *a->cq_mascara];
+    __atomic_store_n(a->cq_cabeza, cabeza + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static inline int uring_hay_terminaciones(const AnilloUring *a) {
+    return *a->cq_cabeza != __atomic_load_n(a->cq_cola, __ATOMIC_ACQUIRE);
+}
+
+#endif
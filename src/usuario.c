@@ -12,6 +12,9 @@
 #include <sys/stat.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "memoria.h"
 
 #define BUFFER_SIZE 256
 #define LOG_FILE "../data/transacciones.log"
@@ -39,15 +42,25 @@ typedef struct {
     int tipo_operacion; // 1: Depósito, 2: Retiro, 3: Transferencia, 4: Consultar saldo
     double monto;
     int cuenta;
+    int cuenta_destino; // Sólo para transferencias
     // Descriptor de archivo para escribir al banco
     int fifo_fd;
 } Operacion;
 
-// Estructura para pasar parámetros al hilo.
+// Estructura para pasar parámetros al hilo. Lleva también los buffers del mensaje y de la
+// respuesta, que así se reciclan con el bloque en lugar de vivir en la pila de cada hilo.
 typedef struct {
     Operacion op;
+    char mensaje[BUFFER_SIZE + 64];    // Deja sitio para el prefijo "ID:<clave>|"
+    char respuesta[BUFFER_SIZE * 2];
 } OperacionArgs;
 
+// Bloques de OperacionArgs preasignados: una operación toma uno al lanzarse y lo devuelve al acabar
+#define MAX_OPERACIONES_EN_CURSO 32
+OperacionArgs bloques_operaciones[MAX_OPERACIONES_EN_CURSO];
+int libres_operaciones[MAX_OPERACIONES_EN_CURSO];
+PoolBloques pool_operaciones;
+
 // Variables globales para los FIFOs
 char fifo_escritura[256]; // Usuario escribe aquí, banco lee
 char fifo_lectura[256];   // Banco escribe aquí, usuario lee
@@ -57,6 +70,155 @@ int fifo_lectura_fd = -1;
 // Mutex para sincronizar la salida
 pthread_mutex_t stdout_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Contador para generar claves de idempotencia únicas (protegido por stdout_mutex)
+unsigned long contador_peticiones = 0;
+
+#define MAX_SALDOS_CACHE 8
+
+// Saldo de una cuenta suscrita; el banco envía cada cambio, así que no hace falta preguntarle
+typedef struct {
+    int cuenta;
+    double saldo;
+} SaldoCache;
+
+SaldoCache cache_saldos[MAX_SALDOS_CACHE];
+int num_saldos_cache = 0;
+pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Última respuesta del banco a una petición, entregada por el hilo receptor
+char respuesta_banco[BUFFER_SIZE * 2];
+unsigned long respuestas_recibidas = 0;
+pthread_mutex_t respuesta_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t respuesta_cond = PTHREAD_COND_INITIALIZER;
+
+void actualizar_cache_saldo(int cuenta, double saldo) {
+    pthread_mutex_lock(&cache_mutex);
+    int i = 0;
+    while (i < num_saldos_cache && cache_saldos[i].cuenta != cuenta) i++;
+    if (i < MAX_SALDOS_CACHE) {
+        if (i == num_saldos_cache) num_saldos_cache++;
+        cache_saldos[i].cuenta = cuenta;
+        cache_saldos[i].saldo = saldo;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+// Devuelve 1 y el saldo si la cuenta está en la caché local
+int saldo_en_cache(int cuenta, double *saldo) {
+    int encontrado = 0;
+    pthread_mutex_lock(&cache_mutex);
+    for (int i = 0; i < num_saldos_cache; i++) {
+        if (cache_saldos[i].cuenta == cuenta) {
+            *saldo = cache_saldos[i].saldo;
+            encontrado = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return encontrado;
+}
+
+// Interpreta una lista "cuenta=saldo:cuenta=saldo..." y la guarda en la caché
+static void actualizar_cache_lista(const char *p) {
+    int cuenta, consumidos;
+    double saldo;
+    while (sscanf(p, "%d=%lf%n", &cuenta, &saldo, &consumidos) == 2) {
+        actualizar_cache_saldo(cuenta, saldo);
+        p += consumidos;
+        if (*p != ':') break;
+        p++;
+    }
+}
+
+// Los avisos de saldo actualizan la caché; el resto son respuestas para quien las espera
+void procesar_mensaje_banco(const char *mensaje) {
+    if (strncmp(mensaje, "[NOTIF:SALDO:", 13) == 0) {
+        debug_log("Aviso de saldo recibido: %s", mensaje);
+        actualizar_cache_lista(mensaje + 13);
+        return;
+    }
+    if (strncmp(mensaje, "[SUSCRITO:", 10) == 0) {
+        debug_log("Suscripción confirmada: %s", mensaje);
+        actualizar_cache_lista(mensaje + 10);
+        return;
+    }
+
+    pthread_mutex_lock(&respuesta_mutex);
+    snprintf(respuesta_banco, sizeof(respuesta_banco), "%s", mensaje);
+    respuestas_recibidas++;
+    pthread_cond_broadcast(&respuesta_cond);
+    pthread_mutex_unlock(&respuesta_mutex);
+}
+
+// Hilo que lee todo lo que envía el banco y lo separa por la marca FIN-MSG
+void *hilo_receptor(void *arg) {
+    char buffer[BUFFER_SIZE * 4];
+    size_t usados = 0;
+    (void)arg;
+
+    while (1) {
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(fifo_lectura_fd, &readfds);
+        if (select(fifo_lectura_fd + 1, &readfds, NULL, NULL, NULL) < 0) {
+            if (errno == EINTR) continue;
+            debug_log("ERROR en select(): %s", strerror(errno));
+            break;
+        }
+
+        ssize_t leidos = read(fifo_lectura_fd, buffer + usados, sizeof(buffer) - 1 - usados);
+        if (leidos == 0) {
+            // El banco aún no abrió su extremo o lo cerró: esperar sin consumir CPU
+            usleep(100000);
+            continue;
+        }
+        if (leidos < 0) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            debug_log("Error al leer del FIFO: %s", strerror(errno));
+            break;
+        }
+        usados += leidos;
+        buffer[usados] = '\0';
+
+        char *fin;
+        while ((fin = strstr(buffer, "FIN-MSG\n")) != NULL) {
+            size_t consumidos = fin - buffer + strlen("FIN-MSG\n");
+            *fin = '\0';
+            while (fin > buffer && (fin[-1] == '\n' || fin[-1] == '\r')) *--fin = '\0';
+            procesar_mensaje_banco(buffer);
+            memmove(buffer, buffer + consumidos, usados - consumidos + 1);
+            usados -= consumidos;
+        }
+        if (usados == sizeof(buffer) - 1) {
+            debug_log("Mensaje del banco sin marca FIN-MSG descartado");
+            usados = 0;
+        }
+    }
+    return NULL;
+}
+
+/// @brief Abre la sesión por el socket de banco_router. Se usa el mismo socket para
+///        enviar y, duplicado, para recibir, así el resto del programa no cambia.
+int conectar_router(const char *ruta) {
+    struct sockaddr_un dir;
+    memset(&dir, 0, sizeof(dir));
+    dir.sun_family = AF_UNIX;
+    snprintf(dir.sun_path, sizeof(dir.sun_path), "%s", ruta);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&dir, sizeof(dir)) < 0) {
+        close(fd);
+        return -1;
+    }
+    // Si el router se cae, write debe devolver EPIPE en lugar de terminar el proceso
+    signal(SIGPIPE, SIG_IGN);
+    fifo_escritura_fd = fd;
+    fifo_lectura_fd = dup(fd);
+    fcntl(fifo_lectura_fd, F_SETFL, fcntl(fifo_lectura_fd, F_GETFL) | O_NONBLOCK);
+    return fifo_lectura_fd < 0 ? -1 : 0;
+}
+
 // Manejador para cerrar apropiadamente
 void manejador_terminar(int sig) {
     printf("\nTerminando sesión...\n");
@@ -82,12 +244,22 @@ void get_timestamp(char *buffer, size_t size) {
 // Función que ejecuta la operación y comunica con el banco
 void *ejecutar_operacion(void *arg) {
     OperacionArgs *args = (OperacionArgs *)arg;
-    char mensaje[BUFFER_SIZE];
+    char *mensaje = args->mensaje;
     char timestamp[30];
     get_timestamp(timestamp, sizeof(timestamp));
     
     // Bloquear el mutex para asegurar que el mensaje completo se escriba de una vez
     pthread_mutex_lock(&stdout_mutex);
+
+    // Las cuentas suscritas se consultan en la caché local, sin ir al banco
+    double saldo_local;
+    if (args->op.tipo_operacion == 4 && saldo_en_cache(args->op.cuenta, &saldo_local)) {
+        printf("Saldo de la cuenta %d: %.2f (caché local, el banco avisa de cada cambio)\n",
+               args->op.cuenta, saldo_local);
+        pthread_mutex_unlock(&stdout_mutex);
+        pool_devolver(&pool_operaciones, args);
+        pthread_exit(NULL);
+    }
     
     // Crear mensaje basado en el tipo de operación
     switch (args->op.tipo_operacion) {
@@ -100,8 +272,8 @@ void *ejecutar_operacion(void *arg) {
                    timestamp, args->op.monto, args->op.cuenta);
             break;
         case 3:
-            sprintf(mensaje, "[%s] Transferencia de %.2f desde la cuenta %d completada.\n", 
-                   timestamp, args->op.monto, args->op.cuenta);
+            sprintf(mensaje, "[%s] Transferencia de %.2f desde la cuenta %d a la cuenta %d.\n",
+                   timestamp, args->op.monto, args->op.cuenta, args->op.cuenta_destino);
             break;
         case 4:
             sprintf(mensaje, "[%s] Consulta de saldo en la cuenta %d solicitada.\n", 
@@ -113,6 +285,21 @@ void *ejecutar_operacion(void *arg) {
             break;
     }
     
+    // Las operaciones que modifican saldos llevan una clave de idempotencia: si hay que
+    // reenviarlas, el banco reconoce la clave y no las aplica dos veces
+    int con_clave = args->op.tipo_operacion >= 1 && args->op.tipo_operacion <= 3;
+    if (con_clave) {
+        char sin_clave[BUFFER_SIZE];
+        strcpy(sin_clave, mensaje);
+        snprintf(mensaje, sizeof(args->mensaje), "ID:%d-%ld-%lu|%s", (int)getpid(), (long)time(NULL),
+                 ++contador_peticiones, sin_clave);
+    }
+
+    // Las respuestas que lleguen a partir de aquí son para esta operación
+    pthread_mutex_lock(&respuesta_mutex);
+    unsigned long respuestas_vistas = respuestas_recibidas;
+    pthread_mutex_unlock(&respuesta_mutex);
+
     // Enviar mensaje al banco a través del FIFO
     if (fifo_escritura_fd >= 0) {
         printf("[DEBUG] Enviando mensaje al banco: %s", mensaje);
@@ -120,86 +307,71 @@ void *ejecutar_operacion(void *arg) {
         if (bytes_escritos < 0) {
             perror("[ERROR] Error al escribir en FIFO");
             pthread_mutex_unlock(&stdout_mutex);
-            free(args);
+            pool_devolver(&pool_operaciones, args);
             pthread_exit(NULL);
         } else {
             printf("[DEBUG] Mensaje enviado correctamente: %ld bytes escritos\n", bytes_escritos);
         }
     }
     
-    // Si es una consulta de saldo, esperar respuesta del banco
-    if (args->op.tipo_operacion == 4 && fifo_lectura_fd >= 0) {
-        debug_log("Preparando para consulta de saldo con cuenta %d", args->op.cuenta);
-        
-        // Use direct mode setting instead of toggling between modes
-        int original_flags = fcntl(fifo_lectura_fd, F_GETFL);
-        fcntl(fifo_lectura_fd, F_SETFL, original_flags & ~O_NONBLOCK); // Set blocking
-        
+    // Esperar la respuesta del banco a las consultas de saldo y a las operaciones con clave.
+    // El hilo receptor lee el FIFO y entrega aquí las respuestas.
+    if ((args->op.tipo_operacion == 4 || con_clave) && fifo_lectura_fd >= 0) {
         debug_log("Esperando respuesta del banco (puede tardar unos segundos)...");
         printf("Esperando respuesta del banco...\n");
         
-        // Use select() with a timeout and limited retries
         int max_retries = 3;
         int retry_count = 0;
         int got_response = 0;
+        char *buffer = args->respuesta;
         
+        pthread_mutex_lock(&respuesta_mutex);
         while (retry_count < max_retries && !got_response) {
-            fd_set readfds;
-            struct timeval tv;
-            FD_ZERO(&readfds);
-            FD_SET(fifo_lectura_fd, &readfds);
-            tv.tv_sec = 5;  // 5 second timeout per retry
-            tv.tv_usec = 0;
+            struct timespec limite;
+            clock_gettime(CLOCK_REALTIME, &limite);
+            limite.tv_sec += 5;  // 5 second timeout per retry
             
             debug_log("Intento %d de %d para leer respuesta", retry_count + 1, max_retries);
-            int ret = select(fifo_lectura_fd + 1, &readfds, NULL, NULL, &tv);
+            int ret = 0;
+            while (respuestas_recibidas == respuestas_vistas && ret == 0) {
+                ret = pthread_cond_timedwait(&respuesta_cond, &respuesta_mutex, &limite);
+            }
             
-            if (ret == -1) {
-                debug_log("ERROR en select(): %s", strerror(errno));
-                retry_count++;
-                continue;
-            } else if (ret == 0) {
+            if (respuestas_recibidas == respuestas_vistas) {
                 debug_log("Timeout de 5 segundos esperando respuesta");
                 retry_count++;
-                continue;
-            } else {
-                // Data available
-                debug_log("¡Hay datos disponibles para leer!");
-                
-                // Clear buffer and read data
-                char buffer[BUFFER_SIZE * 2] = {0};
-                ssize_t bytes_leidos = read(fifo_lectura_fd, buffer, sizeof(buffer) - 1);
-                
-                if (bytes_leidos > 0) {
-                    buffer[bytes_leidos] = '\0'; // Ensure null termination
-                    debug_log("Datos recibidos: '%s'", buffer);
-                    printf("Respuesta del banco: %s\n", buffer);
-                    got_response = 1;  // Got a valid response
-                } else if (bytes_leidos == 0) {
-                    debug_log("EOF detectado - El banco cerró la conexión sin enviar datos");
-                    retry_count++;
-                    continue;
-                } else {
-                    debug_log("Error al leer del FIFO: %s", strerror(errno));
-                    retry_count++;
-                    continue;
+                // Reenviar con la misma clave: si el banco ya la aplicó, sólo repite la respuesta
+                if (con_clave && retry_count < max_retries &&
+                    write(fifo_escritura_fd, mensaje, strlen(mensaje)) < 0) {
+                    perror("[ERROR] Error al reenviar la operación");
                 }
+                continue;
             }
+            
+            snprintf(buffer, sizeof(args->respuesta), "%s", respuesta_banco);
+            got_response = 1;
         }
+        pthread_mutex_unlock(&respuesta_mutex);
         
-        if (!got_response) {
+        if (got_response) {
+            debug_log("Datos recibidos: '%s'", buffer);
+            int reintentar_ms;
+            char *sobrecarga = strstr(buffer, "[SOBRECARGA:reintentar_ms=");
+            if (sobrecarga != NULL && sscanf(sobrecarga, "[SOBRECARGA:reintentar_ms=%d]", &reintentar_ms) == 1) {
+                // El banco rechazó la petición sin encolarla; no tiene sentido seguir esperando
+                printf("El banco está sobrecargado, vuelva a intentarlo en %d ms\n", reintentar_ms);
+            } else {
+                printf("Respuesta del banco: %s\n", buffer);
+            }
+        } else {
             printf("No se pudo obtener respuesta del banco después de %d intentos\n", max_retries);
         }
-        
-        // Restore original flags
-        fcntl(fifo_lectura_fd, F_SETFL, original_flags);
-        debug_log("Restaurada configuración original del FIFO");
     }
     
     // Desbloquear el mutex
     pthread_mutex_unlock(&stdout_mutex);
     
-    free(args);
+    pool_devolver(&pool_operaciones, args);
     pthread_exit(NULL);
 }
 
@@ -233,6 +405,7 @@ void menu_usuario(int cuenta) {
         op.tipo_operacion = opcion;
         op.monto = 0.0;
         op.cuenta = cuenta;
+        op.cuenta_destino = 0;
         op.fifo_fd = fifo_escritura_fd;
 
         // Para operaciones que requieren monto.
@@ -245,11 +418,20 @@ void menu_usuario(int cuenta) {
             }
             op.monto = monto;
         }
+        if (opcion == 3) {
+            printf("Ingrese la cuenta destino: ");
+            if (scanf("%d", &op.cuenta_destino) != 1 || op.cuenta_destino <= 0 || op.cuenta_destino == cuenta) {
+                fprintf(stderr, "Cuenta destino inválida. Intente de nuevo.\n");
+                while (getchar() != '\n');
+                continue;
+            }
+        }
         
         // Preparar los argumentos para el hilo.
-        OperacionArgs *args = malloc(sizeof(OperacionArgs));
+        OperacionArgs *args = pool_tomar(&pool_operaciones);
         if (args == NULL) {
-            perror("Error al asignar memoria para OperacionArgs");
+            fprintf(stderr, "Hay demasiadas operaciones en curso (%d). Espere a que terminen.\n",
+                    MAX_OPERACIONES_EN_CURSO);
             continue;
         }
         args->op = op;
@@ -257,7 +439,7 @@ void menu_usuario(int cuenta) {
         // Crear un hilo para ejecutar la operación.
         if (pthread_create(&tid, NULL, ejecutar_operacion, (void *)args) != 0) {
             perror("Error al crear el hilo");
-            free(args);
+            pool_devolver(&pool_operaciones, args);
             continue;
         }
         
@@ -282,18 +464,27 @@ void menu_usuario(int cuenta) {
 
 int main(int argc, char *argv[]) {
     if (argc < 2) {
-        fprintf(stderr, "Uso: %s <numero_cuenta> [fifo_escritura] [fifo_lectura]\n", argv[0]);
+        fprintf(stderr, "Uso: %s <numero_cuenta> [fifo_escritura fifo_lectura | unix:<socket_router>]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
     int numero_cuenta = atoi(argv[1]);
+    pool_iniciar(&pool_operaciones, bloques_operaciones, sizeof(OperacionArgs), MAX_OPERACIONES_EN_CURSO,
+                 libres_operaciones);
     
     // Configurar manejadores de señales
     signal(SIGTERM, manejador_terminar);
     signal(SIGINT, manejador_terminar);
     
-    // Si se proporcionaron nombres de FIFOs, usarlos para la comunicación
-    if (argc >= 4) {
+    // Con unix:<ruta> la sesión va por el socket de banco_router (banco repartido en shards);
+    // si se proporcionaron nombres de FIFOs, usarlos para la comunicación
+    if (argc >= 3 && strncmp(argv[2], "unix:", 5) == 0) {
+        printf("Conectando con el router del banco en %s...\n", argv[2] + 5);
+        if (conectar_router(argv[2] + 5) < 0) {
+            perror("Error al conectar con el router");
+            exit(EXIT_FAILURE);
+        }
+    } else if (argc >= 4) {
         strcpy(fifo_escritura, argv[2]); // Usuario -> Banco
         strcpy(fifo_lectura, argv[3]);   // Banco -> Usuario
         
@@ -318,15 +509,28 @@ int main(int argc, char *argv[]) {
             close(fifo_escritura_fd);
             exit(EXIT_FAILURE);
         }
-        
+    }
+
+    if (fifo_escritura_fd >= 0 && fifo_lectura_fd >= 0) {
         // Enviar mensaje de inicio
-        if (fifo_escritura_fd >= 0) {
-            char mensaje[BUFFER_SIZE];
-            sprintf(mensaje, "Usuario con cuenta %d ha iniciado sesión.\n", numero_cuenta);
-            if (write(fifo_escritura_fd, mensaje, strlen(mensaje)) < 0) {
-                perror("Error al enviar mensaje de inicio");
-            }
+        char mensaje[BUFFER_SIZE];
+        sprintf(mensaje, "Usuario con cuenta %d ha iniciado sesión.\n", numero_cuenta);
+        if (write(fifo_escritura_fd, mensaje, strlen(mensaje)) < 0) {
+            perror("Error al enviar mensaje de inicio");
+        }
+
+        // Recibir los avisos de cambio de saldo de la propia cuenta
+        sprintf(mensaje, "SUSCRIBIR:%d\n", numero_cuenta);
+        if (write(fifo_escritura_fd, mensaje, strlen(mensaje)) < 0) {
+            perror("Error al enviar la suscripción");
+        }
+
+        pthread_t receptor;
+        if (pthread_create(&receptor, NULL, hilo_receptor, NULL) != 0) {
+            perror("Error al crear el hilo receptor");
+            exit(EXIT_FAILURE);
         }
+        pthread_detach(receptor);
     }
     
     menu_usuario(numero_cuenta);